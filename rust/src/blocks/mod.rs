@@ -1,9 +1,6 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 /* Copyright © 2020 Fragcolor Pte. Ltd. */
 
-#[cfg(not(target_arch = "wasm32"))]
-extern crate reqwest;
-
 extern crate bs58;
 extern crate ethabi;
 extern crate ethereum_types;
@@ -24,9 +21,6 @@ extern crate webbrowser;
 use crate::types::common_type;
 use crate::types::Type;
 
-#[cfg(not(target_arch = "wasm32"))]
-pub mod http;
-
 pub mod ecdsa;
 pub mod hash;
 
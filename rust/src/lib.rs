@@ -412,9 +412,6 @@ pub extern "C" fn registerRustBlocks(core: *mut CBCore) {
     Core = core;
   }
 
-  #[cfg(not(target_arch = "wasm32"))]
-  blocks::http::registerBlocks();
-
   blocks::casting::registerBlocks();
   blocks::hash::registerBlocks();
   blocks::ecdsa::registerBlocks();
@@ -0,0 +1,455 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/* Copyright © 2021 Fragcolor Pte. Ltd. */
+
+#ifndef CB_ASYNCFILE_HPP
+#define CB_ASYNCFILE_HPP
+
+// Files read and written without stalling the node thread: on Linux the I/O
+// is submitted to a per thread io_uring and the chain suspends until the
+// kernel completes it, elsewhere (or if io_uring is not available) the
+// blocking calls run on the shared thread pool through await.
+
+#include "shared.hpp"
+#include <fstream>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace chainblocks {
+#ifdef __linux__
+namespace detail {
+// A minimal io_uring, no liburing needed, only readv/writev/fsync are used
+// which are available since the very first kernels supporting io_uring
+class Ring {
+public:
+  static constexpr unsigned Entries = 64;
+
+  struct Completion {
+    int res{0};
+    bool done{false};
+    iovec iov{};
+  };
+
+  Ring() {
+    io_uring_params p{};
+    _fd = int(syscall(__NR_io_uring_setup, Entries, &p));
+    if (_fd < 0)
+      return;
+
+    _sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      _sqSize = _cqSize = std::max(_sqSize, _cqSize);
+
+    _sq = mmap(nullptr, _sqSize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    _cq = single ? _sq
+                 : mmap(nullptr, _cqSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+    _sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    _sqes = reinterpret_cast<io_uring_sqe *>(
+        mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES));
+    if (_sq == MAP_FAILED || _cq == MAP_FAILED || _sqes == MAP_FAILED) {
+      release();
+      return;
+    }
+
+    auto sq = reinterpret_cast<uint8_t *>(_sq);
+    _sqHead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    _sqMask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    _sqEntries = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_entries);
+    _sqArray = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+
+    auto cq = reinterpret_cast<uint8_t *>(_cq);
+    _cqHead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    _cqMask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+  }
+
+  ~Ring() { release(); }
+
+  Ring(const Ring &) = delete;
+  Ring &operator=(const Ring &) = delete;
+
+  bool valid() const { return _fd >= 0; }
+
+  // every chain running on this thread shares the ring
+  static Ring *get() {
+    static thread_local std::unique_ptr<Ring> ring;
+    static thread_local bool failed = false;
+    if (!ring && !failed) {
+      ring.reset(new Ring());
+      if (!ring->valid()) {
+        CBLOG_DEBUG("io_uring not available, using the thread pool");
+        ring.reset();
+        failed = true;
+      }
+    }
+    return ring.get();
+  }
+
+  // submits the operation and suspends the chain until it's completed,
+  // returns the result of the syscall (bytes or -errno). If the chain is
+  // stopped meanwhile we must still wait, the kernel owns the buffer.
+  int run(CBContext *context, uint8_t opcode, int fd, void *buf, size_t len,
+          uint64_t offset, uint32_t flags = 0) {
+    Completion c;
+    c.iov.iov_base = buf;
+    c.iov.iov_len = len;
+
+    io_uring_sqe *sqe;
+    while (!(sqe = acquire())) {
+      // full, only possible with many chains doing I/O at once
+      reap();
+      if (chainblocks::suspend(context, 0) != CBChainState::Continue)
+        wait();
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    if (opcode == IORING_OP_FSYNC) {
+      sqe->fsync_flags = flags;
+    } else {
+      sqe->addr = uint64_t(uintptr_t(&c.iov));
+      sqe->len = 1;
+    }
+    sqe->user_data = uint64_t(uintptr_t(&c));
+    submit();
+
+    reap();
+    bool stopping = false;
+    while (!c.done) {
+      if (!stopping &&
+          chainblocks::suspend(context, 0) != CBChainState::Continue) {
+        stopping = true;
+      }
+      if (stopping && !c.done) {
+        wait();
+      }
+      reap();
+    }
+    return c.res;
+  }
+
+private:
+  io_uring_sqe *acquire() {
+    const auto head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    const auto tail = *_sqTail;
+    if (tail - head >= _sqEntries)
+      return nullptr;
+    const auto index = tail & _sqMask;
+    auto sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    _sqArray[index] = index;
+    return sqe;
+  }
+
+  void submit() {
+    __atomic_store_n(_sqTail, *_sqTail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, _fd, 1, 0, 0, nullptr, 0) < 0 &&
+           errno == EINTR)
+      ;
+  }
+
+  void wait() {
+    while (syscall(__NR_io_uring_enter, _fd, 0, 1, IORING_ENTER_GETEVENTS,
+                   nullptr, 0) < 0 &&
+           errno == EINTR)
+      ;
+  }
+
+  // completions might belong to other chains of this thread
+  void reap() {
+    auto head = *_cqHead;
+    const auto tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      auto &cqe = _cqes[head & _cqMask];
+      auto c = reinterpret_cast<Completion *>(uintptr_t(cqe.user_data));
+      c->res = cqe.res;
+      c->done = true;
+      head++;
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  void release() {
+    if (_sqes && _sqes != MAP_FAILED)
+      munmap(_sqes, _sqesSize);
+    if (_cq && _cq != MAP_FAILED && _cq != _sq)
+      munmap(_cq, _cqSize);
+    if (_sq && _sq != MAP_FAILED)
+      munmap(_sq, _sqSize);
+    if (_fd >= 0)
+      ::close(_fd);
+    _fd = -1;
+  }
+
+  int _fd{-1};
+  void *_sq{nullptr};
+  void *_cq{nullptr};
+  io_uring_sqe *_sqes{nullptr};
+  size_t _sqSize{0};
+  size_t _cqSize{0};
+  size_t _sqesSize{0};
+
+  unsigned *_sqHead{nullptr};
+  unsigned *_sqTail{nullptr};
+  unsigned *_sqArray{nullptr};
+  unsigned _sqMask{0};
+  unsigned _sqEntries{0};
+
+  unsigned *_cqHead{nullptr};
+  unsigned *_cqTail{nullptr};
+  unsigned _cqMask{0};
+  io_uring_cqe *_cqes{nullptr};
+};
+} // namespace detail
+#endif
+
+class AsyncFile {
+public:
+  enum class Mode { Read, Write, Append };
+
+  AsyncFile() = default;
+  ~AsyncFile() { close(); }
+
+  AsyncFile(const AsyncFile &) = delete;
+  AsyncFile &operator=(const AsyncFile &) = delete;
+
+  // opening is synchronous, it's a metadata operation
+  bool open(const std::string &path, Mode mode) {
+    close();
+    _offset = 0;
+#ifdef __linux__
+    int flags = O_CLOEXEC;
+    switch (mode) {
+    case Mode::Read:
+      flags |= O_RDONLY;
+      break;
+    case Mode::Write:
+      flags |= O_WRONLY | O_CREAT | O_TRUNC;
+      break;
+    case Mode::Append:
+      flags |= O_WRONLY | O_CREAT | O_APPEND;
+      break;
+    }
+    _fd = ::open(path.c_str(), flags, 0644);
+    if (_fd < 0)
+      return false;
+    struct stat st;
+    _size = fstat(_fd, &st) == 0 ? int64_t(st.st_size) : -1;
+    if (mode == Mode::Append)
+      _offset = uint64_t(std::max(int64_t(0), _size));
+    return true;
+#else
+    auto flags = std::ios::binary;
+    switch (mode) {
+    case Mode::Read:
+      flags |= std::ios::in | std::ios::ate;
+      break;
+    case Mode::Write:
+      flags |= std::ios::out | std::ios::trunc;
+      break;
+    case Mode::Append:
+      flags |= std::ios::out | std::ios::app;
+      break;
+    }
+    _stream.open(path, flags);
+    if (!_stream.is_open())
+      return false;
+    _size = mode == Mode::Read ? int64_t(_stream.tellg()) : -1;
+    return true;
+#endif
+  }
+
+  void close() {
+#ifdef __linux__
+    if (_fd >= 0) {
+      ::close(_fd);
+      _fd = -1;
+    }
+#else
+    if (_stream.is_open())
+      _stream.close();
+#endif
+  }
+
+  bool isOpen() const {
+#ifdef __linux__
+    return _fd >= 0;
+#else
+    return _stream.is_open();
+#endif
+  }
+
+  // size when opened, -1 if unknown
+  int64_t size() const { return _size; }
+
+  // returns the bytes read, less than len only at the end of the file
+  size_t read(CBContext *context, uint8_t *buf, size_t len, uint64_t offset) {
+    size_t total = 0;
+    while (total < len) {
+      const auto n = readSome(context, buf + total, len - total, offset + total);
+      if (n == 0)
+        break;
+      total += n;
+    }
+    return total;
+  }
+
+  // writes after the previous write (or at the end in append mode)
+  void write(CBContext *context, const uint8_t *buf, size_t len) {
+#ifdef __linux__
+    while (len > 0) {
+      auto res = io(context, IORING_OP_WRITEV, const_cast<uint8_t *>(buf), len,
+                    _offset);
+      // 0 means no progress, retrying would spin forever
+      if (res <= 0)
+        throw ActivationError("File write failed");
+      buf += res;
+      len -= size_t(res);
+      _offset += uint64_t(res);
+    }
+#else
+    await(
+        context,
+        [&]() {
+          _stream.write((const char *)buf, len);
+          if (!_stream.good())
+            throw ActivationError("File write failed");
+        },
+        [] {});
+#endif
+  }
+
+  // flushes the written data to the disk
+  void sync(CBContext *context) {
+#ifdef __linux__
+    if (io(context, IORING_OP_FSYNC, nullptr, 0, 0, IORING_FSYNC_DATASYNC) < 0)
+      throw ActivationError("File sync failed");
+#else
+    await(
+        context, [&]() { _stream.flush(); }, [] {});
+#endif
+  }
+
+  // reads a whole file into buffer, recycling its capacity, an extra 0 is
+  // appended if terminated is true (not counted in the returned size)
+  static size_t readAll(CBContext *context, const std::string &path,
+                        std::vector<uint8_t> &buffer, bool terminated) {
+    AsyncFile file;
+    if (!file.open(path, Mode::Read))
+      throw ActivationError("Failed to open file for reading");
+
+    const size_t extra = terminated ? 1 : 0;
+    size_t total = 0;
+    if (file.size() > 0) {
+      buffer.resize(size_t(file.size()) + extra);
+      total = file.read(context, buffer.data(), size_t(file.size()), 0);
+    } else {
+      // unknown size (pipes, procfs...), read until the end
+      buffer.resize(64 * 1024 + extra);
+      while (true) {
+        const auto n = file.read(context, buffer.data() + total,
+                                 buffer.size() - extra - total, total);
+        total += n;
+        if (total < buffer.size() - extra)
+          break;
+        buffer.resize(buffer.size() * 2);
+      }
+    }
+    buffer.resize(total + extra);
+    if (terminated)
+      buffer[total] = 0;
+    return total;
+  }
+
+  static void writeAll(CBContext *context, const std::string &path,
+                       const uint8_t *data, size_t len, bool append) {
+    AsyncFile file;
+    if (!file.open(path, append ? Mode::Append : Mode::Write))
+      throw ActivationError("Failed to open file for writing");
+    file.write(context, data, len);
+  }
+
+private:
+  size_t readSome(CBContext *context, uint8_t *buf, size_t len,
+                  uint64_t offset) {
+#ifdef __linux__
+    // stay within what a single readv can return
+    len = std::min(len, size_t(0x7ffff000));
+    const auto res = io(context, IORING_OP_READV, buf, len, offset);
+    if (res < 0)
+      throw ActivationError("File read failed");
+    return size_t(res);
+#else
+    size_t res = 0;
+    await(
+        context,
+        [&]() {
+          _stream.clear();
+          _stream.seekg(std::streamoff(offset));
+          _stream.read((char *)buf, std::streamsize(len));
+          res = size_t(_stream.gcount());
+          if (_stream.bad())
+            throw ActivationError("File read failed");
+        },
+        [] {});
+    return res;
+#endif
+  }
+
+#ifdef __linux__
+  int io(CBContext *context, uint8_t opcode, uint8_t *buf, size_t len,
+         uint64_t offset, uint32_t flags = 0) {
+    auto ring = detail::Ring::get();
+    if (ring)
+      return ring->run(context, opcode, _fd, buf, len, offset, flags);
+
+    ssize_t res = 0;
+    await(
+        context,
+        [&]() {
+          do {
+            switch (opcode) {
+            case IORING_OP_READV:
+              res = ::pread(_fd, buf, len, off_t(offset));
+              break;
+            case IORING_OP_WRITEV:
+              res = ::pwrite(_fd, buf, len, off_t(offset));
+              break;
+            default:
+              res = ::fdatasync(_fd);
+              break;
+            }
+          } while (res < 0 && errno == EINTR);
+          if (res < 0)
+            res = -errno;
+        },
+        [] {});
+    return int(res);
+  }
+
+  int _fd{-1};
+#else
+  std::fstream _stream;
+#endif
+  int64_t _size{-1};
+  uint64_t _offset{0};
+};
+} // namespace chainblocks
+
+#endif
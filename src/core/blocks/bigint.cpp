@@ -30,6 +30,259 @@ inline cpp_int from_var(const CBVar &op) {
   return bib;
 }
 
+// 64 x 64 bits product, returns the low half and stores the high one
+inline uint64_t mulWide(uint64_t a, uint64_t b, uint64_t &hi) {
+#ifdef __SIZEOF_INT128__
+  const auto p = (unsigned __int128)a * b;
+  hi = uint64_t(p >> 64);
+  return uint64_t(p);
+#else
+  // no 128 bits integers on 32 bits targets, use 32 bits halves
+  const uint64_t al = uint32_t(a), ah = a >> 32;
+  const uint64_t bl = uint32_t(b), bh = b >> 32;
+  const uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+  const uint64_t mid = (ll >> 32) + uint32_t(lh) + uint32_t(hl);
+  hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+  return (mid << 32) | uint32_t(ll);
+#endif
+}
+
+// Fixed width fast path, most values (e.g. 256 bits words) fit in a few
+// 64 bits limbs, same sign + magnitude layout as the bytes.
+// Any overflow returns false and the caller falls back to cpp_int.
+template <size_t N> struct Fixed {
+  static constexpr size_t Size = N * sizeof(uint64_t);
+
+  // little endian
+  uint64_t limbs[N];
+  bool negative;
+
+  bool load(const CBVar &var) {
+    const size_t len = var.payload.bytesSize;
+    if (len == 0 || len - 1 > Size)
+      return false;
+    memset(limbs, 0x0, sizeof(limbs));
+    const uint8_t *mag = var.payload.bytesValue + 1;
+    for (size_t i = 0; i < len - 1; i++) {
+      // magnitude is big endian
+      const size_t bit = (len - 2 - i) * 8;
+      limbs[bit / 64] |= uint64_t(mag[i]) << (bit % 64);
+    }
+    negative = var.payload.bytesValue[0] != 0;
+    normalize();
+    return true;
+  }
+
+  Var store(std::vector<uint8_t> &buffer) const {
+    size_t len = Size;
+    while (len > 1 && byte(len - 1) == 0)
+      len--;
+    buffer.resize(len + 1);
+    buffer[0] = uint8_t(negative);
+    for (size_t i = 0; i < len; i++) {
+      buffer[1 + i] = byte(len - 1 - i);
+    }
+    return Var(&buffer.front(), buffer.size());
+  }
+
+  uint8_t byte(size_t i) const {
+    return uint8_t(limbs[i / 8] >> ((i % 8) * 8));
+  }
+
+  bool zero() const {
+    for (size_t i = 0; i < N; i++) {
+      if (limbs[i])
+        return false;
+    }
+    return true;
+  }
+
+  // cpp_int has no negative zero
+  void normalize() {
+    if (negative && zero())
+      negative = false;
+  }
+
+  static int compare(const uint64_t *a, const uint64_t *b) {
+    for (size_t i = N; i-- > 0;) {
+      if (a[i] != b[i])
+        return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+  }
+
+  // returns the carry
+  static bool add(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    uint64_t carry = 0;
+    for (size_t i = 0; i < N; i++) {
+      const auto s = a[i] + carry;
+      carry = s < carry;
+      out[i] = s + b[i];
+      carry += out[i] < s;
+    }
+    return carry != 0;
+  }
+
+  // a >= b
+  static void sub(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    uint64_t borrow = 0;
+    for (size_t i = 0; i < N; i++) {
+      const auto d = a[i] - b[i];
+      const uint64_t under = a[i] < b[i];
+      out[i] = d - borrow;
+      borrow = under | (d < borrow);
+    }
+  }
+
+  // returns false on overflow
+  static bool mul(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+    uint64_t res[N]{};
+    for (size_t i = 0; i < N; i++) {
+      if (!a[i])
+        continue;
+      uint64_t carry = 0;
+      for (size_t j = 0; j < N; j++) {
+        if (i + j >= N) {
+          if (b[j])
+            return false;
+          continue;
+        }
+        // a * b + res + carry always fits in 128 bits
+        uint64_t hi;
+        auto lo = mulWide(a[i], b[j], hi);
+        lo += res[i + j];
+        hi += lo < res[i + j];
+        lo += carry;
+        hi += lo < carry;
+        res[i + j] = lo;
+        carry = hi;
+      }
+      if (carry)
+        return false;
+    }
+    memcpy(out, res, sizeof(res));
+    return true;
+  }
+
+  // b != 0
+  static void mod(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+#ifdef __SIZEOF_INT128__
+    bool small = true;
+    for (size_t i = 1; i < N; i++) {
+      if (b[i]) {
+        small = false;
+        break;
+      }
+    }
+    if (small) {
+      unsigned __int128 rem = 0;
+      for (size_t i = N; i-- > 0;) {
+        rem = ((rem << 64) | a[i]) % b[0];
+      }
+      memset(out, 0x0, sizeof(uint64_t) * N);
+      out[0] = uint64_t(rem);
+      return;
+    }
+#endif
+
+    // binary long division, only the remainder is kept
+    uint64_t rem[N]{};
+    for (size_t bit = N * 64; bit-- > 0;) {
+      const bool top = rem[N - 1] >> 63;
+      for (size_t i = N - 1; i > 0; i--) {
+        rem[i] = (rem[i] << 1) | (rem[i - 1] >> 63);
+      }
+      rem[0] = (rem[0] << 1) | ((a[bit / 64] >> (bit % 64)) & 1);
+      // the shifted out bit means we are above b, wrapping is fine
+      if (top || compare(rem, b) >= 0)
+        sub(rem, b, rem);
+    }
+    memcpy(out, rem, sizeof(rem));
+  }
+};
+
+template <size_t N>
+inline bool fixedAdd(const Fixed<N> &a, const Fixed<N> &b, Fixed<N> &res) {
+  if (a.negative == b.negative) {
+    if (Fixed<N>::add(a.limbs, b.limbs, res.limbs))
+      return false;
+    res.negative = a.negative;
+  } else if (Fixed<N>::compare(a.limbs, b.limbs) >= 0) {
+    Fixed<N>::sub(a.limbs, b.limbs, res.limbs);
+    res.negative = a.negative;
+  } else {
+    Fixed<N>::sub(b.limbs, a.limbs, res.limbs);
+    res.negative = b.negative;
+  }
+  res.normalize();
+  return true;
+}
+
+template <size_t N>
+inline bool fixedSub(const Fixed<N> &a, const Fixed<N> &b, Fixed<N> &res) {
+  auto nb = b;
+  nb.negative = !b.negative;
+  nb.normalize();
+  return fixedAdd(a, nb, res);
+}
+
+template <size_t N>
+inline bool fixedMul(const Fixed<N> &a, const Fixed<N> &b, Fixed<N> &res) {
+  if (!Fixed<N>::mul(a.limbs, b.limbs, res.limbs))
+    return false;
+  res.negative = a.negative != b.negative;
+  res.normalize();
+  return true;
+}
+
+template <size_t N>
+inline bool fixedMod(const Fixed<N> &a, const Fixed<N> &b, Fixed<N> &res) {
+  // let cpp_int throw its division by zero
+  if (b.zero())
+    return false;
+  Fixed<N>::mod(a.limbs, b.limbs, res.limbs);
+  // truncated like cpp_int, the sign follows the dividend
+  res.negative = a.negative;
+  res.normalize();
+  return true;
+}
+
+template <size_t N>
+inline bool fixedPow(const Fixed<N> &a, uint64_t exp, Fixed<N> &res) {
+  auto base = a;
+  base.negative = false;
+  memset(res.limbs, 0x0, sizeof(res.limbs));
+  res.limbs[0] = 1;
+  res.negative = a.negative && (exp & 1);
+  while (exp) {
+    if ((exp & 1) && !Fixed<N>::mul(res.limbs, base.limbs, res.limbs))
+      return false;
+    exp >>= 1;
+    if (exp && !Fixed<N>::mul(base.limbs, base.limbs, base.limbs))
+      return false;
+  }
+  res.normalize();
+  return true;
+}
+
+template <size_t N, typename F>
+inline bool tryFixed(const CBVar &a, const CBVar &b, F op,
+                     std::vector<uint8_t> &buffer, CBVar &output) {
+  Fixed<N> fa, fb, fres;
+  if (!fa.load(a) || !fb.load(b) || !op(fa, fb, fres))
+    return false;
+  output = fres.store(buffer);
+  return true;
+}
+
+// 256 bits first, 512 if that overflows, false if cpp_int is needed
+template <typename F>
+inline bool fixedOp(const CBVar &a, const CBVar &b, F op,
+                    std::vector<uint8_t> &buffer, CBVar &output) {
+  return tryFixed<4>(a, b, op, buffer, output) ||
+         tryFixed<8>(a, b, op, buffer, output);
+}
+
 struct ToBigInt {
   std::vector<uint8_t> _buffer;
 
@@ -113,6 +366,32 @@ struct BigIntBinaryOp : public ::chainblocks::Math::BinaryOperation<T> {
     }                                                                          \
   };
 
+#define BIGINT_FIXED_MATH_OP(__NAME__, __OP__, __FIXED__)                      \
+  struct __NAME__ : public BigIntBinaryOp<__NAME__> {                          \
+    void operator()(CBVar &output, const CBVar &input, const CBVar &operand,   \
+                    void *pself) {                                             \
+      auto self = reinterpret_cast<__NAME__ *>(pself);                         \
+      std::vector<uint8_t> *buffer = nullptr;                                  \
+      if (self->_buffers.size() <= _offset) {                                  \
+        buffer = &self->_buffers.emplace_back();                               \
+      } else {                                                                 \
+        buffer = &self->_buffers[_offset];                                     \
+      }                                                                        \
+      if (!fixedOp(                                                            \
+              input, operand,                                                  \
+              [](const auto &a, const auto &b, auto &res) {                    \
+                return __FIXED__(a, b, res);                                   \
+              },                                                               \
+              *buffer, output)) {                                              \
+        cpp_int bia = from_var(input);                                         \
+        cpp_int bib = from_var(operand);                                       \
+        cpp_int bres = bia __OP__ bib;                                         \
+        output = to_var(bres, *buffer);                                        \
+      }                                                                        \
+      _offset++;                                                               \
+    }                                                                          \
+  };
+
 struct BigOperandBase {
   std::vector<uint8_t> _buffer;
 
@@ -190,14 +469,14 @@ struct RegOperandBase {
   }
 };
 
-BIGINT_MATH_OP(Add, +);
-BIGINT_MATH_OP(Subtract, -);
-BIGINT_MATH_OP(Multiply, *);
+BIGINT_FIXED_MATH_OP(Add, +, fixedAdd);
+BIGINT_FIXED_MATH_OP(Subtract, -, fixedSub);
+BIGINT_FIXED_MATH_OP(Multiply, *, fixedMul);
 BIGINT_MATH_OP(Divide, /);
 BIGINT_MATH_OP(Xor, ^);
 BIGINT_MATH_OP(And, &);
 BIGINT_MATH_OP(Or, |);
-BIGINT_MATH_OP(Mod, %);
+BIGINT_FIXED_MATH_OP(Mod, %, fixedMod);
 
 #define BIGINT_LOGIC_OP(__NAME__, __OP__)                                      \
   struct __NAME__ : public BigOperandBase {                                    \
@@ -245,19 +524,26 @@ BIGINT_LOGIC_OP(IsLessEqual, <=);
 BIGINT_BINARY_OP(Min, std::min);
 BIGINT_BINARY_OP(Max, std::max);
 
-#define BIGINT_REG_BINARY_OP(__NAME__, __OP__)                                 \
-  struct __NAME__ : public RegOperandBase {                                    \
-    CBVar activate(CBContext *context, const CBVar &input) {                   \
-      cpp_int bia = from_var(input);                                           \
-      auto op = getOperand();                                                  \
-      if (op.valueType != Int)                                                 \
-        throw ActivationError("Pow operand should be an Int");                 \
-      cpp_int bres = __OP__(bia, op.payload.intValue);                         \
-      return to_var(bres, _buffer);                                            \
-    }                                                                          \
+struct Pow : public RegOperandBase {
+  CBVar activate(CBContext *context, const CBVar &input) {
+    auto op = getOperand();
+    if (op.valueType != Int)
+      throw ActivationError("Pow operand should be an Int");
+    const auto exp = op.payload.intValue;
+    // cpp_int takes an unsigned exponent, leave anything else to it
+    if (exp >= 0 && exp <= int64_t(UINT32_MAX)) {
+      Fixed<4> a4, r4;
+      if (a4.load(input) && fixedPow(a4, uint64_t(exp), r4))
+        return r4.store(_buffer);
+      Fixed<8> a8, r8;
+      if (a8.load(input) && fixedPow(a8, uint64_t(exp), r8))
+        return r8.store(_buffer);
+    }
+    cpp_int bia = from_var(input);
+    cpp_int bres = pow(bia, op.payload.intValue);
+    return to_var(bres, _buffer);
   }
-
-BIGINT_REG_BINARY_OP(Pow, pow);
+};
 
 #define BIGINT_UNARY_OP(__NAME__, __OP__)                                      \
   struct __NAME__ : public RegOperandBase {                                    \
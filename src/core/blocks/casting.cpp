@@ -122,6 +122,26 @@ struct FromBytes {
   }
 };
 
+struct FromAudio {
+  template <CBType OF>
+  void toSeq(std::vector<Var> &output, const CBVar &input) {
+    if constexpr (OF == CBType::Float) {
+      if (input.valueType != CBType::Audio)
+        throw ActivationError("Expected Audio type.");
+
+      // interleaved samples, nsamples frames of channels each
+      const auto &a = input.payload.audioValue;
+      const size_t len = size_t(a.nsamples) * size_t(a.channels);
+      output.resize(len, Var(0.0));
+      for (size_t i = 0; i < len; i++) {
+        output[i].payload.floatValue = double(a.samples[i]);
+      }
+    } else {
+      throw ActivationError("Conversion pair not implemented yet.");
+    }
+  }
+};
+
 template <CBType CBTYPE, CBType CBOTHER> struct ToSeq {
   static inline Type _inputType{{CBTYPE}};
   static inline Type _outputElemType{{CBOTHER}};
@@ -140,6 +160,9 @@ template <CBType CBTYPE, CBType CBOTHER> struct ToSeq {
     } else if constexpr (CBTYPE == CBType::Bytes) {
       FromBytes c;
       c.toSeq<CBOTHER>(_output, input);
+    } else if constexpr (CBTYPE == CBType::Audio) {
+      FromAudio c;
+      c.toSeq<CBOTHER>(_output, input);
     } else {
       throw ActivationError("Conversion pair not implemented yet.");
     }
@@ -824,6 +847,9 @@ void registerCastingBlocks() {
   REGISTER_CBLOCK("ImageToFloats", ImageToFloats);
   REGISTER_CBLOCK("FloatsToImage", FloatsToImage);
 
+  using AudioToFloats = ToSeq<CBType::Audio, CBType::Float>;
+  REGISTER_CBLOCK("AudioToFloats", AudioToFloats);
+
   using BytesToInts = ToSeq<CBType::Bytes, CBType::Int>;
   using BytesToString = ToString1<CBType::Bytes>;
   using IntsToBytes = ToBytes<CBType::Int>;
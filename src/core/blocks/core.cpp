@@ -1610,9 +1610,71 @@ CBVar exitProgramActivation(const CBVar &input) {
   exit(input.payload.intValue);
 }
 
-CBVar hashActivation(const CBVar &input) {
-  return Var(chainblocks::hash(input));
-}
+struct Hash {
+  static inline Parameters params{
+      {"Streaming",
+       CBCCSTR("If true the hash state is kept across activations and every "
+               "input is fed into it, the output is the digest of everything "
+               "received so far. String and Bytes inputs are fed raw, so "
+               "hashing chunks gives the same result as streaming the whole "
+               "at once."),
+       {CoreInfo::BoolType}}};
+
+  static CBTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::IntType; }
+
+  static CBParametersInfo parameters() { return params; }
+
+  bool _streaming{false};
+  // XXH3 needs a 64 bytes aligned state, more than blocks are allocated with
+  XXH3_state_t *_state{nullptr};
+
+  void setParam(int index, const CBVar &value) {
+    _streaming = value.payload.boolValue;
+  }
+
+  CBVar getParam(int index) { return Var(_streaming); }
+
+  void warmup(CBContext *context) {
+    if (!_streaming)
+      return;
+
+    _state = XXH3_createState();
+    if (!_state)
+      throw WarmupError("Hash: failed to allocate the hash state");
+    XXH3_64bits_reset_withSecret(_state, CUSTOM_XXH3_kSecret,
+                                 XXH_SECRET_DEFAULT_SIZE);
+  }
+
+  void cleanup() {
+    if (_state) {
+      XXH3_freeState(_state);
+      _state = nullptr;
+    }
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (!_streaming)
+      return Var(chainblocks::hash(input));
+
+    switch (input.valueType) {
+    case CBType::Bytes:
+      XXH3_64bits_update(_state, input.payload.bytesValue,
+                         size_t(input.payload.bytesSize));
+      break;
+    case CBType::String:
+      XXH3_64bits_update(_state, input.payload.stringValue,
+                         size_t(CBSTRLEN(input)));
+      break;
+    default: {
+      // structured values are fed as their own hash
+      const auto h = chainblocks::hash(input);
+      XXH3_64bits_update(_state, &h, sizeof(uint64_t));
+    } break;
+    }
+    return Var(XXH3_64bits_digest(_state));
+  }
+};
 
 CBVar blockingSleepActivation(const CBVar &input) {
   if (input.valueType == CBType::Int) {
@@ -1777,9 +1839,7 @@ void registerBlocksCoreBlocks() {
   REGISTER_CBLOCK("Pass", PassMockBlock);
   REGISTER_CBLOCK("Exit", ExitBlock);
 
-  using HasherBlock =
-      LambdaBlock<hashActivation, CoreInfo::AnyType, CoreInfo::IntType>;
-  REGISTER_CBLOCK("Hash", HasherBlock);
+  REGISTER_CBLOCK("Hash", Hash);
 
   using BlockingSleepBlock = LambdaBlock<blockingSleepActivation,
                                          CoreInfo::AnyType, CoreInfo::AnyType>;
@@ -5,6 +5,9 @@
 #include "chainblocks.h"
 #include "foundation.hpp"
 #include "shared.hpp"
+#include <filesystem>
+#include <fstream>
+#include <list>
 
 namespace chainblocks {
 static Type condBlockSeqs = Type::SeqOf(CoreInfo::BlocksOrNone);
@@ -1082,6 +1085,359 @@ struct HashedBlocks {
   }
 };
 
+struct Memoize {
+  BlocksVar _blocks{};
+  CBComposeResult _composition{};
+  IterableExposedInfo _exposedInfo{};
+  int64_t _budget{64 * 1024 * 1024};
+  std::string _file;
+  std::string _statsName;
+
+  static inline Types StatsTypes{{CoreInfo::IntType, CoreInfo::IntType,
+                                  CoreInfo::IntType, CoreInfo::IntType,
+                                  CoreInfo::IntType}};
+  static inline std::array<CBString, 5> StatsKeys{"Hits", "Misses", "Evictions",
+                                                  "Entries", "Bytes"};
+  static inline Type StatsType = Type::TableOf(StatsTypes, StatsKeys);
+
+  struct Entry {
+    uint64_t key;
+    // the hash is just an index, a hit must match the input as well
+    OwnedVar input;
+    OwnedVar value;
+    size_t size;
+  };
+
+  // bumped when the cache file layout changes
+  static constexpr uint64_t FileVersion = 2;
+
+  // front = most recently used
+  std::list<Entry> _lru;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> _index;
+  size_t _bytes{0};
+  uint64_t _blocksHash{0};
+
+  int64_t _hits{0};
+  int64_t _misses{0};
+  int64_t _evictions{0};
+  TableVar _stats{};
+  CBVar *_statsVar{nullptr};
+
+  static CBOptionalString help() {
+    return CBCCSTR(
+        "Activates a block or a sequence of blocks and caches their output, "
+        "keyed on the blocks (and their parameters) and the hash of the "
+        "input. Further activations with an equal input skip the sub flow and "
+        "output the cached value. The sub flow must be pure, its output "
+        "should depend only on its input.");
+  }
+
+  static CBTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static CBOptionalString inputHelp() {
+    return CBCCSTR("The value given to the block or sequence of blocks in "
+                   "this sub flow and used as cache key.");
+  }
+
+  static CBTypesInfo outputTypes() { return CoreInfo::AnyType; }
+  static CBOptionalString outputHelp() {
+    return CBCCSTR("The output of the sub flow, either fresh or cached.");
+  }
+
+  static CBParametersInfo parameters() {
+    static Parameters params{
+        {"Blocks",
+         CBCCSTR("The blocks to execute in the sub flow."),
+         {CoreInfo::BlocksOrNone}},
+        {"MaxBytes",
+         CBCCSTR("The memory budget of the cache in bytes, least recently "
+                 "used outputs are evicted when it is exceeded."),
+         {CoreInfo::IntType}},
+        {"File",
+         CBCCSTR("Optional file used to persist the cache, loaded on warmup "
+                 "and written on cleanup."),
+         {CoreInfo::NoneType, CoreInfo::StringType}},
+        {"Stats",
+         CBCCSTR("Optional name of a variable to expose the cache counters "
+                 "to: Hits, Misses, Evictions, Entries and Bytes."),
+         {CoreInfo::NoneType, CoreInfo::StringType}}};
+    return params;
+  }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _blocks = value;
+      break;
+    case 1:
+      if (value.payload.intValue < 0)
+        throw CBException("Memoize: MaxBytes cannot be negative.");
+      _budget = value.payload.intValue;
+      break;
+    case 2:
+      if (value.valueType == None)
+        _file.clear();
+      else
+        _file = value.payload.stringValue;
+      break;
+    case 3:
+      if (value.valueType == None)
+        _statsName.clear();
+      else
+        _statsName = value.payload.stringValue;
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return _blocks;
+    case 1:
+      return Var(_budget);
+    case 2:
+      return _file.empty() ? Var::Empty : Var(_file);
+    case 3:
+      return _statsName.empty() ? Var::Empty : Var(_statsName);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  CBTypeInfo compose(const CBInstanceData &data) {
+    _composition = _blocks.compose(data);
+    return _composition.outputType;
+  }
+
+  CBExposedTypesInfo exposedVariables() {
+    _exposedInfo = IterableExposedInfo(_composition.exposedInfo);
+    if (!_statsName.empty()) {
+      _exposedInfo.push_back(
+          CBExposedTypeInfo{_statsName.c_str(),
+                            CBCCSTR("The memoization cache counters."),
+                            StatsType});
+    }
+    return _exposedInfo;
+  }
+
+  struct Counter {
+    void operator()(const uint8_t *buf, size_t size) {}
+  };
+
+  struct Writer {
+    std::ofstream &_stream;
+    Writer(std::ofstream &stream) : _stream(stream) {}
+    void operator()(const uint8_t *buf, size_t size) {
+      _stream.write((const char *)buf, size);
+    }
+  };
+
+  struct Reader {
+    std::ifstream &_stream;
+    Reader(std::ifstream &stream) : _stream(stream) {}
+    void operator()(uint8_t *buf, size_t size) {
+      _stream.read((char *)buf, size);
+      if (!_stream)
+        throw CBException("Memoize: truncated cache file");
+    }
+  };
+
+  void insert(uint64_t key, const CBVar &input, const CBVar &value,
+              size_t size) {
+    // a colliding entry is replaced
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+      _bytes -= it->second->size;
+      _lru.erase(it->second);
+    }
+    _lru.push_front(Entry{key, OwnedVar(input), OwnedVar(value), size});
+    _index[key] = _lru.begin();
+    _bytes += size;
+    while (_bytes > size_t(_budget) && _lru.size() > 1) {
+      auto &last = _lru.back();
+      _bytes -= last.size;
+      _index.erase(last.key);
+      _lru.pop_back();
+      _evictions++;
+    }
+  }
+
+  void clear() {
+    _index.clear();
+    _lru.clear();
+    _bytes = 0;
+  }
+
+  void load() {
+    std::ifstream stream(_file, std::ios::binary);
+    if (!stream.good())
+      return;
+
+    try {
+      Reader read(stream);
+      Serialization serial;
+      uint64_t version = 0;
+      read((uint8_t *)&version, sizeof(uint64_t));
+      if (version != FileVersion) {
+        CBLOG_WARNING("Memoize: ignoring cache file {}, unknown version",
+                      _file);
+        return;
+      }
+      uint64_t count = 0;
+      read((uint8_t *)&count, sizeof(uint64_t));
+      // written from least to most recently used, pushing to the front
+      // restores the order
+      for (uint64_t i = 0; i < count; i++) {
+        uint64_t key;
+        uint64_t size;
+        read((uint8_t *)&key, sizeof(uint64_t));
+        read((uint8_t *)&size, sizeof(uint64_t));
+        CBVar input{};
+        serial.reset();
+        serial.deserialize(read, input);
+        DEFER(Serialization::varFree(input));
+        CBVar value{};
+        serial.reset();
+        serial.deserialize(read, value);
+        DEFER(Serialization::varFree(value));
+        insert(key, input, value, size_t(size));
+      }
+    } catch (const std::exception &e) {
+      CBLOG_WARNING("Memoize: ignoring cache file {}, error: {}", _file,
+                    e.what());
+      clear();
+    }
+  }
+
+  void save() {
+    namespace fs = std::filesystem;
+    fs::path p(_file);
+    auto parent_path = p.parent_path();
+    if (!parent_path.empty() && !fs::exists(parent_path))
+      fs::create_directories(parent_path);
+
+    std::ofstream stream(_file, std::ios::trunc | std::ios::binary);
+    Writer write(stream);
+    Serialization serial;
+    const uint64_t version = FileVersion;
+    write((const uint8_t *)&version, sizeof(uint64_t));
+    uint64_t count = _lru.size();
+    write((const uint8_t *)&count, sizeof(uint64_t));
+    for (auto it = _lru.rbegin(); it != _lru.rend(); ++it) {
+      const uint64_t size = it->size;
+      write((const uint8_t *)&it->key, sizeof(uint64_t));
+      write((const uint8_t *)&size, sizeof(uint64_t));
+      serial.reset();
+      serial.serialize(it->input, write);
+      serial.reset();
+      serial.serialize(it->value, write);
+    }
+  }
+
+  void updateStats() {
+    if (!_statsVar)
+      return;
+
+    _stats["Hits"] = Var(_hits);
+    _stats["Misses"] = Var(_misses);
+    _stats["Evictions"] = Var(_evictions);
+    _stats["Entries"] = Var(int64_t(_lru.size()));
+    _stats["Bytes"] = Var(int64_t(_bytes));
+    cloneVar(*_statsVar, _stats);
+  }
+
+  void warmup(CBContext *ctx) {
+    _blocks.warmup(ctx);
+
+    // parameters and structure of the sub flow, stable across runs
+    _blocksHash = hash(CBVar(_blocks));
+
+    if (!_statsName.empty()) {
+      _statsVar = referenceVariable(ctx, _statsName.c_str());
+    }
+
+    if (!_file.empty()) {
+      load();
+    }
+    updateStats();
+  }
+
+  void cleanup() {
+    if (!_file.empty() && !_lru.empty()) {
+      try {
+        save();
+      } catch (const std::exception &e) {
+        CBLOG_ERROR("Memoize: failed to write cache file {}, error: {}", _file,
+                    e.what());
+      }
+    }
+
+    CBLOG_DEBUG("Memoize: hits: {} misses: {} evictions: {}", _hits, _misses,
+                _evictions);
+
+    clear();
+    _hits = 0;
+    _misses = 0;
+    _evictions = 0;
+
+    if (_statsVar) {
+      releaseVariable(_statsVar);
+      _statsVar = nullptr;
+    }
+
+    _blocks.cleanup();
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const uint64_t parts[2] = {_blocksHash, hash(input)};
+    const auto key = XXH3_64bits_withSecret(
+        parts, sizeof(parts), CUSTOM_XXH3_kSecret, XXH_SECRET_DEFAULT_SIZE);
+
+    auto it = _index.find(key);
+    if (it != _index.end() && it->second->input == input) {
+      _hits++;
+      // move to front, iterators stay valid
+      _lru.splice(_lru.begin(), _lru, it->second);
+      updateStats();
+      return it->second->value;
+    }
+
+    _misses++;
+    CBVar output{};
+    const auto state = _blocks.activate(context, input, output);
+    if (state != CBChainState::Continue) {
+      // stopped, restarted or failed, the output is not a result
+      updateStats();
+      return output;
+    }
+
+    // serialized size is our memory estimate, values that can't be
+    // serialized (objects) are not cached
+    size_t size;
+    try {
+      Counter counter;
+      Serialization serial;
+      size = serial.serialize(output, counter);
+      serial.reset();
+      size += serial.serialize(input, counter);
+    } catch (const CBException &e) {
+      CBLOG_TRACE("Memoize: not caching output, error: {}", e.what());
+      updateStats();
+      return output;
+    }
+
+    if (size <= size_t(_budget)) {
+      insert(key, input, output, size);
+      updateStats();
+      return _lru.front().value;
+    }
+
+    updateStats();
+    return output;
+  }
+};
+
 void registerFlowBlocks() {
   REGISTER_CBLOCK("Cond", Cond);
   REGISTER_CBLOCK("Maybe", Maybe);
@@ -1092,5 +1448,6 @@ void registerFlowBlocks() {
   REGISTER_CBLOCK("Match", Match);
   REGISTER_CBLOCK("Sub", Sub);
   REGISTER_CBLOCK("Hashed", HashedBlocks);
+  REGISTER_CBLOCK("Memoize", Memoize);
 }
 }; // namespace chainblocks
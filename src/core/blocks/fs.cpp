@@ -1,9 +1,20 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 /* Copyright © 2019 Fragcolor Pte. Ltd. */
 
+#include "asyncfile.hpp"
 #include "shared.hpp"
 #include <boost/algorithm/string.hpp>
-#include <fstream>
+#include <map>
+#include <mutex>
+#include <unordered_set>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CB_FS_MMAP 1
+#endif
 
 #ifdef WIN32
 // windows mingw has bugged copy/copyfile
@@ -223,22 +234,19 @@ struct Read {
   }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    _buffer.clear();
     fs::path p(input.payload.stringValue);
     if (!fs::exists(p)) {
       CBLOG_ERROR("File is missing: {}", p);
       throw ActivationError("FS.Read, file does not exist.");
     }
 
+    // straight into our recycled buffer, the chain suspends meanwhile
+    const auto size =
+        AsyncFile::readAll(context, p.string(), _buffer, !_binary);
     if (_binary) {
-      std::ifstream file(p.string(), std::ios::binary);
-      _buffer.assign(std::istreambuf_iterator<char>(file), {});
-      return Var(_buffer.data(), uint32_t(_buffer.size()));
+      return Var(_buffer.data(), uint32_t(size));
     } else {
-      std::ifstream file(p.string(), std::ios::binary);
-      _buffer.assign(std::istreambuf_iterator<char>(file), {});
-      _buffer.push_back(0);
-      return Var((const char *)_buffer.data());
+      return Var((const char *)_buffer.data(), size);
     }
   }
 };
@@ -326,20 +334,17 @@ struct Write {
       if (!parent_path.empty() && !fs::exists(parent_path))
         fs::create_directories(p.parent_path());
 
-      auto flags = std::ios::binary;
-      if (_append) {
-        flags |= std::ios::app;
-      }
-      std::ofstream file(p.string(), flags);
       if (contents.valueType == String) {
         auto len = contents.payload.stringLen > 0 ||
                            contents.payload.stringValue == nullptr
                        ? contents.payload.stringLen
                        : strlen(contents.payload.stringValue);
-        file.write((const char *)contents.payload.stringValue, len);
+        AsyncFile::writeAll(context, p.string(),
+                            (const uint8_t *)contents.payload.stringValue, len,
+                            _append);
       } else {
-        file.write((const char *)contents.payload.bytesValue,
-                   contents.payload.bytesSize);
+        AsyncFile::writeAll(context, p.string(), contents.payload.bytesValue,
+                            contents.payload.bytesSize, _append);
       }
     }
     return input;
@@ -420,26 +425,284 @@ struct Copy {
       throw ActivationError("Destination is not a valid");
     const auto dst = fs::path(dstVar.payload.stringValue);
 
+    // might be a whole tree, copy it on the thread pool
     std::error_code err;
-    if (fs::is_regular_file(src) &&
-        (!fs::exists(dst) || fs::is_regular_file(dst))) {
-      fs::copy_file(src, dst, options, err);
-      if (err) {
-        CBLOG_ERROR("copy error: {}", err.message());
-        throw ActivationError("Copy failed.");
-      }
-    } else {
-      options |= fs::copy_options::recursive;
-      fs::copy(src, dst, options, err);
-      if (err) {
-        CBLOG_ERROR("copy error: {}", err.message());
-        throw ActivationError("Copy failed.");
-      }
+    await(
+        context,
+        [&]() {
+          if (fs::is_regular_file(src) &&
+              (!fs::exists(dst) || fs::is_regular_file(dst))) {
+            fs::copy_file(src, dst, options, err);
+          } else {
+            options |= fs::copy_options::recursive;
+            fs::copy(src, dst, options, err);
+          }
+        },
+        [] {});
+    if (err) {
+      CBLOG_ERROR("copy error: {}", err.message());
+      throw ActivationError("Copy failed.");
     }
 
     return input;
   }
 };
+
+// A read only file mapping, shared by every FS.Map block mapping the same
+// (unchanged) file. One zero page is reserved right after the file so the
+// mapping is always null terminated and can be output as String.
+struct Mapping {
+  uint8_t *data{nullptr};
+  size_t size{0};
+#ifdef CB_FS_MMAP
+  size_t reserved{0};
+  ~Mapping() {
+    if (data)
+      munmap(data, reserved);
+  }
+#else
+  // no mmap, the whole file is read instead
+  std::vector<uint8_t> buffer;
+#endif
+
+  static std::shared_ptr<Mapping> get(CBContext *context,
+                                      const std::string &path) {
+    static std::mutex mutex;
+    static std::map<std::string,
+                    std::tuple<std::weak_ptr<Mapping>, uintmax_t,
+                               fs::file_time_type>>
+        mappings;
+
+    std::error_code ec;
+    const auto canonical = fs::canonical(path, ec).string();
+    if (ec)
+      throw ActivationError("FS.Map, file does not exist.");
+    const auto status = fs::status(canonical, ec);
+    if (ec)
+      throw ActivationError("FS.Map, failed to stat file.");
+    if (!fs::is_regular_file(status))
+      throw ActivationError("FS.Map, not a regular file.");
+    const auto size = fs::file_size(canonical, ec);
+    if (ec)
+      throw ActivationError("FS.Map, failed to get the file size.");
+    const auto mtime = fs::last_write_time(canonical, ec);
+    if (ec)
+      throw ActivationError("FS.Map, failed to get the file time.");
+
+    std::scoped_lock lock(mutex);
+    for (auto it = mappings.begin(); it != mappings.end();) {
+      if (std::get<0>(it->second).expired())
+        it = mappings.erase(it);
+      else
+        ++it;
+    }
+
+    auto &entry = mappings[canonical];
+    auto mapping = std::get<0>(entry).lock();
+    if (mapping && std::get<1>(entry) == size && std::get<2>(entry) == mtime)
+      return mapping;
+
+    // new or modified, holders of the old mapping keep it alive
+    mapping = std::make_shared<Mapping>();
+    mapping->size = size_t(size);
+#ifdef CB_FS_MMAP
+    const auto page = size_t(sysconf(_SC_PAGESIZE));
+    mapping->reserved = (mapping->size / page + 1) * page;
+    auto base = mmap(nullptr, mapping->reserved, PROT_READ,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+      throw ActivationError("FS.Map, failed to reserve address space.");
+    mapping->data = reinterpret_cast<uint8_t *>(base);
+    if (mapping->size > 0) {
+      const auto fd = ::open(canonical.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        throw ActivationError("FS.Map, failed to open file.");
+      auto mapped = mmap(base, mapping->size, PROT_READ, MAP_SHARED | MAP_FIXED,
+                         fd, 0);
+      ::close(fd);
+      if (mapped == MAP_FAILED)
+        throw ActivationError("FS.Map, failed to map file.");
+    }
+#else
+    AsyncFile::readAll(context, canonical, mapping->buffer, true);
+    mapping->size = mapping->buffer.size() - 1;
+    mapping->data = mapping->buffer.data();
+#endif
+    entry = std::make_tuple(std::weak_ptr<Mapping>(mapping), size, mtime);
+    return mapping;
+  }
+};
+
+struct Map {
+  enum class Advice { Normal, Sequential, Random, WillNeed };
+  static inline EnumInfo<Advice> AdviceEnum{"MapAdvice", CoreCC, 'fsma'};
+  static inline Type AdviceEnumType{
+      {CBType::Enum, {.enumeration = {CoreCC, 'fsma'}}}};
+
+  ParamVar _offset{Var(0)};
+  ParamVar _size{};
+  Advice _advice{Advice::Normal};
+  bool _binary{false};
+
+  std::shared_ptr<Mapping> _mapping;
+  // every mapping output since warmup, views of any of them might still be
+  // held downstream
+  std::unordered_set<std::shared_ptr<Mapping>> _held;
+  std::string _path;
+  const uint8_t *_advised{nullptr};
+  size_t _advisedSize{0};
+
+  static CBTypesInfo inputTypes() { return CoreInfo::StringType; }
+  CBTypesInfo outputTypes() {
+    if (_binary)
+      return CoreInfo::BytesType;
+    else
+      return CoreInfo::StringType;
+  }
+
+  static CBOptionalString help() {
+    return CBCCSTR(
+        "Maps the file at the input path in memory and outputs a view of it, "
+        "nothing is copied and pages are loaded by the OS on access. The "
+        "mapping is shared with other FS.Map blocks and every mapping this "
+        "block output stays valid until it is cleaned up, even after "
+        "switching to other paths. Views are limited to 4GB, use Offset "
+        "and Size to window larger files. The file must not be truncated "
+        "while mapped, reading a view past the new end of the file crashes "
+        "the process with SIGBUS.");
+  }
+
+  static inline Parameters params{
+      {"Bytes",
+       CBCCSTR("If the output should be Bytes instead of String. String views "
+               "must extend to the end of the file."),
+       {CoreInfo::BoolType}},
+      {"Offset",
+       CBCCSTR("The offset of the view in the file."),
+       {CoreInfo::IntType, CoreInfo::IntVarType}},
+      {"Size",
+       CBCCSTR("The size of the view, None for the rest of the file."),
+       {CoreInfo::IntType, CoreInfo::IntVarType, CoreInfo::NoneType}},
+      {"Advice",
+       CBCCSTR("How the view will be accessed, a hint for the OS paging."),
+       {AdviceEnumType}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _binary = value.payload.boolValue;
+      break;
+    case 1:
+      _offset = value;
+      break;
+    case 2:
+      _size = value;
+      break;
+    case 3:
+      _advice = Advice(value.payload.enumValue);
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(_binary);
+    case 1:
+      return _offset;
+    case 2:
+      return _size;
+    case 3:
+      return Var::Enum(_advice, CoreCC, 'fsma');
+    default:
+      return Var::Empty;
+    }
+  }
+
+  void warmup(CBContext *context) {
+    _offset.warmup(context);
+    _size.warmup(context);
+  }
+
+  void cleanup() {
+    _offset.cleanup();
+    _size.cleanup();
+    _mapping.reset();
+    _held.clear();
+    _path.clear();
+    _advised = nullptr;
+    _advisedSize = 0;
+  }
+
+  void advise(const uint8_t *data, size_t size) {
+#ifdef CB_FS_MMAP
+    if (data == _advised && size == _advisedSize)
+      return;
+    _advised = data;
+    _advisedSize = size;
+
+    int advice = MADV_NORMAL;
+    switch (_advice) {
+    case Advice::Normal:
+      advice = MADV_NORMAL;
+      break;
+    case Advice::Sequential:
+      advice = MADV_SEQUENTIAL;
+      break;
+    case Advice::Random:
+      advice = MADV_RANDOM;
+      break;
+    case Advice::WillNeed:
+      advice = MADV_WILLNEED;
+      break;
+    }
+    const auto page = uintptr_t(sysconf(_SC_PAGESIZE));
+    const auto begin = uintptr_t(data) & ~(page - 1);
+    const auto end = uintptr_t(data) + size;
+    if (end > begin)
+      madvise(reinterpret_cast<void *>(begin), end - begin, advice);
+#endif
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto path = CBSTRVIEW(input);
+    if (!_mapping || path != _path) {
+      _mapping = Mapping::get(context, std::string(path));
+      _held.insert(_mapping);
+      _path = path;
+      _advised = nullptr;
+    }
+
+    const auto offset = _offset.get().payload.intValue;
+    if (offset < 0 || size_t(offset) > _mapping->size)
+      throw ActivationError("FS.Map, offset out of range.");
+    const auto &vsize = _size.get();
+    size_t size = _mapping->size - size_t(offset);
+    if (vsize.valueType == Int) {
+      if (vsize.payload.intValue < 0 || size_t(vsize.payload.intValue) > size)
+        throw ActivationError("FS.Map, size out of range.");
+      size = size_t(vsize.payload.intValue);
+    }
+    if (size > UINT32_MAX)
+      throw ActivationError(
+          "FS.Map, view larger than 4GB, use Offset and Size.");
+
+    const auto data = _mapping->data + offset;
+    advise(data, size);
+
+    if (_binary) {
+      return Var(const_cast<uint8_t *>(data), uint32_t(size));
+    } else {
+      // only the end of the mapping is followed by a 0
+      if (size_t(offset) + size != _mapping->size)
+        throw ActivationError(
+            "FS.Map, String views must extend to the end of the file.");
+      return Var((const char *)data, size);
+    }
+  }
+};
 }; // namespace FS
 
 void registerFSBlocks() {
@@ -447,6 +710,7 @@ void registerFSBlocks() {
   REGISTER_CBLOCK("FS.Extension", FS::Extension);
   REGISTER_CBLOCK("FS.Filename", FS::Filename);
   REGISTER_CBLOCK("FS.Read", FS::Read);
+  REGISTER_CBLOCK("FS.Map", FS::Map);
   REGISTER_CBLOCK("FS.Write", FS::Write);
   REGISTER_CBLOCK("FS.IsFile", FS::IsFile);
   REGISTER_CBLOCK("FS.IsDirectory", FS::IsDirectory);
@@ -5,6 +5,7 @@
 #include "chainblocks.h"
 #include "chainblocks.hpp"
 #include "shared.hpp"
+#include <chrono>
 #include <limits>
 #include <pdqsort.h>
 #include <random>
@@ -63,6 +64,12 @@ struct Evolve {
     case 8:
       _coros = value.payload.intValue;
       break;
+    case 9:
+      if (value.valueType == None)
+        _statsName.clear();
+      else
+        _statsName = value.payload.stringValue;
+      break;
     default:
       break;
     }
@@ -88,11 +95,26 @@ struct Evolve {
       return Var(_threads);
     case 8:
       return Var(_coros);
+    case 9:
+      return _statsName.size() == 0 ? Var::Empty : Var(_statsName);
     default:
       return Var::Empty;
     }
   }
 
+  CBExposedTypesInfo exposedVariables() {
+    if (_statsName.size() > 0) {
+      _statsInfo = ExposedInfo(ExposedInfo::Variable(
+          _statsName.c_str(),
+          CBCCSTR("Individuals evaluated and served from cache in the last "
+                  "era."),
+          CoreInfo::Int2Type));
+      return CBExposedTypesInfo(_statsInfo);
+    } else {
+      return {};
+    }
+  }
+
   CBTypeInfo compose(const CBInstanceData &data) {
     // we still want to run a compose on the subject, in order
     // to serialize it properly!
@@ -169,9 +191,16 @@ struct Evolve {
     if (!_exec || _exec->num_workers() != (size_t(threads) + 1)) {
       _exec.reset(new tf::Executor(size_t(threads) + 1));
     }
+    if (_statsName.size() > 0 && !_stats) {
+      _stats = referenceVariable(context, _statsName.c_str());
+    }
   }
 
   void cleanup() {
+    if (_stats) {
+      releaseVariable(_stats);
+      _stats = nullptr;
+    }
     if (_population.size() > 0) {
       tf::Taskflow cleanupFlow;
       cleanupFlow.for_each_dynamic(
@@ -194,7 +223,7 @@ struct Evolve {
   }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    return awaitne(
+    auto res = awaitne(
         context,
         [&]() {
           // Init on the first run!
@@ -320,6 +349,15 @@ struct Evolve {
             best->chainUsers.clear();
           }
 
+          // only individuals whose genome changed since their last
+          // evaluation are run, the others keep their fitness
+          _evaluating.clear();
+          for (auto &i : _sortedPopulation) {
+            if (i->dirty)
+              _evaluating.emplace_back(i);
+          }
+          const auto evalStart = std::chrono::high_resolution_clock::now();
+
 #if 1
           // We run chains up to completion
           // From validation to end, every iteration/era
@@ -329,9 +367,7 @@ struct Evolve {
             tf::Taskflow flow;
 
             flow.for_each_dynamic(
-                _era == 0 ? _sortedPopulation.begin()
-                          : _sortedPopulation.begin() + _nelites,
-                _sortedPopulation.end(),
+                _evaluating.begin(), _evaluating.end(),
                 [](auto &i) {
                   // Evaluate our brain chain
                   auto chain =
@@ -347,9 +383,7 @@ struct Evolve {
             tf::Taskflow flow;
 
             flow.for_each_dynamic(
-                _era == 0 ? _sortedPopulation.begin()
-                          : _sortedPopulation.begin() + _nelites,
-                _sortedPopulation.end(),
+                _evaluating.begin(), _evaluating.end(),
                 [](auto &i) {
                   if (!i->node->empty())
                     i->node->tick();
@@ -373,9 +407,7 @@ struct Evolve {
             tf::Taskflow flow;
 
             flow.for_each_dynamic(
-                _era == 0 ? _sortedPopulation.begin()
-                          : _sortedPopulation.begin() + _nelites,
-                _sortedPopulation.end(),
+                _evaluating.begin(), _evaluating.end(),
                 [](auto &i) {
                   // compute the fitness
                   TickObserver obs{*i};
@@ -394,9 +426,7 @@ struct Evolve {
             tf::Taskflow flow;
 
             flow.for_each_dynamic(
-                _era == 0 ? _sortedPopulation.begin()
-                          : _sortedPopulation.begin() + _nelites,
-                _sortedPopulation.end(),
+                _evaluating.begin(), _evaluating.end(),
                 [](auto &i) {
                   if (!i->node->empty()) {
                     TickObserver obs{*i};
@@ -448,25 +478,39 @@ struct Evolve {
           }
 #endif
           CBLOG_TRACE("Evolve, stopping all chains");
-          { // Stop all the population chains
+          { // Stop all the chains we ran
             tf::Taskflow flow;
 
             flow.for_each_dynamic(
-                _population.begin(), _population.end(), [](Individual &i) {
+                _evaluating.begin(), _evaluating.end(), [](Individual *i) {
                   auto chain =
-                      CBChain::sharedFromRef(i.chain.payload.chainValue);
-                  auto fitchain =
-                      CBChain::sharedFromRef(i.fitnessChain.payload.chainValue);
+                      CBChain::sharedFromRef(i->chain.payload.chainValue);
+                  auto fitchain = CBChain::sharedFromRef(
+                      i->fitnessChain.payload.chainValue);
                   stop(chain.get());
                   chain->composedHash = 0;
                   stop(fitchain.get());
                   fitchain->composedHash = 0;
-                  i.node->terminate();
+                  i->node->terminate();
+                  i->dirty = false;
                 });
 
             _exec->run(flow).get();
           }
 
+          {
+            const auto evalEnd = std::chrono::high_resolution_clock::now();
+            const auto ms =
+                std::chrono::duration<double, std::milli>(evalEnd - evalStart)
+                    .count();
+            _evaluated = _evaluating.size();
+            _cached = _population.size() - _evaluated;
+            CBLOG_DEBUG("Evolve, era {} evaluated {} cached {} in {:.2f} ms, "
+                        "{:.1f} individuals/s",
+                        _era, _evaluated, _cached, ms,
+                        ms > 0.0 ? double(_evaluated) * 1000.0 / ms : 0.0);
+          }
+
           CBLOG_TRACE("Evolve, sorting");
           // remove non normal fitness (sort needs this or crashes will happen)
           std::for_each(_sortedPopulation.begin(), _sortedPopulation.end(),
@@ -530,6 +574,10 @@ struct Evolve {
         [] {
           // TODO CANCELLATION
         });
+    if (_stats) {
+      *_stats = Var(int64_t(_evaluated), int64_t(_cached));
+    }
+    return res;
   }
 
 private:
@@ -568,6 +616,9 @@ private:
 
     bool extinct = false;
 
+    // genome changed since the fitness was computed
+    bool dirty = true;
+
     tf::Task crossoverTask;
     int parent0Idx = -1;
     int parent1Idx = -1;
@@ -627,7 +678,12 @@ private:
        {CoreInfo::IntType}},
       {"Coroutines",
        CBCCSTR("The number of coroutines to run on each thread."),
-       {CoreInfo::IntType}}};
+       {CoreInfo::IntType}},
+      {"Stats",
+       CBCCSTR("The name of a variable receiving, after every era, how many "
+               "individuals were evaluated and how many kept their previous "
+               "fitness because their genome did not change, as an Int2."),
+       {CoreInfo::StringOrNone}}};
   static inline Types _outputTypes{{CoreInfo::FloatType, CoreInfo::ChainType}};
   static inline Type _outputType{{CBType::Seq, {.seqTypes = _outputTypes}}};
 
@@ -638,6 +694,7 @@ private:
   std::vector<CBVar> _result;
   std::vector<Individual> _population;
   std::vector<Individual *> _sortedPopulation;
+  std::vector<Individual *> _evaluating;
   std::vector<std::tuple<Individual *, Individual *, Individual *>>
       _crossingOver;
   int64_t _popsize = 64;
@@ -650,6 +707,12 @@ private:
   double _elitism = 0.1;
   size_t _nelites = 0;
   size_t _era = 0;
+  // last era metrics
+  size_t _evaluated = 0;
+  size_t _cached = 0;
+  std::string _statsName;
+  CBVar *_stats = nullptr;
+  ExposedInfo _statsInfo{};
 };
 
 struct Mutant {
@@ -969,6 +1032,7 @@ inline void Evolve::crossover(Individual &child, const Individual &parent0,
         auto p0s = p0b->getState(p0b);
         auto p1s = p1b->getState(p1b);
         cb->crossover(cb, &p0s, &p1s);
+        child.dirty = true;
       }
       // check if we have mutant params and cross them over
       auto &indices = cmuts->block.get()._indices;
@@ -980,10 +1044,12 @@ inline void Evolve::crossover(Individual &child, const Individual &parent0,
             // take from 0
             auto val = p0b->getParam(p0b, i);
             cb->setParam(cb, i, &val);
+            child.dirty = true;
           } else if (r < 0.66) {
             // take from 1
             auto val = p1b->getParam(p1b, i);
             cb->setParam(cb, i, &val);
+            child.dirty = true;
           } // else we keep
         }
       }
@@ -1012,6 +1078,7 @@ inline void Evolve::mutate(Evolve::Individual &individual) {
         auto &mutator = info.block.get();
         auto &options = mutator._options;
         if (info.block.get().mutant()) {
+          individual.dirty = true;
           auto mutant = info.block.get().mutant();
           auto &indices = mutator._indices;
           if (mutant->mutate && (indices.valueType == None || rand() < 0.5)) {
@@ -1058,6 +1125,7 @@ inline void Evolve::mutate(Evolve::Individual &individual) {
 }
 
 inline void Evolve::resetState(Evolve::Individual &individual) {
+  individual.dirty = true;
   // Reset params and state
   std::for_each(std::begin(individual.mutants), std::end(individual.mutants),
                 [](MutantInfo &info) {
@@ -7,17 +7,39 @@
 #define BOOST_ERROR_CODE_HEADER_ONLY
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
 #include <boost/beast/version.hpp>
+#if BOOST_VERSION >= 107300
+#include <boost/asio/ssl/host_name_verification.hpp>
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#endif
 
 namespace beast = boost::beast; // from <boost/beast.hpp>
 namespace http = beast::http;   // from <boost/beast/http.hpp>
 namespace net = boost::asio;    // from <boost/asio.hpp>
+namespace ssl = net::ssl;       // from <boost/asio/ssl.hpp>
 using tcp = net::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <ctime>
 #include <deque>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 #include <iomanip>
 #include <sstream>
 #include <string>
@@ -26,6 +48,7 @@ using tcp = net::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 #include <emscripten/fetch.h>
 #endif
 
+#include "http.hpp"
 #include "shared.hpp"
 #include <filesystem>
 
@@ -56,8 +79,6 @@ inline std::string url_encode(const std::string_view &value) {
 
 namespace chainblocks {
 namespace Http {
-#ifdef __EMSCRIPTEN__
-// those blocks for non emscripten platforms are implemented in Rust
 
 struct Base {
   static inline Types FullStrOutputTypes{
@@ -165,6 +186,7 @@ struct Base {
     headers.cleanup();
   }
 
+#ifdef __EMSCRIPTEN__
   static void fetchSucceeded(emscripten_fetch_t *fetch) {
     auto self = reinterpret_cast<Base *>(fetch->userData);
     if (self->fullResponse) {
@@ -199,6 +221,31 @@ struct Base {
     self->state = -1;
     emscripten_fetch_close(fetch); // Also free data on failure.
   }
+#endif
+
+  // builds the output from buffer (and status/headers if fullResponse)
+  CBVar finalize() {
+    if (unlikely(fullResponse)) {
+      outMap.insert_or_assign("status", Var(status));
+      if (asBytes) {
+        outMap.insert_or_assign("body",
+                                Var((uint8_t *)buffer.data(), buffer.size()));
+      } else {
+        outMap.insert_or_assign("body", Var(buffer));
+      }
+      CBVar res{};
+      res.valueType = CBType::Table;
+      res.payload.tableValue.opaque = &outMap;
+      res.payload.tableValue.api = &GetGlobals().TableInterface;
+      return res;
+    } else {
+      if (asBytes) {
+        return Var((uint8_t *)buffer.data(), buffer.size());
+      } else {
+        return Var(buffer);
+      }
+    }
+  }
 
   bool asBytes{false};
   bool fullResponse{false};
@@ -206,14 +253,17 @@ struct Base {
   int state{0};
   int timeout{10};
   std::string buffer;
-  std::string hbuffer;
   std::string vars;
+#ifdef __EMSCRIPTEN__
+  std::string hbuffer;
   std::vector<const char *> headersCArray;
+#endif
   CBMap outMap;
   ParamVar url{Var("")};
   ParamVar headers{};
 };
 
+#ifdef __EMSCRIPTEN__
 template <const string_view &METHOD> struct GetLike : public Base {
   static inline Types InputTypes{
       {CoreInfo::NoneType, CoreInfo::StringTableType}};
@@ -410,6 +460,573 @@ using Delete = PostLike<DELETE>;
 
 #else
 
+namespace Client {
+using Clock = std::chrono::steady_clock;
+
+struct Url {
+  bool secure{false};
+  std::string host;
+  std::string port;
+  std::string target;
+
+  // absolute http(s) urls, the scheme defaults to http
+  static Url parse(std::string_view url) {
+    Url res;
+    const auto schemeEnd = url.find("://");
+    if (schemeEnd != std::string_view::npos) {
+      const auto scheme = beast::string_view(url.data(), schemeEnd);
+      if (beast::iequals(scheme, "https"))
+        res.secure = true;
+      else if (!beast::iequals(scheme, "http"))
+        throw ActivationError("Http: unsupported url scheme");
+      url.remove_prefix(schemeEnd + 3);
+    }
+
+    const auto pathStart = url.find_first_of("/?#");
+    auto authority = url.substr(0, pathStart);
+    if (pathStart != std::string_view::npos)
+      res.target = url.substr(pathStart);
+    // fragments are never sent
+    const auto fragment = res.target.find('#');
+    if (fragment != std::string::npos)
+      res.target.resize(fragment);
+    if (res.target.empty() || res.target[0] != '/')
+      res.target.insert(0, "/");
+
+    const auto userInfo = authority.rfind('@');
+    if (userInfo != std::string_view::npos)
+      authority.remove_prefix(userInfo + 1);
+
+    std::string_view portView;
+    if (!authority.empty() && authority[0] == '[') {
+      // ipv6 literal
+      const auto close = authority.find(']');
+      if (close == std::string_view::npos)
+        throw ActivationError("Http: invalid url");
+      res.host = authority.substr(1, close - 1);
+      if (close + 1 < authority.size() && authority[close + 1] == ':')
+        portView = authority.substr(close + 2);
+    } else {
+      const auto colon = authority.rfind(':');
+      res.host = authority.substr(0, colon);
+      if (colon != std::string_view::npos)
+        portView = authority.substr(colon + 1);
+    }
+
+    if (res.host.empty())
+      throw ActivationError("Http: invalid url");
+
+    if (portView.empty())
+      res.port = res.secure ? "443" : "80";
+    else
+      res.port = portView;
+
+    return res;
+  }
+
+  std::string key() const {
+    return (secure ? "https://" : "http://") + host + ":" + port;
+  }
+};
+
+struct Settings {
+  // how long an unused connection is kept open, 0 disables keep-alive
+  std::chrono::seconds keepAlive{30};
+  size_t maxConnections{6};
+  bool pipelining{false};
+};
+
+// a single request/response, shared between the block and the connection
+// so that a stopped chain can't leave dangling handlers
+struct Exchange {
+  http::request<http::string_body> request;
+  http::response_parser<http::string_body> parser;
+  std::chrono::seconds timeout{10};
+  bool idempotent{false};
+  // sent on a connection which already served requests, the server might
+  // have closed it in the meantime so failures are retried once
+  bool reused{false};
+  // 0 = pending, 1 = done, -1 = failed
+  int state{0};
+  beast::error_code error;
+
+  Exchange() { parser.body_limit(std::numeric_limits<std::uint64_t>::max()); }
+};
+
+struct Connection : public std::enable_shared_from_this<Connection> {
+  enum class State { Idle, Connecting, Connected, Closed };
+
+  Connection(net::io_context &ioc, ssl::context &sslCtx, const Url &url)
+      : _resolver(ioc), _host(url.host), _port(url.port) {
+    if (url.secure)
+      _secure.emplace(ioc, sslCtx);
+    else
+      _plain.emplace(ioc);
+  }
+
+  bool closed() const { return _state == State::Closed; }
+  size_t pending() const { return _writes.size() + _reads.size(); }
+  Clock::time_point lastUsed() const { return _lastUsed; }
+
+  void enqueue(const std::shared_ptr<Exchange> &exchange) {
+    exchange->reused = _served > 0;
+    _writes.emplace_back(exchange);
+    _lastUsed = Clock::now();
+    if (_state == State::Idle) {
+      connect(exchange->timeout);
+    } else if (_state == State::Connected && !_writing) {
+      write();
+    }
+  }
+
+  void close() {
+    if (_state == State::Closed)
+      return;
+    _state = State::Closed;
+    beast::error_code ec;
+    _resolver.cancel();
+    stream().socket().shutdown(tcp::socket::shutdown_both, ec);
+    stream().close();
+    fail(net::error::operation_aborted);
+  }
+
+private:
+  beast::tcp_stream &stream() {
+    return _secure ? beast::get_lowest_layer(*_secure) : *_plain;
+  }
+
+  template <typename F> void withStream(F &&f) {
+    if (_secure)
+      f(*_secure);
+    else
+      f(*_plain);
+  }
+
+  void fail(const beast::error_code &ec) {
+    for (auto &pending : {&_writes, &_reads}) {
+      for (auto &exchange : *pending) {
+        exchange->error = ec;
+        exchange->state = -1;
+      }
+      pending->clear();
+    }
+    if (_state != State::Closed)
+      close();
+  }
+
+  void connect(std::chrono::seconds timeout) {
+    _state = State::Connecting;
+    _resolver.async_resolve(
+        _host, _port,
+        [self = shared_from_this(),
+         timeout](beast::error_code ec, tcp::resolver::results_type results) {
+          if (ec)
+            return self->fail(ec);
+
+          self->stream().expires_after(timeout);
+          self->stream().async_connect(
+              results,
+              [self](beast::error_code ec, tcp::endpoint) {
+                if (ec)
+                  return self->fail(ec);
+
+                if (self->_secure) {
+                  // SNI, many hosts require it
+                  if (!SSL_set_tlsext_host_name(self->_secure->native_handle(),
+                                                self->_host.c_str())) {
+                    return self->fail(
+                        beast::error_code(static_cast<int>(::ERR_get_error()),
+                                          net::error::get_ssl_category()));
+                  }
+#if BOOST_VERSION >= 107300
+                  self->_secure->set_verify_callback(
+                      ssl::host_name_verification(self->_host));
+#else
+                  self->_secure->set_verify_callback(
+                      ssl::rfc2818_verification(self->_host));
+#endif
+                  self->_secure->async_handshake(
+                      ssl::stream_base::client, [self](beast::error_code ec) {
+                        if (ec)
+                          return self->fail(ec);
+                        self->connected();
+                      });
+                } else {
+                  self->connected();
+                }
+              });
+        });
+  }
+
+  void connected() {
+    _state = State::Connected;
+    if (!_writes.empty())
+      write();
+  }
+
+  void write() {
+    _writing = true;
+    auto exchange = _writes.front();
+    stream().expires_after(exchange->timeout);
+    withStream([&](auto &s) {
+      http::async_write(
+          s, exchange->request,
+          [self = shared_from_this(), exchange](beast::error_code ec,
+                                                std::size_t) {
+            self->_writing = false;
+            if (ec)
+              return self->fail(ec);
+
+            self->_writes.pop_front();
+            self->_reads.emplace_back(exchange);
+            if (!self->_reading)
+              self->read();
+            // pipelined requests go out without waiting for responses
+            if (!self->_writes.empty())
+              self->write();
+          });
+    });
+  }
+
+  void read() {
+    _reading = true;
+    auto exchange = _reads.front();
+    stream().expires_after(exchange->timeout);
+    withStream([&](auto &s) {
+      http::async_read(
+          s, _buffer, exchange->parser,
+          [self = shared_from_this(), exchange](beast::error_code ec,
+                                                std::size_t) {
+            self->_reading = false;
+            if (ec)
+              return self->fail(ec);
+
+            self->_reads.pop_front();
+            self->_served++;
+            self->_lastUsed = Clock::now();
+            exchange->state = 1;
+
+            if (!exchange->parser.get().keep_alive()) {
+              self->close();
+            } else if (!self->_reads.empty()) {
+              self->read();
+            } else {
+              // nothing in flight, don't time out while idle
+              self->stream().expires_never();
+            }
+          });
+    });
+  }
+
+  tcp::resolver _resolver;
+  std::optional<beast::tcp_stream> _plain;
+  std::optional<beast::ssl_stream<beast::tcp_stream>> _secure;
+  std::string _host;
+  std::string _port;
+  beast::flat_buffer _buffer;
+  std::deque<std::shared_ptr<Exchange>> _writes;
+  std::deque<std::shared_ptr<Exchange>> _reads;
+  State _state{State::Idle};
+  bool _writing{false};
+  bool _reading{false};
+  uint64_t _served{0};
+  Clock::time_point _lastUsed{Clock::now()};
+};
+
+// keep-alive connections shared by all the client blocks of a node (and
+// thread), keyed by scheme, host and port
+struct Pool {
+  // declared first so it outlives the streams owned by pending handlers
+  ssl::context sslCtx{ssl::context::tlsv12_client};
+  net::io_context ioc;
+
+  Pool() {
+    sslCtx.set_default_verify_paths();
+    sslCtx.set_verify_mode(ssl::verify_peer);
+  }
+
+  ~Pool() {
+    for (auto &[_, connections] : _connections) {
+      for (auto &connection : connections) {
+        connection->close();
+      }
+    }
+    // let handlers run and release their references
+    poll();
+  }
+
+  // runs ready handlers without blocking, poll stops the context when it runs
+  // out of work so it's restarted first
+  void poll() {
+    if (ioc.stopped())
+      ioc.restart();
+    ioc.poll();
+  }
+
+  static std::shared_ptr<Pool> get(const CBNode *node) {
+    return perNodeThread<Pool>(node);
+  }
+
+  // returns a connection to send the request to, nullptr if the caller
+  // should wait because every allowed connection is busy
+  std::shared_ptr<Connection> acquire(const Url &url, const Settings &settings,
+                                      bool idempotent) {
+    const auto now = Clock::now();
+    auto &connections = _connections[url.key()];
+    for (auto it = connections.begin(); it != connections.end();) {
+      auto &connection = *it;
+      if (!connection->closed() && connection->pending() == 0 &&
+          now - connection->lastUsed() > settings.keepAlive) {
+        connection->close();
+      }
+      if (connection->closed())
+        it = connections.erase(it);
+      else
+        ++it;
+    }
+
+    for (auto &connection : connections) {
+      if (connection->pending() == 0)
+        return connection;
+    }
+
+    if (connections.size() < settings.maxConnections) {
+      return connections.emplace_back(
+          std::make_shared<Connection>(ioc, sslCtx, url));
+    }
+
+    // only idempotent requests are pipelined, a failure in the middle of the
+    // pipeline might require sending them again
+    if (settings.pipelining && idempotent) {
+      return *std::min_element(connections.begin(), connections.end(),
+                               [](const auto &a, const auto &b) {
+                                 return a->pending() < b->pending();
+                               });
+    }
+
+    return nullptr;
+  }
+
+private:
+  std::unordered_map<std::string, std::list<std::shared_ptr<Connection>>>
+      _connections;
+};
+} // namespace Client
+
+struct PooledBase : public Base {
+  static inline Parameters params{
+      Base::params,
+      {{"KeepAlive",
+        CBCCSTR("How many seconds an unused connection is kept open for "
+                "further requests to the same host, 0 disables keep-alive."),
+        {CoreInfo::IntType}},
+       {"MaxConnections",
+        CBCCSTR("The maximum number of concurrent connections to the same "
+                "host, further requests wait for a free connection."),
+        {CoreInfo::IntType}},
+       {"Pipelining",
+        CBCCSTR("If GET and HEAD requests can be sent over a busy connection "
+                "when MaxConnections is reached, without waiting for the "
+                "previous responses."),
+        {CoreInfo::BoolType}}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 5:
+      settings.keepAlive = std::chrono::seconds(value.payload.intValue);
+      break;
+    case 6:
+      settings.maxConnections =
+          size_t(std::max(int64_t(1), value.payload.intValue));
+      break;
+    case 7:
+      settings.pipelining = value.payload.boolValue;
+      break;
+    default:
+      Base::setParam(index, value);
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 5:
+      return Var(int64_t(settings.keepAlive.count()));
+    case 6:
+      return Var(int64_t(settings.maxConnections));
+    case 7:
+      return Var(settings.pipelining);
+    default:
+      return Base::getParam(index);
+    }
+  }
+
+  void warmup(CBContext *context) {
+    Base::warmup(context);
+    auto node = context->main->node.lock();
+    pool = Client::Pool::get(node.get());
+  }
+
+  void cleanup() {
+    exchange.reset();
+    pool.reset();
+    Base::cleanup();
+  }
+
+  CBVar request(CBContext *context, const Client::Url &url, http::verb method,
+                std::string_view target, std::string_view contentType,
+                std::string_view body) {
+    const bool idempotent =
+        method == http::verb::get || method == http::verb::head;
+
+    for (int attempt = 0;; attempt++) {
+      exchange = std::make_shared<Client::Exchange>();
+      auto &req = exchange->request;
+      req.method(method);
+      req.target(beast::string_view(target.data(), target.size()));
+      req.version(11);
+      req.set(http::field::host, url.host);
+      req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+      req.keep_alive(settings.keepAlive.count() > 0);
+      // custom headers override the default content type
+      if (!contentType.empty())
+        req.set(http::field::content_type,
+                beast::string_view(contentType.data(), contentType.size()));
+      if (headers.get().valueType == Table) {
+        ForEach(headers.get().payload.tableValue, [&](auto key, auto &value) {
+          const auto sv_value = CBSTRVIEW(value);
+          req.set(key, beast::string_view(sv_value.data(), sv_value.size()));
+        });
+      }
+      req.body() = body;
+      req.prepare_payload();
+      exchange->timeout = std::chrono::seconds(timeout);
+      exchange->idempotent = idempotent;
+      if (method == http::verb::head)
+        exchange->parser.skip(true);
+
+      // wait for a free connection
+      std::shared_ptr<Client::Connection> connection;
+      while (!(connection = pool->acquire(url, settings, idempotent))) {
+        pool->poll();
+        CB_SUSPEND(context, 0.0);
+      }
+      connection->enqueue(exchange);
+
+      while (exchange->state == 0) {
+        pool->poll();
+        if (exchange->state != 0)
+          break;
+        CB_SUSPEND(context, 0.0);
+      }
+
+      if (exchange->state == 1)
+        break;
+
+      // a kept alive connection might have been closed by the server
+      if (exchange->reused && exchange->idempotent && attempt == 0) {
+        CBLOG_DEBUG("Http request on reused connection failed: {}, retrying",
+                    exchange->error.message());
+        continue;
+      }
+
+      CBLOG_ERROR("Http request failed: {}", exchange->error.message());
+      throw ActivationError("Http request failed");
+    }
+
+    auto &res = exchange->parser.get();
+    status = uint16_t(res.result_int());
+    if (unlikely(fullResponse)) {
+      auto &mvar = outMap["headers"];
+      auto m = reinterpret_cast<CBMap *>(mvar.payload.tableValue.opaque);
+      m->clear();
+      for (auto &field : res) {
+        std::string key(field.name_string().data(),
+                        field.name_string().size());
+        std::transform(key.begin(), key.end(), key.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        m->insert_or_assign(std::move(key),
+                            Var(field.value().data(), field.value().size()));
+      }
+    }
+    buffer = std::move(res.body());
+    exchange.reset();
+    return finalize();
+  }
+
+  Client::Settings settings;
+  std::shared_ptr<Client::Pool> pool;
+  std::shared_ptr<Client::Exchange> exchange;
+};
+
+template <http::verb METHOD> struct GetLike : public PooledBase {
+  static inline Types InputTypes{
+      {CoreInfo::NoneType, CoreInfo::StringTableType}};
+  static CBTypesInfo inputTypes() { return InputTypes; }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto parsed = Client::Url::parse(CBSTRVIEW(url.get()));
+    vars.assign(parsed.target);
+    if (input.valueType == Table) {
+      vars.append(vars.find('?') == std::string::npos ? "?" : "&");
+      ForEach(input.payload.tableValue, [&](auto key, auto &value) {
+        auto sv_value = CBSTRVIEW(value);
+        vars.append(url_encode(key));
+        vars.append("=");
+        vars.append(url_encode(sv_value));
+        vars.append("&");
+      });
+      vars.resize(vars.size() - 1);
+    }
+    return request(context, parsed, METHOD, vars, "", "");
+  }
+};
+
+using Get = GetLike<http::verb::get>;
+using Head = GetLike<http::verb::head>;
+
+template <http::verb METHOD> struct PostLike : public PooledBase {
+  static inline Types InputTypes{{CoreInfo::NoneType, CoreInfo::StringTableType,
+                                  CoreInfo::BytesType, CoreInfo::StringType}};
+  static CBTypesInfo inputTypes() { return InputTypes; }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto parsed = Client::Url::parse(CBSTRVIEW(url.get()));
+
+    std::string_view contentType;
+    if (input.valueType == CBType::String) {
+      contentType = "application/json";
+      vars = CBSTRVIEW(input);
+    } else if (input.valueType == CBType::Bytes) {
+      contentType = "application/octet-stream";
+      vars.assign((const char *)input.payload.bytesValue,
+                  input.payload.bytesSize);
+    } else if (input.valueType == CBType::Table) {
+      contentType = "application/x-www-form-urlencoded";
+      vars.clear();
+      ForEach(input.payload.tableValue, [&](auto key, auto &value) {
+        auto sv_value = CBSTRVIEW(value);
+        vars.append(url_encode(key));
+        vars.append("=");
+        vars.append(url_encode(sv_value));
+        vars.append("&");
+      });
+      if (!vars.empty())
+        vars.resize(vars.size() - 1);
+    } else {
+      vars.clear();
+    }
+    return request(context, parsed, METHOD, parsed.target, contentType, vars);
+  }
+};
+
+using Post = PostLike<http::verb::post>;
+using Put = PostLike<http::verb::put>;
+using Patch = PostLike<http::verb::patch>;
+using Delete = PostLike<http::verb::delete_>;
+
 struct Peer : public std::enable_shared_from_this<Peer> {
   static constexpr uint32_t PeerCC = 'httP';
   static inline Type Info{
@@ -417,6 +1034,25 @@ struct Peer : public std::enable_shared_from_this<Peer> {
 
   std::shared_ptr<CBChain> chain;
   std::shared_ptr<tcp::socket> socket;
+
+  // per connection state, kept across requests (keep-alive), the buffer
+  // might hold the beginning of the next pipelined request
+  beast::flat_buffer buffer{8192};
+  unsigned version{11};
+  bool keepAlive{true};
+  // the last request read, owned by the Http.Read block
+  const http::request_header<> *request{nullptr};
+  // set when the body of the last request is streamed by Http.ReadChunk
+  http::request_parser<http::buffer_body> *bodyParser{nullptr};
+
+  void reset(tcp::socket *newSocket) {
+    socket.reset(newSocket);
+    request = nullptr;
+    bodyParser = nullptr;
+    buffer.clear();
+    version = 11;
+    keepAlive = true;
+  }
 };
 
 struct PeerError {
@@ -435,6 +1071,13 @@ struct Server {
        {CoreInfo::StringType}},
       {"Port",
        CBCCSTR("The port this service will use."),
+       {CoreInfo::IntType}},
+      {"Threads",
+       CBCCSTR("If greater than 0, the number of threads serving requests, "
+               "each with its own node and acceptor sharing the port "
+               "(SO_REUSEPORT). Handler chains then run on those nodes and "
+               "can't use the variables of this chain. If 0 requests are "
+               "served by the node running this block."),
        {CoreInfo::IntType}}};
 
   static CBParametersInfo parameters() { return params; }
@@ -457,6 +1100,9 @@ struct Server {
     case 2:
       _port = uint16_t(val.payload.intValue);
       break;
+    case 3:
+      _threads = int(std::max(int64_t(0), val.payload.intValue));
+      break;
     default:
       break;
     }
@@ -470,18 +1116,141 @@ struct Server {
       return Var(_endpoint);
     case 2:
       return Var(int(_port));
+    case 3:
+      return Var(_threads);
     default:
       return Var::Empty;
     }
   }
 
   CBTypeInfo compose(const CBInstanceData &data) {
-    const IterableExposedInfo shared(data.shared);
-    // copy shared
-    _sharedCopy = shared;
+    if (_threads > 0) {
+      // handlers run on other nodes, nothing to share
+      _sharedCopy = IterableExposedInfo();
+    } else {
+      const IterableExposedInfo shared(data.shared);
+      // copy shared
+      _sharedCopy = shared;
+    }
     return data.inputType;
   }
 
+  // A thread running its own node and io_context, accepting on its own
+  // SO_REUSEPORT socket, so the kernel balances connections between workers
+  struct Worker {
+    Server &server;
+    std::shared_ptr<CBNode> node{CBNode::make()};
+    net::io_context ioc;
+    std::unique_ptr<tcp::acceptor> acceptor;
+    std::unique_ptr<ChainDoppelgangerPool<Peer>> pool;
+    std::atomic_bool running{true};
+    // set before the thread exits on an error, error is written first
+    std::atomic_bool failed{false};
+    std::string error;
+    std::thread thread;
+
+    Worker(Server &server) : server(server) {
+      pool.reset(new ChainDoppelgangerPool<Peer>(
+          server._handlerMaster.payload.chainValue));
+
+      auto addr = net::ip::make_address(server._endpoint);
+      tcp::endpoint endpoint{addr, server._port};
+      acceptor.reset(new tcp::acceptor(ioc));
+      acceptor->open(endpoint.protocol());
+      acceptor->set_option(net::socket_base::reuse_address(true));
+#ifdef SO_REUSEPORT
+      using reuse_port =
+          net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+      acceptor->set_option(reuse_port(true));
+#endif
+      acceptor->bind(endpoint);
+      acceptor->listen();
+
+      // the first handler is composed here so that compose errors fail the
+      // warmup of the server
+      accept_once();
+      thread = std::thread([this] { run(); });
+    }
+
+    ~Worker() {
+      running = false;
+      ioc.stop();
+      if (thread.joinable())
+        thread.join();
+    }
+
+    void compose(CBChain *chain) {
+      CBInstanceData data{};
+      data.inputType = CoreInfo::StringType;
+      data.chain = chain;
+      chain->node = node;
+      auto res = composeChain(
+          chain,
+          [](const struct CBlock *errorBlock, const char *errorTxt,
+             CBBool nonfatalWarning, void *userData) {
+            if (!nonfatalWarning) {
+              CBLOG_ERROR(errorTxt);
+              throw ActivationError("Http.Server handler chain compose failed");
+            } else {
+              CBLOG_WARNING(errorTxt);
+            }
+          },
+          nullptr, data);
+      arrayFree(res.exposedInfo);
+      arrayFree(res.requiredInfo);
+    }
+
+    void accept_once() {
+      auto peer = pool->acquire(*this);
+      peer->chain->onStop.clear(); // we have a fresh recycled chain here
+      std::weak_ptr<Peer> weakPeer(peer);
+      peer->chain->onStop.emplace_back([this, weakPeer]() {
+        if (auto p = weakPeer.lock())
+          pool->release(p);
+      });
+      peer->reset(new tcp::socket(ioc));
+      acceptor->async_accept(*peer->socket, [peer, this](beast::error_code ec) {
+        if (!ec) {
+          peer->chain->variables["Http.Server.Socket"] =
+              Var::Object(peer.get(), CoreCC, Peer::PeerCC);
+          node->schedule(peer->chain, Var::Empty, false);
+        } else {
+          pool->release(peer);
+          if (ec == net::error::operation_aborted)
+            return;
+        }
+        // continue accepting the next
+        accept_once();
+      });
+    }
+
+    void run() {
+      try {
+        while (running) {
+          try {
+            // wakes up as soon as there is I/O to process, handlers waiting
+            // on it are then resumed by the tick right after
+            ioc.run_for(std::chrono::milliseconds(1));
+          } catch (PeerError pe) {
+            CBLOG_DEBUG("Http request error: {} from {} - closing connection.",
+                        pe.ec.message(), pe.source);
+            stop(pe.peer->chain.get());
+          }
+          node->tick();
+        }
+      } catch (const std::exception &e) {
+        CBLOG_ERROR("Http.Server worker failed: {}", e.what());
+        error = e.what();
+        failed = true;
+      }
+
+      beast::error_code ec;
+      acceptor->close(ec);
+      pool->stopAll();
+      node->terminate();
+    }
+  };
+
   // "Loop" forever accepting new connections.
   void accept_once(CBContext *context) {
     auto peer = _pool->acquire(_composer);
@@ -491,7 +1260,7 @@ struct Server {
       if (auto p = weakPeer.lock())
         _pool->release(p);
     });
-    peer->socket.reset(new tcp::socket(*_ioc));
+    peer->reset(new tcp::socket(*_ioc));
     _acceptor->async_accept(
         *peer->socket, [context, peer, this](beast::error_code ec) {
           if (!ec) {
@@ -516,6 +1285,22 @@ struct Server {
       throw ComposeError("Peer chains pool not valid!");
     }
 
+    if (_threads > 0) {
+#ifndef SO_REUSEPORT
+      if (_threads > 1) {
+        CBLOG_WARNING("Http.Server: SO_REUSEPORT not available, using a "
+                      "single worker thread");
+      }
+      const int threads = 1;
+#else
+      const int threads = _threads;
+#endif
+      for (int i = 0; i < threads; i++) {
+        _workers.emplace_back(new Worker(*this));
+      }
+      return;
+    }
+
     _ioc.reset(new net::io_context());
     auto addr = net::ip::make_address(_endpoint);
     _acceptor.reset(new tcp::acceptor(*_ioc, {addr, _port}));
@@ -524,9 +1309,22 @@ struct Server {
     accept_once(context);
   }
 
-  void cleanup() { _pool->stopAll(); }
+  void cleanup() {
+    _workers.clear();
+    _pool->stopAll();
+  }
 
   CBVar activate(CBContext *context, const CBVar &input) {
+    if (!_workers.empty()) {
+      // a dead worker would silently stop serving its share of the port
+      for (auto &worker : _workers) {
+        if (worker->failed)
+          throw ActivationError("Http.Server worker failed: " +
+                                worker->error);
+      }
+      return input;
+    }
+
     try {
       _ioc->poll();
     } catch (PeerError pe) {
@@ -565,7 +1363,9 @@ struct Server {
   };
 
   uint16_t _port{7070};
+  int _threads{0};
   std::string _endpoint{"0.0.0.0"};
+  std::vector<std::unique_ptr<Worker>> _workers;
   OwnedVar _handlerMaster{};
   std::unique_ptr<ChainDoppelgangerPool<Peer>> _pool;
   IterableExposedInfo _sharedCopy;
@@ -578,8 +1378,66 @@ struct Server {
 };
 
 struct Read {
+  static inline Types OutputTypes{{CoreInfo::StringType, CoreInfo::StringType,
+                                   CoreInfo::StringTableType,
+                                   CoreInfo::StringType}};
+  static inline std::array<CBString, 4> OutputKeys{"method", "target",
+                                                   "headers", "body"};
+  static inline Type OutputType = Type::TableOf(OutputTypes, OutputKeys);
+
+  static inline Parameters params{
+      {"BodyLimit",
+       CBCCSTR("The maximum size in bytes of a request body, bigger requests "
+               "close the connection."),
+       {CoreInfo::IntType}},
+      {"Stream",
+       CBCCSTR("Only read the request line and headers, the body is left "
+               "empty and streamed with Http.ReadChunk."),
+       {CoreInfo::BoolType}},
+      {"Timeout",
+       CBCCSTR("The seconds to wait for a request, the connection is closed "
+               "if none arrived by then, so idle keep-alive peers don't hold "
+               "a handler forever. 0 waits forever."),
+       {CoreInfo::FloatType, CoreInfo::IntType}}};
+
   static CBTypesInfo inputTypes() { return CoreInfo::NoneType; }
-  static CBTypesInfo outputTypes() { return CoreInfo::StringTableType; }
+  static CBTypesInfo outputTypes() { return OutputType; }
+  static CBParametersInfo parameters() { return params; }
+
+  static CBOptionalString help() {
+    return CBCCSTR("Reads the next request of the connection. Header names "
+                   "are lowercased; the output table owns its values, so "
+                   "each value is copied once. The entries are updated in "
+                   "place, so their memory is reused from one request to "
+                   "the next.");
+  }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _bodyLimit = uint64_t(std::max(int64_t(0), value.payload.intValue));
+      break;
+    case 1:
+      _stream = value.payload.boolValue;
+      break;
+    default:
+      _timeout = std::max(0.0, value.valueType == CBType::Int
+                                   ? double(value.payload.intValue)
+                                   : value.payload.floatValue);
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(int64_t(_bodyLimit));
+    case 1:
+      return Var(_stream);
+    default:
+      return Var(_timeout);
+    }
+  }
 
   void warmup(CBContext *context) {
     _peerVar = referenceVariable(context, "Http.Server.Socket");
@@ -589,6 +1447,8 @@ struct Read {
   }
 
   void cleanup() {
+    // cancels a pending timeout, its handler only holds the socket
+    _timer.reset();
     releaseVariable(_peerVar);
     _peerVar = nullptr;
   }
@@ -598,47 +1458,127 @@ struct Read {
     assert(_peerVar->payload.objectValue);
     auto peer = reinterpret_cast<Peer *>(_peerVar->payload.objectValue);
 
-    bool done = false;
-    request.body().clear();
-    request.clear();
-    buffer.clear();
-    http::async_read(*peer->socket, buffer, request,
-                     [&, peer](beast::error_code ec, std::size_t nbytes) {
-                       if (ec) {
-                         // notice there is likehood of done not being valid
-                         // anymore here
-                         throw PeerError{"Read", ec, peer};
-                       } else {
-                         done = true;
-                       }
-                     });
+    if (!peer->keepAlive) {
+      // the last response closed the connection, we are done with this peer
+      CB_STOP();
+    }
 
-    // we suspend here, that's why we captured & above!!
-    while (!done) {
-      CB_SUSPEND(context, 0.0);
+    // a streamed body not read to the end is still in front of the next
+    // request, skip what's left of it
+    if (peer->bodyParser && !peer->bodyParser->is_done()) {
+      auto parser = peer->bodyParser;
+      _discard.resize(16 * 1024);
+      while (!parser->is_done()) {
+        auto &body = parser->get().body();
+        body.data = _discard.data();
+        body.size = _discard.size();
+        _done = false;
+        http::async_read(*peer->socket, peer->buffer, *parser,
+                         [this, peer](beast::error_code ec, std::size_t) {
+                           if (ec && ec != http::error::need_buffer) {
+                             throw PeerError{"Read", ec, peer};
+                           } else {
+                             _done = true;
+                           }
+                         });
+        while (!_done) {
+          CB_SUSPEND(context, 0.0);
+        }
+      }
     }
+    peer->bodyParser = nullptr;
 
-    switch (request.method()) {
-    case http::verb::get:
-      _output["method"] = Var("GET", 3);
-      break;
-    case http::verb::post:
-      _output["method"] = Var("POST", 4);
-      break;
-    case http::verb::put:
-      _output["method"] = Var("PUT", 3);
-      break;
-    case http::verb::delete_:
-      _output["method"] = Var("DELETE", 6);
-      break;
-    default:
-      throw ActivationError("Unsupported HTTP method.");
+    const auto handler = [this, peer](beast::error_code ec, std::size_t) {
+      if (ec) {
+        throw PeerError{"Read", ec, peer};
+      } else {
+        _done = true;
+      }
+    };
+
+    if (_timeout > 0.0) {
+      // closing the socket fails the pending read, which stops the handler
+      _timer.emplace(peer->socket->get_executor());
+      _timer->expires_after(std::chrono::duration_cast<
+                            net::steady_timer::duration>(
+          std::chrono::duration<double>(_timeout)));
+      _timer->async_wait([socket = peer->socket](beast::error_code ec) {
+        if (!ec) {
+          beast::error_code ignored;
+          socket->close(ignored);
+        }
+      });
+    }
+
+    _done = false;
+    // peer->buffer might already hold the next pipelined request
+    if (_stream) {
+      _streamParser.emplace();
+      // the handler decides how much it wants to read
+      _streamParser->body_limit(std::numeric_limits<std::uint64_t>::max());
+      http::async_read_header(*peer->socket, peer->buffer, *_streamParser,
+                              handler);
+    } else {
+      _parser.emplace();
+      _parser->body_limit(_bodyLimit);
+      http::async_read(*peer->socket, peer->buffer, *_parser, handler);
     }
 
+    // we suspend here, the handler only touches members
+    while (!_done) {
+      CB_SUSPEND(context, 0.0);
+    }
+    if (_timer)
+      _timer->cancel();
+
+    const http::request_header<> &request =
+        _stream ? static_cast<const http::request_header<> &>(
+                      _streamParser->get())
+                : static_cast<const http::request_header<> &>(_parser->get());
+    peer->request = &request;
+    if (_stream)
+      peer->bodyParser = &*_streamParser;
+    peer->version = request.version();
+    peer->keepAlive =
+        _stream ? _streamParser->keep_alive() : _parser->keep_alive();
+
+    auto method = request.method_string();
+    _output["method"] = Var(method.data(), method.size());
+
     auto target = request.target();
     _output["target"] = Var(target.data(), target.size());
 
-    _output["body"] = Var(request.body());
+    auto &hvar = _output["headers"];
+    if (hvar.valueType != Table) {
+      CBMap empty;
+      CBVar tmp{};
+      tmp.valueType = CBType::Table;
+      tmp.payload.tableValue.opaque = &empty;
+      tmp.payload.tableValue.api = &GetGlobals().TableInterface;
+      hvar = tmp;
+    }
+    auto headers = reinterpret_cast<CBMap *>(hvar.payload.tableValue.opaque);
+    // values are assigned in place to reuse their buffers, only the headers
+    // this request doesn't have are dropped
+    for (auto it = headers->begin(); it != headers->end();) {
+      if (request.find(beast::string_view(it->first.data(),
+                                          it->first.size())) == request.end())
+        it = headers->erase(it);
+      else
+        ++it;
+    }
+    for (auto &field : request) {
+      const auto name = field.name_string();
+      _key.assign(name.data(), name.size());
+      std::transform(_key.begin(), _key.end(), _key.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      (*headers)[_key] = Var(field.value().data(), field.value().size());
+    }
+
+    if (_stream)
+      _output["body"] = Var("");
+    else
+      _output["body"] = Var(_parser->get().body());
 
     auto res = CBVar();
     res.valueType = Table;
@@ -649,12 +1589,112 @@ struct Read {
 
   CBVar *_peerVar{nullptr};
   CBMap _output;
-  beast::flat_buffer buffer{8192};
-  http::request<http::string_body> request;
+  uint64_t _bodyLimit{1024 * 1024};
+  bool _stream{false};
+  double _timeout{30.0};
+  bool _done{false};
+  std::string _key;
+  std::optional<net::steady_timer> _timer;
+  std::optional<http::request_parser<http::string_body>> _parser;
+  std::optional<http::request_parser<http::buffer_body>> _streamParser;
+  std::vector<char> _discard;
 };
 
+struct ReadChunk {
+  static CBTypesInfo inputTypes() { return CoreInfo::NoneType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::BytesType; }
+
+  static CBOptionalString help() {
+    return CBCCSTR("Reads the next piece of the body of a request read by "
+                   "Http.Read with Stream on, chunked bodies are decoded. "
+                   "Outputs empty bytes once the whole body was read.");
+  }
+
+  static inline Parameters params{
+      {"Size",
+       CBCCSTR("The maximum size in bytes of every piece."),
+       {CoreInfo::IntType}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    _size = size_t(std::max(int64_t(1), value.payload.intValue));
+  }
+
+  CBVar getParam(int index) { return Var(int64_t(_size)); }
+
+  void warmup(CBContext *context) {
+    _peerVar = referenceVariable(context, "Http.Server.Socket");
+    if (_peerVar->valueType == CBType::None) {
+      throw WarmupError("Socket variable not found in chain");
+    }
+  }
+
+  void cleanup() {
+    releaseVariable(_peerVar);
+    _peerVar = nullptr;
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    assert(_peerVar->valueType == Object);
+    assert(_peerVar->payload.objectValue);
+    auto peer = reinterpret_cast<Peer *>(_peerVar->payload.objectValue);
+
+    auto parser = peer->bodyParser;
+    if (!parser) {
+      throw ActivationError(
+          "Http.ReadChunk: no streamed request, use Http.Read :Stream true");
+    }
+
+    _chunk.resize(_size);
+    if (parser->is_done()) {
+      return Var((uint8_t *)_chunk.data(), 0);
+    }
+
+    auto &body = parser->get().body();
+    body.data = _chunk.data();
+    body.size = _chunk.size();
+    _done = false;
+    // completes once our buffer is full (need_buffer) or the body is over
+    http::async_read(*peer->socket, peer->buffer, *parser,
+                     [this, peer](beast::error_code ec, std::size_t) {
+                       if (ec && ec != http::error::need_buffer) {
+                         throw PeerError{"ReadChunk", ec, peer};
+                       } else {
+                         _done = true;
+                       }
+                     });
+
+    // we suspend here, the handler only touches members
+    while (!_done) {
+      CB_SUSPEND(context, 0.0);
+    }
+
+    const auto n = _chunk.size() - parser->get().body().size;
+    return Var((uint8_t *)_chunk.data(), uint32_t(n));
+  }
+
+  CBVar *_peerVar{nullptr};
+  size_t _size{64 * 1024};
+  bool _done{false};
+  std::vector<char> _chunk;
+};
+
+// writes the custom headers param into a response header
+template <typename Fields>
+inline void setHeaders(Fields &fields, const ParamVar &headers) {
+  if (headers.get().valueType == Table) {
+    auto htab = headers.get().payload.tableValue;
+    ForEach(htab, [&](auto key, auto &value) {
+      const auto sv_value = CBSTRVIEW(value);
+      fields.set(key, beast::string_view(sv_value.data(), sv_value.size()));
+    });
+  }
+}
+
 struct Response {
-  static inline Types PostInTypes{CoreInfo::StringType};
+  static inline Types PostInTypes{
+      {CoreInfo::StringType, CoreInfo::BytesType}};
 
   static CBTypesInfo inputTypes() { return PostInTypes; }
   static CBTypesInfo outputTypes() { return PostInTypes; }
@@ -664,7 +1704,8 @@ struct Response {
        CBCCSTR("The HTTP status code to return."),
        {CoreInfo::IntType}},
       {"Headers",
-       CBCCSTR("The headers to attach to this response."),
+       CBCCSTR("The headers to attach to this response, Content-Type "
+               "defaults to application/json."),
        {CoreInfo::StringTableType, CoreInfo::StringVarTableType,
         CoreInfo::NoneType}}};
 
@@ -704,52 +1745,271 @@ struct Response {
     auto peer = reinterpret_cast<Peer *>(_peerVar->payload.objectValue);
     _response.clear();
 
+    _response.version(peer->version);
+    _response.keep_alive(peer->keepAlive);
     _response.result(_status);
     _response.set(http::field::content_type, "application/json");
-    auto input_view = CBSTRVIEW(input);
-    _response.body() = input_view;
+    if (input.valueType == CBType::Bytes) {
+      _response.body().assign((const char *)input.payload.bytesValue,
+                              input.payload.bytesSize);
+    } else {
+      _response.body() = CBSTRVIEW(input);
+    }
 
     // add custom headers
-    if (_headers.get().valueType == Table) {
-      auto htab = _headers.get().payload.tableValue;
-      ForEach(htab, [&](auto key, auto &value) {
-        _response.set(key, value.payload.stringValue);
-        return true;
-      });
-    }
+    setHeaders(_response, _headers);
 
     _response.prepare_payload();
 
-    bool done = false;
+    _done = false;
     http::async_write(*peer->socket, _response,
-                      [&, peer](beast::error_code ec, std::size_t nbytes) {
+                      [this, peer](beast::error_code ec, std::size_t nbytes) {
                         if (ec) {
                           throw PeerError{"Response", ec, peer};
                         } else {
                           CBLOG_TRACE("Response: async_write bytes: {}",
                                       nbytes);
-                          done = true;
+                          _done = true;
                         }
                       });
 
-    // we suspend here, that's why we captured & above!!
-    while (!done) {
+    // we suspend here, the handler only touches members
+    while (!_done) {
       CB_SUSPEND(context, 0.0);
     }
 
+    if (!peer->keepAlive) {
+      beast::error_code ec;
+      peer->socket->shutdown(tcp::socket::shutdown_send, ec);
+    }
+
     return input;
   }
 
   http::status _status{200};
   CBVar *_peerVar{nullptr};
   ParamVar _headers{};
+  bool _done{false};
   http::response<http::string_body> _response;
 };
 
+struct Stream {
+  static inline Types InTypes{
+      {CoreInfo::StringType, CoreInfo::BytesType, CoreInfo::NoneType}};
+
+  static CBTypesInfo inputTypes() { return InTypes; }
+  static CBTypesInfo outputTypes() { return InTypes; }
+
+  static CBOptionalString help() {
+    return CBCCSTR("Streams a chunked response, the first activation sends "
+                   "the headers, every activation sends its input as a chunk "
+                   "and an empty input (or none) ends the response. HTTP/1.0 "
+                   "peers get a plain body ended by closing the connection.");
+  }
+
+  static CBParametersInfo parameters() { return Response::params; }
+
+  void setParam(int index, const CBVar &value) {
+    if (index == 0)
+      _status = http::status(value.payload.intValue);
+    else
+      _headers = value;
+  }
+
+  CBVar getParam(int index) {
+    if (index == 0)
+      return Var(int64_t(_status));
+    else
+      return _headers;
+  }
+
+  void warmup(CBContext *context) {
+    _headers.warmup(context);
+    _peerVar = referenceVariable(context, "Http.Server.Socket");
+    if (_peerVar->valueType == CBType::None) {
+      throw WarmupError("Socket variable not found in chain");
+    }
+  }
+
+  void cleanup() {
+    _headers.cleanup();
+    releaseVariable(_peerVar);
+    _peerVar = nullptr;
+    _serializer.reset();
+  }
+
+  template <typename F> void write(CBContext *context, Peer *peer, F &&op) {
+    _done = false;
+    op([this, peer](beast::error_code ec, std::size_t nbytes) {
+      if (ec) {
+        throw PeerError{"Stream", ec, peer};
+      } else {
+        _done = true;
+      }
+    });
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    assert(_peerVar->valueType == Object);
+    assert(_peerVar->payload.objectValue);
+    auto peer = reinterpret_cast<Peer *>(_peerVar->payload.objectValue);
+
+    if (!_serializer) {
+      // HTTP/1.0 has no chunked encoding, the end of the body is the end of
+      // the connection
+      _chunked = peer->version >= 11;
+      if (!_chunked)
+        peer->keepAlive = false;
+
+      _header = {};
+      _header.version(peer->version);
+      _header.keep_alive(peer->keepAlive);
+      _header.result(_status);
+      _header.set(http::field::content_type, "application/json");
+      setHeaders(_header, _headers);
+      if (_chunked)
+        _header.chunked(true);
+      _serializer.emplace(_header);
+      write(context, peer, [&](auto &&handler) {
+        http::async_write_header(*peer->socket, *_serializer, handler);
+      });
+      while (!_done) {
+        CB_SUSPEND(context, 0.0);
+      }
+    }
+
+    net::const_buffer data;
+    if (input.valueType == CBType::Bytes) {
+      data = net::buffer(input.payload.bytesValue, input.payload.bytesSize);
+    } else if (input.valueType == CBType::String) {
+      data = net::buffer(input.payload.stringValue, CBSTRLEN(input));
+    }
+
+    if (data.size() > 0) {
+      write(context, peer, [&](auto &&handler) {
+        if (_chunked)
+          net::async_write(*peer->socket, http::make_chunk(data), handler);
+        else
+          net::async_write(*peer->socket, data, handler);
+      });
+    } else {
+      if (_chunked) {
+        write(context, peer, [&](auto &&handler) {
+          net::async_write(*peer->socket, http::make_chunk_last(), handler);
+        });
+      } else {
+        _done = true;
+      }
+      _serializer.reset();
+    }
+
+    while (!_done) {
+      CB_SUSPEND(context, 0.0);
+    }
+
+    if (!_serializer && !peer->keepAlive) {
+      beast::error_code ec;
+      peer->socket->shutdown(tcp::socket::shutdown_send, ec);
+    }
+
+    return input;
+  }
+
+  http::status _status{200};
+  CBVar *_peerVar{nullptr};
+  ParamVar _headers{};
+  bool _done{false};
+  bool _chunked{true};
+  http::response<http::empty_body> _header;
+  std::optional<http::response_serializer<http::empty_body>> _serializer;
+};
+
+// content of small static files, shared by all the SendFile blocks (every
+// handler chain has its own and they might run on many threads), entries are
+// validated against the file size and modification time on every hit
+struct SmallFilesCache {
+  static constexpr uint64_t MaxFileSize = 64 * 1024;
+  static constexpr uint64_t MaxTotalSize = 32 * 1024 * 1024;
+
+  std::shared_ptr<const std::string> get(const std::string &path,
+                                         uint64_t size, int64_t mtime) {
+    if (auto content = find(path, size, mtime))
+      return content;
+
+    // read without holding the lock, other workers keep being served
+    std::ifstream stream(path, std::ios::binary);
+    auto content = std::make_shared<std::string>(size, '\0');
+    if (!stream.read(content->data(), size))
+      return nullptr;
+
+    std::scoped_lock lock(_mutex);
+    auto it = _entries.find(path);
+    if (it != _entries.end()) {
+      // someone else read it meanwhile
+      auto &entry = it->second;
+      if (entry.size == size && entry.mtime == mtime) {
+        _lru.splice(_lru.begin(), _lru, entry.lruIt);
+        return entry.content;
+      }
+      evict(it);
+    }
+
+    _lru.push_front(path);
+    _entries.emplace(path, Entry{size, mtime, content, _lru.begin()});
+    _total += size;
+    while (_total > MaxTotalSize && _lru.size() > 1) {
+      evict(_entries.find(_lru.back()));
+    }
+    return content;
+  }
+
+private:
+  struct Entry {
+    uint64_t size;
+    int64_t mtime;
+    std::shared_ptr<const std::string> content;
+    std::list<std::string>::iterator lruIt;
+  };
+
+  std::shared_ptr<const std::string> find(const std::string &path,
+                                          uint64_t size, int64_t mtime) {
+    std::scoped_lock lock(_mutex);
+    auto it = _entries.find(path);
+    if (it == _entries.end())
+      return nullptr;
+    auto &entry = it->second;
+    if (entry.size != size || entry.mtime != mtime) {
+      evict(it);
+      return nullptr;
+    }
+    _lru.splice(_lru.begin(), _lru, entry.lruIt);
+    return entry.content;
+  }
+
+  void evict(std::unordered_map<std::string, Entry>::iterator it) {
+    _total -= it->second.size;
+    _lru.erase(it->second.lruIt);
+    _entries.erase(it);
+  }
+
+  std::mutex _mutex;
+  std::list<std::string> _lru;
+  std::unordered_map<std::string, Entry> _entries;
+  uint64_t _total{0};
+};
+
 struct SendFile {
   static CBTypesInfo inputTypes() { return CoreInfo::StringType; }
   static CBTypesInfo outputTypes() { return CoreInfo::StringType; }
 
+  static CBOptionalString help() {
+    return CBCCSTR(
+        "Sends the file at the given path (relative to the root path) as "
+        "response to the last request read. Supports conditional requests "
+        "(ETag and Last-Modified), single byte ranges and pre-compressed "
+        "siblings (.br and .gz) when the client accepts them.");
+  }
+
   static inline Parameters params{
       {"Headers",
        CBCCSTR("The headers to attach to this response."),
@@ -774,134 +2034,336 @@ struct SendFile {
     _headers.cleanup();
     releaseVariable(_peerVar);
     _peerVar = nullptr;
+    _content.reset();
   }
 
   static boost::beast::string_view mime_type(boost::beast::string_view path) {
-    using boost::beast::iequals;
-    auto const ext = [&path] {
-      auto const pos = path.rfind(".");
-      if (pos == boost::beast::string_view::npos)
-        return boost::beast::string_view{};
-      return path.substr(pos);
-    }();
-    if (iequals(ext, ".htm"))
-      return "text/html";
-    if (iequals(ext, ".html"))
-      return "text/html";
-    if (iequals(ext, ".php"))
-      return "text/html";
-    if (iequals(ext, ".css"))
-      return "text/css";
-    if (iequals(ext, ".txt"))
-      return "text/plain";
-    if (iequals(ext, ".js"))
-      return "application/javascript";
-    if (iequals(ext, ".json"))
-      return "application/json";
-    if (iequals(ext, ".xml"))
-      return "application/xml";
-    if (iequals(ext, ".swf"))
-      return "application/x-shockwave-flash";
-    if (iequals(ext, ".flv"))
-      return "video/x-flv";
-    if (iequals(ext, ".png"))
-      return "image/png";
-    if (iequals(ext, ".jpe"))
-      return "image/jpeg";
-    if (iequals(ext, ".jpeg"))
-      return "image/jpeg";
-    if (iequals(ext, ".jpg"))
-      return "image/jpeg";
-    if (iequals(ext, ".gif"))
-      return "image/gif";
-    if (iequals(ext, ".bmp"))
-      return "image/bmp";
-    if (iequals(ext, ".ico"))
-      return "image/vnd.microsoft.icon";
-    if (iequals(ext, ".tiff"))
-      return "image/tiff";
-    if (iequals(ext, ".tif"))
-      return "image/tiff";
-    if (iequals(ext, ".svg"))
-      return "image/svg+xml";
-    if (iequals(ext, ".svgz"))
-      return "image/svg+xml";
-    if (iequals(ext, ".wasm"))
-      return "application/wasm";
+    static const std::unordered_map<std::string, std::string_view> types{
+        {".htm", "text/html"},
+        {".html", "text/html"},
+        {".php", "text/html"},
+        {".css", "text/css"},
+        {".txt", "text/plain"},
+        {".js", "application/javascript"},
+        {".json", "application/json"},
+        {".xml", "application/xml"},
+        {".swf", "application/x-shockwave-flash"},
+        {".flv", "video/x-flv"},
+        {".png", "image/png"},
+        {".jpe", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".jpg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".bmp", "image/bmp"},
+        {".ico", "image/vnd.microsoft.icon"},
+        {".tiff", "image/tiff"},
+        {".tif", "image/tiff"},
+        {".svg", "image/svg+xml"},
+        {".svgz", "image/svg+xml"},
+        {".wasm", "application/wasm"}};
+
+    const auto pos = path.rfind(".");
+    if (pos != boost::beast::string_view::npos && path.size() - pos <= 8) {
+      std::string ext(path.data() + pos, path.size() - pos);
+      std::transform(ext.begin(), ext.end(), ext.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      auto it = types.find(ext);
+      if (it != types.end())
+        return {it->second.data(), it->second.size()};
+    }
     return "application/text";
   }
 
+  template <typename Message>
+  void write(CBContext *context, Peer *peer, Message &message,
+             std::string_view source) {
+    _done = false;
+    http::async_write(*peer->socket, message,
+                      [this, peer, source](beast::error_code ec,
+                                           std::size_t nbytes) {
+                        if (ec) {
+                          throw PeerError{source, ec, peer};
+                        } else {
+                          CBLOG_TRACE("{}: async_write bytes: {}", source,
+                                      nbytes);
+                          _done = true;
+                        }
+                      });
+  }
+
   CBVar activate(CBContext *context, const CBVar &input) {
     assert(_peerVar->valueType == Object);
     assert(_peerVar->payload.objectValue);
     auto peer = reinterpret_cast<Peer *>(_peerVar->payload.objectValue);
+    auto request = peer->request;
 
     std::filesystem::path p{GetGlobals().RootPath};
     p += input.payload.stringValue;
+    const auto mime = mime_type(input.payload.stringValue);
+
+    // serve a pre-compressed sibling if the client accepts it
+    std::string_view encoding;
+    auto served = p;
+    std::error_code fsError;
+    if (request) {
+      const auto accepted = (*request)[http::field::accept_encoding];
+      // highest q-value wins, br first on ties
+      double best = 0.0;
+      for (auto [name, extension] :
+           {std::pair<std::string_view, std::string_view>{"br", ".br"},
+            {"gzip", ".gz"}}) {
+        const auto q = encodingQuality(
+            accepted, beast::string_view(name.data(), name.size()));
+        if (q <= best)
+          continue;
+        auto candidate = p;
+        candidate += extension;
+        if (std::filesystem::is_regular_file(candidate, fsError)) {
+          served = candidate;
+          encoding = name;
+          best = q;
+        }
+      }
+    }
 
-    http::file_body::value_type file;
-    boost::beast::error_code ec;
-    auto pstr = p.generic_string();
-    bool done = false;
-    file.open(pstr.c_str(), boost::beast::file_mode::read, ec);
-    if (unlikely(bool(ec))) {
+    const auto size = std::filesystem::file_size(served, fsError);
+    if (fsError || !std::filesystem::is_regular_file(served, fsError)) {
       _404_response.clear();
+      _404_response.version(peer->version);
+      _404_response.keep_alive(peer->keepAlive);
       _404_response.result(http::status::not_found);
       _404_response.body() = "File not found.";
       _404_response.prepare_payload();
+      write(context, peer, _404_response, "SendFile:1");
+      while (!_done) {
+        CB_SUSPEND(context, 0.0);
+      }
+      return input;
+    }
+
+    const auto ftime = std::filesystem::last_write_time(served, fsError);
+    const auto mtime = int64_t(ftime.time_since_epoch().count());
+    const auto mtimeSys = std::chrono::system_clock::to_time_t(
+        std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+            ftime - std::filesystem::file_time_type::clock::now() +
+            std::chrono::system_clock::now()));
+
+    std::stringstream etagStream;
+    etagStream << '"' << std::hex << size << '-' << mtime;
+    if (!encoding.empty())
+      etagStream << '-' << encoding;
+    etagStream << '"';
+    const auto etag = etagStream.str();
+    const auto lastModified = httpDate(mtimeSys);
+
+    const auto setCommon = [&](auto &res) {
+      res.version(peer->version);
+      res.keep_alive(peer->keepAlive);
+      res.set(http::field::etag, etag);
+      res.set(http::field::last_modified, lastModified);
+      res.set(http::field::accept_ranges, "bytes");
+      res.set(http::field::vary, "Accept-Encoding");
+      setHeaders(res, _headers);
+    };
+
+    // conditional requests
+    if (request) {
+      const auto ifNoneMatch = (*request)[http::field::if_none_match];
+      const auto ifModifiedSince = (*request)[http::field::if_modified_since];
+      bool notModified = false;
+      if (!ifNoneMatch.empty()) {
+        notModified = ifNoneMatch == "*" ||
+                      ifNoneMatch.find(etag) != beast::string_view::npos;
+      } else if (!ifModifiedSince.empty()) {
+        // only meaningful for GET and HEAD, invalid dates are ignored
+        std::time_t since;
+        const auto method = request->method();
+        notModified =
+            (method == http::verb::get || method == http::verb::head) &&
+            parseHttpDate(ifModifiedSince, since) && mtimeSys <= since;
+      }
+      if (notModified) {
+        _header = {};
+        _header.result(http::status::not_modified);
+        setCommon(_header);
+        write(context, peer, _header, "SendFile:304");
+        while (!_done) {
+          CB_SUSPEND(context, 0.0);
+        }
+        return input;
+      }
+    }
 
-      http::async_write(*peer->socket, _404_response,
-                        [&, peer](beast::error_code ec, std::size_t nbytes) {
-                          if (ec) {
-                            throw PeerError{"SendFile:1", ec, peer};
-                          } else {
-                            CBLOG_TRACE("SendFile:1: async_write bytes: {}",
-                                        nbytes);
-                            done = true;
-                          }
-                        });
+    uint64_t first = 0;
+    uint64_t last = size > 0 ? size - 1 : 0;
+    bool partial = false;
+    if (request && size > 0) {
+      const auto range = (*request)[http::field::range];
+      if (!range.empty() && !parseRange(range, size, first, last, partial)) {
+        _header = {};
+        _header.result(http::status::range_not_satisfiable);
+        setCommon(_header);
+        _header.set(http::field::content_range,
+                    "bytes */" + std::to_string(size));
+        _header.content_length(0);
+        write(context, peer, _header, "SendFile:416");
+        while (!_done) {
+          CB_SUSPEND(context, 0.0);
+        }
+        return input;
+      }
+    }
+    const uint64_t length = size > 0 ? last - first + 1 : 0;
+    const bool headOnly = request && request->method() == http::verb::head;
+
+    _header = {};
+    _header.result(partial ? http::status::partial_content : http::status::ok);
+    _header.set(http::field::content_type, mime);
+    if (!encoding.empty())
+      _header.set(http::field::content_encoding,
+                  beast::string_view(encoding.data(), encoding.size()));
+    if (partial)
+      _header.set(http::field::content_range,
+                  "bytes " + std::to_string(first) + "-" +
+                      std::to_string(last) + "/" + std::to_string(size));
+    setCommon(_header);
+    _header.content_length(length);
+
+    const auto servedStr = served.string();
+    if (!headOnly && size <= SmallFilesCache::MaxFileSize) {
+      _content = Cache.get(servedStr, size, mtime);
     } else {
-      _response.clear();
-      _response.result(http::status::ok);
-      _response.set(http::field::content_type,
-                    mime_type(input.payload.stringValue));
-      _response.body() = std::move(file);
-
-      // add custom headers
-      if (_headers.get().valueType == Table) {
-        auto htab = _headers.get().payload.tableValue;
-        ForEach(htab, [&](auto key, auto &value) {
-          _response.set(key, value.payload.stringValue);
-          return true;
+      _content.reset();
+    }
+
+    // headers first, the body goes straight from the cache or the file
+    _serializer.emplace(_header);
+    _done = false;
+    http::async_write_header(
+        *peer->socket, *_serializer,
+        [this, peer](beast::error_code ec, std::size_t nbytes) {
+          if (ec) {
+            throw PeerError{"SendFile:2", ec, peer};
+          } else {
+            _done = true;
+          }
         });
-      }
+    while (!_done) {
+      CB_SUSPEND(context, 0.0);
+    }
 
-      _response.prepare_payload();
+    if (headOnly || length == 0) {
+      return input;
+    }
 
-      http::async_write(*peer->socket, _response,
-                        [&, peer](beast::error_code ec, std::size_t nbytes) {
-                          if (ec) {
-                            throw PeerError{"SendFile:2", ec, peer};
-                          } else {
-                            CBLOG_TRACE("SendFile:2: async_write bytes: {}",
-                                        nbytes);
-                            done = true;
-                          }
-                        });
+    if (_content) {
+      _done = false;
+      net::async_write(*peer->socket,
+                       net::buffer(_content->data() + first, length),
+                       [this, peer](beast::error_code ec, std::size_t nbytes) {
+                         if (ec) {
+                           throw PeerError{"SendFile:3", ec, peer};
+                         } else {
+                           _done = true;
+                         }
+                       });
+      while (!_done) {
+        CB_SUSPEND(context, 0.0);
+      }
+      return input;
     }
 
-    // we suspend here, that's why we captured & above!!
-    while (!done) {
-      CB_SUSPEND(context, 0.0);
+#ifdef __linux__
+    // zero copy, from the page cache straight into the socket
+    const auto fd = ::open(servedStr.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      throw ActivationError("SendFile: failed to open file");
     }
+    DEFER(::close(fd));
+
+    auto &socket = *peer->socket;
+    beast::error_code ec;
+    socket.native_non_blocking(true, ec);
+    off_t offset = off_t(first);
+    uint64_t remaining = length;
+    while (remaining > 0) {
+      const auto n = ::sendfile(socket.native_handle(), fd, &offset,
+                                size_t(std::min<uint64_t>(remaining, 1 << 30)));
+      if (n > 0) {
+        remaining -= uint64_t(n);
+      } else if (n == -1 && errno == EINTR) {
+        continue;
+      } else if (n == -1 && errno == EAGAIN) {
+        // socket buffer full, wait until it drains
+        _done = false;
+        socket.async_wait(tcp::socket::wait_write,
+                          [this, peer](beast::error_code ec) {
+                            if (ec) {
+                              throw PeerError{"SendFile:4", ec, peer};
+                            } else {
+                              _done = true;
+                            }
+                          });
+        while (!_done) {
+          CB_SUSPEND(context, 0.0);
+        }
+      } else {
+        // file truncated while sending or socket error, the response is
+        // broken at this point so drop the connection
+        CBLOG_DEBUG("SendFile: sendfile failed, errno: {}", errno);
+        peer->keepAlive = false;
+        socket.shutdown(tcp::socket::shutdown_both, ec);
+        return input;
+      }
+    }
+#else
+    beast::error_code ec;
+    http::file_body::value_type file;
+    file.open(servedStr.c_str(), boost::beast::file_mode::read, ec);
+    if (ec) {
+      throw ActivationError("SendFile: failed to open file");
+    }
+    file.file().seek(first, ec);
+    _chunk.resize(size_t(std::min<uint64_t>(length, 64 * 1024)));
+    uint64_t remaining = length;
+    while (remaining > 0) {
+      const auto n = file.file().read(
+          _chunk.data(), size_t(std::min<uint64_t>(remaining, _chunk.size())),
+          ec);
+      if (ec || n == 0) {
+        throw ActivationError("SendFile: failed to read file");
+      }
+      remaining -= n;
+      _done = false;
+      net::async_write(*peer->socket, net::buffer(_chunk.data(), n),
+                       [this, peer](beast::error_code ec, std::size_t nbytes) {
+                         if (ec) {
+                           throw PeerError{"SendFile:3", ec, peer};
+                         } else {
+                           _done = true;
+                         }
+                       });
+      while (!_done) {
+        CB_SUSPEND(context, 0.0);
+      }
+    }
+#endif
 
     return input;
   }
 
+  static inline SmallFilesCache Cache;
+
   CBVar *_peerVar{nullptr};
   ParamVar _headers{};
-  http::response<http::file_body> _response;
+  bool _done{false};
+  std::shared_ptr<const std::string> _content;
+  http::response<http::empty_body> _header;
+  std::optional<http::response_serializer<http::empty_body>> _serializer;
   http::response<http::string_body> _404_response;
+#ifndef __linux__
+  std::vector<char> _chunk;
+#endif
 };
 #endif
 
@@ -917,17 +2379,18 @@ struct EncodeURI {
 };
 
 void registerBlocks() {
-#ifdef __EMSCRIPTEN__
   REGISTER_CBLOCK("Http.Get", Get);
   REGISTER_CBLOCK("Http.Head", Head);
   REGISTER_CBLOCK("Http.Post", Post);
   REGISTER_CBLOCK("Http.Put", Put);
   REGISTER_CBLOCK("Http.Patch", Patch);
   REGISTER_CBLOCK("Http.Delete", Delete);
-#else
+#ifndef __EMSCRIPTEN__
   REGISTER_CBLOCK("Http.Server", Server);
   REGISTER_CBLOCK("Http.Read", Read);
+  REGISTER_CBLOCK("Http.ReadChunk", ReadChunk);
   REGISTER_CBLOCK("Http.Response", Response);
+  REGISTER_CBLOCK("Http.Stream", Stream);
   REGISTER_CBLOCK("Http.SendFile", SendFile);
 #endif
   REGISTER_CBLOCK("String.EncodeURI", EncodeURI);
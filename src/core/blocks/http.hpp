@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/* Copyright © 2021 Fragcolor Pte. Ltd. */
+
+#ifndef CB_HTTP_HPP
+#define CB_HTTP_HPP
+
+// Helpers shared by the Http and WebSocket blocks, and the header parsing
+// used by Http.SendFile, kept apart so it can be unit tested
+
+#include <boost/beast/core/string.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <locale>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+struct CBNode;
+
+namespace chainblocks {
+namespace Http {
+namespace beast = boost::beast;
+
+// The instance of T (an io_context owner) shared by the blocks of a node
+// running on the calling thread, created on first use and released with the
+// last block holding it
+template <typename T> std::shared_ptr<T> perNodeThread(const CBNode *node) {
+  static std::mutex mutex;
+  static std::map<std::pair<const CBNode *, std::thread::id>, std::weak_ptr<T>>
+      instances;
+
+  std::scoped_lock lock(mutex);
+  for (auto it = instances.begin(); it != instances.end();) {
+    if (it->second.expired())
+      it = instances.erase(it);
+    else
+      ++it;
+  }
+
+  auto &weak = instances[std::make_pair(node, std::this_thread::get_id())];
+  auto instance = weak.lock();
+  if (!instance) {
+    instance = std::make_shared<T>();
+    weak = instance;
+  }
+  return instance;
+}
+
+inline std::string httpDate(std::time_t time) {
+  std::tm tm;
+#ifdef _WIN32
+  gmtime_s(&tm, &time);
+#else
+  gmtime_r(&time, &tm);
+#endif
+  char buf[64];
+  const auto len =
+      std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return std::string(buf, len);
+}
+
+// parses the three date formats HTTP/1.1 recipients must accept
+inline bool parseHttpDate(beast::string_view value, std::time_t &time) {
+  static constexpr const char *formats[] = {
+      "%a, %d %b %Y %H:%M:%S", // IMF-fixdate
+      "%A, %d-%b-%y %H:%M:%S", // obsolete RFC 850
+      "%a %b %d %H:%M:%S %Y"}; // asctime
+  for (auto format : formats) {
+    std::tm tm{};
+    std::istringstream stream(std::string(value.data(), value.size()));
+    stream.imbue(std::locale::classic());
+    stream >> std::get_time(&tm, format);
+    if (stream.fail())
+      continue;
+#ifdef _WIN32
+    time = _mkgmtime(&tm);
+#else
+    time = timegm(&tm);
+#endif
+    return time != std::time_t(-1);
+  }
+  return false;
+}
+
+// the q-value given to a content coding by an Accept-Encoding header,
+// 0 when not acceptable (missing or explicitly q=0)
+inline double encodingQuality(beast::string_view header,
+                              beast::string_view coding) {
+  const auto trim = [](beast::string_view v) {
+    while (!v.empty() && (v.front() == ' ' || v.front() == '\t'))
+      v.remove_prefix(1);
+    while (!v.empty() && (v.back() == ' ' || v.back() == '\t'))
+      v.remove_suffix(1);
+    return v;
+  };
+  // splits the next element off list, separated by sep
+  const auto next = [](beast::string_view &list, char sep) {
+    const auto pos = list.find(sep);
+    auto item = list.substr(0, pos);
+    list = pos == list.npos ? beast::string_view{} : list.substr(pos + 1);
+    return item;
+  };
+
+  double wildcard = 0.0;
+  bool hasWildcard = false;
+  while (!header.empty()) {
+    auto params = next(header, ',');
+    const auto name = trim(next(params, ';'));
+    const bool exact = beast::iequals(name, coding);
+    if (!exact && name != "*")
+      continue;
+
+    double q = 1.0;
+    while (!params.empty()) {
+      auto value = next(params, ';');
+      const auto key = trim(next(value, '='));
+      if (beast::iequals(key, "q")) {
+        const auto number = trim(value);
+        q = std::strtod(std::string(number.data(), number.size()).c_str(),
+                        nullptr);
+      }
+    }
+    if (exact)
+      return q;
+    wildcard = q;
+    hasWildcard = true;
+  }
+  return hasWildcard ? wildcard : 0.0;
+}
+
+// a single "bytes=first-last" range, multiple ranges are served as a full
+// response, returns false if unsatisfiable
+inline bool parseRange(beast::string_view value, uint64_t size,
+                       uint64_t &first, uint64_t &last, bool &partial) {
+  partial = false;
+  if (!value.starts_with("bytes=") || value.find(',') != value.npos)
+    return true;
+  value.remove_prefix(6);
+  const auto dash = value.find('-');
+  if (dash == value.npos)
+    return true;
+
+  const auto number = [](beast::string_view s, uint64_t &out) {
+    if (s.empty())
+      return false;
+    out = 0;
+    for (auto c : s) {
+      if (c < '0' || c > '9')
+        return false;
+      out = out * 10 + uint64_t(c - '0');
+    }
+    return true;
+  };
+
+  uint64_t a, b;
+  const bool hasA = number(value.substr(0, dash), a);
+  const bool hasB = number(value.substr(dash + 1), b);
+  if (hasA) {
+    if (a >= size)
+      return false;
+    first = a;
+    last = hasB ? std::min(b, size - 1) : size - 1;
+    if (last < first)
+      return false;
+  } else if (hasB) {
+    // suffix range, the last b bytes
+    if (b == 0)
+      return false;
+    first = b >= size ? 0 : size - b;
+    last = size - 1;
+  } else {
+    return true;
+  }
+  partial = true;
+  return true;
+}
+} // namespace Http
+} // namespace chainblocks
+
+#endif /* CB_HTTP_HPP */
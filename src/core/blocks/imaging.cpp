@@ -4,10 +4,13 @@
 #ifndef IMAGING_H
 #define IMAGING_H
 
+#include "largeimage.hpp"
 #include "shared.hpp"
 
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include <stb_image_resize.h>
+#include <taskflow/taskflow.hpp>
+#include <thread>
 
 namespace chainblocks {
 namespace Imaging {
@@ -321,11 +324,997 @@ private:
   int _height{32};
 };
 
+// Whole image filtering: pixels are converted to float one cache sized tile
+// at a time (plus the apron the kernel needs, clamped at the image edges),
+// filtered with contiguous multiply-add loops over rows that compilers turn
+// into SIMD and converted back. Tiles are independent and spread over a
+// thread pool when Threads is more than 1.
+namespace Filters {
+constexpr int TileSize = 64;
+
+struct Tile {
+  int x, y, w, h;
+};
+
+inline int pixelSize(uint8_t flags) {
+  if ((flags & CBIMAGE_FLAGS_16BITS_INT) == CBIMAGE_FLAGS_16BITS_INT)
+    return 2;
+  else if ((flags & CBIMAGE_FLAGS_32BITS_FLOAT) == CBIMAGE_FLAGS_32BITS_FLOAT)
+    return 4;
+  return 1;
+}
+
+template <typename T> inline T toPixel(float v) {
+  if constexpr (std::is_floating_point_v<T>) {
+    return v;
+  } else {
+    return T(std::clamp(v + 0.5f, 0.0f, float(std::numeric_limits<T>::max())));
+  }
+}
+
+// out += k * in, the building block of every filter
+inline void axpy(float *out, const float *in, float k, int n) {
+  for (int i = 0; i < n; i++)
+    out[i] += k * in[i];
+}
+
+template <typename T>
+void loadTile(const CBImage &image, const Tile &t, int rx, int ry,
+              float *dst) {
+  const int w = image.width;
+  const int h = image.height;
+  const int c = image.channels;
+  const auto pixels = reinterpret_cast<const T *>(image.data);
+  const int left = t.x - rx;
+  const int right = t.x + t.w + rx;
+  const int begin = std::max(left, 0);
+  const int end = std::min(right, w);
+  const size_t stride = size_t(t.w + 2 * rx) * c;
+  for (int r = 0; r < t.h + 2 * ry; r++) {
+    const int sy = std::clamp(t.y - ry + r, 0, h - 1);
+    const T *row = pixels + size_t(sy) * w * c;
+    float *out = dst + r * stride;
+    // only the apron crossing the image edges needs clamping
+    for (int x = left; x < begin; x++)
+      for (int i = 0; i < c; i++)
+        *out++ = float(row[i]);
+    const T *src = row + size_t(begin) * c;
+    const int n = (end - begin) * c;
+    for (int i = 0; i < n; i++)
+      out[i] = float(src[i]);
+    out += n;
+    const T *last = row + size_t(w - 1) * c;
+    for (int x = end; x < right; x++)
+      for (int i = 0; i < c; i++)
+        *out++ = float(last[i]);
+  }
+}
+
+template <typename T>
+void storeTile(CBImage &image, const Tile &t, const float *src) {
+  const int c = image.channels;
+  const int n = t.w * c;
+  auto pixels = reinterpret_cast<T *>(image.data);
+  for (int y = 0; y < t.h; y++) {
+    T *row = pixels + (size_t(t.y + y) * image.width + t.x) * c;
+    const float *s = src + size_t(y) * n;
+    for (int i = 0; i < n; i++)
+      row[i] = toPixel<T>(s[i]);
+  }
+}
+
+// kernel(in, inStride, out, tileWidth, tileHeight, channels)
+template <typename T, typename TKernel>
+void processTile(const CBImage &input, CBImage &output, const Tile &t, int rx,
+                 int ry, const TKernel &kernel) {
+  thread_local std::vector<float> src;
+  thread_local std::vector<float> dst;
+  const int c = input.channels;
+  const int stride = (t.w + 2 * rx) * c;
+  src.resize(size_t(stride) * (t.h + 2 * ry));
+  dst.resize(size_t(t.w) * t.h * c);
+  loadTile<T>(input, t, rx, ry, src.data());
+  kernel(src.data(), stride, dst.data(), t.w, t.h, c);
+  storeTile<T>(output, t, dst.data());
+}
+
+inline void convolve(const float *in, int stride, float *out, int tw, int th,
+                     int c, const std::vector<float> &kernel, int side,
+                     float bias) {
+  const int n = tw * c;
+  for (int y = 0; y < th; y++) {
+    float *o = out + size_t(y) * n;
+    std::fill(o, o + n, bias);
+    for (int ky = 0; ky < side; ky++) {
+      const float *row = in + size_t(y + ky) * stride;
+      for (int kx = 0; kx < side; kx++) {
+        const float k = kernel[ky * side + kx];
+        if (k != 0.0f)
+          axpy(o, row + kx * c, k, n);
+      }
+    }
+  }
+}
+
+inline void convolveSeparable(const float *in, int stride, float *out, int tw,
+                              int th, int c, const std::vector<float> &hk,
+                              const std::vector<float> &vk, float bias) {
+  thread_local std::vector<float> tmp;
+  const int n = tw * c;
+  const int rows = th + int(vk.size()) - 1;
+  tmp.assign(size_t(rows) * n, 0.0f);
+  for (int y = 0; y < rows; y++) {
+    float *t = tmp.data() + size_t(y) * n;
+    const float *row = in + size_t(y) * stride;
+    for (size_t kx = 0; kx < hk.size(); kx++) {
+      if (hk[kx] != 0.0f)
+        axpy(t, row + kx * c, hk[kx], n);
+    }
+  }
+  for (int y = 0; y < th; y++) {
+    float *o = out + size_t(y) * n;
+    std::fill(o, o + n, bias);
+    for (size_t ky = 0; ky < vk.size(); ky++) {
+      if (vk[ky] != 0.0f)
+        axpy(o, tmp.data() + (y + ky) * n, vk[ky], n);
+    }
+  }
+}
+
+struct Base {
+  static CBTypesInfo inputTypes() { return CoreInfo::ImageType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::ImageType; }
+
+  static inline Parameters params{
+      {"Threads",
+       CBCCSTR("The number of cpu threads to use, tiles of the image are "
+               "processed in parallel."),
+       {CoreInfo::IntType}}};
+
+  int64_t _threads{1};
+  std::unique_ptr<tf::Executor> _exec;
+  std::vector<Tile> _tiles;
+  std::vector<uint8_t> _bytes;
+
+  void warmup(CBContext *context) {
+    const auto threads =
+        std::min(_threads, int64_t(std::thread::hardware_concurrency()));
+    if (threads > 1) {
+      if (!_exec || _exec->num_workers() != size_t(threads))
+        _exec.reset(new tf::Executor(size_t(threads)));
+    } else {
+      _exec.reset(nullptr);
+    }
+  }
+
+  template <typename TFunc> void forEachTile(TFunc &&func) {
+    if (_exec && _tiles.size() > 1) {
+      tf::Taskflow flow;
+      flow.for_each_dynamic(_tiles.begin(), _tiles.end(),
+                            [&](const Tile &t) { func(t); });
+      _exec->run(flow).get();
+    } else {
+      for (auto &t : _tiles)
+        func(t);
+    }
+  }
+
+  // rx/ry is the apron the kernel reads around every output pixel
+  template <typename TKernel>
+  CBVar apply(const CBVar &input, int rx, int ry, const TKernel &kernel) {
+    const auto &image = input.payload.imageValue;
+    const int w = image.width;
+    const int h = image.height;
+    if (w == 0 || h == 0)
+      return input;
+
+    const auto pixsize = pixelSize(image.flags);
+    _bytes.resize(size_t(w) * h * image.channels * pixsize);
+    CBImage output = image;
+    output.data = _bytes.data();
+
+    _tiles.clear();
+    for (int y = 0; y < h; y += TileSize) {
+      for (int x = 0; x < w; x += TileSize) {
+        _tiles.push_back(
+            {x, y, std::min(TileSize, w - x), std::min(TileSize, h - y)});
+      }
+    }
+
+    forEachTile([&](const Tile &t) {
+      if (pixsize == 1)
+        processTile<uint8_t>(image, output, t, rx, ry, kernel);
+      else if (pixsize == 2)
+        processTile<uint16_t>(image, output, t, rx, ry, kernel);
+      else
+        processTile<float>(image, output, t, rx, ry, kernel);
+    });
+
+    return Var(output);
+  }
+};
+
+inline std::vector<float> floats(const CBVar &seq) {
+  std::vector<float> res;
+  for (auto &v : seq)
+    res.emplace_back(float(v.payload.floatValue));
+  return res;
+}
+
+inline CBVar floatsVar(const std::vector<float> &values,
+                       std::vector<CBVar> &storage) {
+  storage.clear();
+  for (auto v : values)
+    storage.emplace_back(Var(double(v)));
+  return Var(storage);
+}
+} // namespace Filters
+
+struct ConvolveImage : public Filters::Base {
+  static inline Parameters params{
+      {{"Kernel",
+        CBCCSTR("The square kernel as a flat sequence of weights, row by row, "
+                "e.g. 9 values for a 3x3 kernel."),
+        {CoreInfo::FloatSeqType}},
+       {"Bias",
+        CBCCSTR("A value added to every filtered pixel."),
+        {CoreInfo::FloatType}}},
+      Filters::Base::params};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _kernel = Filters::floats(value);
+      break;
+    case 1:
+      _bias = float(value.payload.floatValue);
+      break;
+    case 2:
+      _threads = std::max(int64_t(1), value.payload.intValue);
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Filters::floatsVar(_kernel, _kernelVar);
+    case 1:
+      return Var(double(_bias));
+    case 2:
+      return Var(_threads);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  CBTypeInfo compose(const CBInstanceData &data) {
+    _side = int(std::lround(std::sqrt(double(_kernel.size()))));
+    if (_kernel.empty() || size_t(_side * _side) != _kernel.size() ||
+        _side % 2 == 0) {
+      throw ComposeError("ConvolveImage: Kernel must be a square with an odd "
+                         "side, e.g. 9 values for 3x3.");
+    }
+    return data.inputType;
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const int r = _side / 2;
+    return apply(input, r, r,
+                 [&](const float *in, int stride, float *out, int tw, int th,
+                     int c) {
+                   Filters::convolve(in, stride, out, tw, th, c, _kernel, _side,
+                                     _bias);
+                 });
+  }
+
+private:
+  std::vector<float> _kernel{1.0f};
+  std::vector<CBVar> _kernelVar;
+  float _bias{0.0f};
+  int _side{1};
+};
+
+struct FilterImage : public Filters::Base {
+  static inline Parameters params{
+      {{"Horizontal",
+        CBCCSTR("The weights applied along rows, an odd number of values."),
+        {CoreInfo::FloatSeqType}},
+       {"Vertical",
+        CBCCSTR("The weights applied along columns, an odd number of values."),
+        {CoreInfo::FloatSeqType}},
+       {"Bias",
+        CBCCSTR("A value added to every filtered pixel."),
+        {CoreInfo::FloatType}}},
+      Filters::Base::params};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _horizontal = Filters::floats(value);
+      break;
+    case 1:
+      _vertical = Filters::floats(value);
+      break;
+    case 2:
+      _bias = float(value.payload.floatValue);
+      break;
+    case 3:
+      _threads = std::max(int64_t(1), value.payload.intValue);
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Filters::floatsVar(_horizontal, _horizontalVar);
+    case 1:
+      return Filters::floatsVar(_vertical, _verticalVar);
+    case 2:
+      return Var(double(_bias));
+    case 3:
+      return Var(_threads);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  CBTypeInfo compose(const CBInstanceData &data) {
+    if (_horizontal.size() % 2 == 0 || _vertical.size() % 2 == 0) {
+      throw ComposeError("FilterImage: Horizontal and Vertical must have an "
+                         "odd number of weights.");
+    }
+    return data.inputType;
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    return apply(input, int(_horizontal.size() / 2), int(_vertical.size() / 2),
+                 [&](const float *in, int stride, float *out, int tw, int th,
+                     int c) {
+                   Filters::convolveSeparable(in, stride, out, tw, th, c,
+                                              _horizontal, _vertical, _bias);
+                 });
+  }
+
+private:
+  std::vector<float> _horizontal{1.0f};
+  std::vector<float> _vertical{1.0f};
+  std::vector<CBVar> _horizontalVar;
+  std::vector<CBVar> _verticalVar;
+  float _bias{0.0f};
+};
+
+struct BlurImage : public Filters::Base {
+  static inline Parameters params{
+      {{"Radius",
+        CBCCSTR("The radius of the gaussian kernel in pixels."),
+        {CoreInfo::IntType}}},
+      Filters::Base::params};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _radius = std::max(1, int(value.payload.intValue));
+      break;
+    case 1:
+      _threads = std::max(int64_t(1), value.payload.intValue);
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(_radius);
+    case 1:
+      return Var(_threads);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  void warmup(CBContext *context) {
+    Filters::Base::warmup(context);
+    // the kernel covers 3 sigmas on both sides
+    const float sigma = std::max(float(_radius) / 3.0f, 0.5f);
+    _weights.resize(size_t(_radius) * 2 + 1);
+    float sum = 0.0f;
+    for (int i = -_radius; i <= _radius; i++) {
+      const float w = std::exp(-float(i * i) / (2.0f * sigma * sigma));
+      _weights[i + _radius] = w;
+      sum += w;
+    }
+    for (auto &w : _weights)
+      w /= sum;
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    return apply(input, _radius, _radius,
+                 [&](const float *in, int stride, float *out, int tw, int th,
+                     int c) {
+                   Filters::convolveSeparable(in, stride, out, tw, th, c,
+                                              _weights, _weights, 0.0f);
+                 });
+  }
+
+private:
+  int _radius{1};
+  std::vector<float> _weights;
+};
+
+struct SharpenImage : public Filters::Base {
+  static inline Parameters params{
+      {{"Amount",
+        CBCCSTR("How much the edges are enhanced, 0 leaves the image as is."),
+        {CoreInfo::FloatType}}},
+      Filters::Base::params};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _amount = float(value.payload.floatValue);
+      break;
+    case 1:
+      _threads = std::max(int64_t(1), value.payload.intValue);
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(double(_amount));
+    case 1:
+      return Var(_threads);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  void warmup(CBContext *context) {
+    Filters::Base::warmup(context);
+    const float a = _amount;
+    _kernel = {0.0f, -a, 0.0f, -a, 1.0f + 4.0f * a, -a, 0.0f, -a, 0.0f};
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    return apply(input, 1, 1,
+                 [&](const float *in, int stride, float *out, int tw, int th,
+                     int c) {
+                   Filters::convolve(in, stride, out, tw, th, c, _kernel, 3,
+                                     0.0f);
+                 });
+  }
+
+private:
+  float _amount{1.0f};
+  std::vector<float> _kernel;
+};
+
+// Gradient magnitude of the 3x3 Sobel operator, per channel
+struct SobelImage : public Filters::Base {
+  static CBParametersInfo parameters() { return Filters::Base::params; }
+
+  void setParam(int index, const CBVar &value) {
+    _threads = std::max(int64_t(1), value.payload.intValue);
+  }
+
+  CBVar getParam(int index) { return Var(_threads); }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    static const std::vector<float> derivative{-1.0f, 0.0f, 1.0f};
+    static const std::vector<float> smooth{1.0f, 2.0f, 1.0f};
+    return apply(input, 1, 1,
+                 [&](const float *in, int stride, float *out, int tw, int th,
+                     int c) {
+                   thread_local std::vector<float> gy;
+                   const size_t n = size_t(tw) * th * c;
+                   gy.resize(n);
+                   Filters::convolveSeparable(in, stride, out, tw, th, c,
+                                              derivative, smooth, 0.0f);
+                   Filters::convolveSeparable(in, stride, gy.data(), tw, th, c,
+                                              smooth, derivative, 0.0f);
+                   for (size_t i = 0; i < n; i++)
+                     out[i] = std::sqrt(out[i] * out[i] + gy[i] * gy[i]);
+                 });
+  }
+};
+
+// Every patch Convolve would output while scanning the image, in a single
+// activation (im2col): one patch per row, width is kernel x kernel pixels.
+struct ExtractPatches : public Filters::Base {
+  static inline Parameters params{
+      {{"Radius",
+        CBCCSTR("The radius of the kernel, e.g. 1 = 1x1; 2 = 3x3; 3 = 5x5 and "
+                "so on."),
+        {CoreInfo::IntType}},
+       {"Step",
+        CBCCSTR("How many pixels to advance between patches, horizontally "
+                "and vertically."),
+        {CoreInfo::IntType}}},
+      Filters::Base::params};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _radius = std::max(1, int(value.payload.intValue));
+      _kernel = (_radius - 1) * 2 + 1;
+      break;
+    case 1:
+      _step = std::max(1, int(value.payload.intValue));
+      break;
+    case 2:
+      _threads = std::max(int64_t(1), value.payload.intValue);
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(_radius);
+    case 1:
+      return Var(_step);
+    case 2:
+      return Var(_threads);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  template <typename T>
+  void extractRow(const CBImage &image, int py, int nx, T *dst) {
+    const int w = image.width;
+    const int h = image.height;
+    const int c = image.channels;
+    const int r = _radius - 1;
+    const auto pixels = reinterpret_cast<const T *>(image.data);
+    const int y = py * _step;
+    dst += size_t(py) * nx * _kernel * _kernel * c;
+    for (int px = 0; px < nx; px++) {
+      const int x = px * _step;
+      const bool inside = x - r >= 0 && x + r < w;
+      for (int ky = -r; ky <= r; ky++) {
+        const T *row = pixels + size_t(std::clamp(y + ky, 0, h - 1)) * w * c;
+        if (inside) {
+          memcpy(dst, row + size_t(x - r) * c, sizeof(T) * _kernel * c);
+          dst += _kernel * c;
+        } else {
+          for (int kx = -r; kx <= r; kx++) {
+            const T *src = row + size_t(std::clamp(x + kx, 0, w - 1)) * c;
+            for (int i = 0; i < c; i++)
+              *dst++ = src[i];
+          }
+        }
+      }
+    }
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto &image = input.payload.imageValue;
+    const int w = image.width;
+    const int h = image.height;
+    const int c = image.channels;
+    if (w == 0 || h == 0)
+      return input;
+
+    const int nx = (w + _step - 1) / _step;
+    const int ny = (h + _step - 1) / _step;
+    const auto patches = size_t(nx) * ny;
+    const auto patchWidth = size_t(_kernel) * _kernel;
+    if (patches > UINT16_MAX || patchWidth > UINT16_MAX) {
+      throw ActivationError("ExtractPatches: too many patches for an image, "
+                            "increase Step.");
+    }
+
+    const auto pixsize = Filters::pixelSize(image.flags);
+    _bytes.resize(patches * patchWidth * c * pixsize);
+
+    // one tile per row of patches
+    _tiles.clear();
+    for (int py = 0; py < ny; py++)
+      _tiles.push_back({0, py, w, 1});
+
+    forEachTile([&](const Filters::Tile &t) {
+      if (pixsize == 1)
+        extractRow(image, t.y, nx, (uint8_t *)_bytes.data());
+      else if (pixsize == 2)
+        extractRow(image, t.y, nx, (uint16_t *)_bytes.data());
+      else
+        extractRow(image, t.y, nx, (float *)_bytes.data());
+    });
+
+    return Var(_bytes.data(), uint16_t(patchWidth), uint16_t(patches),
+               image.channels, image.flags);
+  }
+
+private:
+  int _radius{1};
+  int _step{1};
+  int _kernel{1};
+};
+
+// Blocks working on LargeImage, the output is always a new object holding a
+// reference to the pixels, so views stay valid as long as anyone uses them.
+namespace Large {
+struct Base {
+  static CBTypesInfo inputTypes() { return LargeImage::ObjType; }
+  static CBTypesInfo outputTypes() { return LargeImage::ObjType; }
+
+  LargeImage *_output{nullptr};
+
+  void release() {
+    if (_output) {
+      LargeImage::Var.Release(_output);
+      _output = nullptr;
+    }
+  }
+
+  LargeImage &newOutput() {
+    release();
+    _output = LargeImage::Var.New();
+    return *_output;
+  }
+
+  void cleanup() { release(); }
+};
+
+struct FromImage : public Base {
+  static CBTypesInfo inputTypes() { return CoreInfo::ImageType; }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto &image = input.payload.imageValue;
+    auto &output = newOutput();
+    output.allocate(image.width, image.height, image.channels, image.flags);
+    memcpy(output.data, image.data, output.stride * size_t(output.height));
+    return LargeImage::Var.Get(_output);
+  }
+};
+
+// zero-copy when the rows are contiguous, otherwise the region is packed
+struct ToImage {
+  static CBTypesInfo inputTypes() { return LargeImage::ObjType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::ImageType; }
+
+  std::vector<uint8_t> _bytes;
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto &image = LargeImage::from(input);
+    if (image.width > UINT16_MAX || image.height > UINT16_MAX ||
+        image.channels > UINT8_MAX) {
+      throw ActivationError("LargeImage too large for an Image, use "
+                            "LargeImage.Crop or LargeImage.Tiles first.");
+    }
+    auto data = image.data;
+    if (!image.contiguous()) {
+      const auto rowSize = image.rowSize();
+      _bytes.resize(rowSize * size_t(image.height));
+      for (uint64_t y = 0; y < image.height; y++) {
+        memcpy(_bytes.data() + size_t(y) * rowSize, image.row(y), rowSize);
+      }
+      data = _bytes.data();
+    }
+    return Var(data, uint16_t(image.width), uint16_t(image.height),
+               uint8_t(image.channels), image.flags);
+  }
+};
+
+struct Size {
+  static CBTypesInfo inputTypes() { return LargeImage::ObjType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::Int2Type; }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto &image = LargeImage::from(input);
+    return Var(int64_t(image.width), int64_t(image.height));
+  }
+};
+
+struct Crop : public Base {
+  static inline Parameters params{
+      {"X",
+       CBCCSTR("The left edge of the region."),
+       {CoreInfo::IntType, CoreInfo::IntVarType}},
+      {"Y",
+       CBCCSTR("The top edge of the region."),
+       {CoreInfo::IntType, CoreInfo::IntVarType}},
+      {"Width",
+       CBCCSTR("The width of the region."),
+       {CoreInfo::IntType, CoreInfo::IntVarType}},
+      {"Height",
+       CBCCSTR("The height of the region."),
+       {CoreInfo::IntType, CoreInfo::IntVarType}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  ParamVar _x{Var(0)};
+  ParamVar _y{Var(0)};
+  ParamVar _width{Var(0)};
+  ParamVar _height{Var(0)};
+
+  ParamVar &param(int index) {
+    switch (index) {
+    case 0:
+      return _x;
+    case 1:
+      return _y;
+    case 2:
+      return _width;
+    default:
+      return _height;
+    }
+  }
+
+  void setParam(int index, const CBVar &value) { param(index) = value; }
+
+  CBVar getParam(int index) { return param(index); }
+
+  void warmup(CBContext *context) {
+    for (int i = 0; i < 4; i++)
+      param(i).warmup(context);
+  }
+
+  void cleanup() {
+    for (int i = 0; i < 4; i++)
+      param(i).cleanup();
+    Base::cleanup();
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto &image = LargeImage::from(input);
+    int64_t region[4];
+    for (int i = 0; i < 4; i++) {
+      region[i] = param(i).get().payload.intValue;
+      if (region[i] < 0)
+        throw ActivationError("LargeImage.Crop: negative region");
+    }
+    auto view = image.view(region[0], region[1], region[2], region[3]);
+    newOutput() = std::move(view);
+    return LargeImage::Var.Get(_output);
+  }
+};
+
+// Splits an image into views of Size x Size pixels, row by row, the tiles at
+// the right and bottom edges might be smaller
+struct Tiles {
+  static CBTypesInfo inputTypes() { return LargeImage::ObjType; }
+  static CBTypesInfo outputTypes() { return LargeImage::SeqType; }
+
+  static inline Parameters params{
+      {"Size", CBCCSTR("The side of a tile in pixels."), {CoreInfo::IntType}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    _size = std::max(int64_t(1), value.payload.intValue);
+  }
+
+  CBVar getParam(int index) { return Var(_size); }
+
+  int64_t _size{1024};
+  std::vector<LargeImage *> _tiles;
+  std::vector<CBVar> _output;
+
+  void release() {
+    for (auto tile : _tiles)
+      LargeImage::Var.Release(tile);
+    _tiles.clear();
+    _output.clear();
+  }
+
+  void cleanup() { release(); }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    release();
+    const auto &image = LargeImage::from(input);
+    const auto size = uint64_t(_size);
+    for (uint64_t y = 0; y < image.height; y += size) {
+      for (uint64_t x = 0; x < image.width; x += size) {
+        auto tile = LargeImage::Var.New();
+        *tile = image.view(x, y, std::min(size, image.width - x),
+                           std::min(size, image.height - y));
+        _tiles.emplace_back(tile);
+        _output.emplace_back(LargeImage::Var.Get(tile));
+      }
+    }
+    return Var(_output);
+  }
+};
+
+// Triangle filter resampling, widened when downscaling so every input pixel
+// contributes. Output rows are produced one at a time from a small ring of
+// horizontally resampled input rows, the input is never copied nor converted
+// as a whole. The input is a LargeImage so it is resident, LargeImage.Load
+// only streams PNG decoding into it.
+struct Resize : public Base {
+  static inline Parameters params{
+      {"Width", CBCCSTR("The target width."), {CoreInfo::IntType}},
+      {"Height", CBCCSTR("The target height."), {CoreInfo::IntType}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    if (index == 0)
+      _width = std::max(int64_t(1), value.payload.intValue);
+    else
+      _height = std::max(int64_t(1), value.payload.intValue);
+  }
+
+  CBVar getParam(int index) {
+    if (index == 0)
+      return Var(_width);
+    else
+      return Var(_height);
+  }
+
+  // the input pixels (first + i) every output pixel of an axis blends
+  struct Contributions {
+    std::vector<int64_t> first;
+    std::vector<size_t> offset;
+    std::vector<float> weights;
+
+    size_t count(size_t i) const { return offset[i + 1] - offset[i]; }
+
+    void compute(uint64_t inSize, uint64_t outSize) {
+      first.clear();
+      offset.clear();
+      weights.clear();
+      const double scale = double(outSize) / double(inSize);
+      const double support = std::max(1.0, 1.0 / scale);
+      offset.emplace_back(0);
+      for (uint64_t i = 0; i < outSize; i++) {
+        const double center = (double(i) + 0.5) / scale - 0.5;
+        const auto lo = int64_t(std::ceil(center - support));
+        const auto hi = int64_t(std::floor(center + support));
+        const auto begin = weights.size();
+        float sum = 0.0f;
+        for (int64_t j = lo; j <= hi; j++) {
+          const auto distance = std::abs(double(j) - center) / support;
+          const auto w = float(std::max(0.0, 1.0 - distance));
+          weights.emplace_back(w);
+          sum += w;
+        }
+        if (sum > 0.0f) {
+          for (auto k = begin; k < weights.size(); k++)
+            weights[k] /= sum;
+        }
+        first.emplace_back(lo);
+        offset.emplace_back(weights.size());
+      }
+    }
+  };
+
+  int64_t _width{32};
+  int64_t _height{32};
+  Contributions _horizontal;
+  Contributions _vertical;
+  // ring of horizontally resampled input rows
+  std::vector<float> _rows;
+  std::vector<int64_t> _rowIndex;
+  std::vector<float> _accum;
+
+  template <typename T>
+  void resampleRow(const LargeImage &input, int64_t y, float *out) {
+    const int c = input.channels;
+    const auto last = int64_t(input.width) - 1;
+    const auto src = reinterpret_cast<const T *>(input.row(uint64_t(y)));
+    for (int64_t ox = 0; ox < _width; ox++) {
+      float *o = out + ox * c;
+      std::fill(o, o + c, 0.0f);
+      const auto n = _horizontal.count(ox);
+      const float *w = &_horizontal.weights[_horizontal.offset[ox]];
+      const auto first = _horizontal.first[ox];
+      for (size_t k = 0; k < n; k++) {
+        const auto sx = std::clamp<int64_t>(first + int64_t(k), 0, last);
+        const T *p = src + sx * c;
+        for (int i = 0; i < c; i++)
+          o[i] += w[k] * float(p[i]);
+      }
+    }
+  }
+
+  template <typename T>
+  void resize(const LargeImage &input, LargeImage &output) {
+    const size_t rowFloats = size_t(_width) * input.channels;
+    size_t ringSize = 0;
+    for (int64_t oy = 0; oy < _height; oy++)
+      ringSize = std::max(ringSize, _vertical.count(oy));
+    _rows.resize(ringSize * rowFloats);
+    // rows before the first one are clamped, so -1 is a valid index
+    _rowIndex.assign(ringSize, INT64_MIN);
+    _accum.resize(rowFloats);
+
+    const auto last = int64_t(input.height) - 1;
+    // windows only move forward, so a ring indexed by row works
+    const auto base = _vertical.first[0];
+    for (int64_t oy = 0; oy < _height; oy++) {
+      std::fill(_accum.begin(), _accum.end(), 0.0f);
+      const auto n = _vertical.count(oy);
+      const float *w = &_vertical.weights[_vertical.offset[oy]];
+      const auto first = _vertical.first[oy];
+      for (size_t k = 0; k < n; k++) {
+        const auto y = first + int64_t(k);
+        const auto slot = size_t(y - base) % ringSize;
+        float *row = &_rows[slot * rowFloats];
+        if (_rowIndex[slot] != y) {
+          resampleRow<T>(input, std::clamp<int64_t>(y, 0, last), row);
+          _rowIndex[slot] = y;
+        }
+        Filters::axpy(_accum.data(), row, w[k], int(rowFloats));
+      }
+      auto dst = reinterpret_cast<T *>(output.row(uint64_t(oy)));
+      for (size_t i = 0; i < rowFloats; i++)
+        dst[i] = Filters::toPixel<T>(_accum[i]);
+    }
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto &image = LargeImage::from(input);
+    if (image.width == 0 || image.height == 0)
+      throw ActivationError("LargeImage.Resize: empty image");
+
+    _horizontal.compute(image.width, uint64_t(_width));
+    _vertical.compute(image.height, uint64_t(_height));
+
+    // the copy keeps the pixels alive even if the input was our own previous
+    // output
+    const auto source = image;
+    auto &output = newOutput();
+    output.allocate(uint64_t(_width), uint64_t(_height), source.channels,
+                    source.flags);
+    switch (source.sampleSize()) {
+    case 1:
+      resize<uint8_t>(source, output);
+      break;
+    case 2:
+      resize<uint16_t>(source, output);
+      break;
+    default:
+      resize<float>(source, output);
+      break;
+    }
+    return LargeImage::Var.Get(_output);
+  }
+};
+} // namespace Large
+
 void registerBlocks() {
   REGISTER_CBLOCK("Convolve", Convolve);
   REGISTER_CBLOCK("StripAlpha", StripAlpha);
   REGISTER_CBLOCK("FillAlpha", FillAlpha);
   REGISTER_CBLOCK("ResizeImage", Resize);
+  REGISTER_CBLOCK("ConvolveImage", ConvolveImage);
+  REGISTER_CBLOCK("FilterImage", FilterImage);
+  REGISTER_CBLOCK("BlurImage", BlurImage);
+  REGISTER_CBLOCK("SharpenImage", SharpenImage);
+  REGISTER_CBLOCK("SobelImage", SobelImage);
+  REGISTER_CBLOCK("ExtractPatches", ExtractPatches);
+  REGISTER_CBLOCK("LargeImage.FromImage", Large::FromImage);
+  REGISTER_CBLOCK("LargeImage.ToImage", Large::ToImage);
+  REGISTER_CBLOCK("LargeImage.Size", Large::Size);
+  REGISTER_CBLOCK("LargeImage.Crop", Large::Crop);
+  REGISTER_CBLOCK("LargeImage.Tiles", Large::Tiles);
+  REGISTER_CBLOCK("LargeImage.Resize", Large::Resize);
 }
 } // namespace Imaging
 } // namespace chainblocks
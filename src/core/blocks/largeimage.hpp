@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/* Copyright © 2021 Fragcolor Pte. Ltd. */
+
+#ifndef CB_LARGEIMAGE_HPP
+#define CB_LARGEIMAGE_HPP
+
+#include "shared.hpp"
+#include <memory>
+
+namespace chainblocks {
+constexpr uint32_t LargeImageCC = 'limg';
+
+// Images CBImage can't describe, dimensions are 64 bits and rows are
+// strided so that crops and tiles are views sharing the same pixels.
+struct LargeImage {
+  static inline Type ObjType{
+      {CBType::Object,
+       {.object = {.vendorId = CoreCC, .typeId = LargeImageCC}}}};
+  static inline Type SeqType = Type::SeqOf(ObjType);
+
+  static inline ObjectVar<LargeImage> Var{"LargeImage", CoreCC, LargeImageCC};
+
+  // owns the memory, shared by every view of the same pixels
+  std::shared_ptr<uint8_t> pixels;
+  uint8_t *data{nullptr};
+  uint64_t width{0};
+  uint64_t height{0};
+  uint32_t channels{0};
+  // same as CBImage flags
+  uint8_t flags{0};
+  // bytes between the start of two rows
+  size_t stride{0};
+
+  static LargeImage &from(const CBVar &var) {
+    return *reinterpret_cast<LargeImage *>(var.payload.objectValue);
+  }
+
+  size_t sampleSize() const {
+    if ((flags & CBIMAGE_FLAGS_16BITS_INT) == CBIMAGE_FLAGS_16BITS_INT)
+      return 2;
+    else if ((flags & CBIMAGE_FLAGS_32BITS_FLOAT) ==
+             CBIMAGE_FLAGS_32BITS_FLOAT)
+      return 4;
+    return 1;
+  }
+
+  size_t pixelSize() const { return channels * sampleSize(); }
+
+  size_t rowSize() const { return size_t(width) * pixelSize(); }
+
+  uint8_t *row(uint64_t y) const { return data + size_t(y) * stride; }
+
+  bool contiguous() const { return stride == rowSize(); }
+
+  void allocate(uint64_t w, uint64_t h, uint32_t c, uint8_t f) {
+    width = w;
+    height = h;
+    channels = c;
+    flags = f;
+    stride = rowSize();
+    pixels.reset(new uint8_t[stride * size_t(h)],
+                 std::default_delete<uint8_t[]>());
+    data = pixels.get();
+  }
+
+  // a zero-copy region of this image
+  LargeImage view(uint64_t x, uint64_t y, uint64_t w, uint64_t h) const {
+    if (x + w > width || y + h > height) {
+      throw ActivationError("LargeImage region out of bounds");
+    }
+    LargeImage res = *this;
+    res.data = data + size_t(y) * stride + size_t(x) * pixelSize();
+    res.width = w;
+    res.height = h;
+    return res;
+  }
+};
+} // namespace chainblocks
+
+#endif /* CB_LARGEIMAGE_HPP */
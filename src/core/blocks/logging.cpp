@@ -2,32 +2,402 @@
 /* Copyright © 2019 Fragcolor Pte. Ltd. */
 
 #include "shared.hpp"
+#include <chrono>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <thread>
 
 namespace chainblocks {
+namespace Logging {
+// Entries logged by Log and Msg when the async pipeline is enabled.
+// The value is cloned into the slot (recycling its memory) and formatted
+// later on the pipeline thread, the chain thread never touches a sink.
+struct Entry {
+  spdlog::level::level_enum level;
+  spdlog::log_clock::time_point time;
+  std::string chain;
+  std::string message;
+  CBVar value{};
+  bool hasValue{false};
+  uint64_t suppressed{0};
+};
+
+// Binary log layout, all integers little endian:
+// header "CBLG" uint32 version
+// records: int64 ns since epoch, uint8 level, uint32 + chain name,
+//          uint32 + message, uint8 has value, serialized CBVar if any,
+//          uint64 suppressed count
+class Pipeline {
+public:
+  static constexpr uint32_t BinaryVersion = 1;
+
+  Pipeline(size_t capacity, std::shared_ptr<spdlog::logger> logger,
+           const char *binaryPath)
+      : _logger(std::move(logger)) {
+    size_t size = 64;
+    while (size < capacity)
+      size <<= 1;
+    _mask = size - 1;
+    _slots.reset(new Slot[size]);
+    for (size_t i = 0; i < size; i++) {
+      _slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    if (binaryPath && binaryPath[0] != 0) {
+      _binary.open(binaryPath, std::ios::binary | std::ios::app);
+      if (!_binary.good()) {
+        CBLOG_ERROR("Failed to open binary log file: {}", binaryPath);
+      } else if (_binary.tellp() == 0) {
+        _binary.write("CBLG", 4);
+        _binary.write((const char *)&BinaryVersion, sizeof(uint32_t));
+      }
+    }
+
+    _worker = std::thread([this]() { run(); });
+  }
+
+  ~Pipeline() {
+    stop(true);
+    for (size_t i = 0; i <= _mask; i++) {
+      destroyVar(_slots[i].entry.value);
+    }
+  }
+
+  // the worker drains the queue and exits, later logs go to spdlog directly
+  // only a lock free store when not waiting, so usable from signal handlers
+  void stop(bool wait) {
+    _running = false;
+    if (wait && _worker.joinable())
+      _worker.join();
+  }
+
+  bool running() const { return _running; }
+
+  // multiple producers, never blocks, drops when full
+  bool push(spdlog::level::level_enum level, const char *chain,
+            std::string_view message, const CBVar *value,
+            uint64_t suppressed) {
+    auto pos = _tail.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+      slot = &_slots[pos & _mask];
+      auto seq = slot->seq.load(std::memory_order_acquire);
+      auto diff = intptr_t(seq) - intptr_t(pos);
+      if (diff == 0) {
+        if (_tail.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        _dropped++;
+        return false;
+      } else {
+        pos = _tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    auto &entry = slot->entry;
+    entry.level = level;
+    entry.time = spdlog::log_clock::now();
+    entry.chain = chain;
+    entry.message = message;
+    entry.hasValue = value != nullptr;
+    if (value)
+      cloneVar(entry.value, *value);
+    entry.suppressed = suppressed;
+
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  struct Slot {
+    std::atomic<size_t> seq;
+    Entry entry;
+  };
+
+  std::shared_ptr<spdlog::logger> _logger;
+  std::unique_ptr<Slot[]> _slots;
+  size_t _mask;
+  alignas(64) std::atomic<size_t> _tail{0};
+  alignas(64) size_t _head{0};
+  std::atomic<uint64_t> _dropped{0};
+  std::atomic_bool _running{true};
+  std::thread _worker;
+  std::ofstream _binary;
+  Serialization _serialization;
+  std::vector<uint8_t> _record;
+
+  bool pop() {
+    auto &slot = _slots[_head & _mask];
+    if (slot.seq.load(std::memory_order_acquire) != _head + 1)
+      return false;
+
+    if (_binary.is_open())
+      write(slot.entry);
+    else
+      format(slot.entry);
+
+    slot.seq.store(_head + _mask + 1, std::memory_order_release);
+    _head++;
+    return true;
+  }
+
+  void format(const Entry &entry) {
+    std::string msg;
+    if (entry.hasValue) {
+      if (entry.message.size() > 0) {
+        msg = fmt::format("[{}] {}: {}", entry.chain, entry.message,
+                          entry.value);
+      } else {
+        msg = fmt::format("[{}] {}", entry.chain, entry.value);
+      }
+    } else {
+      msg = fmt::format("[{}] {}", entry.chain, entry.message);
+    }
+    if (entry.suppressed > 0) {
+      msg += fmt::format(" ({} suppressed)", entry.suppressed);
+    }
+    _logger->log(entry.time,
+                 spdlog::source_loc{__FILE__, __LINE__, SPDLOG_FUNCTION},
+                 entry.level, msg);
+  }
+
+  void write(const Entry &entry) {
+    _record.clear();
+    auto put = [&](const void *data, size_t size) {
+      auto bytes = (const uint8_t *)data;
+      _record.insert(_record.end(), bytes, bytes + size);
+    };
+    auto putString = [&](const std::string &str) {
+      uint32_t len = uint32_t(str.size());
+      put(&len, sizeof(uint32_t));
+      put(str.data(), len);
+    };
+
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     entry.time.time_since_epoch())
+                     .count();
+    put(&ns, sizeof(int64_t));
+    uint8_t level = uint8_t(entry.level);
+    put(&level, 1);
+    putString(entry.chain);
+    putString(entry.message);
+    uint8_t hasValue = entry.hasValue ? 1 : 0;
+    put(&hasValue, 1);
+    if (entry.hasValue) {
+      auto writer = [&](const uint8_t *data, size_t size) { put(data, size); };
+      _serialization.serialize(entry.value, writer);
+      // records are independent, don't keep chains across them
+      _serialization.reset();
+    }
+    put(&entry.suppressed, sizeof(uint64_t));
+    _binary.write((const char *)_record.data(), _record.size());
+  }
+
+  void run() {
+    int idle = 0;
+    while (true) {
+      if (pop()) {
+        idle = 0;
+        continue;
+      }
+
+      auto dropped = _dropped.exchange(0);
+      if (dropped > 0) {
+        _logger->warn("Log pipeline full, dropped {} entries", dropped);
+      }
+
+      if (!_running)
+        break;
+
+      // queue is empty, flush and back off
+      if (idle == 0) {
+        if (_binary.is_open())
+          _binary.flush();
+        _logger->flush();
+      }
+      if (idle < 64) {
+        idle++;
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+    }
+
+    // drain what was pushed while stopping
+    while (pop())
+      ;
+    if (_binary.is_open())
+      _binary.flush();
+    _logger->flush();
+  }
+};
+
+static std::unique_ptr<Pipeline> pipeline;
+
+inline bool hasObjects(const CBVar &var) {
+  switch (var.valueType) {
+  case CBType::Object:
+    return true;
+  case CBType::Seq:
+    for (uint32_t i = 0; i < var.payload.seqValue.len; i++) {
+      if (hasObjects(var.payload.seqValue.elements[i]))
+        return true;
+    }
+    return false;
+  case CBType::Table: {
+    auto found = false;
+    ForEach(var.payload.tableValue, [&](auto key, auto &value) {
+      found = found || hasObjects(value);
+    });
+    return found;
+  }
+  case CBType::Set: {
+    auto found = false;
+    ForEach(var.payload.setValue,
+            [&](auto &value) { found = found || hasObjects(value); });
+    return found;
+  }
+  default:
+    return false;
+  }
+}
+
+inline bool push(spdlog::level::level_enum level, const char *chain,
+                 std::string_view message, const CBVar *value,
+                 uint64_t suppressed) {
+  if (!pipeline || !pipeline->running())
+    return false;
+
+  // objects reference counting is not thread safe, format those right away,
+  // also when nested in a sequence or table
+  if (value && hasObjects(*value)) {
+    std::stringstream ss;
+    ss << message << (message.size() > 0 ? ": " : "") << *value;
+    pipeline->push(level, chain, ss.str(), nullptr, suppressed);
+  } else {
+    pipeline->push(level, chain, message, value, suppressed);
+  }
+  return true;
+}
+} // namespace Logging
+
+void startLogPipeline(size_t capacity, std::shared_ptr<spdlog::logger> logger,
+                      const char *binaryPath) {
+  Logging::pipeline.reset(
+      new Logging::Pipeline(capacity, std::move(logger), binaryPath));
+}
+
+void stopLogPipeline(bool wait) {
+  if (Logging::pipeline)
+    Logging::pipeline->stop(wait);
+}
+
 struct LoggingBase {
   static CBTypesInfo inputTypes() { return CoreInfo::AnyType; }
 
   static CBTypesInfo outputTypes() { return CoreInfo::AnyType; }
-};
 
-struct Log : public LoggingBase {
-  static inline ParamsInfo msgParamsInfo = ParamsInfo(ParamsInfo::Param(
-      "Prefix", CBCCSTR("The prefix message to the value to log."),
-      CoreInfo::StringType));
+  static inline Parameters samplingParams{
+      {"Every",
+       CBCCSTR("Log only one activation every this many, 1 logs them all."),
+       {CoreInfo::IntType}},
+      {"PerSecond",
+       CBCCSTR("The maximum number of logs per second from this block, 0 is "
+               "unlimited."),
+       {CoreInfo::FloatType}}};
 
   std::string msg;
+  int64_t _every{1};
+  double _perSecond{0.0};
+
+  // sampling state, this block is the call site
+  int64_t _count{0};
+  uint64_t _suppressed{0};
+  double _tokens{0.0};
+  std::chrono::steady_clock::time_point _last;
+
+  void setSampling(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _every = std::max(value.payload.intValue, int64_t(1));
+      break;
+    case 1:
+      _perSecond = std::max(value.payload.floatValue, 0.0);
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getSampling(int index) {
+    switch (index) {
+    case 0:
+      return Var(_every);
+    case 1:
+      return Var(_perSecond);
+    default:
+      return Var::Empty;
+    }
+  }
 
-  static CBParametersInfo parameters() {
-    return CBParametersInfo(msgParamsInfo);
+  void warmup(CBContext *context) {
+    _count = 0;
+    _suppressed = 0;
+    _tokens = std::max(_perSecond, 1.0);
+    _last = std::chrono::steady_clock::now();
   }
 
+  bool admit() {
+    if (!spdlog::default_logger_raw()->should_log(spdlog::level::info))
+      return false;
+
+    if (_every > 1 && (_count++ % _every) != 0) {
+      _suppressed++;
+      return false;
+    }
+
+    if (_perSecond > 0.0) {
+      // token bucket, bursts up to one second worth of logs
+      auto now = std::chrono::steady_clock::now();
+      std::chrono::duration<double> elapsed = now - _last;
+      _last = now;
+      _tokens =
+          std::min(std::max(_perSecond, 1.0),
+                   _tokens + elapsed.count() * _perSecond);
+      if (_tokens < 1.0) {
+        _suppressed++;
+        return false;
+      }
+      _tokens -= 1.0;
+    }
+
+    return true;
+  }
+
+  uint64_t takeSuppressed() {
+    auto res = _suppressed;
+    _suppressed = 0;
+    return res;
+  }
+};
+
+struct Log : public LoggingBase {
+  static inline Parameters params{
+      {{"Prefix", CBCCSTR("The prefix message to the value to log."),
+        {CoreInfo::StringType}}},
+      samplingParams};
+
+  static CBParametersInfo parameters() { return params; }
+
   void setParam(int index, const CBVar &inValue) {
     switch (index) {
     case 0:
       msg = inValue.payload.stringValue;
       break;
     default:
+      setSampling(index - 1, inValue);
       break;
     }
   }
@@ -40,14 +410,30 @@ struct Log : public LoggingBase {
       res.payload.stringValue = msg.c_str();
       break;
     default:
-      break;
+      return getSampling(index - 1);
     }
     return res;
   }
 
   CBVar activate(CBContext *context, const CBVar &input) {
+    if (!admit())
+      return input;
+
     auto current = context->chainStack.back();
-    if (msg.size() > 0) {
+    auto suppressed = takeSuppressed();
+    if (Logging::push(spdlog::level::info, current->name.c_str(), msg, &input,
+                      suppressed))
+      return input;
+
+    if (suppressed > 0) {
+      if (msg.size() > 0) {
+        CBLOG_INFO("[{}] {}: {} ({} suppressed)", current->name, msg, input,
+                   suppressed);
+      } else {
+        CBLOG_INFO("[{}] {} ({} suppressed)", current->name, input,
+                   suppressed);
+      }
+    } else if (msg.size() > 0) {
       CBLOG_INFO("[{}] {}: {}", current->name, msg, input);
     } else {
       CBLOG_INFO("[{}] {}", current->name, input);
@@ -57,14 +443,11 @@ struct Log : public LoggingBase {
 };
 
 struct Msg : public LoggingBase {
-  static inline ParamsInfo msgParamsInfo = ParamsInfo(ParamsInfo::Param(
-      "Message", CBCCSTR("The message to log."), CoreInfo::StringType));
-
-  std::string msg;
+  static inline Parameters params{
+      {{"Message", CBCCSTR("The message to log."), {CoreInfo::StringType}}},
+      samplingParams};
 
-  static CBParametersInfo parameters() {
-    return CBParametersInfo(msgParamsInfo);
-  }
+  static CBParametersInfo parameters() { return params; }
 
   void setParam(int index, const CBVar &inValue) {
     switch (index) {
@@ -72,6 +455,7 @@ struct Msg : public LoggingBase {
       msg = inValue.payload.stringValue;
       break;
     default:
+      setSampling(index - 1, inValue);
       break;
     }
   }
@@ -84,14 +468,26 @@ struct Msg : public LoggingBase {
       res.payload.stringValue = msg.c_str();
       break;
     default:
-      break;
+      return getSampling(index - 1);
     }
     return res;
   }
 
   CBVar activate(CBContext *context, const CBVar &input) {
+    if (!admit())
+      return input;
+
     auto current = context->chainStack.back();
-    CBLOG_INFO("[{}] {}", current->name, msg);
+    auto suppressed = takeSuppressed();
+    if (Logging::push(spdlog::level::info, current->name.c_str(), msg, nullptr,
+                      suppressed))
+      return input;
+
+    if (suppressed > 0) {
+      CBLOG_INFO("[{}] {} ({} suppressed)", current->name, msg, suppressed);
+    } else {
+      CBLOG_INFO("[{}] {}", current->name, msg);
+    }
     return input;
   }
 };
@@ -103,6 +499,7 @@ RUNTIME_BLOCK_outputTypes(Log);
 RUNTIME_BLOCK_parameters(Log);
 RUNTIME_BLOCK_setParam(Log);
 RUNTIME_BLOCK_getParam(Log);
+RUNTIME_BLOCK_warmup(Log);
 RUNTIME_BLOCK_activate(Log);
 RUNTIME_BLOCK_END(Log);
 
@@ -113,6 +510,7 @@ RUNTIME_BLOCK_outputTypes(Msg);
 RUNTIME_BLOCK_parameters(Msg);
 RUNTIME_BLOCK_setParam(Msg);
 RUNTIME_BLOCK_getParam(Msg);
+RUNTIME_BLOCK_warmup(Msg);
 RUNTIME_BLOCK_activate(Msg);
 RUNTIME_BLOCK_END(Msg);
 
@@ -7,8 +7,19 @@
 #include "../runtime.hpp"
 #include "shared.hpp"
 #include "utility.hpp"
+#include <atomic>
 #include <boost/lockfree/queue.hpp>
+#include <chrono>
+#include <ikcp.h>
+#include <limits>
+#include <map>
+#include <random>
 #include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
 
 using boost::asio::ip::udp;
 
@@ -16,9 +27,142 @@ namespace chainblocks {
 namespace Network {
 constexpr uint32_t SocketCC = 'netS';
 
+struct Packet {
+  udp::endpoint remote;
+  // capacity is kept when recycled, packets settle to the size of the
+  // traffic after a few ticks
+  std::vector<char> data;
+};
+
+// Preallocated packets, shared by the io thread (receiving) and the chain
+// (running the Receive flow and queueing sends). The chain side also owns
+// the send queue which is flushed once per tick with a single syscall per
+// batch where the platform allows.
+struct PacketPool {
+  static constexpr size_t PreallocatedPackets = 256;
+  static constexpr size_t MaxPackets = 4096;
+  static constexpr size_t BatchSize = 64;
+
+  boost::lockfree::queue<Packet *> free{MaxPackets};
+  boost::lockfree::queue<Packet *> received{MaxPackets};
+  // chain thread only
+  std::vector<Packet *> outgoing;
+
+  std::atomic<int64_t> allocated{0};
+  std::atomic<int64_t> receivedCount{0};
+  std::atomic<int64_t> sentCount{0};
+  std::atomic<int64_t> droppedCount{0};
+
+  PacketPool() {
+    for (size_t i = 0; i < PreallocatedPackets; i++) {
+      auto pkt = new Packet();
+      pkt->data.reserve(1500);
+      free.push(pkt);
+    }
+    allocated = PreallocatedPackets;
+    outgoing.reserve(BatchSize);
+  }
+
+  ~PacketPool() {
+    Packet *pkt;
+    while (free.pop(pkt))
+      delete pkt;
+    while (received.pop(pkt))
+      delete pkt;
+    for (auto p : outgoing)
+      delete p;
+  }
+
+  // nullptr if the pool is exhausted, the caller counts the drop
+  Packet *acquire() {
+    Packet *pkt;
+    if (free.pop(pkt))
+      return pkt;
+    if (allocated.fetch_add(1) < int64_t(MaxPackets))
+      return new Packet();
+    allocated--;
+    return nullptr;
+  }
+
+  void release(Packet *pkt) { free.push(pkt); }
+
+  void drop(Packet *pkt) {
+    droppedCount++;
+    release(pkt);
+  }
+
+  void flush(udp::socket &socket) {
+    if (outgoing.empty())
+      return;
+
+#ifdef __linux__
+    std::array<mmsghdr, BatchSize> msgs;
+    std::array<iovec, BatchSize> iovs;
+    size_t offset = 0;
+    while (offset < outgoing.size()) {
+      const auto count = std::min(BatchSize, outgoing.size() - offset);
+      for (size_t i = 0; i < count; i++) {
+        auto pkt = outgoing[offset + i];
+        iovs[i].iov_base = pkt->data.data();
+        iovs[i].iov_len = pkt->data.size();
+        msgs[i] = {};
+        msgs[i].msg_hdr.msg_name = pkt->remote.data();
+        msgs[i].msg_hdr.msg_namelen = socklen_t(pkt->remote.size());
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      const auto sent = ::sendmmsg(socket.native_handle(), msgs.data(),
+                                   unsigned(count), MSG_DONTWAIT);
+      if (sent > 0) {
+        sentCount += sent;
+        offset += size_t(sent);
+      } else if (sent == -1 && errno == EINTR) {
+        continue;
+      } else if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // socket buffer full, it's UDP so drop the rest of this tick
+        droppedCount += int64_t(outgoing.size() - offset);
+        break;
+      } else {
+        // the first packet of the batch failed (e.g. ICMP unreachable from
+        // a previous send), skip it and keep going
+        droppedCount++;
+        offset++;
+      }
+    }
+#else
+    for (auto pkt : outgoing) {
+      boost::system::error_code ec;
+      socket.send_to(boost::asio::buffer(pkt->data.data(), pkt->data.size()),
+                     pkt->remote, 0, ec);
+      if (ec) {
+        droppedCount++;
+      } else {
+        sentCount++;
+      }
+    }
+#endif
+
+    for (auto pkt : outgoing)
+      release(pkt);
+    outgoing.clear();
+  }
+
+  void clearOutgoing() {
+    for (auto pkt : outgoing)
+      release(pkt);
+    outgoing.clear();
+  }
+};
+
+struct KCPSession;
+
 struct SocketData {
   udp::socket *socket;
   udp::endpoint *endpoint;
+  PacketPool *pool;
+  // set by the KCP blocks, Send goes through the reliable session then
+  KCPSession *session;
 };
 
 struct NetworkBase {
@@ -35,7 +179,18 @@ struct NetworkBase {
 
   // Every server/client will share same context, so sharing the same recv
   // buffer is possible and nice!
+#ifdef __linux__
+  static constexpr size_t RecvBatchSize = 16;
+  ThreadShared<std::array<std::array<char, 0xFFFF>, RecvBatchSize>> _recv_batch;
+#else
   ThreadShared<std::array<char, 0xFFFF>> _recv_buffer;
+  udp::endpoint _sender;
+#endif
+
+  PacketPool _pool;
+  // deserialization target, recycled across packets
+  CBVar _payload{};
+  Serialization deserial;
 
   CBVar *_socketVar = nullptr;
   SocketData _socket{};
@@ -74,6 +229,8 @@ struct NetworkBase {
   }
 
   void destroy() {
+    Serialization::varFree(_payload);
+
     // defer all in the context or we will crash!
     if (_io_context_refc > 0) {
       boost::asio::post(_io_context, []() {
@@ -89,6 +246,9 @@ struct NetworkBase {
   void cleanup() {
     // defer all in the context or we will crash!
     if (_socket.socket) {
+      // don't lose what was queued during the last tick
+      _pool.flush(*_socket.socket);
+
       auto socket = _socket.socket;
       boost::asio::post(_io_context, [socket]() {
         if (socket) {
@@ -99,6 +259,8 @@ struct NetworkBase {
 
       _socket.socket = nullptr;
       _socket.endpoint = nullptr;
+    } else {
+      _pool.clearOutgoing();
     }
 
     // clean context vars
@@ -201,74 +363,114 @@ struct NetworkBase {
     }
     auto rc = _socketVar->refcount;
     auto rcflag = _socketVar->flags & CBVAR_FLAGS_REF_COUNTED;
+    _socket.pool = &_pool;
     *_socketVar = Var::Object(&_socket, CoreCC, SocketCC);
     _socketVar->refcount = rc;
     _socketVar->flags |= rcflag;
   }
-};
-
-struct Server : public NetworkBase {
-  struct ClientPkt {
-    udp::endpoint *remote;
-    CBVar payload;
-  };
-
-  boost::lockfree::queue<ClientPkt> _queue{16};
-  boost::lockfree::queue<ClientPkt> _empty_queue{16};
-  udp::endpoint _sender;
-
-  void destroy() {
-    // drain queues first
-    while (!_queue.empty()) {
-      ClientPkt pkt;
-      if (_queue.pop(pkt)) {
-        delete pkt.remote;
-        Serialization::varFree(pkt.payload);
-      }
-    }
-
-    while (!_empty_queue.empty()) {
-      ClientPkt pkt;
-      if (_empty_queue.pop(pkt)) {
-        delete pkt.remote;
-        Serialization::varFree(pkt.payload);
-      }
-    }
-
-    NetworkBase::destroy();
-  }
-
-  Serialization deserial;
 
+  // runs on the io thread, raw datagrams go straight into the pool and are
+  // deserialized later by the chain
   void do_receive() {
+#ifdef __linux__
+    _socket.socket->async_wait(udp::socket::wait_read,
+                               [this](boost::system::error_code ec) {
+                                 if (!ec) {
+                                   receiveBatch();
+                                   // keep receiving
+                                   do_receive();
+                                 }
+                               });
+#else
     _socket.socket->async_receive_from(
         boost::asio::buffer(&_recv_buffer().front(), _recv_buffer().size()),
         _sender, [this](boost::system::error_code ec, std::size_t bytes_recvd) {
-          if (!ec && bytes_recvd > 0) {
-            ClientPkt pkt{};
-
-            // try reuse vars internal memory smartly
-            if (!_empty_queue.empty()) {
-              _empty_queue.pop(pkt);
-              *pkt.remote = _sender;
-            } else {
-              pkt.remote = new udp::endpoint(_sender);
+          if (!ec) {
+            if (bytes_recvd > 0) {
+              enqueue(_sender.data(), _sender.size(),
+                      &_recv_buffer().front(), bytes_recvd);
             }
-
-            // deserialize from buffer
-            Reader r(&_recv_buffer().front(), bytes_recvd);
-            deserial.reset();
-            deserial.deserialize(r, pkt.payload);
-
-            // add ready packet to queue
-            _queue.push(pkt);
-
             // keep receiving
             do_receive();
           }
         });
+#endif
   }
 
+#ifdef __linux__
+  // drain the socket with as few syscalls as possible
+  void receiveBatch() {
+    auto &buffers = _recv_batch();
+    std::array<mmsghdr, RecvBatchSize> msgs;
+    std::array<iovec, RecvBatchSize> iovs;
+    std::array<sockaddr_storage, RecvBatchSize> names;
+    while (true) {
+      for (size_t i = 0; i < RecvBatchSize; i++) {
+        iovs[i].iov_base = buffers[i].data();
+        iovs[i].iov_len = buffers[i].size();
+        msgs[i] = {};
+        msgs[i].msg_hdr.msg_name = &names[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      const auto n = ::recvmmsg(_socket.socket->native_handle(), msgs.data(),
+                                unsigned(RecvBatchSize), MSG_DONTWAIT, nullptr);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+
+      for (int i = 0; i < n; i++) {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+          _pool.droppedCount++;
+          continue;
+        }
+        enqueue(&names[i], msgs[i].msg_hdr.msg_namelen, buffers[i].data(),
+                msgs[i].msg_len);
+      }
+
+      if (size_t(n) < RecvBatchSize)
+        break;
+    }
+  }
+#endif
+
+  void enqueue(const void *name, size_t nameLen, const char *data,
+               size_t size) {
+    auto pkt = _pool.acquire();
+    if (!pkt || nameLen > pkt->remote.capacity()) {
+      _pool.droppedCount++;
+      if (pkt)
+        _pool.release(pkt);
+      return;
+    }
+    memcpy(pkt->remote.data(), name, nameLen);
+    pkt->remote.resize(nameLen);
+    pkt->data.assign(data, data + size);
+    _pool.receivedCount++;
+    _pool.received.push(pkt);
+  }
+
+  // runs the Receive flow on every packet received since the last tick
+  template <typename OnPacket>
+  void processReceived(CBContext *context, OnPacket onPacket) {
+    Packet *pkt;
+    while (_pool.received.pop(pkt)) {
+      Reader r(pkt->data.data(), pkt->data.size());
+      deserial.reset();
+      deserial.deserialize(r, _payload);
+      onPacket(pkt);
+      CBVar output{};
+      activateBlocks(CBVar(_blks).payload.seqValue, context, _payload, output);
+      // recycle the packet buffers
+      _pool.release(pkt);
+    }
+  }
+};
+
+struct Server : public NetworkBase {
   CBVar activate(CBContext *context, const CBVar &input) {
     if (!_socket.socket) {
       // first activation, let's init
@@ -281,23 +483,25 @@ struct Server : public NetworkBase {
 
     setSocket(context);
 
-    // receive from ringbuffer and run chains
-    while (!_queue.empty()) {
-      ClientPkt pkt;
-      if (_queue.pop(pkt)) {
-        CBVar output{};
-        // update remote as pops in context variable
-        _socket.endpoint = pkt.remote;
-        activateBlocks(CBVar(_blks).payload.seqValue, context, pkt.payload,
-                       output);
-        // release the var once done
-        // will recycle internal buffers
-        _empty_queue.push(pkt);
-      }
-    }
+    // sends queued after us during the previous tick
+    _pool.flush(*_socket.socket);
+
+    // receive from the pool and run chains
+    processReceived(context, [&](Packet *pkt) {
+      // update remote as pops in context variable
+      // copied as the packet gets recycled, a Send outside of the Receive
+      // flow will target the last remote
+      _remote = pkt->remote;
+      _socket.endpoint = &_remote;
+    });
+
+    // replies, one batch per tick
+    _pool.flush(*_socket.socket);
 
     return input;
   }
+
+  udp::endpoint _remote;
 };
 
 // Register
@@ -318,56 +522,6 @@ RUNTIME_BLOCK_END(Server);
 struct Client : public NetworkBase {
   ExposedInfo _exposedInfo{};
 
-  boost::lockfree::queue<CBVar> _queue{16};
-  boost::lockfree::queue<CBVar> _empty_queue{16};
-
-  void destroy() {
-    // drain queues first
-    while (!_queue.empty()) {
-      CBVar v;
-      if (_queue.pop(v)) {
-        Serialization::varFree(v);
-      }
-    }
-
-    while (!_empty_queue.empty()) {
-      CBVar v;
-      if (_empty_queue.pop(v)) {
-        Serialization::varFree(v);
-      }
-    }
-
-    NetworkBase::destroy();
-  }
-
-  Serialization deserial;
-
-  void do_receive() {
-    _socket.socket->async_receive_from(
-        boost::asio::buffer(&_recv_buffer().front(), _recv_buffer().size()),
-        _server, [this](boost::system::error_code ec, std::size_t bytes_recvd) {
-          if (!ec && bytes_recvd > 0) {
-            CBVar v{};
-
-            // try reuse vars internal memory smartly
-            if (!_empty_queue.empty()) {
-              _empty_queue.pop(v);
-            }
-
-            // deserialize from buffer
-            Reader r(&_recv_buffer().front(), bytes_recvd);
-            deserial.reset();
-            deserial.deserialize(r, v);
-
-            // process a packet
-            _queue.push(v);
-
-            // keep receiving
-            do_receive();
-          }
-        });
-  }
-
   CBVar activate(CBContext *context, const CBVar &input) {
     if (!_socket.socket) {
       // first activation, let's init
@@ -389,17 +543,13 @@ struct Client : public NetworkBase {
     // in the case of client we actually set the remote here
     _socket.endpoint = &_server;
 
-    // receive from ringbuffer and run chains
-    while (!_queue.empty()) {
-      CBVar v;
-      if (_queue.pop(v)) {
-        CBVar output{};
-        activateBlocks(CBVar(_blks).payload.seqValue, context, v, output);
-        // release the var once done
-        // will recycle internal buffers
-        _empty_queue.push(v);
-      }
-    }
+    // sends queued after us during the previous tick
+    _pool.flush(*_socket.socket);
+
+    // receive from the pool and run chains
+    processReceived(context, [](Packet *) {});
+
+    _pool.flush(*_socket.socket);
 
     return input;
   }
@@ -451,15 +601,40 @@ struct Send {
   static CBTypesInfo outputTypes() { return CoreInfo::AnyType; }
 
   Serialization serializer;
+  std::vector<char> _message;
 
   CBVar activate(CBContext *context, const CBVar &input) {
     auto socket = getSocket(context);
+    if (!socket->endpoint) {
+      throw ActivationError("Network.Send: no remote endpoint yet");
+    }
+
+    if (socket->session) {
+      // reliable, up to MaxMessage bytes, KCP fragments it
+      _message.clear();
+      serializer.reset();
+      auto writer = [&](const uint8_t *buf, size_t size) {
+        _message.insert(_message.end(), buf, buf + size);
+      };
+      serializer.serialize(input, writer);
+      socket->session->send(_message.data(), _message.size());
+      return input;
+    }
+
     NetworkBase::Writer w(&_send_buffer().front(), _send_buffer().size());
     serializer.reset();
     auto size = serializer.serialize(input, w);
-    // use async, avoid syscalls!
-    socket->socket->send_to(boost::asio::buffer(&_send_buffer().front(), size),
-                            *socket->endpoint);
+
+    // queued, the owning Server/Client flushes once per tick
+    auto pool = socket->pool;
+    auto pkt = pool->acquire();
+    if (!pkt) {
+      pool->droppedCount++;
+      return input;
+    }
+    pkt->remote = *socket->endpoint;
+    pkt->data.assign(&_send_buffer().front(), &_send_buffer().front() + size);
+    pool->outgoing.push_back(pkt);
     return input;
   }
 };
@@ -471,11 +646,561 @@ RUNTIME_BLOCK_inputTypes(Send);
 RUNTIME_BLOCK_outputTypes(Send);
 RUNTIME_BLOCK_activate(Send);
 RUNTIME_BLOCK_END(Send);
+
+struct Stats {
+  static inline Types StatsTypes{{CoreInfo::IntType, CoreInfo::IntType,
+                                  CoreInfo::IntType, CoreInfo::IntType}};
+  static inline std::array<CBString, 4> StatsKeys{"Received", "Sent",
+                                                  "Dropped", "Packets"};
+  static inline Type StatsType = Type::TableOf(StatsTypes, StatsKeys);
+
+  CBVar *_socketVar = nullptr;
+  TableVar _output{};
+
+  void cleanup() {
+    if (_socketVar) {
+      releaseVariable(_socketVar);
+      _socketVar = nullptr;
+    }
+  }
+
+  static CBTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static CBTypesInfo outputTypes() { return StatsType; }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (!_socketVar) {
+      _socketVar = referenceVariable(context, "Network.Socket");
+    }
+    if (_socketVar->valueType != CBType::Object) {
+      throw ActivationError("Network.Stats: no active socket");
+    }
+    auto socket = reinterpret_cast<SocketData *>(_socketVar->payload.objectValue);
+    auto pool = socket->pool;
+    _output["Received"] = Var(pool->receivedCount.load());
+    _output["Sent"] = Var(pool->sentCount.load());
+    _output["Dropped"] = Var(pool->droppedCount.load());
+    _output["Packets"] = Var(pool->allocated.load());
+    return _output;
+  }
+};
+
+// Register
+RUNTIME_BLOCK(Network, Stats);
+RUNTIME_BLOCK_cleanup(Stats);
+RUNTIME_BLOCK_inputTypes(Stats);
+RUNTIME_BLOCK_outputTypes(Stats);
+RUNTIME_BLOCK_activate(Stats);
+RUNTIME_BLOCK_END(Stats);
+// A reliable ordered session with one remote peer. KCP runs in stream mode
+// and messages are framed with their size, so serialized vars of any size
+// can be sent (plain KCP messages are limited to the receive window).
+// Everything here runs on the chain's thread, the segments KCP emits go
+// through the packet pool send queue and are flushed once per tick.
+struct KCPSettings {
+  bool noDelay{true};
+  int interval{10};
+  int resend{2};
+  bool noCongestion{true};
+  int window{128};
+  int mtu{1400};
+  uint32_t maxMessage{16 * 1024 * 1024};
+};
+
+struct KCPSession {
+  // the header of every KCP segment
+  static constexpr size_t Overhead = 24;
+  // IKCP_CMD_PUSH, a data segment
+  static constexpr uint8_t PushCommand = 81;
+
+  ikcpcb *kcp;
+  udp::endpoint remote;
+  PacketPool *pool;
+  uint32_t maxMessage;
+  std::chrono::steady_clock::time_point lastSeen;
+  // received stream bytes not forming a full message yet
+  std::vector<char> stream;
+  std::vector<char> chunk;
+
+  KCPSession(uint32_t conv, const udp::endpoint &remote, PacketPool *pool,
+             const KCPSettings &settings)
+      : remote(remote), pool(pool), maxMessage(settings.maxMessage),
+        lastSeen(std::chrono::steady_clock::now()) {
+    kcp = ikcp_create(conv, this);
+    ikcp_setoutput(kcp, &KCPSession::output);
+    kcp->stream = 1;
+    ikcp_nodelay(kcp, settings.noDelay ? 1 : 0, settings.interval,
+                 settings.resend, settings.noCongestion ? 1 : 0);
+    ikcp_wndsize(kcp, settings.window, settings.window);
+    ikcp_setmtu(kcp, settings.mtu);
+  }
+
+  ~KCPSession() { ikcp_release(kcp); }
+
+  KCPSession(const KCPSession &) = delete;
+  KCPSession &operator=(const KCPSession &) = delete;
+
+  static uint32_t now() {
+    using namespace std::chrono;
+    return uint32_t(
+        duration_cast<milliseconds>(steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  // segment header fields are little endian
+  static uint32_t decode32(const char *p) {
+    auto b = reinterpret_cast<const uint8_t *>(p);
+    return uint32_t(b[0]) | uint32_t(b[1]) << 8 | uint32_t(b[2]) << 16 |
+           uint32_t(b[3]) << 24;
+  }
+
+  // a new conversation can only start with its first data segment, anything
+  // else from an unknown endpoint is noise or a stale peer
+  static bool opens(const char *data, size_t size) {
+    return decode32(data) != 0 && uint8_t(data[4]) == PushCommand &&
+           decode32(data + 12) == 0 &&
+           decode32(data + 20) <= size - Overhead;
+  }
+
+  static int output(const char *buf, int len, ikcpcb *kcp, void *user) {
+    auto self = reinterpret_cast<KCPSession *>(user);
+    auto pkt = self->pool->acquire();
+    if (!pkt) {
+      // KCP will retransmit it
+      self->pool->droppedCount++;
+      return 0;
+    }
+    pkt->remote = self->remote;
+    pkt->data.assign(buf, buf + len);
+    self->pool->outgoing.push_back(pkt);
+    return 0;
+  }
+
+  void send(const char *data, size_t size) {
+    if (size > size_t(maxMessage)) {
+      throw ActivationError("Network.Send: message larger than MaxMessage");
+    }
+    const uint32_t header = uint32_t(size);
+    check(ikcp_send(kcp, reinterpret_cast<const char *>(&header),
+                    sizeof(header)));
+    // ikcp_send refuses more fragments than the default receive window
+    const size_t maxChunk = size_t(kcp->mss) * 64;
+    while (size > 0) {
+      const auto len = std::min(size, maxChunk);
+      check(ikcp_send(kcp, data, int(len)));
+      data += len;
+      size -= len;
+    }
+  }
+
+  static void check(int res) {
+    if (res < 0) {
+      CBLOG_ERROR("ikcp_send failed with error: {}", res);
+      throw ActivationError("Network.Send: KCP send failed");
+    }
+  }
+
+  void input(const char *data, size_t size) {
+    lastSeen = std::chrono::steady_clock::now();
+    ikcp_input(kcp, data, long(size));
+  }
+
+  // calls onMessage with every complete message received, false if the peer
+  // announced a message larger than maxMessage, the session is unusable then
+  template <typename OnMessage> bool receive(OnMessage onMessage) {
+    while (true) {
+      const auto size = ikcp_peeksize(kcp);
+      if (size <= 0)
+        break;
+      chunk.resize(size_t(size));
+      const auto n = ikcp_recv(kcp, chunk.data(), size);
+      if (n <= 0)
+        break;
+      stream.insert(stream.end(), chunk.data(), chunk.data() + n);
+    }
+
+    size_t offset = 0;
+    while (stream.size() - offset >= sizeof(uint32_t)) {
+      uint32_t len;
+      memcpy(&len, stream.data() + offset, sizeof(uint32_t));
+      if (len > maxMessage)
+        return false;
+      if (stream.size() - offset - sizeof(uint32_t) < len)
+        break;
+      onMessage(stream.data() + offset + sizeof(uint32_t), size_t(len));
+      offset += sizeof(uint32_t) + len;
+    }
+    stream.erase(stream.begin(), stream.begin() + offset);
+    return true;
+  }
+
+  void update(uint32_t current) { ikcp_update(kcp, current); }
+
+  bool dead() const { return kcp->state == uint32_t(-1); }
+};
+
+struct KCPBase : public NetworkBase {
+  KCPSettings _settings{};
+
+  static inline Parameters params{
+      {"Address",
+       CBCCSTR("The local bind address or the remote address."),
+       {CoreInfo::StringOrStringVar}},
+      {"Port",
+       CBCCSTR("The port to bind if server or to connect to if client."),
+       {CoreInfo::IntOrIntVar}},
+      {"Receive",
+       CBCCSTR("The flow to execute when a message is received."),
+       {CoreInfo::BlocksOrNone}},
+      {"NoDelay",
+       CBCCSTR("Retransmit early and flush acks immediately, lower latency "
+               "at the cost of some bandwidth."),
+       {CoreInfo::BoolType}},
+      {"Interval",
+       CBCCSTR("The internal update interval in milliseconds."),
+       {CoreInfo::IntType}},
+      {"Resend",
+       CBCCSTR("Fast retransmit after this many out of order acks, 0 to "
+               "disable."),
+       {CoreInfo::IntType}},
+      {"NoCongestion",
+       CBCCSTR("Disable congestion control."),
+       {CoreInfo::BoolType}},
+      {"Window",
+       CBCCSTR("The send and receive window size in packets."),
+       {CoreInfo::IntType}},
+      {"MTU",
+       CBCCSTR("The maximum size of a datagram."),
+       {CoreInfo::IntType}},
+      {"MaxMessage",
+       CBCCSTR("The largest message in bytes, a peer announcing a larger one "
+               "is dropped."),
+       {CoreInfo::IntType}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 3:
+      _settings.noDelay = value.payload.boolValue;
+      break;
+    case 4:
+      _settings.interval = int(value.payload.intValue);
+      break;
+    case 5:
+      _settings.resend = int(value.payload.intValue);
+      break;
+    case 6:
+      _settings.noCongestion = value.payload.boolValue;
+      break;
+    case 7:
+      _settings.window = int(value.payload.intValue);
+      break;
+    case 8:
+      _settings.mtu = int(value.payload.intValue);
+      break;
+    case 9:
+      _settings.maxMessage = uint32_t(std::clamp(
+          value.payload.intValue, int64_t(0),
+          int64_t(std::numeric_limits<uint32_t>::max())));
+      break;
+    default:
+      NetworkBase::setParam(index, value);
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 3:
+      return Var(_settings.noDelay);
+    case 4:
+      return Var(_settings.interval);
+    case 5:
+      return Var(_settings.resend);
+    case 6:
+      return Var(_settings.noCongestion);
+    case 7:
+      return Var(_settings.window);
+    case 8:
+      return Var(_settings.mtu);
+    case 9:
+      return Var(int64_t(_settings.maxMessage));
+    default:
+      return NetworkBase::getParam(index);
+    }
+  }
+
+  void runMessage(CBContext *context, const char *data, size_t size) {
+    Reader r(const_cast<char *>(data), size);
+    deserial.reset();
+    deserial.deserialize(r, _payload);
+    CBVar output{};
+    activateBlocks(CBVar(_blks).payload.seqValue, context, _payload, output);
+  }
+};
+
+struct KCPServer : public KCPBase {
+  static CBOptionalString help() {
+    return CBCCSTR("A reliable ordered UDP server, each remote peer gets its "
+                   "own KCP session. Network.Send within the Receive flow "
+                   "replies to the peer that sent the message.");
+  }
+
+  static inline Parameters params{
+      KCPBase::params,
+      {{"Timeout",
+        CBCCSTR("Seconds of silence after which a peer session is dropped. "
+                "Until then datagrams from the same endpoint with another "
+                "conversation id are ignored."),
+        {CoreInfo::FloatType, CoreInfo::IntType}},
+       {"MaxSessions",
+        CBCCSTR("The maximum number of peer sessions, new peers are ignored "
+                "while it's reached."),
+        {CoreInfo::IntType}}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  double _timeout{10.0};
+  size_t _maxSessions{1024};
+  std::map<udp::endpoint, std::unique_ptr<KCPSession>> _sessions;
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 10:
+      _timeout = value.valueType == Int ? double(value.payload.intValue)
+                                        : value.payload.floatValue;
+      break;
+    case 11:
+      _maxSessions = size_t(std::max(int64_t(1), value.payload.intValue));
+      break;
+    default:
+      KCPBase::setParam(index, value);
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 10:
+      return Var(_timeout);
+    case 11:
+      return Var(int64_t(_maxSessions));
+    default:
+      return KCPBase::getParam(index);
+    }
+  }
+
+  void dropSession(KCPSession *session) {
+    if (_socket.session == session) {
+      _socket.session = nullptr;
+      _socket.endpoint = nullptr;
+    }
+    const auto remote = session->remote;
+    _sessions.erase(remote);
+  }
+
+  void cleanup() {
+    // let the last segments out
+    for (auto &[_, session] : _sessions) {
+      ikcp_flush(session->kcp);
+    }
+    _socket.session = nullptr;
+    NetworkBase::cleanup();
+    _sessions.clear();
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (!_socket.socket) {
+      // first activation, let's init
+      _socket.socket = new udp::socket(
+          _io_context, udp::endpoint(udp::v4(), _port.get().payload.intValue));
+
+      // start receiving
+      boost::asio::post(_io_context, [this]() { do_receive(); });
+    }
+
+    setSocket(context);
+
+    Packet *pkt;
+    while (_pool.received.pop(pkt)) {
+      if (pkt->data.size() < KCPSession::Overhead) {
+        _pool.drop(pkt);
+        continue;
+      }
+
+      const auto conv = ikcp_getconv(pkt->data.data());
+      KCPSession *session;
+      auto it = _sessions.find(pkt->remote);
+      if (it == _sessions.end()) {
+        if (_sessions.size() >= _maxSessions ||
+            !KCPSession::opens(pkt->data.data(), pkt->data.size())) {
+          _pool.drop(pkt);
+          continue;
+        }
+        session = _sessions
+                      .emplace(pkt->remote,
+                               std::make_unique<KCPSession>(
+                                   conv, pkt->remote, &_pool, _settings))
+                      .first->second.get();
+      } else if (it->second->kcp->conv != conv) {
+        // stale or spoofed, a restarted peer gets its new session once the
+        // old one timed out
+        _pool.drop(pkt);
+        continue;
+      } else {
+        session = it->second.get();
+      }
+      session->input(pkt->data.data(), pkt->data.size());
+      _pool.release(pkt);
+
+      _socket.session = session;
+      _socket.endpoint = &session->remote;
+      if (!session->receive([&](const char *data, size_t size) {
+            runMessage(context, data, size);
+          })) {
+        CBLOG_WARNING("Network.KCPServer: dropping a peer that sent a message "
+                      "larger than MaxMessage");
+        dropSession(session);
+      }
+    }
+
+    const auto current = KCPSession::now();
+    const auto now = std::chrono::steady_clock::now();
+    for (auto it = _sessions.begin(); it != _sessions.end();) {
+      auto session = it->second.get();
+      const auto idle =
+          std::chrono::duration<double>(now - session->lastSeen).count();
+      if (session->dead() || idle > _timeout) {
+        ++it;
+        dropSession(session);
+      } else {
+        session->update(current);
+        ++it;
+      }
+    }
+
+    _pool.flush(*_socket.socket);
+
+    return input;
+  }
+};
+
+// Register
+RUNTIME_BLOCK(Network, KCPServer);
+RUNTIME_BLOCK_help(KCPServer);
+RUNTIME_BLOCK_setup(KCPServer);
+RUNTIME_BLOCK_cleanup(KCPServer);
+RUNTIME_BLOCK_warmup(KCPServer);
+RUNTIME_BLOCK_destroy(KCPServer);
+RUNTIME_BLOCK_inputTypes(KCPServer);
+RUNTIME_BLOCK_outputTypes(KCPServer);
+RUNTIME_BLOCK_parameters(KCPServer);
+RUNTIME_BLOCK_setParam(KCPServer);
+RUNTIME_BLOCK_getParam(KCPServer);
+RUNTIME_BLOCK_activate(KCPServer);
+RUNTIME_BLOCK_compose(KCPServer);
+RUNTIME_BLOCK_END(KCPServer);
+
+struct KCPClient : public KCPBase {
+  static CBOptionalString help() {
+    return CBCCSTR("A reliable ordered UDP client, Network.Send goes to the "
+                   "server through a KCP session.");
+  }
+
+  udp::endpoint _server;
+  std::unique_ptr<KCPSession> _session;
+
+  void cleanup() {
+    if (_session) {
+      ikcp_flush(_session->kcp);
+    }
+    _socket.session = nullptr;
+    NetworkBase::cleanup();
+    _session.reset();
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (!_socket.socket) {
+      // first activation, let's init
+      _socket.socket =
+          new udp::socket(_io_context, udp::endpoint(udp::v4(), 0));
+
+      boost::asio::io_service io_service;
+      udp::resolver resolver(io_service);
+      auto sport = std::to_string(_port.get().payload.intValue);
+      udp::resolver::query query(udp::v4(), _addr.get().payload.stringValue,
+                                 sport);
+      _server = *resolver.resolve(query);
+
+      // the server tells sessions apart by endpoint and conversation id, a
+      // fresh id keeps a restarted client out of its previous session
+      std::random_device rd;
+      uint32_t conv = 0;
+      while (conv == 0)
+        conv = rd();
+      _session =
+          std::make_unique<KCPSession>(conv, _server, &_pool, _settings);
+
+      // start receiving
+      boost::asio::post(_io_context, [this]() { do_receive(); });
+    }
+
+    setSocket(context);
+    // in the case of client we actually set the remote here
+    _socket.endpoint = &_server;
+    _socket.session = _session.get();
+
+    Packet *pkt;
+    while (_pool.received.pop(pkt)) {
+      if (pkt->remote == _server && pkt->data.size() >= KCPSession::Overhead) {
+        _session->input(pkt->data.data(), pkt->data.size());
+        _pool.release(pkt);
+      } else {
+        _pool.drop(pkt);
+      }
+    }
+
+    if (!_session->receive([&](const char *data, size_t size) {
+          runMessage(context, data, size);
+        })) {
+      throw ActivationError(
+          "Network.KCPClient: server sent a message larger than MaxMessage");
+    }
+
+    if (_session->dead()) {
+      throw ActivationError("Network.KCPClient: connection lost");
+    }
+
+    _session->update(KCPSession::now());
+    _pool.flush(*_socket.socket);
+
+    return input;
+  }
+};
+
+// Register
+RUNTIME_BLOCK(Network, KCPClient);
+RUNTIME_BLOCK_help(KCPClient);
+RUNTIME_BLOCK_setup(KCPClient);
+RUNTIME_BLOCK_cleanup(KCPClient);
+RUNTIME_BLOCK_warmup(KCPClient);
+RUNTIME_BLOCK_destroy(KCPClient);
+RUNTIME_BLOCK_inputTypes(KCPClient);
+RUNTIME_BLOCK_outputTypes(KCPClient);
+RUNTIME_BLOCK_parameters(KCPClient);
+RUNTIME_BLOCK_setParam(KCPClient);
+RUNTIME_BLOCK_getParam(KCPClient);
+RUNTIME_BLOCK_activate(KCPClient);
+RUNTIME_BLOCK_compose(KCPClient);
+RUNTIME_BLOCK_END(KCPClient);
 }; // namespace Network
 
 void registerNetworkBlocks() {
   REGISTER_BLOCK(Network, Server);
   REGISTER_BLOCK(Network, Client);
   REGISTER_BLOCK(Network, Send);
+  REGISTER_BLOCK(Network, Stats);
+  REGISTER_BLOCK(Network, KCPServer);
+  REGISTER_BLOCK(Network, KCPClient);
 }
 }; // namespace chainblocks
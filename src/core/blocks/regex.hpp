@@ -0,0 +1,1079 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/* Copyright © 2021 Fragcolor Pte. Ltd. */
+
+#ifndef CB_REGEX_HPP
+#define CB_REGEX_HPP
+
+// A small linear time regular expression engine for the Regex blocks.
+// Supports the regular subset of the ECMAScript syntax used by std::regex,
+// patterns are compiled once into a Thompson NFA program which is executed
+// either by a lazily built DFA (no captures needed) or by a Pike VM
+// (leftmost-first, like a backtracking engine).
+// Non regular features (backreferences, lookarounds) and captures inside
+// repetitions that could match empty or skip them (where ECMAScript iteration
+// rules differ from the VM) throw Unsupported so that callers can fall back
+// to std::regex.
+
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace chainblocks {
+namespace Regex {
+struct Unsupported : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+constexpr size_t NoPos = std::numeric_limits<size_t>::max();
+
+enum class Op : uint8_t {
+  Byte,
+  Class,
+  Split,
+  Jump,
+  Save,
+  LineStart,
+  LineEnd,
+  WordBoundary,
+  NotWordBoundary,
+  Match
+};
+
+struct Inst {
+  Op op;
+  uint8_t byte;
+  uint32_t x; // class index, first (preferred) target, save slot or match id
+  uint32_t y; // second target
+};
+
+using ByteClass = std::bitset<256>;
+
+struct Program {
+  std::vector<Inst> insts;
+  std::vector<ByteClass> classes;
+  uint32_t groups{0}; // including the whole match group 0
+  uint32_t patterns{0};
+  bool wordBoundaries{false};
+
+  uint32_t slots() const { return groups * 2; }
+};
+
+namespace detail {
+constexpr uint32_t MaxRepeat = 1000;
+constexpr size_t MaxInsts = 1 << 20;
+
+inline bool isWord(uint8_t c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+inline ByteClass digitClass() {
+  ByteClass c;
+  for (int i = '0'; i <= '9'; i++)
+    c.set(i);
+  return c;
+}
+
+inline ByteClass wordClass() {
+  ByteClass c;
+  for (int i = 0; i < 256; i++)
+    if (isWord(uint8_t(i)))
+      c.set(i);
+  return c;
+}
+
+inline ByteClass spaceClass() {
+  ByteClass c;
+  for (auto s : {' ', '\t', '\n', '\v', '\f', '\r'})
+    c.set(uint8_t(s));
+  return c;
+}
+
+inline ByteClass dotClass() {
+  ByteClass c;
+  c.set();
+  c.reset('\n');
+  c.reset('\r');
+  return c;
+}
+
+inline bool isWordBoundary(std::string_view input, size_t at) {
+  const auto before = at > 0 && isWord(uint8_t(input[at - 1]));
+  const auto after = at < input.size() && isWord(uint8_t(input[at]));
+  return before != after;
+}
+
+struct Node {
+  enum Kind {
+    Empty,
+    Byte,
+    Class,
+    Concat,
+    Alternate,
+    Repeat,
+    Group,
+    LineStart,
+    LineEnd,
+    WordBoundary,
+    NotWordBoundary
+  } kind;
+  uint8_t byte{};
+  ByteClass cls{};
+  int group{-1};
+  uint32_t min{}, max{};
+  bool unbounded{false};
+  bool greedy{true};
+  std::vector<Node> children;
+};
+
+class Parser {
+public:
+  Parser(std::string_view pattern, uint32_t &groups)
+      : _p(pattern), _groups(groups) {}
+
+  Node parse() {
+    auto node = parseAlternation();
+    if (!eof())
+      throw Unsupported("unbalanced parenthesis");
+    return node;
+  }
+
+private:
+  std::string_view _p;
+  size_t _pos{0};
+  uint32_t &_groups;
+
+  bool eof() const { return _pos >= _p.size(); }
+  char peek() const { return _p[_pos]; }
+  bool accept(char c) {
+    if (!eof() && _p[_pos] == c) {
+      _pos++;
+      return true;
+    }
+    return false;
+  }
+  char next() {
+    if (eof())
+      throw Unsupported("unexpected end of pattern");
+    return _p[_pos++];
+  }
+
+  Node parseAlternation() {
+    auto first = parseConcat();
+    if (eof() || peek() != '|')
+      return first;
+    Node alt{Node::Alternate};
+    alt.children.emplace_back(std::move(first));
+    while (accept('|')) {
+      alt.children.emplace_back(parseConcat());
+    }
+    return alt;
+  }
+
+  Node parseConcat() {
+    Node cat{Node::Concat};
+    while (!eof() && peek() != '|' && peek() != ')') {
+      auto atom = parseAtom();
+      parseQuantifier(atom);
+      cat.children.emplace_back(std::move(atom));
+    }
+    return cat;
+  }
+
+  void parseQuantifier(Node &atom) {
+    if (eof())
+      return;
+
+    uint32_t min, max = 0;
+    bool unbounded = false;
+    switch (peek()) {
+    case '*':
+      _pos++;
+      min = 0;
+      unbounded = true;
+      break;
+    case '+':
+      _pos++;
+      min = 1;
+      unbounded = true;
+      break;
+    case '?':
+      _pos++;
+      min = 0;
+      max = 1;
+      break;
+    case '{': {
+      _pos++;
+      min = parseNumber();
+      if (accept(',')) {
+        if (!eof() && peek() == '}') {
+          unbounded = true;
+        } else {
+          max = parseNumber();
+        }
+      } else {
+        max = min;
+      }
+      if (!accept('}'))
+        throw Unsupported("invalid repetition");
+      if (!unbounded && max < min)
+        throw Unsupported("invalid repetition range");
+    } break;
+    default:
+      return;
+    }
+
+    if (atom.kind == Node::LineStart || atom.kind == Node::LineEnd ||
+        atom.kind == Node::WordBoundary || atom.kind == Node::NotWordBoundary)
+      throw Unsupported("nothing to repeat");
+
+    Node rep{Node::Repeat};
+    rep.min = min;
+    rep.max = max;
+    rep.unbounded = unbounded;
+    rep.greedy = !accept('?');
+    rep.children.emplace_back(std::move(atom));
+    atom = std::move(rep);
+  }
+
+  uint32_t parseNumber() {
+    if (eof() || peek() < '0' || peek() > '9')
+      throw Unsupported("invalid repetition");
+    uint32_t n = 0;
+    while (!eof() && peek() >= '0' && peek() <= '9') {
+      n = n * 10 + uint32_t(next() - '0');
+      if (n > MaxRepeat)
+        throw Unsupported("repetition count too big");
+    }
+    return n;
+  }
+
+  Node parseAtom() {
+    const auto c = next();
+    switch (c) {
+    case '(': {
+      Node group{Node::Group};
+      if (accept('?')) {
+        if (!accept(':'))
+          throw Unsupported("lookarounds are not supported");
+      } else {
+        group.group = int(_groups++);
+      }
+      group.children.emplace_back(parseAlternation());
+      if (!accept(')'))
+        throw Unsupported("unbalanced parenthesis");
+      return group;
+    }
+    case '[':
+      return parseClass();
+    case '.': {
+      Node node{Node::Class};
+      node.cls = dotClass();
+      return node;
+    }
+    case '^':
+      return Node{Node::LineStart};
+    case '$':
+      return Node{Node::LineEnd};
+    case '\\':
+      return parseEscape();
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      throw Unsupported("nothing to repeat");
+    default: {
+      Node node{Node::Byte};
+      node.byte = uint8_t(c);
+      return node;
+    }
+    }
+  }
+
+  // shared by atoms and classes, returns true if the escape is a class
+  bool parseEscapeInto(ByteClass &cls, uint8_t &byte, bool inClass) {
+    const auto c = next();
+    switch (c) {
+    case 'd':
+      cls = digitClass();
+      return true;
+    case 'D':
+      cls = ~digitClass();
+      return true;
+    case 'w':
+      cls = wordClass();
+      return true;
+    case 'W':
+      cls = ~wordClass();
+      return true;
+    case 's':
+      cls = spaceClass();
+      return true;
+    case 'S':
+      cls = ~spaceClass();
+      return true;
+    case 'n':
+      byte = '\n';
+      return false;
+    case 't':
+      byte = '\t';
+      return false;
+    case 'r':
+      byte = '\r';
+      return false;
+    case 'f':
+      byte = '\f';
+      return false;
+    case 'v':
+      byte = '\v';
+      return false;
+    case '0':
+      byte = 0;
+      return false;
+    case 'b':
+      if (!inClass)
+        throw Unsupported("unexpected word boundary");
+      byte = '\b';
+      return false;
+    case 'x': {
+      uint8_t value = 0;
+      for (int i = 0; i < 2; i++) {
+        const auto h = next();
+        value <<= 4;
+        if (h >= '0' && h <= '9')
+          value |= uint8_t(h - '0');
+        else if (h >= 'a' && h <= 'f')
+          value |= uint8_t(h - 'a' + 10);
+        else if (h >= 'A' && h <= 'F')
+          value |= uint8_t(h - 'A' + 10);
+        else
+          throw Unsupported("invalid hex escape");
+      }
+      byte = value;
+      return false;
+    }
+    case 'u':
+    case 'c':
+      throw Unsupported("unsupported escape");
+    default:
+      if (c >= '1' && c <= '9')
+        throw Unsupported("backreferences are not supported");
+      byte = uint8_t(c);
+      return false;
+    }
+  }
+
+  Node parseEscape() {
+    if (accept('b'))
+      return Node{Node::WordBoundary};
+    if (accept('B'))
+      return Node{Node::NotWordBoundary};
+
+    Node node{Node::Byte};
+    if (parseEscapeInto(node.cls, node.byte, false))
+      node.kind = Node::Class;
+    return node;
+  }
+
+  static ByteClass posixClass(std::string_view name) {
+    ByteClass c;
+    for (int i = 0; i < 256; i++) {
+      const auto b = i;
+      bool in = false;
+      if (name == "alpha")
+        in = std::isalpha(b);
+      else if (name == "digit")
+        in = std::isdigit(b);
+      else if (name == "alnum")
+        in = std::isalnum(b);
+      else if (name == "space")
+        in = std::isspace(b);
+      else if (name == "upper")
+        in = std::isupper(b);
+      else if (name == "lower")
+        in = std::islower(b);
+      else if (name == "punct")
+        in = std::ispunct(b);
+      else if (name == "xdigit")
+        in = std::isxdigit(b);
+      else if (name == "blank")
+        in = b == ' ' || b == '\t';
+      else if (name == "cntrl")
+        in = std::iscntrl(b);
+      else if (name == "print")
+        in = std::isprint(b);
+      else if (name == "graph")
+        in = std::isgraph(b);
+      else if (name == "w")
+        in = isWord(uint8_t(b));
+      else
+        throw Unsupported("unknown character class");
+      if (b < 128 && in)
+        c.set(size_t(b));
+    }
+    return c;
+  }
+
+  // a single class member, returns true if it was a class (not a byte)
+  bool parseClassAtom(ByteClass &cls, uint8_t &byte) {
+    const auto c = next();
+    if (c == '\\') {
+      return parseEscapeInto(cls, byte, true);
+    } else if (c == '[' && !eof() && peek() == ':') {
+      _pos++;
+      const auto end = _p.find(":]", _pos);
+      if (end == std::string_view::npos)
+        throw Unsupported("unterminated character class");
+      cls = posixClass(_p.substr(_pos, end - _pos));
+      _pos = end + 2;
+      return true;
+    } else if (c == '[' && !eof() && (peek() == '.' || peek() == '=')) {
+      throw Unsupported("collating elements are not supported");
+    }
+    byte = uint8_t(c);
+    return false;
+  }
+
+  Node parseClass() {
+    Node node{Node::Class};
+    const auto negate = accept('^');
+    if (!eof() && peek() == ']')
+      throw Unsupported("empty character class");
+    while (true) {
+      if (eof())
+        throw Unsupported("unterminated character class");
+      if (accept(']'))
+        break;
+
+      ByteClass cls;
+      uint8_t lo = 0;
+      if (parseClassAtom(cls, lo)) {
+        node.cls |= cls;
+        continue;
+      }
+
+      if (_pos + 1 < _p.size() && peek() == '-' && _p[_pos + 1] != ']') {
+        _pos++;
+        uint8_t hi = 0;
+        if (parseClassAtom(cls, hi))
+          throw Unsupported("invalid class range");
+        if (hi < lo)
+          throw Unsupported("invalid class range");
+        for (int i = lo; i <= hi; i++)
+          node.cls.set(size_t(i));
+      } else {
+        node.cls.set(lo);
+      }
+    }
+    if (negate)
+      node.cls.flip();
+    return node;
+  }
+};
+
+inline bool nullable(const Node &node) {
+  switch (node.kind) {
+  case Node::Byte:
+  case Node::Class:
+    return false;
+  case Node::Concat:
+    return std::all_of(node.children.begin(), node.children.end(), nullable);
+  case Node::Alternate:
+    return std::any_of(node.children.begin(), node.children.end(), nullable);
+  case Node::Repeat:
+    return node.min == 0 || nullable(node.children[0]);
+  case Node::Group:
+    return nullable(node.children[0]);
+  default:
+    return true;
+  }
+}
+
+inline bool hasCaptures(const Node &node) {
+  if (node.kind == Node::Group && node.group >= 0)
+    return true;
+  return std::any_of(node.children.begin(), node.children.end(), hasCaptures);
+}
+
+// if a capture group might not participate in a match of the node
+inline bool hasOptionalCaptures(const Node &node) {
+  if (node.kind == Node::Alternate ||
+      (node.kind == Node::Repeat && node.min == 0))
+    return hasCaptures(node);
+  return std::any_of(node.children.begin(), node.children.end(),
+                     hasOptionalCaptures);
+}
+
+class Compiler {
+public:
+  Compiler(Program &program) : _p(program) {}
+
+  void compile(const Node &node) {
+    switch (node.kind) {
+    case Node::Empty:
+      break;
+    case Node::Byte:
+      emit({Op::Byte, node.byte, 0, 0});
+      break;
+    case Node::Class:
+      _p.classes.emplace_back(node.cls);
+      emit({Op::Class, 0, uint32_t(_p.classes.size() - 1), 0});
+      break;
+    case Node::Concat:
+      for (const auto &child : node.children)
+        compile(child);
+      break;
+    case Node::Alternate: {
+      std::vector<size_t> jumps;
+      for (size_t i = 0; i < node.children.size(); i++) {
+        if (i < node.children.size() - 1) {
+          const auto split = emit({Op::Split, 0, 0, 0});
+          _p.insts[split].x = uint32_t(split + 1);
+          compile(node.children[i]);
+          jumps.emplace_back(emit({Op::Jump, 0, 0, 0}));
+          _p.insts[split].y = uint32_t(_p.insts.size());
+        } else {
+          compile(node.children[i]);
+        }
+      }
+      for (const auto jump : jumps)
+        _p.insts[jump].x = uint32_t(_p.insts.size());
+    } break;
+    case Node::Group:
+      if (node.group >= 0)
+        emit({Op::Save, 0, uint32_t(node.group * 2), 0});
+      compile(node.children[0]);
+      if (node.group >= 0)
+        emit({Op::Save, 0, uint32_t(node.group * 2 + 1), 0});
+      break;
+    case Node::Repeat: {
+      const auto &child = node.children[0];
+      // ECMAScript rejects empty iterations and resets the captures of every
+      // iteration, the VM keeps the last ones, leave those to std::regex
+      if (_p.groups > 0 && hasCaptures(child) &&
+          (nullable(child) ||
+           ((node.unbounded || node.max > 1) && hasOptionalCaptures(child)))) {
+        throw Unsupported("captures inside a repetition");
+      }
+      for (uint32_t i = 0; i < node.min; i++)
+        compile(child);
+      if (node.unbounded) {
+        const auto split = emit({Op::Split, 0, 0, 0});
+        compile(child);
+        emit({Op::Jump, 0, uint32_t(split), 0});
+        setSplit(split, uint32_t(split + 1), uint32_t(_p.insts.size()),
+                 node.greedy);
+      } else {
+        std::vector<size_t> splits;
+        for (uint32_t i = node.min; i < node.max; i++) {
+          splits.emplace_back(emit({Op::Split, 0, 0, 0}));
+          compile(child);
+        }
+        for (const auto split : splits)
+          setSplit(split, uint32_t(split + 1), uint32_t(_p.insts.size()),
+                   node.greedy);
+      }
+    } break;
+    case Node::LineStart:
+      emit({Op::LineStart, 0, 0, 0});
+      break;
+    case Node::LineEnd:
+      emit({Op::LineEnd, 0, 0, 0});
+      break;
+    case Node::WordBoundary:
+      _p.wordBoundaries = true;
+      emit({Op::WordBoundary, 0, 0, 0});
+      break;
+    case Node::NotWordBoundary:
+      _p.wordBoundaries = true;
+      emit({Op::NotWordBoundary, 0, 0, 0});
+      break;
+    }
+  }
+
+  size_t emit(const Inst &inst) {
+    if (_p.insts.size() >= MaxInsts)
+      throw Unsupported("pattern too big");
+    _p.insts.emplace_back(inst);
+    return _p.insts.size() - 1;
+  }
+
+private:
+  Program &_p;
+
+  void setSplit(size_t split, uint32_t body, uint32_t out, bool greedy) {
+    _p.insts[split].x = greedy ? body : out;
+    _p.insts[split].y = greedy ? out : body;
+  }
+};
+} // namespace detail
+
+// Compiles a single pattern, group 0 is the whole match
+inline Program compile(std::string_view pattern) {
+  Program program;
+  program.groups = 1;
+  program.patterns = 1;
+  detail::Parser parser(pattern, program.groups);
+  const auto root = parser.parse();
+  detail::Compiler compiler(program);
+  compiler.emit({Op::Save, 0, 0, 0});
+  compiler.compile(root);
+  compiler.emit({Op::Save, 0, 1, 0});
+  compiler.emit({Op::Match, 0, 0, 0});
+  return program;
+}
+
+// Compiles many patterns in one program, each Match reports its pattern index
+// captures are not tracked
+inline Program compile(const std::vector<std::string> &patterns) {
+  if (patterns.empty())
+    throw std::invalid_argument("no patterns to compile");
+  Program program;
+  program.patterns = uint32_t(patterns.size());
+  detail::Compiler compiler(program);
+  std::vector<size_t> splits;
+  for (size_t i = 0; i < patterns.size(); i++) {
+    if (i < patterns.size() - 1)
+      splits.emplace_back(compiler.emit({Op::Split, 0, 0, 0}));
+    uint32_t groups = 0;
+    detail::Parser parser(patterns[i], groups);
+    const auto root = parser.parse();
+    compiler.compile(root);
+    compiler.emit({Op::Match, 0, uint32_t(i), 0});
+    if (i < patterns.size() - 1) {
+      program.insts[splits.back()].x = uint32_t(splits.back() + 1);
+      program.insts[splits.back()].y = uint32_t(program.insts.size());
+    }
+  }
+  return program;
+}
+
+// Thompson NFA simulation tracking submatches, linear in the input size
+class PikeVM {
+public:
+  PikeVM(const Program &program)
+      : _prog(program), _slots(program.slots()), _clist(program),
+        _nlist(program), _scratch(_slots, NoPos) {}
+
+  // searches for the leftmost-first match starting at `start`,
+  // `anchored` requires the match to begin at `start`,
+  // `full` requires it to end at the end of input,
+  // `notEmpty` rejects empty matches.
+  // slots are absolute offsets in input, NoPos if a group did not participate
+  bool exec(std::string_view input, size_t start, bool anchored, bool full,
+            std::vector<size_t> &slots, bool notEmpty = false) {
+    _clist.clear();
+    _nlist.clear();
+    auto matched = false;
+    for (size_t at = start;; at++) {
+      if (!matched && (!anchored || at == start)) {
+        std::fill(_scratch.begin(), _scratch.end(), NoPos);
+        addThread(_clist, 0, at, input, _scratch.data());
+      }
+
+      if (_clist.size == 0)
+        break;
+
+      for (size_t i = 0; i < _clist.size; i++) {
+        const auto pc = _clist.dense[i];
+        const auto &inst = _prog.insts[pc];
+        auto caps = _clist.caps(pc, _slots);
+        if (inst.op == Op::Match) {
+          if (full && at != input.size())
+            continue;
+          if (notEmpty && caps[0] == at)
+            continue;
+          slots.assign(caps, caps + _slots);
+          matched = true;
+          // lower priority threads are cut off
+          break;
+        } else if (at < input.size() && consumes(inst, uint8_t(input[at]))) {
+          addThread(_nlist, pc + 1, at + 1, input, caps);
+        }
+      }
+
+      std::swap(_clist, _nlist);
+      _nlist.clear();
+
+      if (at >= input.size())
+        break;
+    }
+    return matched;
+  }
+
+  // anchored full match of a many patterns program, collects every match id
+  bool matchAll(std::string_view input, std::vector<uint32_t> &ids) {
+    ids.clear();
+    _clist.clear();
+    _nlist.clear();
+    addThread(_clist, 0, 0, input, _scratch.data());
+    for (size_t at = 0; at < input.size() && _clist.size > 0; at++) {
+      for (size_t i = 0; i < _clist.size; i++) {
+        const auto pc = _clist.dense[i];
+        if (consumes(_prog.insts[pc], uint8_t(input[at])))
+          addThread(_nlist, pc + 1, at + 1, input, _scratch.data());
+      }
+      std::swap(_clist, _nlist);
+      _nlist.clear();
+    }
+    for (size_t i = 0; i < _clist.size; i++) {
+      const auto &inst = _prog.insts[_clist.dense[i]];
+      if (inst.op == Op::Match)
+        ids.emplace_back(inst.x);
+    }
+    std::sort(ids.begin(), ids.end());
+    return !ids.empty();
+  }
+
+private:
+  struct Threads {
+    Threads(const Program &program)
+        : dense(program.insts.size()), sparse(program.insts.size()),
+          slots(program.insts.size() * program.slots()) {}
+
+    std::vector<uint32_t> dense;
+    std::vector<uint32_t> sparse;
+    std::vector<size_t> slots;
+    size_t size{0};
+
+    bool contains(uint32_t pc) const {
+      const auto i = sparse[pc];
+      return i < size && dense[i] == pc;
+    }
+
+    void insert(uint32_t pc) {
+      sparse[pc] = uint32_t(size);
+      dense[size++] = pc;
+    }
+
+    void clear() { size = 0; }
+
+    size_t *caps(uint32_t pc, uint32_t nslots) {
+      return slots.data() + size_t(pc) * nslots;
+    }
+  };
+
+  struct Frame {
+    bool restore;
+    uint32_t index; // pc or slot
+    size_t value;
+  };
+
+  const Program &_prog;
+  uint32_t _slots;
+  Threads _clist;
+  Threads _nlist;
+  std::vector<size_t> _scratch;
+  std::vector<Frame> _stack;
+
+  bool consumes(const Inst &inst, uint8_t c) const {
+    if (inst.op == Op::Byte)
+      return inst.byte == c;
+    else if (inst.op == Op::Class)
+      return _prog.classes[inst.x][c];
+    else
+      return false;
+  }
+
+  // follows empty transitions in priority order, caps is restored on return
+  void addThread(Threads &list, uint32_t startPc, size_t at,
+                 std::string_view input, size_t *caps) {
+    _stack.push_back({false, startPc, 0});
+    while (!_stack.empty()) {
+      const auto frame = _stack.back();
+      _stack.pop_back();
+      if (frame.restore) {
+        caps[frame.index] = frame.value;
+        continue;
+      }
+
+      auto pc = frame.index;
+      while (!list.contains(pc)) {
+        list.insert(pc);
+        const auto &inst = _prog.insts[pc];
+        auto follow = true;
+        switch (inst.op) {
+        case Op::Jump:
+          pc = inst.x;
+          break;
+        case Op::Split:
+          _stack.push_back({false, inst.y, 0});
+          pc = inst.x;
+          break;
+        case Op::Save:
+          if (inst.x < _slots) {
+            _stack.push_back({true, inst.x, caps[inst.x]});
+            caps[inst.x] = at;
+          }
+          pc++;
+          break;
+        case Op::LineStart:
+          follow = at == 0;
+          pc++;
+          break;
+        case Op::LineEnd:
+          follow = at == input.size();
+          pc++;
+          break;
+        case Op::WordBoundary:
+          follow = detail::isWordBoundary(input, at);
+          pc++;
+          break;
+        case Op::NotWordBoundary:
+          follow = !detail::isWordBoundary(input, at);
+          pc++;
+          break;
+        default:
+          // a consuming or matching thread, store its captures
+          std::copy(caps, caps + _slots, list.caps(pc, _slots));
+          follow = false;
+          break;
+        }
+        if (!follow)
+          break;
+      }
+    }
+  }
+};
+
+// DFA built lazily from the program, used for anchored full matches when no
+// captures are needed. Word boundaries are not supported (see supported()).
+class LazyDFA {
+public:
+  LazyDFA(const Program &program, size_t maxStates = 2048)
+      : _prog(program), _maxStates(maxStates),
+        _marks(program.insts.size(), 0) {}
+
+  bool supported() const { return !_prog.wordBoundaries; }
+
+  // returns true if the whole input matches, ids (if given) are filled with
+  // the matching pattern indices
+  bool match(std::string_view input, std::vector<uint32_t> *ids = nullptr) {
+    auto s = start();
+    for (const auto c : input) {
+      s = next(s, uint8_t(c));
+      if (_states[s].pcs.empty())
+        break;
+    }
+    const auto &accepted = finals(s);
+    if (ids)
+      *ids = accepted;
+    return !accepted.empty();
+  }
+
+private:
+  struct State {
+    std::vector<uint32_t> pcs;
+    bool start;
+    bool finalsDone;
+    std::vector<uint32_t> finals;
+  };
+
+  const Program &_prog;
+  size_t _maxStates;
+  std::vector<State> _states;
+  std::vector<int32_t> _trans; // states * 256, -1 if not computed yet
+  std::unordered_map<std::string, int32_t> _index;
+  int32_t _start{-1};
+  std::vector<uint32_t> _marks;
+  uint32_t _generation{0};
+  std::vector<uint32_t> _stack;
+  std::vector<uint32_t> _work;
+  std::string _key;
+
+  void newGeneration() {
+    if (++_generation == 0) {
+      std::fill(_marks.begin(), _marks.end(), 0);
+      _generation = 1;
+    }
+  }
+
+  // line ends are kept pending in the set unless we are at the end
+  void closure(uint32_t pc, bool atStart, bool atEnd,
+               std::vector<uint32_t> &out) {
+    _stack.push_back(pc);
+    while (!_stack.empty()) {
+      auto current = _stack.back();
+      _stack.pop_back();
+      if (_marks[current] == _generation)
+        continue;
+      _marks[current] = _generation;
+      const auto &inst = _prog.insts[current];
+      switch (inst.op) {
+      case Op::Jump:
+        _stack.push_back(inst.x);
+        break;
+      case Op::Split:
+        _stack.push_back(inst.y);
+        _stack.push_back(inst.x);
+        break;
+      case Op::Save:
+        _stack.push_back(current + 1);
+        break;
+      case Op::LineStart:
+        if (atStart)
+          _stack.push_back(current + 1);
+        break;
+      case Op::LineEnd:
+        if (atEnd)
+          _stack.push_back(current + 1);
+        else
+          out.push_back(current);
+        break;
+      default:
+        out.push_back(current);
+        break;
+      }
+    }
+  }
+
+  int32_t intern(std::vector<uint32_t> &pcs, bool isStart) {
+    std::sort(pcs.begin(), pcs.end());
+    _key.assign(reinterpret_cast<const char *>(pcs.data()),
+                pcs.size() * sizeof(uint32_t));
+    _key.push_back(isStart ? 1 : 0);
+    auto it = _index.find(_key);
+    if (it != _index.end())
+      return it->second;
+
+    if (_states.size() >= _maxStates) {
+      // flush the cache, keeps memory bounded on adversarial patterns
+      _states.clear();
+      _trans.clear();
+      _index.clear();
+      _start = -1;
+    }
+
+    const auto id = int32_t(_states.size());
+    _states.push_back({pcs, isStart, false, {}});
+    _trans.resize(_states.size() * 256, -1);
+    _index.emplace(_key, id);
+    return id;
+  }
+
+  int32_t start() {
+    if (_start == -1) {
+      _work.clear();
+      newGeneration();
+      closure(0, true, false, _work);
+      _start = intern(_work, true);
+    }
+    return _start;
+  }
+
+  int32_t next(int32_t s, uint8_t c) {
+    const auto cached = _trans[size_t(s) * 256 + c];
+    if (cached != -1)
+      return cached;
+
+    _work.clear();
+    newGeneration();
+    for (const auto pc : _states[s].pcs) {
+      const auto &inst = _prog.insts[pc];
+      if ((inst.op == Op::Byte && inst.byte == c) ||
+          (inst.op == Op::Class && _prog.classes[inst.x][c]))
+        closure(pc + 1, false, false, _work);
+    }
+    const auto statesBefore = _states.size();
+    const auto ns = intern(_work, false);
+    // if the cache was flushed s is gone
+    if (_states.size() >= statesBefore)
+      _trans[size_t(s) * 256 + c] = ns;
+    return ns;
+  }
+
+  const std::vector<uint32_t> &finals(int32_t s) {
+    auto &state = _states[s];
+    if (!state.finalsDone) {
+      _work.clear();
+      newGeneration();
+      for (const auto pc : state.pcs) {
+        closure(pc, state.start, true, _work);
+      }
+      for (const auto pc : _work) {
+        const auto &inst = _prog.insts[pc];
+        if (inst.op == Op::Match)
+          state.finals.push_back(inst.x);
+      }
+      std::sort(state.finals.begin(), state.finals.end());
+      state.finals.erase(std::unique(state.finals.begin(), state.finals.end()),
+                         state.finals.end());
+      state.finalsDone = true;
+    }
+    return state.finals;
+  }
+};
+
+// A compiled pattern (or set of patterns) with its matching machines
+class Matcher {
+public:
+  Matcher(Program program)
+      : _prog(std::move(program)), _vm(_prog), _dfa(_prog) {}
+
+  // machines reference our program
+  Matcher(const Matcher &) = delete;
+  Matcher &operator=(const Matcher &) = delete;
+
+  const Program &program() const { return _prog; }
+
+  // the whole input must match, slots (if given) receive the groups
+  bool match(std::string_view input, std::vector<size_t> *slots = nullptr) {
+    if (_dfa.supported()) {
+      if (!_dfa.match(input))
+        return false;
+      if (!slots)
+        return true;
+      if (_prog.groups == 1) {
+        slots->assign({0, input.size()});
+        return true;
+      }
+    } else if (!slots) {
+      return _vm.exec(input, 0, true, true, _slots);
+    }
+    return _vm.exec(input, 0, true, true, *slots);
+  }
+
+  // leftmost-first match starting at `start`
+  bool search(std::string_view input, size_t start,
+              std::vector<size_t> &slots) {
+    return _vm.exec(input, start, false, false, slots);
+  }
+
+  // the match following the one in slots, iterating like
+  // std::regex_iterator: after an empty match a non-empty one is tried at
+  // the same position, then the search resumes at the next character
+  bool next(std::string_view input, std::vector<size_t> &slots) {
+    const auto end = slots[1];
+    if (slots[0] != end)
+      return _vm.exec(input, end, false, false, slots);
+    if (end >= input.size())
+      return false;
+    if (_vm.exec(input, end, true, false, slots, true))
+      return true;
+    return _vm.exec(input, end + 1, false, false, slots);
+  }
+
+  // many patterns program, ids of all the patterns matching the whole input
+  bool matchAll(std::string_view input, std::vector<uint32_t> &ids) {
+    if (_dfa.supported())
+      return _dfa.match(input, &ids);
+    return _vm.matchAll(input, ids);
+  }
+
+private:
+  Program _prog;
+  PikeVM _vm;
+  LazyDFA _dfa;
+  std::vector<size_t> _slots;
+};
+} // namespace Regex
+} // namespace chainblocks
+
+#endif
@@ -4,7 +4,10 @@
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
+#include "asyncfile.hpp"
+#include "largeimage.hpp"
 #include "shared.hpp"
+#include <array>
 #include <filesystem>
 #include <fstream>
 #include <future>
@@ -71,7 +74,8 @@ struct FileBase {
 };
 
 struct WriteFile : public FileBase {
-  std::ofstream _fileStream;
+  AsyncFile _file;
+  std::vector<uint8_t> _buffer;
   bool _append = false;
   bool _flush = false;
 
@@ -112,25 +116,22 @@ struct WriteFile : public FileBase {
   }
 
   void cleanup() {
-    if (_fileStream.good()) {
-      _fileStream.flush();
-    }
-    _fileStream = {};
+    _file.close();
     FileBase::cleanup();
   }
 
   struct Writer {
-    std::ofstream &_fileStream;
-    Writer(std::ofstream &stream) : _fileStream(stream) {}
+    std::vector<uint8_t> &_buffer;
+    Writer(std::vector<uint8_t> &buffer) : _buffer(buffer) {}
     void operator()(const uint8_t *buf, size_t size) {
-      _fileStream.write((const char *)buf, size);
+      _buffer.insert(_buffer.end(), buf, buf + size);
     }
   };
 
   Serialization serial;
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    if (!_fileStream.is_open() ||
+    if (!_file.isOpen() ||
         (_filename.isVariable() && _filename.get() != _currentFileName)) {
       std::string filename;
       if (!getFilename(context, filename, false)) {
@@ -145,18 +146,20 @@ struct WriteFile : public FileBase {
       if (!parent_path.empty() && !fs::exists(parent_path))
         fs::create_directories(p.parent_path());
 
-      if (_append)
-        _fileStream = std::ofstream(filename, std::ios::app | std::ios::binary);
-      else
-        _fileStream =
-            std::ofstream(filename, std::ios::trunc | std::ios::binary);
+      if (!_file.open(filename, _append ? AsyncFile::Mode::Append
+                                        : AsyncFile::Mode::Write)) {
+        throw ActivationError("WriteFile: failed to open file");
+      }
     }
 
-    Writer s(_fileStream);
+    // serialized in memory first, then a single write
+    _buffer.clear();
+    Writer s(_buffer);
     serial.reset();
     serial.serialize(input, s);
+    _file.write(context, _buffer.data(), _buffer.size());
     if (_flush) {
-      _fileStream.flush();
+      _file.sync(context);
     }
     return input;
   }
@@ -165,40 +168,70 @@ struct WriteFile : public FileBase {
 struct ReadFile : public FileBase {
   static CBTypesInfo inputTypes() { return CoreInfo::NoneType; }
 
-  std::ifstream _fileStream;
+  // read ahead, deserialization pulls small pieces
+  static constexpr size_t ChunkSize = 256 * 1024;
+
+  AsyncFile _file;
+  std::vector<uint8_t> _chunk;
+  size_t _chunkPos{0};
+  size_t _chunkLen{0};
+  uint64_t _fileOffset{0};
   CBVar _output{};
 
   void cleanup() {
     Serialization::varFree(_output);
-    _fileStream = {};
+    _file.close();
     FileBase::cleanup();
   }
 
+  bool refill(CBContext *context) {
+    _chunk.resize(ChunkSize);
+    _chunkPos = 0;
+    _chunkLen = _file.read(context, _chunk.data(), ChunkSize, _fileOffset);
+    _fileOffset += _chunkLen;
+    return _chunkLen > 0;
+  }
+
   struct Reader {
-    std::ifstream &_fileStream;
-    Reader(std::ifstream &stream) : _fileStream(stream) {}
+    ReadFile &_self;
+    CBContext *_context;
+    Reader(ReadFile &self, CBContext *context)
+        : _self(self), _context(context) {}
     void operator()(uint8_t *buf, size_t size) {
-      _fileStream.read((char *)buf, size);
+      while (size > 0) {
+        if (_self._chunkPos == _self._chunkLen && !_self.refill(_context)) {
+          throw ActivationError("ReadFile: unexpected end of file");
+        }
+        const auto n = std::min(size, _self._chunkLen - _self._chunkPos);
+        memcpy(buf, _self._chunk.data() + _self._chunkPos, n);
+        _self._chunkPos += n;
+        buf += n;
+        size -= n;
+      }
     }
   };
 
   Serialization serial;
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    if (!_fileStream.is_open() ||
+    if (!_file.isOpen() ||
         (_filename.isVariable() && _filename.get() != _currentFileName)) {
       std::string filename;
       if (!getFilename(context, filename)) {
         return Var::Empty;
       }
 
-      _fileStream = std::ifstream(filename, std::ios::binary);
+      if (!_file.open(filename, AsyncFile::Mode::Read)) {
+        return Var::Empty;
+      }
+      _chunkPos = _chunkLen = 0;
+      _fileOffset = 0;
     }
 
-    if (_fileStream.peek() == EOF)
+    if (_chunkPos == _chunkLen && !refill(context))
       return Var::Empty;
 
-    Reader r(_fileStream);
+    Reader r(*this, context);
     serial.reset();
     serial.deserialize(r, _output);
     return _output;
@@ -342,6 +375,13 @@ struct LoadImage : public FileBase {
         throw ActivationError("Failed to load image file");
       }
     }
+    if (x > UINT16_MAX || y > UINT16_MAX) {
+      stbi_image_free(_output.payload.imageValue.data);
+      _output = Var::Empty;
+      throw ActivationError(
+          "Image too large, use LargeImage.Load for images wider or taller "
+          "than 65535 pixels");
+    }
     _output.payload.imageValue.width = uint16_t(x);
     _output.payload.imageValue.height = uint16_t(y);
     _output.payload.imageValue.channels = uint16_t(n);
@@ -360,6 +400,756 @@ struct LoadImage : public FileBase {
   }
 };
 
+static uint8_t pngPaeth(int a, int b, int c) {
+  const int p = a + b - c;
+  const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return uint8_t(a);
+  return uint8_t(pb <= pc ? b : c);
+}
+
+// Writes a PNG a band of rows at a time. The deflate stream (fixed huffman
+// codes, hash chained matches) carries its 32KB window over from band to
+// band, so only the rows being written are ever in memory.
+class PNGStreamWriter {
+public:
+  void open(const std::string &filename, uint64_t width, uint64_t height,
+            int channels, int bitDepth) {
+    if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX)
+      throw ActivationError("Invalid PNG size");
+    static const uint8_t colorTypes[] = {0, 4, 2, 6};
+    if (channels < 1 || channels > 4)
+      throw ActivationError("PNG supports 1 to 4 channels");
+
+    _file.open(filename, std::ios::binary | std::ios::trunc);
+    if (!_file)
+      throw ActivationError("Failed to open PNG file");
+
+    _bpp = channels * bitDepth / 8;
+    _rowSize = size_t(width) * _bpp;
+    _previous.assign(_rowSize, 0);
+    _filtered.resize((_rowSize + 1) * 5);
+    _window.clear();
+    _windowStart = 0;
+    _head.assign(HashSize, -1);
+    _prev.assign(WindowSize, -1);
+    _bits = 0;
+    _bitCount = 0;
+    _adlerA = 1;
+    _adlerB = 0;
+
+    const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    _file.write((const char *)signature, sizeof(signature));
+    uint8_t header[13];
+    be32(header, uint32_t(width));
+    be32(header + 4, uint32_t(height));
+    header[8] = uint8_t(bitDepth);
+    header[9] = colorTypes[channels - 1];
+    header[10] = header[11] = header[12] = 0;
+    chunk("IHDR", header, sizeof(header));
+
+    // zlib header, 32KB window, no dictionary
+    _out.assign({0x78, 0x01});
+  }
+
+  // a row in PNG sample order (big endian if 16 bits)
+  void writeRow(const uint8_t *row) {
+    filter(row);
+    memcpy(_previous.data(), row, _rowSize);
+  }
+
+  // compresses the rows written so far into an IDAT chunk
+  void flush() {
+    deflate(false);
+    if (!_out.empty()) {
+      chunk("IDAT", _out.data(), _out.size());
+      _out.clear();
+    }
+  }
+
+  void close() {
+    deflate(true);
+    uint8_t adler[4];
+    be32(adler, (_adlerB << 16) | _adlerA);
+    _out.insert(_out.end(), adler, adler + 4);
+    chunk("IDAT", _out.data(), _out.size());
+    _out.clear();
+    chunk("IEND", nullptr, 0);
+    _file.close();
+    if (!_file)
+      throw ActivationError("Failed to write PNG file");
+  }
+
+private:
+  static constexpr size_t WindowSize = 32768;
+  static constexpr size_t HashSize = 32768;
+  static constexpr int MaxChain = 32;
+
+  std::ofstream _file;
+  size_t _bpp{0};
+  size_t _rowSize{0};
+  std::vector<uint8_t> _previous;
+  std::vector<uint8_t> _filtered;
+  // filtered rows waiting to be compressed, preceded by up to 32KB of history
+  std::vector<uint8_t> _window;
+  size_t _pending{0};
+  int64_t _windowStart{0};
+  std::vector<int64_t> _head;
+  std::vector<int64_t> _prev;
+  std::vector<uint8_t> _out;
+  uint32_t _bits{0};
+  int _bitCount{0};
+  uint32_t _adlerA{1};
+  uint32_t _adlerB{0};
+
+  static void be32(uint8_t *dst, uint32_t v) {
+    dst[0] = uint8_t(v >> 24);
+    dst[1] = uint8_t(v >> 16);
+    dst[2] = uint8_t(v >> 8);
+    dst[3] = uint8_t(v);
+  }
+
+  static uint32_t crc(uint32_t crc, const uint8_t *data, size_t len) {
+    static const auto table = [] {
+      std::array<uint32_t, 256> t{};
+      for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+          c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        t[n] = c;
+      }
+      return t;
+    }();
+    for (size_t i = 0; i < len; i++)
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+  }
+
+  void chunk(const char *type, const uint8_t *data, size_t len) {
+    uint8_t buf[4];
+    be32(buf, uint32_t(len));
+    _file.write((const char *)buf, 4);
+    _file.write(type, 4);
+    if (len)
+      _file.write((const char *)data, std::streamsize(len));
+    auto c = crc(0xFFFFFFFFu, (const uint8_t *)type, 4);
+    c = crc(c, data, len) ^ 0xFFFFFFFFu;
+    be32(buf, c);
+    _file.write((const char *)buf, 4);
+  }
+
+  // tries every PNG filter and keeps the one with the smallest sum of
+  // absolute differences, like most encoders do
+  void filter(const uint8_t *row) {
+    const auto prev = _previous.data();
+    const auto n = _rowSize;
+    size_t best = 0;
+    uint64_t bestScore = UINT64_MAX;
+    for (int type = 0; type < 5; type++) {
+      uint8_t *dst = &_filtered[type * (n + 1)];
+      dst[0] = uint8_t(type);
+      uint64_t score = 0;
+      for (size_t i = 0; i < n; i++) {
+        const int a = i >= _bpp ? row[i - _bpp] : 0;
+        const int b = prev[i];
+        const int c = i >= _bpp ? prev[i - _bpp] : 0;
+        uint8_t v;
+        switch (type) {
+        case 0:
+          v = row[i];
+          break;
+        case 1:
+          v = uint8_t(row[i] - a);
+          break;
+        case 2:
+          v = uint8_t(row[i] - b);
+          break;
+        case 3:
+          v = uint8_t(row[i] - ((a + b) >> 1));
+          break;
+        default:
+          v = uint8_t(row[i] - pngPaeth(a, b, c));
+          break;
+        }
+        dst[i + 1] = v;
+        score += uint64_t(std::abs(int(int8_t(v))));
+      }
+      if (score < bestScore) {
+        bestScore = score;
+        best = size_t(type);
+      }
+    }
+    const uint8_t *chosen = &_filtered[best * (n + 1)];
+    _window.insert(_window.end(), chosen, chosen + n + 1);
+    _pending += n + 1;
+    for (size_t i = 0; i <= n; i++) {
+      _adlerA = (_adlerA + chosen[i]) % 65521;
+      _adlerB = (_adlerB + _adlerA) % 65521;
+    }
+  }
+
+  void putBits(uint32_t value, int count) {
+    _bits |= value << _bitCount;
+    _bitCount += count;
+    while (_bitCount >= 8) {
+      _out.push_back(uint8_t(_bits));
+      _bits >>= 8;
+      _bitCount -= 8;
+    }
+  }
+
+  // huffman codes are packed most significant bit first
+  void putCode(uint32_t code, int count) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < count; i++)
+      reversed |= ((code >> i) & 1) << (count - 1 - i);
+    putBits(reversed, count);
+  }
+
+  void putSymbol(int symbol) {
+    if (symbol < 144)
+      putCode(0x30 + symbol, 8);
+    else if (symbol < 256)
+      putCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+      putCode(symbol - 256, 7);
+    else
+      putCode(0xC0 + symbol - 280, 8);
+  }
+
+  void putMatch(int length, int distance) {
+    static const int lengthBase[] = {3,  4,  5,  6,   7,   8,   9,   10,
+                                     11, 13, 15, 17,  19,  23,  27,  31,
+                                     35, 43, 51, 59,  67,  83,  99,  115,
+                                     131, 163, 195, 227, 258};
+    static const int lengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                      1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                      4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const int distBase[] = {1,    2,    3,    4,    5,     7,     9,
+                                   13,   17,   25,   33,   49,    65,    97,
+                                   129,  193,  257,  385,  513,   769,   1025,
+                                   1537, 2049, 3073, 4097, 6145,  8193,  12289,
+                                   16385, 24577};
+    static const int distExtra[] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                    4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                    9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    int l = 28;
+    while (lengthBase[l] > length)
+      l--;
+    putSymbol(257 + l);
+    putBits(uint32_t(length - lengthBase[l]), lengthExtra[l]);
+    int d = 29;
+    while (distBase[d] > distance)
+      d--;
+    putCode(uint32_t(d), 5);
+    putBits(uint32_t(distance - distBase[d]), distExtra[d]);
+  }
+
+  static uint32_t hash(const uint8_t *p) {
+    return ((uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2]) *
+            2654435761u) >>
+           17;
+  }
+
+  // one fixed huffman block with everything pending, the last one is empty
+  // and only marks the end of the stream
+  void deflate(bool final) {
+    if (_pending > 0) {
+      putBits(0, 1);
+      putBits(1, 2);
+      const auto data = _window.data();
+      const auto end = _window.size();
+      size_t i = end - _pending;
+      auto insert = [&](size_t pos) {
+        if (pos + 3 > end)
+          return;
+        const auto abs = _windowStart + int64_t(pos);
+        auto &head = _head[hash(data + pos)];
+        _prev[size_t(abs) % WindowSize] = head;
+        head = abs;
+      };
+      while (i < end) {
+        int bestLength = 0;
+        int64_t bestDistance = 0;
+        if (i + 3 <= end) {
+          const auto abs = _windowStart + int64_t(i);
+          auto candidate = _head[hash(data + i)];
+          const auto maxLength = int(std::min<size_t>(258, end - i));
+          for (int chain = 0; chain < MaxChain && candidate >= 0 &&
+                              abs - candidate <= int64_t(WindowSize);
+               chain++) {
+            const auto c = data + size_t(candidate - _windowStart);
+            int length = 0;
+            while (length < maxLength && c[length] == data[i + length])
+              length++;
+            if (length > bestLength) {
+              bestLength = length;
+              bestDistance = abs - candidate;
+              if (length == maxLength)
+                break;
+            }
+            candidate = _prev[size_t(candidate) % WindowSize];
+          }
+        }
+        if (bestLength >= 3) {
+          putMatch(bestLength, int(bestDistance));
+          for (int k = 0; k < bestLength; k++)
+            insert(i + k);
+          i += bestLength;
+        } else {
+          putSymbol(data[i]);
+          insert(i);
+          i++;
+        }
+      }
+      putSymbol(256);
+      _pending = 0;
+
+      // keep the history the next block can reference
+      if (_window.size() > WindowSize) {
+        const auto drop = _window.size() - WindowSize;
+        _window.erase(_window.begin(), _window.begin() + drop);
+        _windowStart += int64_t(drop);
+      }
+    }
+
+    if (final) {
+      putBits(1, 1);
+      putBits(1, 2);
+      putSymbol(256);
+      if (_bitCount > 0)
+        putBits(0, 8 - _bitCount);
+    }
+  }
+};
+
+// Reads a PNG a row at a time, the counterpart of PNGStreamWriter. The
+// inflate keeps only its 32KB window and the current and previous rows, so
+// the size of an image is only limited by where its pixels go. open() accepts
+// non interlaced 8 or 16 bits gray, gray alpha, RGB and RGBA images without
+// transparency chunks, other files are left to stb_image.
+class PNGStreamReader {
+public:
+  uint64_t width{0};
+  uint64_t height{0};
+  uint32_t channels{0};
+  // bits per sample, 8 or 16
+  int depth{0};
+
+  bool open(const std::string &filename) {
+    _file.open(filename, std::ios::binary);
+    if (!_file)
+      return false;
+
+    static const uint8_t signature[] = {0x89, 'P',  'N',  'G',
+                                        '\r', '\n', 0x1A, '\n'};
+    uint8_t header[13];
+    uint32_t length;
+    char type[4];
+    if (!_file.read((char *)header, sizeof(signature)) ||
+        memcmp(header, signature, sizeof(signature)) != 0)
+      return false;
+    if (!chunkHeader(length, type) || memcmp(type, "IHDR", 4) != 0 ||
+        length != sizeof(header) ||
+        !_file.read((char *)header, sizeof(header)))
+      return false;
+    _file.ignore(4);
+
+    width = be32(header);
+    height = be32(header + 4);
+    depth = header[8];
+    // compression, filter and interlace methods
+    if (width == 0 || height == 0 || header[10] != 0 || header[11] != 0 ||
+        header[12] != 0 || (depth != 8 && depth != 16))
+      return false;
+    switch (header[9]) {
+    case 0:
+      channels = 1;
+      break;
+    case 2:
+      channels = 3;
+      break;
+    case 4:
+      channels = 2;
+      break;
+    case 6:
+      channels = 4;
+      break;
+    default:
+      // palettes
+      return false;
+    }
+
+    // skip to the pixels, stb adds an alpha channel when there is a tRNS
+    for (;;) {
+      if (!chunkHeader(length, type) || memcmp(type, "IEND", 4) == 0 ||
+          memcmp(type, "tRNS", 4) == 0)
+        return false;
+      if (memcmp(type, "IDAT", 4) == 0) {
+        _chunkLeft = length;
+        return true;
+      }
+      _file.ignore(std::streamsize(length) + 4);
+    }
+  }
+
+  // calls onRow(row, y) for every row, top to bottom, with samples in PNG
+  // order (big endian if 16 bits)
+  template <typename F> void rows(F &&onRow) {
+    const size_t bpp = channels * size_t(depth) / 8;
+    const size_t rowSize = size_t(width) * bpp;
+    // the filter type byte followed by the row
+    std::vector<uint8_t> current(rowSize + 1);
+    std::vector<uint8_t> previous(rowSize + 1, 0);
+    size_t filled = 0;
+    uint64_t y = 0;
+    inflate([&](const uint8_t *data, size_t len) {
+      while (len > 0 && y < height) {
+        const auto n = std::min(len, current.size() - filled);
+        memcpy(current.data() + filled, data, n);
+        filled += n;
+        data += n;
+        len -= n;
+        if (filled == current.size()) {
+          unfilter(current.data(), previous.data() + 1, rowSize, bpp);
+          onRow(current.data() + 1, y++);
+          std::swap(current, previous);
+          filled = 0;
+        }
+      }
+      return y < height;
+    });
+    if (y < height)
+      throw ActivationError("Truncated PNG file");
+  }
+
+private:
+  static constexpr size_t WindowSize = 32768;
+  static constexpr size_t FlushSize = 65536;
+
+  struct Huffman {
+    // codes up to this length are decoded with a single lookup
+    static constexpr int FastBits = 10;
+
+    std::array<uint16_t, 16> count;
+    std::array<uint16_t, 288> symbol;
+    // length << 9 | symbol, 0 if the code is longer than FastBits
+    std::array<uint16_t, 1 << FastBits> fast;
+
+    void build(const uint8_t *lengths, int n) {
+      count.fill(0);
+      for (int i = 0; i < n; i++)
+        count[lengths[i]]++;
+      count[0] = 0;
+      int left = 1;
+      std::array<uint16_t, 16> offset{};
+      for (int len = 1; len < 16; len++) {
+        left = (left << 1) - count[len];
+        if (left < 0)
+          throw ActivationError("Invalid PNG data");
+        if (len < 15)
+          offset[len + 1] = offset[len] + count[len];
+      }
+      for (int i = 0; i < n; i++) {
+        if (lengths[i])
+          symbol[offset[lengths[i]]++] = uint16_t(i);
+      }
+
+      // canonical codes, packed least significant bit first in the stream
+      fast.fill(0);
+      uint32_t code = 0;
+      int index = 0;
+      for (int len = 1; len < 16; len++) {
+        for (int k = 0; k < count[len]; k++, code++) {
+          const auto sym = symbol[index++];
+          if (len > FastBits)
+            continue;
+          uint32_t reversed = 0;
+          for (int i = 0; i < len; i++)
+            reversed |= ((code >> i) & 1) << (len - 1 - i);
+          for (auto r = reversed; r < fast.size(); r += 1u << len)
+            fast[r] = uint16_t(len << 9 | sym);
+        }
+        code <<= 1;
+      }
+    }
+  };
+
+  std::ifstream _file;
+  uint32_t _chunkLeft{0};
+  std::vector<uint8_t> _input = std::vector<uint8_t>(FlushSize);
+  size_t _inputPos{0};
+  size_t _inputEnd{0};
+  uint64_t _bits{0};
+  int _bitCount{0};
+  std::vector<uint8_t> _window = std::vector<uint8_t>(WindowSize);
+  uint64_t _total{0};
+  std::vector<uint8_t> _out;
+  Huffman _lengths;
+  Huffman _literals;
+  Huffman _distances;
+
+  static uint32_t be32(const uint8_t *src) {
+    return uint32_t(src[0]) << 24 | uint32_t(src[1]) << 16 |
+           uint32_t(src[2]) << 8 | uint32_t(src[3]);
+  }
+
+  bool chunkHeader(uint32_t &length, char *type) {
+    uint8_t buf[4];
+    if (!_file.read((char *)buf, 4) || !_file.read(type, 4))
+      return false;
+    length = be32(buf);
+    return true;
+  }
+
+  // the next byte of the IDAT chunks, -1 after the last one
+  int nextByte() {
+    if (_inputPos == _inputEnd) {
+      while (_chunkLeft == 0) {
+        uint32_t length;
+        char type[4];
+        // crc of the previous chunk
+        _file.ignore(4);
+        if (!chunkHeader(length, type) || memcmp(type, "IDAT", 4) != 0)
+          return -1;
+        _chunkLeft = length;
+      }
+      const auto n = std::min<size_t>(_chunkLeft, _input.size());
+      if (!_file.read((char *)_input.data(), std::streamsize(n)))
+        throw ActivationError("Truncated PNG file");
+      _chunkLeft -= uint32_t(n);
+      _inputPos = 0;
+      _inputEnd = n;
+    }
+    return _input[_inputPos++];
+  }
+
+  void fill() {
+    while (_bitCount <= 56) {
+      const auto b = nextByte();
+      if (b < 0)
+        break;
+      _bits |= uint64_t(b) << _bitCount;
+      _bitCount += 8;
+    }
+  }
+
+  uint32_t bits(int n) {
+    if (_bitCount < n) {
+      fill();
+      if (_bitCount < n)
+        throw ActivationError("Truncated PNG file");
+    }
+    const auto v = uint32_t(_bits & ((uint64_t(1) << n) - 1));
+    _bits >>= n;
+    _bitCount -= n;
+    return v;
+  }
+
+  int decode(const Huffman &h) {
+    if (_bitCount < 15)
+      fill();
+    const auto entry = h.fast[_bits & ((1u << Huffman::FastBits) - 1)];
+    if (entry && int(entry >> 9) <= _bitCount) {
+      _bits >>= entry >> 9;
+      _bitCount -= entry >> 9;
+      return entry & 511;
+    }
+    // longer codes, a bit at a time
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++) {
+      code |= int(bits(1));
+      const int count = h.count[len];
+      if (code - count < first)
+        return h.symbol[index + (code - first)];
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+    throw ActivationError("Invalid PNG data");
+  }
+
+  void put(uint8_t b) {
+    _window[_total % WindowSize] = b;
+    _out.push_back(b);
+    _total++;
+  }
+
+  template <typename F> bool flush(F &onData) {
+    const auto more = onData(_out.data(), _out.size());
+    _out.clear();
+    return more;
+  }
+
+  template <typename F> bool codes(F &onData) {
+    static const uint16_t lengthBase[] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t lengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                          1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                          4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t distBase[] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const uint8_t distExtra[] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                        4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                        9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    for (;;) {
+      auto symbol = decode(_literals);
+      if (symbol < 256) {
+        put(uint8_t(symbol));
+      } else if (symbol == 256) {
+        return true;
+      } else {
+        symbol -= 257;
+        if (symbol >= 29)
+          throw ActivationError("Invalid PNG data");
+        auto length = lengthBase[symbol] + bits(lengthExtra[symbol]);
+        const auto d = decode(_distances);
+        if (d >= 30)
+          throw ActivationError("Invalid PNG data");
+        const auto distance = distBase[d] + bits(distExtra[d]);
+        if (distance > _total)
+          throw ActivationError("Invalid PNG data");
+        while (length--)
+          put(_window[(_total - distance) % WindowSize]);
+      }
+      if (_out.size() >= FlushSize && !flush(onData))
+        return false;
+    }
+  }
+
+  void dynamicTables() {
+    static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                      11, 4,  12, 3, 13, 2, 14, 1, 15};
+    const int nlen = int(bits(5)) + 257;
+    const int ndist = int(bits(5)) + 1;
+    const int ncode = int(bits(4)) + 4;
+    if (nlen > 286 || ndist > 30)
+      throw ActivationError("Invalid PNG data");
+
+    uint8_t lengths[286 + 30]{};
+    for (int i = 0; i < ncode; i++)
+      lengths[order[i]] = uint8_t(bits(3));
+    _lengths.build(lengths, 19);
+
+    int index = 0;
+    while (index < nlen + ndist) {
+      const auto symbol = decode(_lengths);
+      if (symbol < 16) {
+        lengths[index++] = uint8_t(symbol);
+        continue;
+      }
+      uint8_t length = 0;
+      uint32_t repeat;
+      if (symbol == 16) {
+        if (index == 0)
+          throw ActivationError("Invalid PNG data");
+        length = lengths[index - 1];
+        repeat = 3 + bits(2);
+      } else if (symbol == 17) {
+        repeat = 3 + bits(3);
+      } else {
+        repeat = 11 + bits(7);
+      }
+      if (index + int(repeat) > nlen + ndist)
+        throw ActivationError("Invalid PNG data");
+      while (repeat--)
+        lengths[index++] = length;
+    }
+    if (lengths[256] == 0)
+      throw ActivationError("Invalid PNG data");
+    _literals.build(lengths, nlen);
+    _distances.build(lengths + nlen, ndist);
+  }
+
+  void fixedTables() {
+    uint8_t lengths[288];
+    std::fill(lengths, lengths + 144, 8);
+    std::fill(lengths + 144, lengths + 256, 9);
+    std::fill(lengths + 256, lengths + 280, 7);
+    std::fill(lengths + 280, lengths + 288, 8);
+    _literals.build(lengths, 288);
+    std::fill(lengths, lengths + 30, 5);
+    _distances.build(lengths, 30);
+  }
+
+  // feeds onData(data, len) with the zlib stream of the IDAT chunks until it
+  // returns false or the stream is over
+  template <typename F> void inflate(F &&onData) {
+    const auto cmf = bits(8);
+    const auto flg = bits(8);
+    if ((cmf & 15) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 32))
+      throw ActivationError("Invalid PNG data");
+
+    bool last = false;
+    while (!last) {
+      last = bits(1) != 0;
+      switch (bits(2)) {
+      case 0: {
+        // stored, from the next byte boundary
+        bits(_bitCount & 7);
+        const auto length = bits(16);
+        if ((bits(16) ^ 0xFFFF) != length)
+          throw ActivationError("Invalid PNG data");
+        for (uint32_t i = 0; i < length; i++) {
+          put(uint8_t(bits(8)));
+          if (_out.size() >= FlushSize && !flush(onData))
+            return;
+        }
+      } break;
+      case 1:
+        fixedTables();
+        if (!codes(onData))
+          return;
+        break;
+      case 2:
+        dynamicTables();
+        if (!codes(onData))
+          return;
+        break;
+      default:
+        throw ActivationError("Invalid PNG data");
+      }
+    }
+    flush(onData);
+  }
+
+  static void unfilter(uint8_t *row, const uint8_t *prev, size_t n,
+                       size_t bpp) {
+    const auto type = row[0];
+    row++;
+    switch (type) {
+    case 0:
+      break;
+    case 1:
+      for (size_t i = bpp; i < n; i++)
+        row[i] = uint8_t(row[i] + row[i - bpp]);
+      break;
+    case 2:
+      for (size_t i = 0; i < n; i++)
+        row[i] = uint8_t(row[i] + prev[i]);
+      break;
+    case 3:
+      for (size_t i = 0; i < n; i++) {
+        const int a = i >= bpp ? row[i - bpp] : 0;
+        row[i] = uint8_t(row[i] + ((a + prev[i]) >> 1));
+      }
+      break;
+    case 4:
+      for (size_t i = 0; i < n; i++) {
+        const int a = i >= bpp ? row[i - bpp] : 0;
+        const int c = i >= bpp ? prev[i - bpp] : 0;
+        row[i] = uint8_t(row[i] + pngPaeth(a, prev[i], c));
+      }
+      break;
+    default:
+      throw ActivationError("Invalid PNG filter");
+    }
+  }
+};
+
 struct WritePNG : public FileBase {
   std::vector<uint8_t> _scratch;
 
@@ -451,11 +1241,198 @@ struct WritePNG : public FileBase {
   }
 };
 
+// Same as LoadImage but without the 65535 pixels limit of Image. 8 and 16
+// bits PNGs are decoded a row at a time straight into the LargeImage, other
+// files go through stb_image which decodes the whole file at once and can't
+// produce more than 2GB of pixels.
+struct LoadLargeImage : public LoadImage {
+  static CBTypesInfo outputTypes() { return LargeImage::ObjType; }
+
+  static CBOptionalString help() {
+    return CBCCSTR(
+        "Loads an image file as a LargeImage. Non interlaced PNGs with 8 or 16 "
+        "bits per channel and no palette are streamed and only limited by "
+        "memory, other files and formats must fit in 2GB once decoded.");
+  }
+
+  LargeImage *_image{nullptr};
+
+  void cleanup() {
+    if (_image) {
+      LargeImage::Var.Release(_image);
+      _image = nullptr;
+    }
+    LoadImage::cleanup();
+  }
+
+  void newImage() {
+    if (_image) {
+      LargeImage::Var.Release(_image);
+    }
+    _image = LargeImage::Var.New();
+  }
+
+  void loadPNG(PNGStreamReader &png) {
+    const uint8_t flags = _bpp == BPP::u16 ? CBIMAGE_FLAGS_16BITS_INT : 0;
+    const auto rowSize =
+        size_t(png.width) * png.channels * (_bpp == BPP::u16 ? 2 : 1);
+    if (png.width > SIZE_MAX / png.channels / 2 ||
+        png.height > SIZE_MAX / rowSize)
+      throw ActivationError("Image too large");
+
+    newImage();
+    _image->allocate(png.width, png.height, png.channels, flags);
+    const auto count = size_t(png.width) * png.channels;
+    png.rows([&](const uint8_t *src, uint64_t y) {
+      auto dst = _image->row(y);
+      if (png.depth == 8 && _bpp == BPP::u8) {
+        memcpy(dst, src, count);
+      } else if (png.depth == 8) {
+        // same expansion as stbi_load_16
+        auto dst16 = reinterpret_cast<uint16_t *>(dst);
+        for (size_t i = 0; i < count; i++)
+          dst16[i] = uint16_t(src[i] * 257);
+      } else if (_bpp == BPP::u8) {
+        // same truncation as stbi_load
+        for (size_t i = 0; i < count; i++)
+          dst[i] = src[i * 2];
+      } else {
+        auto dst16 = reinterpret_cast<uint16_t *>(dst);
+        for (size_t i = 0; i < count; i++)
+          dst16[i] = uint16_t(src[i * 2] << 8 | src[i * 2 + 1]);
+      }
+    });
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    std::string filename;
+    if (!getFilename(context, filename)) {
+      throw ActivationError("File not found!");
+    }
+
+    if (_bpp != BPP::f32) {
+      PNGStreamReader png;
+      if (png.open(filename)) {
+        loadPNG(png);
+        return LargeImage::Var.Get(_image);
+      }
+    }
+
+    int x, y, n;
+    if (!stbi_info(filename.c_str(), &x, &y, &n)) {
+      throw ActivationError("Failed to load image file");
+    }
+    const uint64_t sampleSize =
+        _bpp == BPP::u8 ? 1 : (_bpp == BPP::u16 ? 2 : 4);
+    if (uint64_t(x) * uint64_t(y) * uint64_t(n) * sampleSize >
+        uint64_t(std::numeric_limits<int>::max())) {
+      throw ActivationError(
+          "Image too large, only 8 or 16 bits non interlaced PNGs can be "
+          "loaded past 2GB of pixels");
+    }
+
+    uint8_t *data;
+    uint8_t flags = 0;
+    if (_bpp == BPP::u8) {
+      data = (uint8_t *)stbi_load(filename.c_str(), &x, &y, &n, 0);
+    } else if (_bpp == BPP::u16) {
+      data = (uint8_t *)stbi_load_16(filename.c_str(), &x, &y, &n, 0);
+      flags = CBIMAGE_FLAGS_16BITS_INT;
+    } else {
+      data = (uint8_t *)stbi_loadf(filename.c_str(), &x, &y, &n, 0);
+      flags = CBIMAGE_FLAGS_32BITS_FLOAT;
+    }
+    if (!data) {
+      throw ActivationError("Failed to load image file");
+    }
+
+    newImage();
+    _image->pixels.reset(data, stbi_image_free);
+    _image->data = data;
+    _image->width = uint64_t(x);
+    _image->height = uint64_t(y);
+    _image->channels = uint32_t(n);
+    _image->flags = flags;
+    _image->stride = _image->rowSize();
+    return LargeImage::Var.Get(_image);
+  }
+};
+
+// Streams the rows of a LargeImage into a PNG, 8 or 16 bits per channel
+struct WriteLargePNG : public FileBase {
+  static CBTypesInfo inputTypes() { return LargeImage::ObjType; }
+  static CBTypesInfo outputTypes() { return LargeImage::ObjType; }
+
+  // rows compressed and written at once
+  static constexpr uint64_t BandRows = 64;
+
+  PNGStreamWriter _writer;
+  std::vector<uint8_t> _row;
+
+  template <typename T> void prepareRow(const LargeImage &image, uint64_t y) {
+    const auto src = reinterpret_cast<const T *>(image.row(y));
+    auto dst = reinterpret_cast<T *>(_row.data());
+    const auto count = size_t(image.width) * image.channels;
+    memcpy(dst, src, count * sizeof(T));
+
+    // demultiply alpha if needed, limited to 4 channels
+    if (image.channels == 4 &&
+        (image.flags & CBIMAGE_FLAGS_PREMULTIPLIED_ALPHA) ==
+            CBIMAGE_FLAGS_PREMULTIPLIED_ALPHA) {
+      const float maxValue = float(std::numeric_limits<T>::max());
+      for (size_t i = 0; i < count; i += 4) {
+        const float fa = float(dst[i + 3]) / maxValue;
+        if (fa == 0.0f)
+          continue;
+        for (size_t k = 0; k < 3; k++)
+          dst[i + k] = T(std::min(float(dst[i + k]) / fa + 0.5f, maxValue));
+      }
+    }
+
+    // PNG samples are big endian
+    if constexpr (sizeof(T) == 2) {
+      auto bytes = _row.data();
+      for (size_t i = 0; i < count; i++)
+        std::swap(bytes[i * 2], bytes[i * 2 + 1]);
+    }
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto &image = LargeImage::from(input);
+    const auto sampleSize = image.sampleSize();
+    if (sampleSize > 2) {
+      throw ActivationError("Bits per pixel must be 8 or 16");
+    }
+
+    std::string filename;
+    if (!getFilename(context, filename, false)) {
+      throw ActivationError("Path does not exist!");
+    }
+
+    _row.resize(image.rowSize());
+    _writer.open(filename, image.width, image.height, int(image.channels),
+                 int(sampleSize * 8));
+    for (uint64_t y = 0; y < image.height; y++) {
+      if (sampleSize == 1)
+        prepareRow<uint8_t>(image, y);
+      else
+        prepareRow<uint16_t>(image, y);
+      _writer.writeRow(_row.data());
+      if ((y + 1) % BandRows == 0)
+        _writer.flush();
+    }
+    _writer.close();
+    return input;
+  }
+};
+
 void registerSerializationBlocks() {
   REGISTER_CBLOCK("WriteFile", WriteFile);
   REGISTER_CBLOCK("ReadFile", ReadFile);
   REGISTER_CBLOCK("LoadImage", LoadImage);
   REGISTER_CBLOCK("WritePNG", WritePNG);
+  REGISTER_CBLOCK("LargeImage.Load", LoadLargeImage);
+  REGISTER_CBLOCK("LargeImage.WritePNG", WriteLargePNG);
   REGISTER_CBLOCK("FromBytes", FromBytes);
   REGISTER_CBLOCK("ToBytes", ToBytes);
 }
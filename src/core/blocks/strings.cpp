@@ -2,6 +2,7 @@
 /* Copyright © 2019 Fragcolor Pte. Ltd. */
 
 #include "../../../deps/utf8.h/utf8.h"
+#include "regex.hpp"
 #include "shared.hpp"
 #include <regex>
 
@@ -11,9 +12,11 @@ struct Common {
   static inline Parameters params{
       {"Regex", CBCCSTR("The regular expression."), {CoreInfo::StringType}}};
 
-  std::regex _re;
   std::string _re_str;
-  std::string _subject;
+  // compiled once, std::regex is kept only for patterns our engine can't run
+  std::unique_ptr<Matcher> _matcher;
+  std::regex _re;
+  std::vector<size_t> _slots;
 
   static CBTypesInfo inputTypes() { return CoreInfo::StringType; }
 
@@ -23,7 +26,14 @@ struct Common {
     switch (index) {
     case 0:
       _re_str = value.payload.stringValue;
-      _re.assign(_re_str);
+      try {
+        _matcher.reset(new Matcher(compile(_re_str)));
+      } catch (const Unsupported &e) {
+        CBLOG_DEBUG("Regex: falling back to std::regex for {}, reason: {}",
+                    _re_str, e.what());
+        _matcher.reset();
+        _re.assign(_re_str);
+      }
       break;
     default:
       break;
@@ -38,6 +48,15 @@ struct Common {
       return Var::Empty;
     }
   }
+
+  static std::string_view group(std::string_view subject,
+                                const std::vector<size_t> &slots, size_t i) {
+    const auto begin = slots[i * 2];
+    const auto end = slots[i * 2 + 1];
+    if (begin == NoPos || end == NoPos)
+      return std::string_view();
+    return subject.substr(begin, end - begin);
+  }
 };
 
 struct Match : public Common {
@@ -47,19 +66,35 @@ struct Match : public Common {
   static CBTypesInfo outputTypes() { return CoreInfo::StringSeqType; }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    std::smatch match;
-    _subject.assign(input.payload.stringValue, CBSTRLEN(input));
-    if (std::regex_match(_subject, match, _re)) {
-      auto size = match.size();
-      _pool.resize(size);
-      _output.resize(size);
-      for (size_t i = 0; i < size; i++) {
-        _pool[i].assign(match[i].str());
-        _output[i] = Var(_pool[i]);
+    const auto subject = CBSTRVIEW(input);
+    if (likely(_matcher)) {
+      if (_matcher->match(subject, &_slots)) {
+        const auto size = _matcher->program().groups;
+        _pool.resize(size);
+        _output.resize(size);
+        for (size_t i = 0; i < size; i++) {
+          _pool[i].assign(group(subject, _slots, i));
+          _output[i] = Var(_pool[i]);
+        }
+      } else {
+        _pool.clear();
+        _output.clear();
       }
     } else {
-      _pool.clear();
-      _output.clear();
+      std::cmatch match;
+      if (std::regex_match(subject.data(), subject.data() + subject.size(),
+                           match, _re)) {
+        auto size = match.size();
+        _pool.resize(size);
+        _output.resize(size);
+        for (size_t i = 0; i < size; i++) {
+          _pool[i].assign(match[i].str());
+          _output[i] = Var(_pool[i]);
+        }
+      } else {
+        _pool.clear();
+        _output.clear();
+      }
     }
     return Var(CBSeq(_output));
   }
@@ -72,19 +107,37 @@ struct Search : public Common {
   static CBTypesInfo outputTypes() { return CoreInfo::StringSeqType; }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    std::smatch match;
-    _subject.assign(input.payload.stringValue, CBSTRLEN(input));
-    _pool.clear();
-    _output.clear();
-    while (std::regex_search(_subject, match, _re)) {
-      auto size = match.size();
-      for (size_t i = 0; i < size; i++) {
-        _pool.emplace_back(match[i].str());
+    const auto subject = CBSTRVIEW(input);
+    size_t count = 0;
+    const auto add = [&](std::string_view value) {
+      if (_pool.size() <= count)
+        _pool.emplace_back();
+      _pool[count++].assign(value);
+    };
+
+    if (likely(_matcher)) {
+      const auto groups = _matcher->program().groups;
+      auto found = _matcher->search(subject, 0, _slots);
+      while (found) {
+        for (size_t i = 0; i < groups; i++) {
+          add(group(subject, _slots, i));
+        }
+        found = _matcher->next(subject, _slots);
+      }
+    } else {
+      const auto end = std::cregex_iterator();
+      for (auto it = std::cregex_iterator(
+               subject.data(), subject.data() + subject.size(), _re);
+           it != end; ++it) {
+        for (size_t i = 0; i < it->size(); i++) {
+          add(std::string_view((*it)[i].first, (*it)[i].length()));
+        }
       }
-      _subject.assign(match.suffix());
     }
-    for (auto &s : _pool) {
-      _output.push_back(Var(s));
+
+    _output.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      _output[i] = Var(_pool[i]);
     }
     return Var(CBSeq(_output));
   }
@@ -92,7 +145,6 @@ struct Search : public Common {
 
 struct Replace : public Common {
   ParamVar _replacement;
-  std::string _replacementStr;
   std::string _output;
 
   static inline Parameters params{
@@ -129,15 +181,132 @@ struct Replace : public Common {
 
   void cleanup() { _replacement.cleanup(); }
 
+  // ECMAScript format rules, same as std::regex_replace
+  void format(std::string_view subject, std::string_view fmt) {
+    const auto groups = _matcher->program().groups;
+    for (size_t i = 0; i < fmt.size(); i++) {
+      const auto c = fmt[i];
+      if (c != '$' || i + 1 == fmt.size()) {
+        _output.push_back(c);
+        continue;
+      }
+
+      const auto n = fmt[++i];
+      if (n == '$') {
+        _output.push_back('$');
+      } else if (n == '&') {
+        _output.append(group(subject, _slots, 0));
+      } else if (n == '`') {
+        _output.append(subject.substr(0, _slots[0]));
+      } else if (n == '\'') {
+        _output.append(subject.substr(_slots[1]));
+      } else if (n >= '0' && n <= '9') {
+        size_t index = size_t(n - '0');
+        if (i + 1 < fmt.size() && fmt[i + 1] >= '0' && fmt[i + 1] <= '9') {
+          index = index * 10 + size_t(fmt[++i] - '0');
+        }
+        if (index < groups)
+          _output.append(group(subject, _slots, index));
+      } else {
+        _output.push_back('$');
+        _output.push_back(n);
+      }
+    }
+  }
+
   CBVar activate(CBContext *context, const CBVar &input) {
-    _subject.assign(input.payload.stringValue, CBSTRLEN(input));
-    _replacementStr.assign(_replacement.get().payload.stringValue,
-                           CBSTRLEN(_replacement.get()));
-    _output.assign(std::regex_replace(_subject, _re, _replacementStr));
+    const auto subject = CBSTRVIEW(input);
+    const auto replacement = CBSTRVIEW(_replacement.get());
+
+    if (likely(_matcher)) {
+      _output.clear();
+      size_t start = 0;
+      auto found = _matcher->search(subject, 0, _slots);
+      while (found) {
+        _output.append(subject.substr(start, _slots[0] - start));
+        format(subject, replacement);
+        start = _slots[1];
+        found = _matcher->next(subject, _slots);
+      }
+      _output.append(subject.substr(start));
+    } else {
+      _output.clear();
+      std::regex_replace(std::back_inserter(_output), subject.begin(),
+                         subject.end(), _re, std::string(replacement));
+    }
     return Var(_output);
   }
 };
 
+struct MatchSet {
+  static inline Parameters params{
+      {"Regexes",
+       CBCCSTR("The regular expressions, tested at once in a single pass."),
+       {CoreInfo::StringSeqType}}};
+
+  static CBTypesInfo inputTypes() { return CoreInfo::StringType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::IntSeqType; }
+
+  static CBOptionalString help() {
+    return CBCCSTR("Outputs the indices of the regular expressions fully "
+                   "matching the input, an empty sequence if none matches.");
+  }
+
+  static CBParametersInfo parameters() { return params; }
+
+  OwnedVar _regexes{};
+  std::unique_ptr<Matcher> _matcher;
+  std::vector<std::regex> _res;
+  std::vector<uint32_t> _ids;
+  IterableSeq _output;
+
+  void setParam(int index, const CBVar &value) {
+    _regexes = value;
+    std::vector<std::string> patterns;
+    if (value.valueType == Seq) {
+      for (auto &pattern : value) {
+        patterns.emplace_back(CBSTRVIEW(pattern));
+      }
+    }
+    _res.clear();
+    if (patterns.empty()) {
+      // nothing can match, activate outputs an empty sequence
+      _matcher.reset();
+      return;
+    }
+    try {
+      _matcher.reset(new Matcher(compile(patterns)));
+    } catch (const Unsupported &e) {
+      CBLOG_DEBUG("Regex.MatchSet: falling back to std::regex, reason: {}",
+                  e.what());
+      _matcher.reset();
+      for (auto &pattern : patterns) {
+        _res.emplace_back(pattern);
+      }
+    }
+  }
+
+  CBVar getParam(int index) { return _regexes; }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    const auto subject = CBSTRVIEW(input);
+    if (likely(_matcher)) {
+      _matcher->matchAll(subject, _ids);
+    } else {
+      _ids.clear();
+      for (size_t i = 0; i < _res.size(); i++) {
+        if (std::regex_match(subject.begin(), subject.end(), _res[i]))
+          _ids.emplace_back(uint32_t(i));
+      }
+    }
+    _output.resize(_ids.size());
+    for (size_t i = 0; i < _ids.size(); i++) {
+      _output[i] = Var(int64_t(_ids[i]));
+    }
+    return Var(CBSeq(_output));
+  }
+};
+
 struct ToUpper {
   static CBTypesInfo inputTypes() { return CoreInfo::StringType; }
   static CBTypesInfo outputTypes() { return CoreInfo::StringType; }
@@ -231,6 +400,7 @@ void registerBlocks() {
   REGISTER_CBLOCK("Regex.Replace", Replace);
   REGISTER_CBLOCK("Regex.Search", Search);
   REGISTER_CBLOCK("Regex.Match", Match);
+  REGISTER_CBLOCK("Regex.MatchSet", MatchSet);
   REGISTER_CBLOCK("String.ToUpper", ToUpper);
   REGISTER_CBLOCK("String.ToLower", ToLower);
   REGISTER_CBLOCK("ParseInt", ParseInt);
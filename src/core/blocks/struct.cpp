@@ -91,10 +91,18 @@ struct StructBase {
     String
   };
 
+  // members are compiled into specialized copy routines once, activations
+  // just run them in sequence without switching on the tags
+  using PackProc = void (*)(const CBVar &input, uint8_t *dst, size_t arrlen);
+  using UnpackProc = void (*)(const uint8_t *src, CBVar &output,
+                              size_t arrlen);
+
   struct Desc {
     size_t arrlen;
     size_t offset;
     Tags tag;
+    PackProc pack;
+    UnpackProc unpack;
   };
 
   static inline std::vector<std::regex> rexes{
@@ -117,18 +125,98 @@ struct StructBase {
 
   static inline std::regex arrlenx{"^.*\\[(\\d+)\\]$"};
 
-  static inline ParamsInfo params = ParamsInfo(ParamsInfo::Param(
-      "Definition",
-      CBCCSTR("A string defining the struct e.g. \"i32 f32 b i8[256]\"."),
-      CoreInfo::StringType));
+  static inline ParamsInfo params = ParamsInfo(
+      ParamsInfo::Param(
+          "Definition",
+          CBCCSTR("A string defining the struct e.g. \"i32 f32 b i8[256]\"."),
+          CoreInfo::StringType),
+      ParamsInfo::Param(
+          "Batch",
+          CBCCSTR("Works on a sequence of structs laid out contiguously in "
+                  "the bytes (array of structs)."),
+          CoreInfo::BoolType));
 
   static CBParametersInfo parameters() { return CBParametersInfo(params); }
 
   std::string _def;
   std::vector<Desc> _members;
-  size_t _size;
+  size_t _size{0};
+  bool _batch{false};
+
+  static void ensureType(const CBVar &input, CBType wantedType) {
+    if (input.valueType != wantedType) {
+      throw ActivationError("Expected " + type2Name(wantedType) +
+                            " instead was: " + type2Name(input.valueType));
+    }
+  }
+
+  template <typename T, CBType CBT, typename CT, CT CBVarPayload::*Value>
+  static void packOne(const CBVar &input, uint8_t *dst, size_t) {
+    ensureType(input, CBT);
+    T x = static_cast<T>(input.payload.*Value);
+    memcpy(dst, &x, sizeof(T));
+  }
+
+  template <typename T, CBType CBT, typename CT, CT CBVarPayload::*Value>
+  static void packMany(const CBVar &input, uint8_t *dst, size_t len) {
+    ensureType(input, Seq);
+    auto &seq = input.payload.seqValue;
+    if (len != (size_t)seq.len) {
+      throw ActivationError("Expected " + std::to_string(len) +
+                            " size sequence as value");
+    }
+    // validate first so that the conversion loop has no branches
+    for (size_t i = 0; i < len; i++) {
+      ensureType(seq.elements[i], CBT);
+    }
+    for (size_t i = 0; i < len; i++) {
+      T x = static_cast<T>(seq.elements[i].payload.*Value);
+      memcpy(dst + (i * sizeof(T)), &x, sizeof(T));
+    }
+  }
+
+  template <typename T, typename CT, CT CBVarPayload::*Value>
+  static void unpackOne(const uint8_t *src, CBVar &output, size_t) {
+    T x;
+    memcpy(&x, src, sizeof(T));
+    output.payload.*Value = static_cast<CT>(x);
+  }
+
+  template <typename T, typename CT, CT CBVarPayload::*Value>
+  static void unpackMany(const uint8_t *src, CBVar &output, size_t len) {
+    auto elements = output.payload.seqValue.elements;
+    for (size_t i = 0; i < len; i++) {
+      T x;
+      memcpy(&x, src + (i * sizeof(T)), sizeof(T));
+      elements[i].payload.*Value = static_cast<CT>(x);
+    }
+  }
+
+  // returns the size of the member
+  template <typename T, CBType CBT, typename CT, CT CBVarPayload::*Value>
+  static size_t compile(Desc &d, bool array) {
+    if (array) {
+      d.pack = &packMany<T, CBT, CT, Value>;
+      d.unpack = &unpackMany<T, CT, Value>;
+      return sizeof(T) * d.arrlen;
+    } else {
+      d.pack = &packOne<T, CBT, CT, Value>;
+      d.unpack = &unpackOne<T, CT, Value>;
+      return sizeof(T);
+    }
+  }
 
   void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      break;
+    case 1:
+      _batch = value.payload.boolValue;
+      return;
+    default:
+      return;
+    }
+
     _def = value.payload.stringValue;
 
     // compile members
@@ -152,54 +240,71 @@ struct StructBase {
       // store offset (using _size)
       d.offset = _size;
 
-      _members.push_back(d);
-
-      // compute size
+      const auto array = d.tag < i8;
+      size_t size = 0;
       switch (d.tag) {
       case Tags::i8Array:
-        _size += d.arrlen;
+      case Tags::i8:
+        size = compile<int8_t, Int, CBInt, &CBVarPayload::intValue>(d, array);
         break;
       case Tags::i16Array:
-        _size += 2 * d.arrlen;
+      case Tags::i16:
+        size =
+            compile<int16_t, Int, CBInt, &CBVarPayload::intValue>(d, array);
         break;
-      case Tags::f32Array:
       case Tags::i32Array:
-        _size += 4 * d.arrlen;
+      case Tags::i32:
+        size =
+            compile<int32_t, Int, CBInt, &CBVarPayload::intValue>(d, array);
         break;
-      case Tags::f64Array:
       case Tags::i64Array:
-        _size += 8 * d.arrlen;
-        break;
-      case Tags::i8:
-        _size += 1;
-        break;
-      case Tags::i16:
-        _size += 2;
+      case Tags::i64:
+        size =
+            compile<int64_t, Int, CBInt, &CBVarPayload::intValue>(d, array);
         break;
+      case Tags::f32Array:
       case Tags::f32:
-      case Tags::i32:
-        _size += 4;
+        size =
+            compile<float, Float, CBFloat, &CBVarPayload::floatValue>(d, array);
         break;
+      case Tags::f64Array:
       case Tags::f64:
-      case Tags::i64:
-        _size += 8;
+        size = compile<double, Float, CBFloat, &CBVarPayload::floatValue>(
+            d, array);
         break;
       case Tags::Bool:
-        _size += 1;
+        size = compile<bool, CBType::Bool, CBBool, &CBVarPayload::boolValue>(
+            d, false);
         break;
       case Tags::Pointer:
-        _size += sizeof(uintptr_t);
+        size = compile<uintptr_t, Int, CBInt, &CBVarPayload::intValue>(
+            d, false);
         break;
       case Tags::String:
-        _size += sizeof(uintptr_t);
+        size = compile<const char *, CBType::String, CBString,
+                       &CBVarPayload::stringValue>(d, false);
         break;
       }
 
+      // compute size
+      _size += size;
+
+      _members.push_back(d);
+
       t.next();
     }
   }
 
-  CBVar getParam(int index) { return Var(_def); }
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(_def);
+    case 1:
+      return Var(_batch);
+    default:
+      return Var::Empty;
+    }
+  }
 };
 
 struct Pack : public StructBase {
@@ -215,121 +320,36 @@ struct Pack : public StructBase {
     _storage.resize(_size);
   }
 
-  void ensureType(const CBVar &input, CBType wantedType) {
-    if (input.valueType != wantedType) {
-      throw ActivationError("Expected " + type2Name(wantedType) +
-                            " instead was: " + type2Name(input.valueType));
+  void pack(const CBSeq &seq, uint8_t *dst) {
+    if (_members.size() != (size_t)seq.len) {
+      throw ActivationError("Expected " + std::to_string(_members.size()) +
+                            " members as input.");
     }
-  }
 
-  template <typename T, typename CT> void write(const CT input, size_t offset) {
-    T x = static_cast<T>(input);
-    memcpy(&_storage.front() + offset, &x, sizeof(T));
-  }
-
-  template <typename T, CBType CBT, typename CT>
-  void writeMany(const CBSeq &input, CT CBVarPayload::*value, size_t offset,
-                 size_t len) {
-    if (len != (size_t)input.len) {
-      throw ActivationError("Expected " + std::to_string(len) +
-                            " size sequence as value");
-    }
-
-    for (size_t i = 0; i < len; i++) {
-      auto &val = input.elements[i];
-      ensureType(val, CBT);
-      write<T, decltype(val.payload.*value)>(val.payload.*value,
-                                             offset + (i * sizeof(T)));
+    for (size_t i = 0; i < _members.size(); i++) {
+      auto &member = _members[i];
+      member.pack(seq.elements[i], dst + member.offset, member.arrlen);
     }
   }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    if (_members.size() != (size_t)input.payload.seqValue.len) {
-      throw ActivationError("Expected " + std::to_string(_members.size()) +
-                            " members as input.");
-    }
-
-    auto idx = 0;
     auto &seq = input.payload.seqValue;
-    for (auto &member : _members) {
-      switch (member.tag) {
-      case Tags::i8Array:
-        ensureType(seq.elements[idx], Seq);
-        writeMany<int8_t, Int>(seq.elements[idx].payload.seqValue,
-                               &CBVarPayload::intValue, member.offset,
-                               member.arrlen);
-        break;
-      case Tags::i8:
-        ensureType(seq.elements[idx], Int);
-        write<int8_t>(seq.elements[idx].payload.intValue, member.offset);
-        break;
-      case Tags::i16Array:
-        ensureType(seq.elements[idx], Seq);
-        writeMany<int16_t, Int>(seq.elements[idx].payload.seqValue,
-                                &CBVarPayload::intValue, member.offset,
-                                member.arrlen);
-        break;
-      case Tags::i16:
-        ensureType(seq.elements[idx], Int);
-        write<int16_t>(seq.elements[idx].payload.intValue, member.offset);
-        break;
-      case Tags::i32Array:
-        ensureType(seq.elements[idx], Seq);
-        writeMany<int32_t, Int>(seq.elements[idx].payload.seqValue,
-                                &CBVarPayload::intValue, member.offset,
-                                member.arrlen);
-        break;
-      case Tags::i32:
-        ensureType(seq.elements[idx], Int);
-        write<int32_t>(seq.elements[idx].payload.intValue, member.offset);
-        break;
-      case Tags::i64Array:
-        ensureType(seq.elements[idx], Seq);
-        writeMany<int64_t, Int>(seq.elements[idx].payload.seqValue,
-                                &CBVarPayload::intValue, member.offset,
-                                member.arrlen);
-        break;
-      case Tags::i64:
-        ensureType(seq.elements[idx], Int);
-        write<int64_t>(seq.elements[idx].payload.intValue, member.offset);
-        break;
-      case Tags::f32Array:
-        ensureType(seq.elements[idx], Seq);
-        writeMany<float, Float>(seq.elements[idx].payload.seqValue,
-                                &CBVarPayload::floatValue, member.offset,
-                                member.arrlen);
-        break;
-      case Tags::f32:
-        ensureType(seq.elements[idx], Float);
-        write<float>(seq.elements[idx].payload.floatValue, member.offset);
-        break;
-      case Tags::f64Array:
-        ensureType(seq.elements[idx], Seq);
-        writeMany<double, Float>(seq.elements[idx].payload.seqValue,
-                                 &CBVarPayload::floatValue, member.offset,
-                                 member.arrlen);
-        break;
-      case Tags::f64:
-        ensureType(seq.elements[idx], Float);
-        write<double>(seq.elements[idx].payload.floatValue, member.offset);
-        break;
-      case Tags::Bool:
-        ensureType(seq.elements[idx], CBType::Bool);
-        write<bool>(seq.elements[idx].payload.boolValue, member.offset);
-        break;
-      case Tags::Pointer:
-        ensureType(seq.elements[idx], Int);
-        write<uintptr_t>(seq.elements[idx].payload.intValue, member.offset);
-        break;
-      case Tags::String:
-        ensureType(seq.elements[idx], CBType::String);
-        write<const char *>(seq.elements[idx].payload.stringValue,
-                            member.offset);
-      }
-      idx++;
+    if (!_batch) {
+      pack(seq, _storage.data());
+      return Var(_storage.data(), _size);
     }
 
-    return Var(&_storage.front(), _size);
+    const auto total = _size * size_t(seq.len);
+    if (total > UINT32_MAX) {
+      throw ActivationError("Packed batch is too large for Bytes.");
+    }
+    if (_storage.size() < total)
+      _storage.resize(total);
+    for (uint32_t i = 0; i < seq.len; i++) {
+      ensureType(seq.elements[i], Seq);
+      pack(seq.elements[i].payload.seqValue, _storage.data() + (_size * i));
+    }
+    return Var(_storage.data(), uint32_t(total));
   }
 };
 
@@ -344,47 +364,49 @@ RUNTIME_BLOCK_activate(Pack);
 RUNTIME_BLOCK_END(Pack);
 
 struct Unpack : public StructBase {
-  CBSeq _output;
+  CBSeq _output{};
+  // batch mode records, grow only
+  std::vector<CBVar> _records;
 
   static CBTypesInfo inputTypes() { return CoreInfo::BytesType; }
   static CBTypesInfo outputTypes() { return CoreInfo::AnySeqType; }
 
-  void destroy() {
-    if (_output.elements) {
-      // cleanup sub seqs
-      for (size_t i = 0; i < _members.size(); i++) {
-        if (_output.elements[i].valueType == Seq) {
-          chainblocks::arrayFree(_output.elements[i].payload.seqValue);
-        }
+  static void release(CBSeq &record) {
+    for (uint32_t i = 0; i < record.len; i++) {
+      if (record.elements[i].valueType == Seq) {
+        chainblocks::arrayFree(record.elements[i].payload.seqValue);
       }
-      chainblocks::arrayFree(_output);
     }
+    chainblocks::arrayFree(record);
   }
 
-  void setParam(int index, const CBVar &value) {
-    StructBase::setParam(index, value);
-    // now we know what size we need
-    size_t curLen = _output.len;
-    if (_members.size() < curLen) {
-      // need to destroy leftovers if arrays
-      for (size_t i = _members.size(); i < curLen; i++) {
-        if (_output.elements[i].valueType == Seq) {
-          chainblocks::arrayFree(_output.elements[i].payload.seqValue);
-        }
-      }
+  void releaseRecords() {
+    for (auto &record : _records) {
+      release(record.payload.seqValue);
     }
-    chainblocks::arrayResize(_output, _members.size());
+    _records.clear();
+  }
+
+  void destroy() {
+    release(_output);
+    releaseRecords();
+  }
+
+  // allocates a sequence shaped like our members
+  void layout(CBSeq &record) {
+    chainblocks::arrayResize(record, _members.size());
     auto idx = 0;
     for (auto &member : _members) {
-      auto &arr = _output.elements[idx].payload.seqValue;
+      auto &elem = record.elements[idx];
+      memset(&elem, 0x0, sizeof(CBVar));
+      auto &arr = elem.payload.seqValue;
       switch (member.tag) {
       case Tags::i8Array:
       case Tags::i16Array:
       case Tags::i32Array:
       case Tags::i64Array:
-        _output.elements[idx].valueType = Seq;
-        chainblocks::arrayResize(_output.elements[idx].payload.seqValue,
-                                 member.arrlen);
+        elem.valueType = Seq;
+        chainblocks::arrayResize(arr, member.arrlen);
         for (size_t i = 0; i < member.arrlen; i++) {
           arr.elements[i].valueType = Int;
         }
@@ -393,124 +415,85 @@ struct Unpack : public StructBase {
       case Tags::i16:
       case Tags::i32:
       case Tags::i64:
-        _output.elements[idx].valueType = Int;
+        elem.valueType = Int;
         break;
       case Tags::f32Array:
       case Tags::f64Array:
-        _output.elements[idx].valueType = Seq;
-        chainblocks::arrayResize(_output.elements[idx].payload.seqValue,
-                                 member.arrlen);
+        elem.valueType = Seq;
+        chainblocks::arrayResize(arr, member.arrlen);
         for (size_t i = 0; i < member.arrlen; i++) {
           arr.elements[i].valueType = Float;
         }
         break;
       case Tags::f32:
       case Tags::f64:
-        _output.elements[idx].valueType = Float;
+        elem.valueType = Float;
         break;
       case Tags::Bool:
-        _output.elements[idx].valueType = CBType::Bool;
+        elem.valueType = CBType::Bool;
         break;
       case Tags::Pointer:
-        _output.elements[idx].valueType = Int;
+        elem.valueType = Int;
         break;
       case Tags::String:
-        _output.elements[idx].valueType = CBType::String;
+        elem.valueType = CBType::String;
         break;
       }
       idx++;
     }
   }
 
-  template <typename T, typename CT>
-  void read(CT &output, const CBVar &input, size_t offset) {
-    T x;
-    memcpy(&x, input.payload.bytesValue + offset, sizeof(T));
-    output = static_cast<CT>(x);
+  void setParam(int index, const CBVar &value) {
+    StructBase::setParam(index, value);
+    // now we know what size we need
+    release(_output);
+    layout(_output);
+    releaseRecords();
+  }
+
+  void unpack(const uint8_t *src, CBSeq &record) {
+    for (size_t i = 0; i < _members.size(); i++) {
+      auto &member = _members[i];
+      member.unpack(src + member.offset, record.elements[i], member.arrlen);
+    }
   }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    auto idx = 0;
-    for (auto &member : _members) {
-      auto &arr = _output.elements[idx].payload.seqValue;
-      switch (member.tag) {
-      case Tags::i8Array:
-        for (size_t i = 0; i < member.arrlen; i++) {
-          read<int8_t>(arr.elements[i].payload.intValue, input,
-                       member.offset + i);
-        }
-        break;
-      case Tags::i8:
-        read<int8_t>(_output.elements[idx].payload.intValue, input,
-                     member.offset);
-        break;
-      case Tags::i16Array:
-        for (size_t i = 0; i < member.arrlen; i++) {
-          read<int16_t>(arr.elements[i].payload.intValue, input,
-                        member.offset + (2 * i));
-        }
-        break;
-      case Tags::i16:
-        read<int16_t>(_output.elements[idx].payload.intValue, input,
-                      member.offset);
-        break;
-      case Tags::i32Array:
-        for (size_t i = 0; i < member.arrlen; i++) {
-          read<int32_t>(arr.elements[i].payload.intValue, input,
-                        member.offset + (4 * i));
-        }
-        break;
-      case Tags::i32:
-        read<int32_t>(_output.elements[idx].payload.intValue, input,
-                      member.offset);
-        break;
-      case Tags::i64Array:
-        for (size_t i = 0; i < member.arrlen; i++) {
-          read<int64_t>(arr.elements[i].payload.intValue, input,
-                        member.offset + (8 * i));
-        }
-        break;
-      case Tags::i64:
-        read<int64_t>(_output.elements[idx].payload.intValue, input,
-                      member.offset);
-        break;
-      case Tags::f32Array:
-        for (size_t i = 0; i < member.arrlen; i++) {
-          read<float>(arr.elements[i].payload.floatValue, input,
-                      member.offset + (4 * i));
-        }
-        break;
-      case Tags::f32:
-        read<float>(_output.elements[idx].payload.floatValue, input,
-                    member.offset);
-        break;
-      case Tags::f64Array:
-        for (size_t i = 0; i < member.arrlen; i++) {
-          read<double>(arr.elements[i].payload.floatValue, input,
-                       member.offset + (8 * i));
-        }
-        break;
-      case Tags::f64:
-        read<double>(_output.elements[idx].payload.floatValue, input,
-                     member.offset);
-        break;
-      case Tags::Bool:
-        read<bool>(_output.elements[idx].payload.boolValue, input,
-                   member.offset);
-        break;
-      case Tags::Pointer:
-        read<uintptr_t>(_output.elements[idx].payload.intValue, input,
-                        member.offset);
-        break;
-      case Tags::String:
-        read<const char *>(_output.elements[idx].payload.stringValue, input,
-                           member.offset);
-        break;
+    const size_t size = input.payload.bytesSize;
+    if (!_batch) {
+      if (size < _size) {
+        throw ActivationError("Expected at least " + std::to_string(_size) +
+                              " bytes as input.");
       }
-      idx++;
+      unpack(input.payload.bytesValue, _output);
+      return Var(_output);
+    }
+
+    if (_size == 0 || size % _size != 0) {
+      throw ActivationError("Expected a multiple of " + std::to_string(_size) +
+                            " bytes as input.");
+    }
+    const auto count = size / _size;
+    if (_records.size() < count) {
+      const auto current = _records.size();
+      _records.resize(count);
+      for (size_t i = current; i < count; i++) {
+        _records[i] = CBVar{};
+        _records[i].valueType = Seq;
+        layout(_records[i].payload.seqValue);
+      }
+    }
+    for (size_t i = 0; i < count; i++) {
+      unpack(input.payload.bytesValue + (_size * i),
+             _records[i].payload.seqValue);
     }
 
-    return Var(_output);
+    CBVar res{};
+    res.valueType = Seq;
+    res.payload.seqValue.elements = count > 0 ? _records.data() : nullptr;
+    res.payload.seqValue.len = uint32_t(count);
+    res.payload.seqValue.cap = 0;
+    return res;
   }
 };
 
@@ -2,12 +2,15 @@
 /* Copyright © 2020 Fragcolor Pte. Ltd. */
 
 #include "shared.hpp"
+#include <atomic>
 #include <cstdio>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <sstream>
+#include <unordered_map>
 
 // for now a carbon copy of wasm3 simple wasi
 
@@ -962,9 +965,10 @@ M3Result m3_LinkWASI(IM3Module module) {
   setmode(fileno(stderr), O_BINARY);
 #else
 
-  // Preopen dirs
+  // Preopen dirs, once, every instance links against the same table
   for (int i = 3; i < PREOPEN_CNT; i++) {
-    preopen[i].fd = open(preopen[i].real_path, O_RDONLY);
+    if (preopen[i].fd < 0)
+      preopen[i].fd = open(preopen[i].real_path, O_RDONLY);
   }
 #endif
 
@@ -1093,6 +1097,209 @@ _catch:
     throw ActivationError(_err_);                                              \
   }
 
+// Module bytes are shared by every instance of the same file content,
+// parsed modules keep pointers into them so they must outlive the runtimes.
+struct ModuleBytes {
+  std::vector<uint8_t> data;
+  uint64_t hash;
+};
+
+class ModuleCache {
+public:
+  // stats the file every call, rereads it only if size or mtime changed
+  static std::shared_ptr<const ModuleBytes> get(const std::string &path) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    auto canonical = fs::canonical(path, ec);
+    if (ec || !fs::is_regular_file(canonical)) {
+      throw ComposeError("Wasm module not found at the given path");
+    }
+    auto mtime = fs::last_write_time(canonical, ec);
+    auto size = fs::file_size(canonical, ec);
+    if (ec) {
+      throw ComposeError("Wasm module not readable: " + ec.message());
+    }
+
+    std::unique_lock lock(_mutex);
+    auto &entry = _entries[canonical.string()];
+    if (entry.bytes && entry.mtime == mtime && entry.size == size) {
+      hits++;
+      return entry.bytes;
+    }
+    loads++;
+
+    std::ifstream wasmFile(canonical, std::ios::binary);
+    std::vector<uint8_t> data(size);
+    if (!wasmFile.read((char *)data.data(), std::streamsize(size))) {
+      throw ComposeError("Failed to read wasm module");
+    }
+    auto hash = XXH3_64bits(data.data(), data.size());
+
+    // identical content under another path shares the bytes and instances
+    auto &shared = _byHash[hash];
+    auto bytes = shared.lock();
+    if (!bytes) {
+      bytes = std::make_shared<const ModuleBytes>(
+          ModuleBytes{std::move(data), hash});
+      shared = bytes;
+    }
+    entry.mtime = mtime;
+    entry.size = size;
+    entry.bytes = bytes;
+    return bytes;
+  }
+
+  // seen by Wasm.Stats
+  static inline std::atomic<int64_t> hits{0};
+  static inline std::atomic<int64_t> loads{0};
+
+private:
+  struct Entry {
+    std::filesystem::file_time_type mtime;
+    uintmax_t size{0};
+    std::shared_ptr<const ModuleBytes> bytes;
+  };
+
+  static inline std::mutex _mutex;
+  static inline std::unordered_map<std::string, Entry> _entries;
+  static inline std::unordered_map<uint64_t, std::weak_ptr<const ModuleBytes>>
+      _byHash;
+};
+
+// A parsed, loaded and linked runtime. wasm3 compiles functions lazily into
+// the runtime, keeping instances around keeps the compiled code too.
+struct Instance {
+  std::shared_ptr<const ModuleBytes> bytes;
+  std::shared_ptr<M3Environment> env;
+  std::shared_ptr<M3Runtime> runtime;
+  IM3Module module{nullptr};
+  IM3Function mainFunc{nullptr};
+  std::string poolKey;
+
+  // linear memory and globals right after instantiation, restoring them is
+  // what makes a used instance fresh again
+  std::vector<uint8_t> memory;
+  std::vector<M3Global> globals;
+
+  Instance(const std::shared_ptr<const ModuleBytes> &moduleBytes,
+           size_t stackSize, const std::string &entryPoint, bool callCtors,
+           PlatformData *data)
+      : bytes(moduleBytes) {
+    env.reset(m3_NewEnvironment(), &m3_FreeEnvironment);
+    assert(env.get());
+    auto rt = m3_NewRuntime(env.get(), uint32_t(stackSize), data);
+    runtime.reset(rt, &m3_FreeRuntime);
+    assert(runtime.get());
+
+    M3Result err = m3_ParseModule(env.get(), &module, bytes->data.data(),
+                                  uint32_t(bytes->data.size()));
+    CHECK_COMPOSE_ERR(err);
+
+    err = m3_LoadModule(runtime.get(), module);
+    if (err != m3Err_none) {
+      // not owned by the runtime yet
+      m3_FreeModule(module);
+    }
+    CHECK_COMPOSE_ERR(err);
+
+    err = WASI::m3_LinkWASI(module);
+    CHECK_COMPOSE_ERR(err);
+
+    err = m3_LinkLibC(module);
+    CHECK_COMPOSE_ERR(err);
+
+    err = m3_FindFunction(&mainFunc, runtime.get(), entryPoint.c_str());
+    CHECK_COMPOSE_ERR(err);
+
+    if (callCtors) {
+      IM3Function ctors;
+      err = m3_FindFunction(&ctors, runtime.get(), "__wasm_call_ctors");
+      if (err == m3Err_none)
+        m3_CallArgv(ctors, 0, nullptr);
+    }
+
+    uint32_t memorySize = 0;
+    auto mem = m3_GetMemory(runtime.get(), &memorySize, 0);
+    if (mem)
+      memory.assign(mem, mem + memorySize);
+    globals.assign(module->globals, module->globals + module->numGlobals);
+  }
+
+  void attach(PlatformData *data) { runtime->userdata = data; }
+
+  void restore() {
+    uint32_t memorySize = 0;
+    auto mem = m3_GetMemory(runtime.get(), &memorySize, 0);
+    if (memorySize != memory.size()) {
+      auto err = ResizeMemory(runtime.get(),
+                              uint32_t(memory.size() / d_m3MemPageSize));
+      CHECK_ACTIVATION_ERR(err);
+      mem = m3_GetMemory(runtime.get(), &memorySize, 0);
+    }
+    if (mem)
+      memcpy(mem, memory.data(), memory.size());
+    std::copy(globals.begin(), globals.end(), module->globals);
+  }
+};
+
+// Idle instances per module content and settings, shared by every Wasm.Run.
+class InstancePool {
+public:
+  static constexpr size_t MaxIdle = 16;
+
+  static std::unique_ptr<Instance>
+  acquire(const std::shared_ptr<const ModuleBytes> &bytes, size_t stackSize,
+          const std::string &entryPoint, bool callCtors, PlatformData *data) {
+    auto k = key(bytes->hash, stackSize, entryPoint, callCtors);
+    {
+      std::unique_lock lock(_mutex);
+      auto &idle = _idle[k];
+      if (!idle.empty()) {
+        auto instance = std::move(idle.back());
+        idle.pop_back();
+        instance->attach(data);
+        reused++;
+        return instance;
+      }
+    }
+    instantiated++;
+    auto instance = std::make_unique<Instance>(bytes, stackSize, entryPoint,
+                                               callCtors, data);
+    instance->poolKey = std::move(k);
+    return instance;
+  }
+
+  static void release(std::unique_ptr<Instance> instance) {
+    // restore out of the lock, if it fails just drop the instance
+    try {
+      instance->restore();
+    } catch (...) {
+      return;
+    }
+    instance->attach(nullptr);
+    std::unique_lock lock(_mutex);
+    auto &idle = _idle[instance->poolKey];
+    if (idle.size() < MaxIdle)
+      idle.emplace_back(std::move(instance));
+  }
+
+  // seen by Wasm.Stats
+  static inline std::atomic<int64_t> instantiated{0};
+  static inline std::atomic<int64_t> reused{0};
+
+private:
+  static std::string key(uint64_t hash, size_t stackSize,
+                         const std::string &entryPoint, bool callCtors) {
+    return std::to_string(hash) + ":" + std::to_string(stackSize) + ":" +
+           entryPoint + (callCtors ? ":c" : "");
+  }
+
+  static inline std::mutex _mutex;
+  static inline std::unordered_map<std::string,
+                                   std::vector<std::unique_ptr<Instance>>>
+      _idle;
+};
+
 struct Run {
   static constexpr CBString wasmExt = ".wasm";
   static constexpr CBStrings wasmExts = {(const char **)&wasmExt, 1, 0};
@@ -1106,10 +1313,9 @@ struct Run {
   std::string _entryPoint{"_start"};
   ParamVar _arguments{};
   std::vector<const char *> _argsArray{};
-  std::vector<uint8_t> _byteCode{};
-  std::shared_ptr<M3Environment> _env;
-  std::shared_ptr<M3Runtime> _runtime;
-  IM3Function _mainFunc{nullptr};
+  std::shared_ptr<const ModuleBytes> _bytes;
+  // owned across activations only when not resetting
+  std::unique_ptr<Instance> _instance;
   PlatformData _data{};
   CachedStreamBuf _sout{};
   CachedStreamBuf _serr{};
@@ -1133,9 +1339,10 @@ struct Run {
        CBCCSTR("The stack size in kilobytes to use."),
        {CoreInfo::IntType}},
       {"ResetRuntime",
-       CBCCSTR("If the runtime should be reset every activation, altho slow "
-               "this might be useful if certain modules fail to execute "
-               "properly or leak on multiple activations."),
+       CBCCSTR("If the runtime should be reset every activation, this "
+               "restores the module memory as it was after loading, useful "
+               "if certain modules fail to execute properly or leak on "
+               "multiple activations."),
        {CoreInfo::BoolType}},
       {"CallConstructors",
        CBCCSTR("Use if it might be necessary to force a call to "
@@ -1188,61 +1395,28 @@ struct Run {
     }
   }
 
-  void loadModule() {
-    _runtime.reset();
-    _env.reset();
+  ~Run() { releaseInstance(); }
 
-    // here we load the module, that's why Module parameter is not variable
-    std::filesystem::path p(_moduleName);
-    if (!std::filesystem::exists(p)) {
-      throw ComposeError("Wasm module not found at the given path");
-    }
-
-    _moduleFileName = p.filename().string();
-
-    _env.reset(m3_NewEnvironment(), &m3_FreeEnvironment);
-    assert(_env.get());
-    auto rt = m3_NewRuntime(_env.get(), _stackSize, &_data);
-    _runtime.reset(rt, &m3_FreeRuntime);
-    assert(_runtime.get());
-    assert(m3_GetUserData(_runtime.get()));
-
-    std::ifstream wasmFile(p.string(), std::ios::binary);
-    // apparently if we use std::copy we need to make sure this is set
-    wasmFile.unsetf(std::ios::skipws);
-    _byteCode.clear();
-    std::copy(std::istream_iterator<uint8_t>(wasmFile),
-              std::istream_iterator<uint8_t>(), std::back_inserter(_byteCode));
-    IM3Module pmodule;
-    M3Result err =
-        m3_ParseModule(_env.get(), &pmodule, &_byteCode[0], _byteCode.size());
-    CHECK_COMPOSE_ERR(err);
-
-    err = m3_LoadModule(_runtime.get(), pmodule);
-    CHECK_COMPOSE_ERR(err);
-
-    err = WASI::m3_LinkWASI(pmodule);
-    CHECK_COMPOSE_ERR(err);
-
-    err = m3_LinkLibC(pmodule);
-    CHECK_COMPOSE_ERR(err);
-
-    err = m3_FindFunction(&_mainFunc, _runtime.get(), _entryPoint.c_str());
-    CHECK_COMPOSE_ERR(err);
+  void releaseInstance() {
+    if (_instance)
+      InstancePool::release(std::move(_instance));
+  }
 
-    if (_callCtors) {
-      IM3Function ctors;
-      err = m3_FindFunction(&ctors, _runtime.get(), "__wasm_call_ctors");
-      if (err == m3Err_none)
-        m3_CallArgv(ctors, 0, nullptr);
-    }
+  void loadModule() {
+    // here we load the module, that's why Module parameter is not variable
+    _bytes = ModuleCache::get(_moduleName);
+    _moduleFileName = std::filesystem::path(_moduleName).filename().string();
   }
 
   CBTypeInfo compose(const CBInstanceData &data) {
-    if (!_reset) {
-      // if we _reset, we do this at activation time
-      loadModule();
-    }
+    releaseInstance();
+    loadModule();
+    // instantiate now to report module errors early, if we _reset this goes
+    // back to the pool ready for the first activation
+    _instance = InstancePool::acquire(_bytes, _stackSize, _entryPoint,
+                                      _callCtors, &_data);
+    if (_reset)
+      releaseInstance();
     return data.inputType;
   }
 
@@ -1254,9 +1428,15 @@ struct Run {
     return awaitne(
         context,
         [&]() {
+          std::unique_ptr<Instance> pooled;
           if (_reset) {
+            // picks up file changes, otherwise a cache hit
             loadModule();
+            pooled = InstancePool::acquire(_bytes, _stackSize, _entryPoint,
+                                           _callCtors, &_data);
           }
+          DEFER(if (pooled) InstancePool::release(std::move(pooled)));
+          auto &instance = pooled ? *pooled : *_instance;
 
           // reset streams
           _sout.reset();
@@ -1298,7 +1478,8 @@ struct Run {
               }
             }
 
-            result = m3_CallArgv(_mainFunc, _argsArray.size(), &_argsArray[0]);
+            result = m3_CallArgv(instance.mainFunc, _argsArray.size(),
+                                 &_argsArray[0]);
           } else {
             // assume wasi
             _data.args.clear();
@@ -1322,7 +1503,7 @@ struct Run {
               }
             }
 
-            result = m3_CallArgv(_mainFunc, 0, nullptr);
+            result = m3_CallArgv(instance.mainFunc, 0, nullptr);
           }
 
           if (result == m3Err_trapExit) {
@@ -1340,14 +1521,14 @@ struct Run {
             _sout.done();
             CBLOG_INFO(_sout.str());
             CBLOG_ERROR(_serr.str());
-            CBLOG_ERROR(_runtime->error_message);
+            CBLOG_ERROR(instance.runtime->error_message);
             CHECK_ACTIVATION_ERR(result);
           }
 
           _serr.done();
           if (_serr.data.size() > 0) {
             // print anyway this stream too
-            CBLOG_INFO("(stderr) ", _serr.str());
+            CBLOG_INFO("(stderr) {}", _serr.str());
           }
           const auto len = _sout.data.size();
           _sout.done();
@@ -1359,7 +1540,461 @@ struct Run {
   }
 };
 
-void registerBlocks() { REGISTER_CBLOCK("Wasm.Run", Wasm::Run); }
+// Keeps one instance alive for the lifetime of the block and calls an
+// exported function with typed arguments every activation.
+// Input buffers are copied straight into the instance linear memory and
+// passed as pointer + size, Bytes and Images are read back as views of
+// that memory, valid until the next activation.
+struct Call {
+  static inline Types InputTypes{{CoreInfo::NoneType, CoreInfo::IntType,
+                                  CoreInfo::FloatType, CoreInfo::BytesType,
+                                  CoreInfo::FloatSeqType, CoreInfo::ImageType}};
+  static inline Types ArgumentsTypes{
+      {CoreInfo::NoneType, CoreInfo::AnySeqType, CoreInfo::AnyVarSeqType}};
+
+  static CBTypesInfo inputTypes() { return InputTypes; }
+  static CBTypesInfo outputTypes() { return InputTypes; }
+
+  static inline Parameters params{
+      {"Module",
+       CBCCSTR("The wasm module to instantiate, the instance lives as long as "
+               "this block."),
+       {Run::WasmFilePath, CoreInfo::StringType}},
+      {"Function",
+       CBCCSTR("The exported function to call. Int and Float inputs are "
+               "passed as one argument, Bytes as (pointer, size), Floats as "
+               "(pointer, count) of 32 bits floats and Images as (pointer, "
+               "width, height, channels). If the function returns a value "
+               "that is the output, otherwise the input buffer is read back "
+               "from the module memory."),
+       {CoreInfo::StringType}},
+      {"Arguments",
+       CBCCSTR("Int or Float arguments passed after the input ones."),
+       {ArgumentsTypes}},
+      {"Allocator",
+       CBCCSTR("The exported function reserving input buffers in the module "
+               "memory, it takes a size in bytes and returns a pointer. "
+               "Buffers are reused and only reallocated when growing, "
+               "releasing the old one with `free` if exported."),
+       {CoreInfo::StringType}},
+      {"StackSize",
+       CBCCSTR("The stack size in kilobytes to use."),
+       {CoreInfo::IntType}},
+      {"CallConstructors",
+       CBCCSTR("If `__wasm_call_ctors` should be called once after "
+               "instantiation."),
+       {CoreInfo::BoolType}}};
+  static CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _moduleName = value.payload.stringValue;
+      break;
+    case 1:
+      _function = value.payload.stringValue;
+      break;
+    case 2:
+      _arguments = value;
+      break;
+    case 3:
+      _allocatorName = value.payload.stringValue;
+      break;
+    case 4:
+      _stackSize = size_t(value.payload.intValue * 1024);
+      break;
+    case 5:
+      _callCtors = value.payload.boolValue;
+      break;
+    default:
+      throw InvalidParameterIndex();
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(_moduleName);
+    case 1:
+      return Var(_function);
+    case 2:
+      return _arguments;
+    case 3:
+      return Var(_allocatorName);
+    case 4:
+      return Var(int64_t(_stackSize) / 1024);
+    case 5:
+      return Var(_callCtors);
+    default:
+      throw InvalidParameterIndex();
+    }
+  }
+
+  std::string _moduleName;
+  std::string _function;
+  ParamVar _arguments{};
+  std::string _allocatorName{"malloc"};
+  size_t _stackSize{1024 * 1024};
+  bool _callCtors{false};
+
+  std::unique_ptr<Instance> _instance;
+  IM3Function _allocator{nullptr};
+  IM3Function _free{nullptr};
+  // the guest buffer holding the input, reused across activations
+  uint32_t _bufferPtr{0};
+  uint32_t _bufferCapacity{0};
+  // wasm3 takes pointers to the raw argument values
+  std::vector<uint64_t> _argValues;
+  std::vector<const void *> _argPtrs;
+  std::vector<CBVar> _floats;
+  PlatformData _data{};
+  CachedStreamBuf _sout{};
+  CachedStreamBuf _serr{};
+  std::ostream _soutStream{&_sout};
+  std::ostream _serrStream{&_serr};
+  StringStreamBuf _sinbuf{std::string_view()};
+  std::istream _sinStream{&_sinbuf};
+
+  ~Call() { releaseInstance(); }
+
+  void releaseInstance() {
+    if (_instance)
+      InstancePool::release(std::move(_instance));
+    _allocator = nullptr;
+    _free = nullptr;
+    _bufferPtr = 0;
+    _bufferCapacity = 0;
+  }
+
+  static uint32_t inputArgsCount(CBType type) {
+    switch (type) {
+    case CBType::None:
+      return 0;
+    case CBType::Bytes:
+    case CBType::Seq:
+      return 2;
+    case CBType::Image:
+      return 4;
+    default:
+      return 1;
+    }
+  }
+
+  static size_t imageSize(const CBImage &image) {
+    size_t pixsize = 1;
+    if ((image.flags & CBIMAGE_FLAGS_16BITS_INT) == CBIMAGE_FLAGS_16BITS_INT)
+      pixsize = 2;
+    else if ((image.flags & CBIMAGE_FLAGS_32BITS_FLOAT) ==
+             CBIMAGE_FLAGS_32BITS_FLOAT)
+      pixsize = 4;
+    return size_t(image.width) * size_t(image.height) *
+           size_t(image.channels) * pixsize;
+  }
+
+  CBTypeInfo compose(const CBInstanceData &data) {
+    releaseInstance();
+    if (_function.empty()) {
+      throw ComposeError("Wasm.Call requires a Function");
+    }
+    auto bytes = ModuleCache::get(_moduleName);
+    _instance = InstancePool::acquire(bytes, _stackSize, _function,
+                                      _callCtors, &_data);
+
+    auto func = _instance->mainFunc;
+    if (!_arguments.isVariable()) {
+      auto expected = inputArgsCount(data.inputType.basicType);
+      if (_arguments->valueType == Seq)
+        expected += _arguments->payload.seqValue.len;
+      if (m3_GetArgCount(func) != expected) {
+        throw ComposeError("Wasm.Call: " + _function + " takes " +
+                           std::to_string(m3_GetArgCount(func)) +
+                           " arguments but input and Arguments provide " +
+                           std::to_string(expected));
+      }
+    }
+
+    if (data.inputType.basicType == CBType::Bytes ||
+        data.inputType.basicType == CBType::Seq ||
+        data.inputType.basicType == CBType::Image) {
+      auto err =
+          m3_FindFunction(&_allocator, _instance->runtime.get(),
+                          _allocatorName.c_str());
+      if (err != m3Err_none) {
+        throw ComposeError("Wasm.Call: buffer inputs need the module to "
+                           "export " +
+                           _allocatorName);
+      }
+      if (m3_FindFunction(&_free, _instance->runtime.get(), "free") !=
+          m3Err_none)
+        _free = nullptr;
+    }
+
+    if (m3_GetRetCount(func) == 0)
+      return data.inputType;
+
+    switch (m3_GetRetType(func, 0)) {
+    case c_m3Type_i32:
+    case c_m3Type_i64:
+      return CoreInfo::IntType;
+    case c_m3Type_f32:
+    case c_m3Type_f64:
+      return CoreInfo::FloatType;
+    default:
+      throw ComposeError("Wasm.Call: unsupported return type");
+    }
+  }
+
+  void warmup(CBContext *context) {
+    _arguments.warmup(context);
+    _data.sin = &_sinStream;
+    _data.sout = &_soutStream;
+    _data.serr = &_serrStream;
+  }
+
+  void cleanup() { _arguments.cleanup(); }
+
+  uint8_t *memory(uint32_t &size) {
+    return m3_GetMemory(_instance->runtime.get(), &size, 0);
+  }
+
+  uint32_t reserveBuffer(size_t size) {
+    if (size > UINT32_MAX)
+      throw ActivationError("Wasm.Call: input too large");
+    if (size <= _bufferCapacity)
+      return _bufferPtr;
+
+    auto capacity = std::max(uint32_t(size), _bufferCapacity * 2);
+    const void *args[] = {&capacity};
+    M3Result err;
+    if (_free && _bufferPtr) {
+      const void *freeArgs[] = {&_bufferPtr};
+      err = m3_Call(_free, 1, freeArgs);
+      CHECK_ACTIVATION_ERR(err);
+    }
+    err = m3_Call(_allocator, 1, args);
+    CHECK_ACTIVATION_ERR(err);
+    uint32_t ptr = 0;
+    const void *rets[] = {&ptr};
+    err = m3_GetResults(_allocator, 1, rets);
+    CHECK_ACTIVATION_ERR(err);
+    if (ptr == 0) {
+      _bufferCapacity = 0;
+      throw ActivationError("Wasm.Call: module allocator failed");
+    }
+    _bufferPtr = ptr;
+    _bufferCapacity = capacity;
+    return ptr;
+  }
+
+  // copies the input into the module memory, returns the guest pointer
+  uint8_t *writeBuffer(const void *data, size_t size, uint32_t &ptr) {
+    ptr = reserveBuffer(size);
+    uint32_t memSize = 0;
+    // allocating might have grown (moved) the memory
+    auto mem = memory(memSize);
+    if (!mem || size_t(ptr) + size > memSize)
+      throw ActivationError("Wasm.Call: allocator returned an invalid buffer");
+    if (data)
+      memcpy(mem + ptr, data, size);
+    return mem + ptr;
+  }
+
+  void pushArg(const CBVar &value) {
+    auto index = uint32_t(_argPtrs.size());
+    if (index >= m3_GetArgCount(_instance->mainFunc))
+      throw ActivationError("Wasm.Call: too many arguments");
+    uint64_t slot = 0;
+    auto type = m3_GetArgType(_instance->mainFunc, index);
+    const bool isFloat = value.valueType == Float;
+    if (!isFloat && value.valueType != Int)
+      throw ActivationError("Wasm.Call: arguments must be Int or Float");
+    switch (type) {
+    case c_m3Type_i32: {
+      int32_t v = isFloat ? int32_t(value.payload.floatValue)
+                          : int32_t(value.payload.intValue);
+      memcpy(&slot, &v, sizeof(v));
+    } break;
+    case c_m3Type_i64: {
+      int64_t v = isFloat ? int64_t(value.payload.floatValue)
+                          : value.payload.intValue;
+      memcpy(&slot, &v, sizeof(v));
+    } break;
+    case c_m3Type_f32: {
+      float v = isFloat ? float(value.payload.floatValue)
+                        : float(value.payload.intValue);
+      memcpy(&slot, &v, sizeof(v));
+    } break;
+    case c_m3Type_f64: {
+      double v =
+          isFloat ? value.payload.floatValue : double(value.payload.intValue);
+      memcpy(&slot, &v, sizeof(v));
+    } break;
+    default:
+      throw ActivationError("Wasm.Call: unsupported argument type");
+    }
+    _argValues[index] = slot;
+    _argPtrs.emplace_back(&_argValues[index]);
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    auto func = _instance->mainFunc;
+    const auto argc = m3_GetArgCount(func);
+    // sized upfront, _argPtrs point into it
+    _argValues.resize(argc);
+    _argPtrs.clear();
+
+    uint32_t ptr = 0;
+    switch (input.valueType) {
+    case Int:
+    case Float:
+      pushArg(input);
+      break;
+    case Bytes:
+      writeBuffer(input.payload.bytesValue, input.payload.bytesSize, ptr);
+      pushArg(Var(int64_t(ptr)));
+      pushArg(Var(int64_t(input.payload.bytesSize)));
+      break;
+    case Seq: {
+      const auto len = input.payload.seqValue.len;
+      auto floats =
+          (float *)writeBuffer(nullptr, size_t(len) * sizeof(float), ptr);
+      for (uint32_t i = 0; i < len; i++) {
+        float f = float(input.payload.seqValue.elements[i].payload.floatValue);
+        memcpy(&floats[i], &f, sizeof(float));
+      }
+      pushArg(Var(int64_t(ptr)));
+      pushArg(Var(int64_t(len)));
+    } break;
+    case Image: {
+      auto &image = input.payload.imageValue;
+      writeBuffer(image.data, imageSize(image), ptr);
+      pushArg(Var(int64_t(ptr)));
+      pushArg(Var(int64_t(image.width)));
+      pushArg(Var(int64_t(image.height)));
+      pushArg(Var(int64_t(image.channels)));
+    } break;
+    default:
+      break;
+    }
+
+    auto &args = _arguments.get();
+    if (args.valueType == Seq) {
+      for (auto &arg : args) {
+        pushArg(arg);
+      }
+    }
+
+    if (_argPtrs.size() != argc) {
+      throw ActivationError("Wasm.Call: " + _function + " takes " +
+                            std::to_string(argc) + " arguments, got " +
+                            std::to_string(_argPtrs.size()));
+    }
+
+    _sout.reset();
+    _serr.reset();
+    auto result = m3_Call(func, argc, _argPtrs.data());
+    if (_sout.data.size() > 0) {
+      _sout.done();
+      CBLOG_INFO(_sout.str());
+    }
+    if (_serr.data.size() > 0) {
+      _serr.done();
+      CBLOG_INFO("(stderr) {}", _serr.str());
+    }
+    if (result) {
+      CBLOG_ERROR(_instance->runtime->error_message);
+      CHECK_ACTIVATION_ERR(result);
+    }
+
+    if (m3_GetRetCount(func) > 0) {
+      uint64_t ret = 0;
+      const void *rets[] = {&ret};
+      result = m3_GetResults(func, 1, rets);
+      CHECK_ACTIVATION_ERR(result);
+      switch (m3_GetRetType(func, 0)) {
+      case c_m3Type_i32: {
+        int32_t v;
+        memcpy(&v, &ret, sizeof(v));
+        return Var(int64_t(v));
+      }
+      case c_m3Type_i64: {
+        int64_t v;
+        memcpy(&v, &ret, sizeof(v));
+        return Var(v);
+      }
+      case c_m3Type_f32: {
+        float v;
+        memcpy(&v, &ret, sizeof(v));
+        return Var(double(v));
+      }
+      default: {
+        double v;
+        memcpy(&v, &ret, sizeof(v));
+        return Var(v);
+      }
+      }
+    }
+
+    // no return value, read the buffer back, the call might have moved memory
+    uint32_t memSize = 0;
+    auto mem = memory(memSize);
+    switch (input.valueType) {
+    case Bytes:
+      return Var(mem + ptr, input.payload.bytesSize);
+    case Seq: {
+      const auto len = input.payload.seqValue.len;
+      _floats.resize(len);
+      for (uint32_t i = 0; i < len; i++) {
+        float f;
+        memcpy(&f, mem + ptr + i * sizeof(float), sizeof(float));
+        _floats[i] = Var(double(f));
+      }
+      return Var(_floats);
+    }
+    case Image: {
+      CBVar output = input;
+      output.payload.imageValue.data = mem + ptr;
+      return output;
+    }
+    default:
+      return input;
+    }
+  }
+};
+
+struct Stats {
+  static inline Types StatsTypes{{CoreInfo::IntType, CoreInfo::IntType,
+                                  CoreInfo::IntType, CoreInfo::IntType}};
+  static inline std::array<CBString, 4> StatsKeys{
+      "ModuleHits", "ModuleLoads", "Instantiated", "Reused"};
+  static inline Type StatsType = Type::TableOf(StatsTypes, StatsKeys);
+
+  static CBOptionalString help() {
+    return CBCCSTR("The module cache and instance pool counters of this "
+                   "process: modules found unchanged in the cache, modules "
+                   "read from disk, runtimes instantiated and runtimes taken "
+                   "back from the pool.");
+  }
+
+  static CBTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static CBTypesInfo outputTypes() { return StatsType; }
+
+  TableVar _output{};
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    _output["ModuleHits"] = Var(ModuleCache::hits.load());
+    _output["ModuleLoads"] = Var(ModuleCache::loads.load());
+    _output["Instantiated"] = Var(InstancePool::instantiated.load());
+    _output["Reused"] = Var(InstancePool::reused.load());
+    return _output;
+  }
+};
+
+void registerBlocks() {
+  REGISTER_CBLOCK("Wasm.Run", Wasm::Run);
+  REGISTER_CBLOCK("Wasm.Call", Wasm::Call);
+  REGISTER_CBLOCK("Wasm.Stats", Wasm::Stats);
+}
 
 } // namespace Wasm
 } // namespace chainblocks
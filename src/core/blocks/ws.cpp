@@ -17,7 +17,10 @@ namespace net = boost::asio;            // from <boost/asio.hpp>
 namespace ssl = boost::asio::ssl;       // from <boost/asio/ssl.hpp>
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 
+#include "http.hpp"
 #include "shared.hpp"
+#include <deque>
+#include <list>
 
 namespace chainblocks {
 namespace WS {
@@ -30,50 +33,337 @@ struct Common {
 
   static inline Type WebSocketVar{
       {CBType::ContextVar, {.contextVarTypes = WebSocket}}};
+
+  // the variable handler chains of a WebSocket.Server get their peer in
+  static constexpr const char *ServerSocketName = "WebSocket.Server.Socket";
 };
 
-struct Socket {
-  net::io_context ioCtx{};
-  ssl::context secureCtx{ssl::context::tlsv12_client};
-  websocket::stream<beast::ssl_stream<tcp::socket>> socket{ioCtx, secureCtx};
+struct Socket;
+
+// The io_context driving every websocket of a node (and thread), the blocks
+// poll it during their activation so no thread is ever blocked on I/O
+struct IO {
+  // declared first so it outlives the streams owned by pending handlers
+  ssl::context sslCtx{ssl::context::tlsv12_client};
+  net::io_context ioc;
+  // sockets waiting for the close handshake, owned here so their owners can
+  // move on, see Socket::close
+  std::list<std::shared_ptr<Socket>> closing;
+
+  ~IO();
+
+  // runs ready handlers without blocking, poll stops the context when it runs
+  // out of work so it's restarted first
+  void poll();
+
+  static std::shared_ptr<IO> get(const CBNode *node) {
+    return Http::perNodeThread<IO>(node);
+  }
+};
+
+struct Message {
+  std::string data;
+  bool binary{false};
+};
+
+// A websocket connection, either connected as client or accepted by a
+// server. Incoming messages are read continuously into the inbox (so control
+// frames are always answered) and outgoing ones are queued and written one
+// after the other without ever blocking the writer.
+struct Socket : public std::enable_shared_from_this<Socket> {
+  using PlainStream = websocket::stream<beast::tcp_stream>;
+  using SecureStream = websocket::stream<beast::ssl_stream<beast::tcp_stream>>;
+
+  // writers suspend when that many messages are still queued
+  static constexpr size_t MaxQueued = 1024;
+
+  std::shared_ptr<IO> io;
+  std::unique_ptr<PlainStream> plain;
+  std::unique_ptr<SecureStream> secure;
+  std::unique_ptr<tcp::resolver> resolver;
+
+  std::deque<Message> inbox;
+  std::deque<Message> outbox;
+  beast::flat_buffer readBuffer;
+  bool writing{false};
+  bool connected{false};
+  bool closed{false};
+  bool closing{false};
+  beast::error_code error;
+
+  Socket(std::shared_ptr<IO> io) : io(io) {}
+
+  template <typename F> void with(F f) {
+    if (secure)
+      f(*secure);
+    else
+      f(*plain);
+  }
 
+  void fail(beast::error_code ec) {
+    if (!closed) {
+      closed = true;
+      error = ec;
+    }
+  }
+
+  void setDeflate(bool enable, beast::role_type role) {
+    if (!enable)
+      return;
+    websocket::permessage_deflate pmd;
+    if (role == beast::role_type::client)
+      pmd.client_enable = true;
+    else
+      pmd.server_enable = true;
+    with([&](auto &ws) { ws.set_option(pmd); });
+  }
+
+  void connect(const std::string &host, const std::string &port,
+               const std::string &target, bool secured, bool deflate) {
+    resolver.reset(new tcp::resolver(io->ioc));
+    if (secured)
+      secure.reset(new SecureStream(io->ioc, io->sslCtx));
+    else
+      plain.reset(new PlainStream(io->ioc));
+    setDeflate(deflate, beast::role_type::client);
+
+    resolver->async_resolve(
+        host, port,
+        [self = shared_from_this(), host,
+         target](beast::error_code ec, tcp::resolver::results_type results) {
+          if (ec)
+            return self->fail(ec);
+
+          CBLOG_TRACE("Websocket resolved remote host");
+
+          self->with([&](auto &ws) {
+            auto &layer = beast::get_lowest_layer(ws);
+            layer.expires_after(std::chrono::seconds(30));
+            layer.async_connect(results, [self, host, target](
+                                             beast::error_code ec,
+                                             tcp::endpoint ep) {
+              if (ec)
+                return self->fail(ec);
+
+              CBLOG_TRACE("Websocket connected with the remote host");
+
+              auto h = host + ':' + std::to_string(ep.port());
+              if (self->secure) {
+                auto &stream = self->secure->next_layer();
+                // SNI
+                if (!SSL_set_tlsext_host_name(stream.native_handle(),
+                                              host.c_str())) {
+                  return self->fail(
+                      beast::error_code(int(::ERR_get_error()),
+                                        net::error::get_ssl_category()));
+                }
+                stream.async_handshake(
+                    ssl::stream_base::client,
+                    [self, h, target](beast::error_code ec) {
+                      if (ec)
+                        return self->fail(ec);
+                      CBLOG_TRACE("Websocket performed SSL handshake");
+                      self->handshake(h, target);
+                    });
+              } else {
+                self->handshake(h, target);
+              }
+            });
+          });
+        });
+  }
+
+  void handshake(const std::string &host, const std::string &target) {
+    with([&](auto &ws) {
+      // the websocket stream has its own timeouts
+      beast::get_lowest_layer(ws).expires_never();
+
+      // Set a decorator to change the User-Agent of the handshake
+      ws.set_option(
+          websocket::stream_base::decorator([](websocket::request_type &req) {
+            req.set(http::field::user_agent,
+                    std::string(BOOST_BEAST_VERSION_STRING) +
+                        " websocket-client-async");
+          }));
+
+      websocket::stream_base::timeout timeouts{
+          std::chrono::seconds(30), // handshake timeout
+          std::chrono::seconds(30), // idle timeout
+          true                      // send ping at half idle timeout
+      };
+      ws.set_option(timeouts);
+
+      CBLOG_DEBUG("WebSocket handshake with: {}", host);
+
+      ws.async_handshake(host, target,
+                         [self = shared_from_this()](beast::error_code ec) {
+                           if (ec)
+                             return self->fail(ec);
+                           CBLOG_TRACE("Websocket performed handshake");
+                           self->connected = true;
+                           self->read();
+                         });
+    });
+  }
+
+  // server side, takes an accepted connection
+  void accept(tcp::socket &&socket, bool deflate) {
+    plain.reset(new PlainStream(std::move(socket)));
+    setDeflate(deflate, beast::role_type::server);
+    plain->set_option(websocket::stream_base::timeout::suggested(
+        beast::role_type::server));
+    plain->async_accept([self = shared_from_this()](beast::error_code ec) {
+      if (ec)
+        return self->fail(ec);
+      self->connected = true;
+      self->read();
+    });
+  }
+
+  void read() {
+    with([&](auto &ws) {
+      ws.async_read(readBuffer, [self = shared_from_this()](
+                                    beast::error_code ec, std::size_t) {
+        if (ec)
+          return self->fail(ec);
+        bool binary = false;
+        self->with([&](auto &ws) { binary = ws.got_binary(); });
+        self->inbox.push_back(
+            Message{beast::buffers_to_string(self->readBuffer.data()), binary});
+        self->readBuffer.consume(self->readBuffer.size());
+        self->read();
+      });
+    });
+  }
+
+  void write(std::string &&data, bool binary) {
+    outbox.push_back(Message{std::move(data), binary});
+    if (!writing)
+      writeNext();
+  }
+
+  // one frame per queued message, messages are never merged as that would
+  // change what the remote reads, a write only waits for the previous one
+  void writeNext() {
+    if (outbox.empty() || closed) {
+      writing = false;
+      return;
+    }
+
+    writing = true;
+    with([&](auto &ws) {
+      auto &msg = outbox.front();
+      ws.binary(msg.binary);
+      ws.async_write(net::buffer(msg.data),
+                     [self = shared_from_this()](beast::error_code ec,
+                                                 std::size_t) {
+                       if (ec) {
+                         self->writing = false;
+                         return self->fail(ec);
+                       }
+                       self->outbox.pop_front();
+                       self->writeNext();
+                     });
+    });
+  }
+
+  // graceful close, the close handshake runs in the background and the
+  // socket is handed to the io which drops the connection once it's done or
+  // late, so the caller never waits for the remote
   void close() {
-    if (socket.is_open()) {
+    if (closing)
+      return;
+    closing = true;
+
+    if (resolver)
+      resolver->cancel();
+
+    if (connected && !closed) {
       CBLOG_DEBUG("Closing WebSocket");
-      try {
-        socket.close(websocket::close_code::normal);
-      } catch (const std::exception &ex) {
-        CBLOG_WARNING("Ignored an exception during WebSocket close: {}",
-                      ex.what());
-      }
+      closeDeadline =
+          std::chrono::steady_clock::now() + std::chrono::milliseconds(250);
+      with([&](auto &ws) {
+        ws.async_close(
+            websocket::close_code::normal,
+            [self = shared_from_this()](beast::error_code ec) {
+              self->abort();
+            });
+      });
+      // the io owns it from now on, drop our reference to it or the two
+      // would keep each other alive
+      auto owner = std::move(io);
+      owner->closing.emplace_back(shared_from_this());
+      owner->poll();
+    } else {
+      abort();
+      // let the aborted handlers run and release their references
+      io->poll();
     }
   }
 
-  ~Socket() { close(); }
+  // drops the connection, pending handlers complete as aborted
+  void abort() {
+    closed = true;
+    beast::error_code ec;
+    with([&](auto &ws) { beast::get_lowest_layer(ws).socket().close(ec); });
+  }
 
-  websocket::stream<beast::ssl_stream<tcp::socket>> &get() { return socket; }
+  std::chrono::steady_clock::time_point closeDeadline;
 };
 
+inline void IO::poll() {
+  if (ioc.stopped())
+    ioc.restart();
+  ioc.poll();
+
+  if (!closing.empty()) {
+    const auto now = std::chrono::steady_clock::now();
+    for (auto it = closing.begin(); it != closing.end();) {
+      auto &ws = *it;
+      if (!ws->closed && now >= ws->closeDeadline) {
+        CBLOG_DEBUG("WebSocket close handshake timed out");
+        ws->abort();
+      }
+      if (ws->closed)
+        it = closing.erase(it);
+      else
+        ++it;
+    }
+  }
+}
+
+inline IO::~IO() {
+  // nobody will poll us anymore, don't wait for the remotes
+  for (auto &ws : closing) {
+    ws->abort();
+  }
+  closing.clear();
+}
+
 struct Client {
   static CBTypesInfo inputTypes() { return CoreInfo::AnyType; }
   static CBTypesInfo outputTypes() { return CoreInfo::AnyType; }
 
   static CBParametersInfo parameters() {
-    static Parameters params{{"Name",
-                              CBCCSTR("The name of this websocket instance."),
-                              {CoreInfo::StringType}},
-                             {"Host",
-                              CBCCSTR("The remote host address or IP."),
-                              {CoreInfo::StringType, CoreInfo::StringVarType}},
-                             {"Target",
-                              CBCCSTR("The remote host target path."),
-                              {CoreInfo::StringType, CoreInfo::StringVarType}},
-                             {"Port",
-                              CBCCSTR("The remote host port."),
-                              {CoreInfo::IntType, CoreInfo::IntVarType}},
-                             {"Secure",
-                              CBCCSTR("If the connection should be secured."),
-                              {CoreInfo::BoolType}}};
+    static Parameters params{
+        {"Name",
+         CBCCSTR("The name of this websocket instance."),
+         {CoreInfo::StringType}},
+        {"Host",
+         CBCCSTR("The remote host address or IP."),
+         {CoreInfo::StringType, CoreInfo::StringVarType}},
+        {"Target",
+         CBCCSTR("The remote host target path."),
+         {CoreInfo::StringType, CoreInfo::StringVarType}},
+        {"Port",
+         CBCCSTR("The remote host port."),
+         {CoreInfo::IntType, CoreInfo::IntVarType}},
+        {"Secure",
+         CBCCSTR("If the connection should be secured."),
+         {CoreInfo::BoolType}},
+        {"Compression",
+         CBCCSTR("If permessage-deflate compression should be negotiated."),
+         {CoreInfo::BoolType}}};
     return params;
   }
 
@@ -94,6 +384,9 @@ struct Client {
     case 4:
       ssl = value.payload.boolValue;
       break;
+    case 5:
+      deflate = value.payload.boolValue;
+      break;
     default:
       break;
     }
@@ -111,77 +404,34 @@ struct Client {
       return port;
     case 4:
       return Var(ssl);
+    case 5:
+      return Var(deflate);
     default:
       return {};
     }
   }
 
-  void connect(CBContext *context) {
-    try {
-      boost::asio::io_context ioc;
-      tcp::resolver resolver{ioc};
-      await(
-          context,
-          [&] {
-            boost::system::error_code error;
-            auto resolved = resolver.resolve(
-                host.get().payload.stringValue,
-                std::to_string(port.get().payload.intValue), error);
-
-            if (error) {
-              throw ActivationError("Failed to resolve host");
-            }
-
-            CBLOG_TRACE("Websocket resolved remote host");
-
-            // Make the connection on the IP address we get from a lookup
-            auto ep = net::connect(get_lowest_layer(ws->get()), resolved);
-            std::string h = host.get().payload.stringValue;
-            h += ':' + std::to_string(ep.port());
-
-            CBLOG_TRACE("Websocket connected with the remote host");
-
-            // Set a decorator to change the User-Agent of the handshake
-            ws->get().set_option(websocket::stream_base::decorator(
-                [](websocket::request_type &req) {
-                  req.set(http::field::user_agent,
-                          std::string(BOOST_BEAST_VERSION_STRING) +
-                              " websocket-client-coro");
-                }));
-
-            websocket::stream_base::timeout timeouts{
-                std::chrono::seconds(30), // handshake timeout
-                std::chrono::seconds(30), // idle timeout
-                true                      // send ping at half idle timeout
-            };
-            ws->get().set_option(timeouts);
-
-            if (ssl) {
-              // Perform the SSL handshake
-              ws->get().next_layer().handshake(ssl::stream_base::client);
-              CBLOG_TRACE("Websocket performed SSL handshake");
-            }
-
-            CBLOG_DEBUG("WebSocket handshake with: {}", h);
-
-            // Perform the websocket handshake
-            ws->get().handshake(h, target.get().payload.stringValue);
-
-            CBLOG_TRACE("Websocket performed handshake");
+  // returns false if the chain was stopped while connecting
+  bool connect(CBContext *context) {
+    ws = std::make_shared<Socket>(io);
+    ws->connect(host.get().payload.stringValue,
+                std::to_string(port.get().payload.intValue),
+                target.get().payload.stringValue, ssl, deflate);
+
+    while (!ws->connected && !ws->closed) {
+      io->poll();
+      if (chainblocks::suspend(context, 0) != CBChainState::Continue)
+        return false;
+    }
 
-            connected = true;
-          },
-          [&] {
-            CBLOG_DEBUG("Cancelling WebSocket connection");
-            resolver.cancel();
-            ws->close();
-          });
-    } catch (const std::exception &ex) {
-      // TODO some exceptions could be left unhandled
-      // or anyway should be fatal
-      CBLOG_WARNING("WebSocket connection failed: {}", ex.what());
+    if (ws->closed) {
+      CBLOG_WARNING("WebSocket connection failed: {}", ws->error.message());
+      ws->close();
+      ws = nullptr;
       throw ActivationError("WebSocket connection failed.");
     }
+
+    return true;
   }
 
   void cleanup() {
@@ -189,12 +439,17 @@ struct Client {
     host.cleanup();
     target.cleanup();
 
+    if (ws) {
+      ws->close();
+      ws = nullptr;
+    }
+
     if (socket) {
       releaseVariable(socket);
-      ws = nullptr;
       socket = nullptr;
-      connected = false;
     }
+
+    io = nullptr;
   }
 
   void warmup(CBContext *ctx) {
@@ -202,7 +457,8 @@ struct Client {
     host.warmup(ctx);
     target.warmup(ctx);
 
-    ws = std::make_shared<Socket>();
+    auto node = ctx->main->node.lock();
+    io = IO::get(node.get());
     socket = referenceVariable(ctx, name.c_str());
   }
 
@@ -214,14 +470,16 @@ struct Client {
   }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    if (!connected) {
-      connect(context);
+    if (!ws) {
+      if (!connect(context))
+        return Var::Empty;
+      socket->valueType = CBType::Object;
       socket->payload.objectVendorId = CoreCC;
       socket->payload.objectTypeId = WebSocketCC;
       socket->payload.objectValue = &ws;
     }
 
-    ws->ioCtx.poll();
+    io->poll();
 
     return input;
   }
@@ -232,25 +490,237 @@ protected:
   ParamVar host{Var("echo.websocket.org")};
   ParamVar target{Var("/")};
   bool ssl = true;
+  bool deflate = false;
 
   CBExposedTypeInfo _expInfo{};
 
-  bool connected = false;
-  CBVar *socket;
+  CBVar *socket{nullptr};
 
-  // These objects perform our I/O
+  std::shared_ptr<IO> io;
   std::shared_ptr<Socket> ws{nullptr};
 };
 
+struct Peer {
+  std::shared_ptr<CBChain> chain;
+  std::shared_ptr<Socket> socket;
+};
+
+struct Server {
+  static inline Parameters params{
+      {"Handler",
+       CBCCSTR("The chain that will be spawned to handle each websocket "
+               "connection, the socket is in the WebSocket.Server.Socket "
+               "variable and it's the default of the read/write blocks."),
+       {CoreInfo::ChainOrNone}},
+      {"Endpoint",
+       CBCCSTR("The local address to listen on."),
+       {CoreInfo::StringType}},
+      {"Port",
+       CBCCSTR("The port this service will use."),
+       {CoreInfo::IntType}},
+      {"Compression",
+       CBCCSTR("If permessage-deflate compression should be accepted."),
+       {CoreInfo::BoolType}}};
+
+  static CBParametersInfo parameters() { return params; }
+
+  // bypass
+  static CBTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::AnyType; }
+
+  void setParam(int idx, const CBVar &val) {
+    switch (idx) {
+    case 0: {
+      _handlerMaster = val;
+      if (_handlerMaster.valueType == CBType::Chain)
+        _pool.reset(
+            new ChainDoppelgangerPool<Peer>(_handlerMaster.payload.chainValue));
+    } break;
+    case 1:
+      _endpoint = val.payload.stringValue;
+      break;
+    case 2:
+      _port = uint16_t(val.payload.intValue);
+      break;
+    case 3:
+      _deflate = val.payload.boolValue;
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int idx) {
+    switch (idx) {
+    case 0:
+      return _handlerMaster;
+    case 1:
+      return Var(_endpoint);
+    case 2:
+      return Var(int(_port));
+    case 3:
+      return Var(_deflate);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  CBTypeInfo compose(const CBInstanceData &data) {
+    const IterableExposedInfo shared(data.shared);
+    // copy shared
+    _sharedCopy = shared;
+    _sharedCopy.push_back(CBExposedTypeInfo{Common::ServerSocketName,
+                                            CBCCSTR("The peer websocket."),
+                                            Common::WebSocket});
+    return data.inputType;
+  }
+
+  struct Composer {
+    Server &server;
+    CBContext *context;
+
+    void compose(CBChain *chain) {
+      CBInstanceData data{};
+      data.inputType = CoreInfo::AnyType;
+      data.shared = server._sharedCopy;
+      data.chain = context->chainStack.back();
+      chain->node = context->main->node;
+      auto res = composeChain(
+          chain,
+          [](const struct CBlock *errorBlock, const char *errorTxt,
+             CBBool nonfatalWarning, void *userData) {
+            if (!nonfatalWarning) {
+              CBLOG_ERROR(errorTxt);
+              throw ActivationError(
+                  "WebSocket.Server handler chain compose failed");
+            } else {
+              CBLOG_WARNING(errorTxt);
+            }
+          },
+          nullptr, data);
+      arrayFree(res.exposedInfo);
+      arrayFree(res.requiredInfo);
+    }
+  };
+
+  // "Loop" forever accepting new connections, the handler chain is scheduled
+  // once the websocket handshake is done
+  void accept_once(CBContext *context) {
+    _acceptor->async_accept([context, this](beast::error_code ec,
+                                            tcp::socket socket) {
+      if (ec) {
+        if (ec == net::error::operation_aborted)
+          return;
+      } else {
+        auto ws = std::make_shared<Socket>(_io);
+        ws->accept(std::move(socket), _deflate);
+        _handshaking.emplace_back(ws);
+      }
+      // continue accepting the next
+      accept_once(context);
+    });
+  }
+
+  void schedule(CBContext *context, std::shared_ptr<Socket> ws) {
+    auto node = context->main->node.lock();
+    if (!node) {
+      ws->close();
+      return;
+    }
+
+    auto peer = _pool->acquire(_composer);
+    peer->chain->onStop.clear(); // we have a fresh recycled chain here
+    std::weak_ptr<Peer> weakPeer(peer);
+    peer->chain->onStop.emplace_back([this, weakPeer]() {
+      if (auto p = weakPeer.lock()) {
+        if (p->socket) {
+          p->socket->close();
+          p->socket = nullptr;
+        }
+        _pool->release(p);
+      }
+    });
+    peer->socket = ws;
+    peer->chain->variables[Common::ServerSocketName] =
+        Var::Object(&peer->socket, CoreCC, WebSocketCC);
+    node->schedule(peer->chain, Var::Empty, false);
+  }
+
+  void warmup(CBContext *context) {
+    if (!_pool) {
+      throw ComposeError("Peer chains pool not valid!");
+    }
+
+    auto node = context->main->node.lock();
+    _io = IO::get(node.get());
+    auto addr = net::ip::make_address(_endpoint);
+    _acceptor.reset(new tcp::acceptor(_io->ioc, {addr, _port}));
+    _composer.context = context;
+    // start accepting
+    accept_once(_composer.context);
+  }
+
+  void cleanup() {
+    if (_acceptor) {
+      beast::error_code ec;
+      _acceptor->close(ec);
+    }
+    for (auto &ws : _handshaking) {
+      ws->close();
+    }
+    _handshaking.clear();
+    if (_pool)
+      _pool->stopAll();
+    if (_io)
+      _io->poll();
+    _acceptor.reset();
+    _io = nullptr;
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    _io->poll();
+
+    // hand over the connections done with the handshake
+    for (auto it = _handshaking.begin(); it != _handshaking.end();) {
+      auto &ws = *it;
+      if (ws->connected) {
+        schedule(context, ws);
+        it = _handshaking.erase(it);
+      } else if (ws->closed) {
+        CBLOG_DEBUG("WebSocket handshake failed: {}", ws->error.message());
+        ws->close();
+        it = _handshaking.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    return input;
+  }
+
+  uint16_t _port{7071};
+  bool _deflate{false};
+  std::string _endpoint{"0.0.0.0"};
+  OwnedVar _handlerMaster{};
+  std::unique_ptr<ChainDoppelgangerPool<Peer>> _pool;
+  IterableExposedInfo _sharedCopy;
+  Composer _composer{*this};
+
+  std::shared_ptr<IO> _io;
+  std::unique_ptr<tcp::acceptor> _acceptor;
+  std::list<std::shared_ptr<Socket>> _handshaking;
+};
+
 struct User {
-  std::shared_ptr<Socket> _ws;
   ParamVar _wsVar{};
   CBExposedTypeInfo _expInfo{};
 
   static CBParametersInfo parameters() {
-    static Parameters params{{"Socket",
-                              CBCCSTR("The websocket instance variable."),
-                              {Common::WebSocketVar}}};
+    static Parameters params{
+        {"Socket",
+         CBCCSTR("The websocket instance variable, if none the peer of the "
+                 "WebSocket.Server running this handler chain."),
+         {Common::WebSocketVar, CoreInfo::NoneType}}};
     return params;
   }
 
@@ -258,29 +728,69 @@ struct User {
 
   CBVar getParam(int index) { return _wsVar; }
 
-  void cleanup() {
-    _wsVar.cleanup();
-    _ws = nullptr;
-  }
+  void cleanup() { _wsVar.cleanup(); }
 
-  void warmup(CBContext *context) { _wsVar.warmup(context); }
+  void warmup(CBContext *context) {
+    if (!_wsVar.isVariable()) {
+      _wsVar = Var::ContextVar(Common::ServerSocketName);
+    }
+    _wsVar.warmup(context);
+  }
 
-  void ensureSocket() {
-    if (_ws == nullptr)
-      _ws = *reinterpret_cast<std::shared_ptr<Socket> *>(
-          _wsVar.get().payload.objectValue);
+  // fetched every time, server handler chains are recycled for new peers
+  Socket &socket() {
+    auto &ws = *reinterpret_cast<std::shared_ptr<Socket> *>(
+        _wsVar.get().payload.objectValue);
+    if (!ws) {
+      throw ActivationError("WebSocket not connected.");
+    }
+    return *ws;
   }
 
   CBExposedTypesInfo requiredVariables() {
-    if (_wsVar.isVariable()) {
-      _expInfo = CBExposedTypeInfo{_wsVar.variableName(),
-                                   CBCCSTR("The required websocket."),
-                                   Common::WebSocket};
-    } else {
-      throw ComposeError("No websocket specified.");
-    }
+    _expInfo = CBExposedTypeInfo{
+        _wsVar.isVariable() ? _wsVar.variableName() : Common::ServerSocketName,
+        CBCCSTR("The required websocket."), Common::WebSocket};
     return CBExposedTypesInfo{&_expInfo, 1, 0};
   }
+
+  void checkOpen(Socket &ws) {
+    if (ws.closed) {
+      CBLOG_DEBUG("WebSocket closed: {}", ws.error.message());
+      throw ActivationError("WebSocket closed.");
+    }
+  }
+
+  // the helpers below return false if the chain was stopped while waiting,
+  // the activation then returns right away
+  bool write(CBContext *context, std::string &&data, bool binary) {
+    auto &ws = socket();
+    checkOpen(ws);
+    ws.write(std::move(data), binary);
+    // back-pressure, otherwise messages are queued and we move on
+    while (ws.outbox.size() > Socket::MaxQueued) {
+      ws.io->poll();
+      checkOpen(ws);
+      if (chainblocks::suspend(context, 0) != CBChainState::Continue)
+        return false;
+    }
+    return true;
+  }
+
+  bool read(CBContext *context, Message &msg) {
+    auto &ws = socket();
+    // poll once, if we have data we will be done quick
+    ws.io->poll();
+    while (ws.inbox.empty()) {
+      checkOpen(ws);
+      if (chainblocks::suspend(context, 0) != CBChainState::Continue)
+        return false;
+      ws.io->poll();
+    }
+    msg = std::move(ws.inbox.front());
+    ws.inbox.pop_front();
+    return true;
+  }
 };
 
 struct WriteString : public User {
@@ -288,8 +798,6 @@ struct WriteString : public User {
   static CBTypesInfo outputTypes() { return CoreInfo::StringType; }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    ensureSocket();
-
     std::string_view payload{};
 
     if (input.payload.stringLen > 0) {
@@ -299,69 +807,85 @@ struct WriteString : public User {
       payload = std::string_view(input.payload.stringValue);
     }
 
-    try {
-      await(
-          context, [&]() { _ws->get().write(net::buffer(payload)); }, [] {});
-    } catch (const std::exception &ex) {
-      // TODO some exceptions could be left unhandled
-      // or anyway should be fatal
-      CBLOG_WARNING("WebSocket write failed: {}", ex.what());
-      throw ActivationError("WebSocket write failed.");
-    }
-
+    if (!write(context, std::string(payload), false))
+      return Var::Empty;
     return input;
   }
 };
 
 struct ReadString : public User {
-  beast::flat_buffer _buffer;
   std::string _output;
 
   static CBTypesInfo inputTypes() { return CoreInfo::NoneType; }
   static CBTypesInfo outputTypes() { return CoreInfo::StringType; }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    // TODO refactor, we are not awaiting here...
-    // either refactor Send of await as well
+    Message msg;
+    if (!read(context, msg))
+      return Var::Empty;
+    _output = std::move(msg.data);
+    return Var(_output);
+  }
+};
 
-    ensureSocket();
+// binary frames carrying serialized vars
+struct Write : public User {
+  static CBTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::AnyType; }
 
-    _buffer.clear();
+  Serialization _serializer;
 
-    // poll once, if we have data we will be done quick
-    // we become the pollers in this case
-    _ws->ioCtx.poll();
-
-    bool done = false;
-    boost::system::error_code done_err{};
-    _ws->get().async_read(_buffer, [&done, &done_err](auto err, auto size) {
-      done_err = err;
-      done = true;
-    });
+  CBVar activate(CBContext *context, const CBVar &input) {
+    std::string data;
+    auto writer = [&](const uint8_t *buf, size_t size) {
+      data.append(reinterpret_cast<const char *>(buf), size);
+    };
+    _serializer.reset();
+    _serializer.serialize(input, writer);
+    if (!write(context, std::move(data), true))
+      return Var::Empty;
+    return input;
+  }
+};
 
-    while (!done) {
-      // we become the pollers in this case
-      _ws->ioCtx.poll();
-      CB_SUSPEND(context, 0);
-    }
+struct Read : public User {
+  static CBTypesInfo inputTypes() { return CoreInfo::NoneType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::AnyType; }
 
-    if (done_err.failed()) {
-      auto errorMsg = done_err.message();
-      throw ActivationError(errorMsg);
+  Serialization _serializer;
+  CBVar _output{};
+
+  void destroy() { Serialization::varFree(_output); }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    Message msg;
+    if (!read(context, msg))
+      return Var::Empty;
+    if (!msg.binary) {
+      throw ActivationError("WebSocket.Read: expected a binary message.");
     }
 
-    _output.clear();
-    const auto data = _buffer.data();
-    _output.reserve(data.size());
-    _output.append(static_cast<char const *>(data.data()), data.size());
-    return Var(_output);
+    size_t offset = 0;
+    auto reader = [&](uint8_t *buf, size_t size) {
+      if (offset + size > msg.data.size()) {
+        throw ActivationError("WebSocket.Read: truncated message.");
+      }
+      memcpy(buf, msg.data.data() + offset, size);
+      offset += size;
+    };
+    _serializer.reset();
+    _serializer.deserialize(reader, _output);
+    return _output;
   }
 };
 
 void registerBlocks() {
   REGISTER_CBLOCK("WebSocket.Client", Client);
+  REGISTER_CBLOCK("WebSocket.Server", Server);
   REGISTER_CBLOCK("WebSocket.WriteString", WriteString);
   REGISTER_CBLOCK("WebSocket.ReadString", ReadString);
+  REGISTER_CBLOCK("WebSocket.Write", Write);
+  REGISTER_CBLOCK("WebSocket.Read", Read);
 }
 } // namespace WS
 } // namespace chainblocks
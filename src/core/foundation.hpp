@@ -351,6 +351,16 @@ struct CBChain : public std::enable_shared_from_this<CBChain> {
   std::string finishedError{};
 
   uint64_t composedHash{};
+  // last composeChain result and the key it was composed with (structure,
+  // parameters, input type and shared variables), reused on a key match
+  mutable uint64_t composeCacheKey{};
+  mutable CBComposeResult composeCacheResult{};
+  // warnings of that compose, replayed to the callback on a cache hit
+  mutable std::vector<std::pair<const CBlock *, std::string>>
+      composeCacheWarnings;
+  // hash of the blocks part of the key, blocks can't be changed while the
+  // chain is warmed up so it is only kept until cleanup
+  mutable uint64_t composeBlocksHash{};
   bool warmedUp{false};
   bool isRoot{false};
   std::unordered_set<void *> chainUsers;
@@ -3,6 +3,7 @@
 
 #include "runtime.hpp"
 #include "blocks/shared.hpp"
+#include "spdlog/async.h"
 #include "spdlog/sinks/dist_sink.h"
 #include "spdlog/sinks/rotating_file_sink.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
@@ -11,6 +12,7 @@
 #include <boost/stacktrace.hpp>
 #include <csignal>
 #include <cstdarg>
+#include <deque>
 #include <filesystem>
 #include <pdqsort.h>
 #include <set>
@@ -76,6 +78,10 @@ CBOptionalString setCompiledCompressedString(uint32_t id, const char *str) {
 
 extern void registerChainsBlocks();
 extern void registerLoggingBlocks();
+extern void startLogPipeline(size_t capacity,
+                             std::shared_ptr<spdlog::logger> logger,
+                             const char *binaryPath);
+extern void stopLogPipeline(bool wait);
 extern void registerFlowBlocks();
 extern void registerSeqsBlocks();
 extern void registerCastingBlocks();
@@ -225,8 +231,28 @@ void registerCoreBlocks() {
   dist_sink->add_sink(sink2);
 #endif
 
-  auto logger =
-      std::make_shared<spdlog::logger>("chainblocks_logger", dist_sink);
+  // CB_LOG_ASYNC=<queue size> moves formatting and sinks off the calling
+  // threads, CB_LOG_BINARY=<file> makes Log and Msg write binary records
+  std::shared_ptr<spdlog::logger> logger;
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+  auto asyncLog = std::getenv("CB_LOG_ASYNC");
+  if (asyncLog) {
+    auto capacity = size_t(std::max(std::atoll(asyncLog), 1024LL));
+    spdlog::init_thread_pool(capacity, 1);
+    logger = std::make_shared<spdlog::async_logger>(
+        "chainblocks_logger", dist_sink, spdlog::thread_pool(),
+        spdlog::async_overflow_policy::overrun_oldest);
+    // Log and Msg have their own queue, their worker writes directly
+    auto pipelineLogger =
+        std::make_shared<spdlog::logger>("chainblocks_pipeline", dist_sink);
+    pipelineLogger->set_level(spdlog::level::trace);
+    startLogPipeline(capacity, pipelineLogger, std::getenv("CB_LOG_BINARY"));
+  } else
+#endif
+  {
+    logger =
+        std::make_shared<spdlog::logger>("chainblocks_logger", dist_sink);
+  }
   logger->flush_on(spdlog::level::err);
   spdlog::set_default_logger(logger);
 
@@ -1344,9 +1370,90 @@ CBComposeResult composeChain(const std::vector<CBlock *> &chain,
   return result;
 }
 
+uint64_t composeHash(const CBChain *chain, const CBInstanceData &data) {
+  XXH3_state_s hashState;
+  XXH3_INITSTATE(&hashState);
+  XXH3_64bits_reset_withSecret(&hashState, CUSTOM_XXH3_kSecret,
+                               XXH_SECRET_DEFAULT_SIZE);
+
+  // blocks, their parameters and states (nested chains included)
+  auto blocksHash = chain->composeBlocksHash;
+  if (!chain->warmedUp || blocksHash == 0) {
+    XXH3_state_s blocksState;
+    XXH3_INITSTATE(&blocksState);
+    XXH3_64bits_reset_withSecret(&blocksState, CUSTOM_XXH3_kSecret,
+                                 XXH_SECRET_DEFAULT_SIZE);
+    gatheringChains().clear();
+    gatheringChains().insert(chain);
+    for (auto blk : chain->blocks) {
+      CBVar tmp;
+      tmp.valueType = CBType::Block;
+      tmp.payload.blockValue = blk;
+      hash_update(tmp, &blocksState);
+    }
+    blocksHash = XXH3_64bits_digest(&blocksState);
+    if (chain->warmedUp)
+      chain->composeBlocksHash = blocksHash;
+  }
+  XXH3_64bits_update(&hashState, &blocksHash, sizeof(uint64_t));
+
+  const auto inputHash = deriveTypeHash(data.inputType);
+  XXH3_64bits_update(&hashState, &inputHash, sizeof(uint64_t));
+
+  // shared variables come from unordered containers, sort them
+  std::vector<uint64_t> sharedHashes;
+  for (uint32_t i = 0; i < data.shared.len; i++) {
+    const auto &info = data.shared.elements[i];
+    XXH3_state_s infoState;
+    XXH3_INITSTATE(&infoState);
+    XXH3_64bits_reset_withSecret(&infoState, CUSTOM_XXH3_kSecret,
+                                 XXH_SECRET_DEFAULT_SIZE);
+    XXH3_64bits_update(&infoState, info.name, strlen(info.name));
+    const auto typeHash = deriveTypeHash(info.exposedType);
+    XXH3_64bits_update(&infoState, &typeHash, sizeof(uint64_t));
+    const uint8_t flags[] = {uint8_t(info.isMutable), uint8_t(info.isProtected),
+                             uint8_t(info.isTableEntry), uint8_t(info.global)};
+    XXH3_64bits_update(&infoState, flags, sizeof(flags));
+    sharedHashes.emplace_back(XXH3_64bits_digest(&infoState));
+  }
+  pdqsort(sharedHashes.begin(), sharedHashes.end());
+  for (const auto hash : sharedHashes) {
+    XXH3_64bits_update(&hashState, &hash, sizeof(uint64_t));
+  }
+
+  // compose also depends on the calling chain and the node we live in
+  const auto node = chain->node.lock();
+  const void *ptrs[] = {data.chain, node.get()};
+  XXH3_64bits_update(&hashState, ptrs, sizeof(ptrs));
+  XXH3_64bits_update(&hashState, &data.onWorkerThread,
+                     sizeof(data.onWorkerThread));
+
+  return XXH3_64bits_digest(&hashState);
+}
+
 CBComposeResult composeChain(const CBChain *chain,
                              CBValidationCallback callback, void *userData,
                              CBInstanceData data) {
+  // blocks keep the types of their last compose, so if nothing changed since
+  // then we can skip the whole validation and return a copy of the last result
+  const auto composeKey = composeHash(chain, data);
+  if (chain->composeCacheKey != 0 && chain->composeCacheKey == composeKey) {
+    CBLOG_TRACE("Reusing cached compose result, chain: {}", chain->name);
+    auto res = chain->composeCacheResult;
+    res.exposedInfo = {};
+    res.requiredInfo = {};
+    for (auto &info : chain->composeCacheResult.exposedInfo) {
+      chainblocks::arrayPush(res.exposedInfo, info);
+    }
+    for (auto &info : chain->composeCacheResult.requiredInfo) {
+      chainblocks::arrayPush(res.requiredInfo, info);
+    }
+    for (auto &[blk, warning] : chain->composeCacheWarnings) {
+      callback(blk, warning.c_str(), true, userData);
+    }
+    return res;
+  }
+
   // settle input type of chain before compose
   if (chain->blocks.size() > 0 &&
       !std::any_of(chain->blocks.begin(), chain->blocks.end(),
@@ -1364,7 +1471,23 @@ CBComposeResult composeChain(const CBChain *chain,
     chain->inputType = data.inputType;
   }
 
-  auto res = composeChain(chain->blocks, callback, userData, data);
+  // record the warnings on the way to the callback so that hits can replay them
+  struct WarningsRecorder {
+    CBValidationCallback callback;
+    void *userData;
+    std::vector<std::pair<const CBlock *, std::string>> warnings;
+  } recorder{callback, userData, {}};
+  auto res = composeChain(
+      chain->blocks,
+      [](const CBlock *errorBlock, const char *errorTxt, bool nonfatalWarning,
+         void *userData) {
+        auto recorder = reinterpret_cast<WarningsRecorder *>(userData);
+        if (nonfatalWarning)
+          recorder->warnings.emplace_back(errorBlock, errorTxt);
+        recorder->callback(errorBlock, errorTxt, nonfatalWarning,
+                           recorder->userData);
+      },
+      &recorder, data);
 
   // set outputtype
   chain->outputType = res.outputType;
@@ -1378,10 +1501,27 @@ CBComposeResult composeChain(const CBChain *chain,
   }
 
   // add variables
+  chain->requiredVariables.clear();
   for (auto req : res.requiredInfo) {
     chain->requiredVariables.emplace_back(req.name);
   }
 
+  // store a copy of the result, if blocks actualized their state during
+  // compose (e.g. sub chains) the key won't match and the next compose misses
+  chainblocks::arrayFree(chain->composeCacheResult.exposedInfo);
+  chainblocks::arrayFree(chain->composeCacheResult.requiredInfo);
+  chain->composeCacheResult = res;
+  chain->composeCacheResult.exposedInfo = {};
+  chain->composeCacheResult.requiredInfo = {};
+  for (auto &info : res.exposedInfo) {
+    chainblocks::arrayPush(chain->composeCacheResult.exposedInfo, info);
+  }
+  for (auto &info : res.requiredInfo) {
+    chainblocks::arrayPush(chain->composeCacheResult.requiredInfo, info);
+  }
+  chain->composeCacheWarnings = std::move(recorder.warnings);
+  chain->composeCacheKey = composeKey;
+
   return res;
 }
 
@@ -1793,6 +1933,8 @@ void error_handler(int err_sig) {
     chainblocks::GetGlobals().SigIntTerm++;
     if (chainblocks::GetGlobals().SigIntTerm > 5)
       std::exit(-1);
+    // not joining here, the worker drains the queue on its own
+    chainblocks::stopLogPipeline(false);
     spdlog::shutdown();
     break;
   case SIGFPE:
@@ -2478,6 +2620,64 @@ uint64_t hash(const CBVar &var) {
   return XXH3_64bits_digest(&hashState);
 }
 
+// hashes a nested value without resetting the chains recursion guard
+static uint64_t hashNested(const CBVar &var) {
+  XXH3_state_s hashState;
+  XXH3_INITSTATE(&hashState);
+  XXH3_64bits_reset_withSecret(&hashState, CUSTOM_XXH3_kSecret,
+                               XXH_SECRET_DEFAULT_SIZE);
+  hash_update(var, &hashState);
+  return XXH3_64bits_digest(&hashState);
+}
+
+// per thread, per nesting depth buffers used to sort the hashes of tables and
+// sets, kept around so repeatedly hashed containers don't allocate
+struct HashScratch {
+  using Buffer = std::vector<std::pair<uint64_t, CBString>>;
+
+  // a single huge table should not pin its peak memory on every thread
+  static constexpr size_t MaxKeptEntries = 4096;
+
+  HashScratch() : hashes(acquire()) {}
+  ~HashScratch() {
+    if (hashes.capacity() > MaxKeptEntries)
+      Buffer().swap(hashes);
+    depth()--;
+  }
+
+  HashScratch(const HashScratch &) = delete;
+  HashScratch &operator=(const HashScratch &) = delete;
+
+  Buffer &hashes;
+
+private:
+  static std::deque<Buffer> &buffers() {
+#ifdef WIN32
+    // same as gatheringChains, leak to avoid tls emulation issues at exit
+    thread_local std::deque<Buffer> *bufs = new std::deque<Buffer>();
+    return *bufs;
+#else
+    thread_local std::deque<Buffer> bufs;
+    return bufs;
+#endif
+  }
+
+  static size_t &depth() {
+    thread_local size_t d = 0;
+    return d;
+  }
+
+  static Buffer &acquire() {
+    auto &bufs = buffers();
+    auto &d = depth();
+    if (bufs.size() <= d)
+      bufs.emplace_back();
+    auto &buf = bufs[d++];
+    buf.clear();
+    return buf;
+  }
+};
+
 void hash_update(const CBVar &var, void *state) {
   auto hashState = reinterpret_cast<XXH3_state_s *>(state);
 
@@ -2545,11 +2745,9 @@ void hash_update(const CBVar &var, void *state) {
     }
   } break;
   case CBType::Table: {
-    // this is unsafe because allocates on the stack
-    // but we need to sort hashes
-    std::vector<std::pair<uint64_t, CBString>,
-                stack_allocator<std::pair<uint64_t, CBString>>>
-        hashes;
+    // entries are unordered, so we sort their hashes
+    HashScratch scratch;
+    auto &hashes = scratch.hashes;
 
     auto &t = var.payload.tableValue;
     CBTableIterator it;
@@ -2557,7 +2755,7 @@ void hash_update(const CBVar &var, void *state) {
     CBString key;
     CBVar value;
     while (t.api->tableNext(t, &it, &key, &value)) {
-      hashes.emplace_back(hash(value), key);
+      hashes.emplace_back(hashNested(value), key);
     }
 
     pdqsort(hashes.begin(), hashes.end());
@@ -2568,22 +2766,21 @@ void hash_update(const CBVar &var, void *state) {
     }
   } break;
   case CBType::Set: {
-    // this is unsafe because allocates on the stack
-    // but we need to sort hashes
-    std::vector<uint64_t, stack_allocator<uint64_t>> hashes;
-
     // just store hashes, sort and actually combine later
+    HashScratch scratch;
+    auto &hashes = scratch.hashes;
+
     auto &s = var.payload.setValue;
     CBSetIterator it;
     s.api->setGetIterator(s, &it);
     CBVar value;
     while (s.api->setNext(s, &it, &value)) {
-      hashes.emplace_back(hash(value));
+      hashes.emplace_back(hashNested(value), nullptr);
     }
 
     pdqsort(hashes.begin(), hashes.end());
-    for (const auto hash : hashes) {
-      XXH3_64bits_update(hashState, &hash, sizeof(uint64_t));
+    for (const auto &pair : hashes) {
+      XXH3_64bits_update(hashState, &pair.first, sizeof(uint64_t));
     }
   } break;
   case CBType::Block: {
@@ -2780,6 +2977,12 @@ void CBChain::reset() {
 
   chainUsers.clear();
   composedHash = 0;
+  composeCacheKey = 0;
+  chainblocks::arrayFree(composeCacheResult.exposedInfo);
+  chainblocks::arrayFree(composeCacheResult.requiredInfo);
+  composeCacheResult = {};
+  composeCacheWarnings.clear();
+  composeBlocksHash = 0;
   inputType = CBTypeInfo();
   outputType = {};
   requiredVariables.clear();
@@ -2842,6 +3045,8 @@ void CBChain::cleanup(bool force) {
                 chainUsers.size());
 
     warmedUp = false;
+    // blocks might be changed from now on
+    composeBlocksHash = 0;
 
     // Run cleanup on all blocks, prepare them for a new start if necessary
     // Do this in reverse to allow a safer cleanup
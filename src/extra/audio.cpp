@@ -3,7 +3,8 @@
 
 #include "blocks/shared.hpp"
 #include "runtime.hpp"
-#include <boost/lockfree/queue.hpp>
+#include <atomic>
+#include <mutex>
 
 #define STB_VORBIS_HEADER_ONLY
 #include "extras/stb_vorbis.c" // Enables Vorbis decoding.
@@ -38,7 +39,6 @@ another iteration
 */
 
 struct ChannelData {
-  float *outputBuffer;
   std::vector<uint32_t> inChannels;
   std::vector<uint32_t> outChannels;
   BlocksVar blocks;
@@ -54,6 +54,54 @@ struct ChannelDesc {
   ChannelData *data;
 };
 
+// dst += src * gain, kept trivial so that it gets vectorized
+inline void mix(float *dst, const float *src, float gain, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    dst[i] += src[i] * gain;
+  }
+}
+
+// The channels routing compiled into flat, preallocated lists.
+// Built on the control thread and never modified once the audio thread
+// picked it up.
+struct AudioGraph {
+  static constexpr int DeviceInput = -1;
+  static constexpr int NoInput = -2;
+
+  // intermediate mix of a bus with a given channels layout
+  struct Bus {
+    uint64_t hash;
+    uint32_t width;
+    std::vector<float> samples;
+  };
+
+  struct Node {
+    ChannelData *data;
+    // index in buses, -1 mixes into the device output
+    int target;
+    uint32_t width;
+    // the output layout is exactly the device layout
+    bool identity;
+  };
+
+  // channels sharing the same input
+  struct Group {
+    uint64_t hash;
+    int source;
+    // the input layout is exactly the device layout
+    bool identity;
+    std::vector<uint32_t> inChannels;
+    std::vector<float> input;
+    std::vector<Node> nodes;
+  };
+
+  // max frames processed at once, larger device periods are split
+  uint32_t capacity{0};
+  std::vector<Bus> buses;
+  // sorted so that every bus is complete before being read
+  std::vector<Group> groups;
+};
+
 struct Device {
   static constexpr uint32_t DeviceCC = 'sndd';
 
@@ -69,21 +117,84 @@ struct Device {
     return &experimental.payload.tableValue;
   }
 
+  static inline Parameters params{
+      {"BufferSize",
+       CBCCSTR("The number of frames processed per period, smaller values "
+               "lower the latency. From 16 to 65535."),
+       {CoreInfo::IntType}},
+      {"Offline",
+       CBCCSTR("Renders without a sound card, every activation pulls Frames "
+               "frames from the channels as fast as possible and outputs "
+               "them. Audio input is used as the device input."),
+       {CoreInfo::BoolType}},
+      {"Frames",
+       CBCCSTR("The number of frames rendered per activation when Offline, 0 "
+               "renders a single period of BufferSize frames."),
+       {CoreInfo::IntType}}};
+
+  CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      // CBAudio holds at most UINT16_MAX frames
+      bufferSize = ma_uint32(
+          std::clamp(value.payload.intValue, int64_t(16), int64_t(UINT16_MAX)));
+      break;
+    case 1:
+      _offline = value.payload.boolValue;
+      break;
+    case 2:
+      _frames = ma_uint32(std::clamp(value.payload.intValue, int64_t(0),
+                                     int64_t(UINT16_MAX)));
+      break;
+    default:
+      throw InvalidParameterIndex();
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(int64_t(bufferSize));
+    case 1:
+      return Var(_offline);
+    case 2:
+      return Var(int64_t(_frames));
+    default:
+      throw InvalidParameterIndex();
+    }
+  }
+
+  CBTypeInfo compose(const CBInstanceData &data) {
+    if (_offline) {
+      return CoreInfo::AudioType;
+    }
+    return data.inputType;
+  }
+
+  bool _offline{false};
+  ma_uint32 _frames{0};
+  std::vector<float> _offlineInput;
+  std::vector<float> _offlineOutput;
+
   mutable ma_device _device;
   mutable bool _open{false};
   bool _started{false};
   CBVar *_deviceVar{nullptr};
   CBVar *_deviceVarDsp{nullptr};
+  CBVar *_deviceVarCompile{nullptr};
 
-  // (bus, channels hash)
-  // don't use those when auto thread is running
-  std::unordered_map<uint32_t,
-                     std::unordered_map<uint64_t, std::vector<ChannelData *>>>
-      channels;
-  std::unordered_map<uint32_t, std::unordered_map<uint64_t, std::vector<float>>>
-      outputBuffers;
+  // control side, every change compiles a new graph
+  std::mutex _registryMutex;
+  std::vector<ChannelDesc> _registry;
 
-  mutable boost::lockfree::queue<ChannelDesc> newChannels{16};
+  // only touched by the audio thread
+  AudioGraph *_graph{nullptr};
+  // handed from the control thread to the audio thread
+  std::atomic<AudioGraph *> _pendingGraph{nullptr};
+  // handed back once replaced, the audio thread never frees memory
+  std::atomic<AudioGraph *> _retiredGraph{nullptr};
 
   // we don't want to use this inside our operation callback
   // miniaudio does not follow the same value on certain platforms
@@ -93,7 +204,6 @@ struct Device {
   ma_uint32 sampleRate{44100};
   ma_uint32 inChannels{2};
   ma_uint32 outChannels{2};
-  std::vector<float> inputScratch;
   uint64_t inputHash;
   uint64_t outputHash;
   CBFlow dpsFlow{};
@@ -104,134 +214,306 @@ struct Device {
   CBContext dspContext{std::move(dspStubCoro), dspChain.get(), &dpsFlow};
 #else
   CBContext dspContext{&dspStubCoro, dspChain.get(), &dpsFlow};
+#endif
+  // channels are warmed up on the control thread while the audio thread
+  // might be running dspContext, so they get a context (and chain) of their
+  // own, guarded by _registryMutex
+  CBFlow compileFlow{};
+  CBCoro compileStubCoro{};
+  std::shared_ptr<CBChain> compileChain =
+      CBChain::make("Audio-DSP-Compile-Chain");
+#ifndef __EMSCRIPTEN__
+  CBContext compileContext{std::move(compileStubCoro), compileChain.get(),
+                           &compileFlow};
+#else
+  CBContext compileContext{&compileStubCoro, compileChain.get(),
+                           &compileFlow};
 #endif
   std::atomic_bool stopped{false};
   std::atomic_bool hasErrors{false};
   std::string errorMessage;
 
-  static void pcmCallback(ma_device *pDevice, void *pOutput, const void *pInput,
-                          ma_uint32 frameCount) {
-    assert(pDevice->capture.format == ma_format_f32);
-    assert(pDevice->playback.format == ma_format_f32);
+  ~Device() { releaseGraphs(); }
 
-    auto device = reinterpret_cast<Device *>(pDevice->pUserData);
+  std::unique_ptr<AudioGraph> compile() const {
+    auto graph = std::make_unique<AudioGraph>();
+    graph->capacity = bufferSize;
 
-    if (device->stopped)
-      return;
-
-    // add any new channels
-    ChannelDesc c;
-    while (device->newChannels.pop(c)) {
-      // Inside here, if happens, there might be syscalls
-      // Allocations and such... we need to refactor if we start
-      // Noticing audio cracks
-      {
-        auto &bus = device->channels[c.inBus];
-        bus[c.inHash].emplace_back(c.data);
+    for (auto &desc : _registry) {
+      auto &outs = desc.data->outChannels;
+      if (desc.outBus == 0) {
+        for (auto c : outs) {
+          if (c >= outChannels)
+            throw WarmupError("Audio.Channel output channel out of range");
+        }
+        continue;
       }
-      {
-        auto &bus = device->outputBuffers[c.outBus];
-        auto &buffer = bus[c.outHash];
-        buffer.resize(frameCount * c.outChannels);
-        c.data->outputBuffer = buffer.data();
+      auto it = std::find_if(
+          graph->buses.begin(), graph->buses.end(),
+          [&](const AudioGraph::Bus &bus) { return bus.hash == desc.outHash; });
+      if (it == graph->buses.end()) {
+        graph->buses.emplace_back(AudioGraph::Bus{
+            desc.outHash, desc.outChannels,
+            std::vector<float>(size_t(bufferSize) * desc.outChannels)});
       }
-      c.data->blocks.warmup(&device->dspContext);
     }
 
-    device->actualBufferSize = frameCount;
+    auto busIndex = [&](uint64_t hash) {
+      for (size_t i = 0; i < graph->buses.size(); i++) {
+        if (graph->buses[i].hash == hash)
+          return int(i);
+      }
+      return AudioGraph::NoInput;
+    };
+
+    // group by input, in registration order
+    std::vector<AudioGraph::Group> groups;
+    for (auto &desc : _registry) {
+      auto it = std::find_if(
+          groups.begin(), groups.end(),
+          [&](const AudioGraph::Group &g) { return g.hash == desc.inHash; });
+      if (it == groups.end()) {
+        auto &group = groups.emplace_back();
+        group.hash = desc.inHash;
+        group.inChannels = desc.data->inChannels;
+        if (desc.inBus == 0) {
+          for (auto c : group.inChannels) {
+            if (c >= inChannels)
+              throw WarmupError("Audio.Channel input channel out of range");
+          }
+          group.source = AudioGraph::DeviceInput;
+          group.identity = desc.inHash == inputHash;
+        } else {
+          group.source = busIndex(desc.inHash);
+          group.identity = false;
+        }
+        group.input.resize(size_t(bufferSize) * group.inChannels.size());
+        it = groups.end() - 1;
+      }
+      AudioGraph::Node node;
+      node.data = desc.data;
+      node.target = desc.outBus == 0 ? -1 : busIndex(desc.outHash);
+      node.width = uint32_t(desc.data->outChannels.size());
+      node.identity = desc.outBus == 0 && desc.outHash == outputHash;
+      it->nodes.emplace_back(node);
+    }
 
-    // clear all output buffers as from now we will += to them
-    for (auto &[_, buffers] : device->outputBuffers) {
-      for (auto &[_, buffer] : buffers) {
-        memset(buffer.data(), 0x0, buffer.size() * sizeof(float));
+    // topological sort, a group runs after every group writing its input
+    std::vector<size_t> pending(groups.size(), 0);
+    for (size_t i = 0; i < groups.size(); i++) {
+      for (auto &other : groups) {
+        for (auto &node : other.nodes) {
+          if (groups[i].source >= 0 && node.target == groups[i].source)
+            pending[i]++;
+        }
+      }
+    }
+    std::vector<bool> done(groups.size(), false);
+    graph->groups.reserve(groups.size());
+    while (graph->groups.size() < groups.size()) {
+      auto ready = groups.size();
+      for (size_t i = 0; i < groups.size(); i++) {
+        if (!done[i] && pending[i] == 0) {
+          ready = i;
+          break;
+        }
+      }
+      if (ready == groups.size()) {
+        throw WarmupError("Audio.Channel routing contains a cycle");
+      }
+      done[ready] = true;
+      for (auto &node : groups[ready].nodes) {
+        for (size_t i = 0; i < groups.size(); i++) {
+          if (groups[i].source >= 0 && node.target == groups[i].source)
+            pending[i]--;
+        }
       }
+      graph->groups.emplace_back(std::move(groups[ready]));
     }
 
-    // batch by output layout
-    for (auto &[nbus, channelKinds] : device->channels) {
-      for (auto &[kind, channels] : channelKinds) {
-        if (channels.size() == 0)
-          continue;
+    return graph;
+  }
 
-        // build the buffer with whatever we need as input
-        const auto nchannels = channels[0]->inChannels.size();
-
-        device->inputScratch.resize(frameCount * nchannels);
-
-        if (nbus == 0) {
-          if (kind == device->inputHash) {
-            // this is the full device input, just copy it
-            memcpy(device->inputScratch.data(), pInput,
-                   sizeof(float) * nchannels * frameCount);
-          } else {
-            auto *finput = reinterpret_cast<const float *>(pInput);
-            // need to properly compose the input
-            for (uint32_t c = 0; c < nchannels; c++) {
-              for (ma_uint32 i = 0; i < frameCount; i++) {
-                device->inputScratch[(i * nchannels) + c] =
-                    finput[(i * nchannels) + channels[0]->inChannels[c]];
-              }
-            }
-          }
+  // control thread, takes ownership of graph
+  void publish(AudioGraph *graph) {
+    delete _retiredGraph.exchange(nullptr);
+    // if still pending the audio thread never saw it
+    delete _pendingGraph.exchange(graph);
+  }
+
+  void addChannel(const ChannelDesc &desc) {
+    std::scoped_lock lock(_registryMutex);
+    _registry.emplace_back(desc);
+    std::unique_ptr<AudioGraph> graph;
+    try {
+      graph = compile();
+    } catch (...) {
+      _registry.pop_back();
+      throw;
+    }
+    // warmup can allocate, do it here rather than in the audio thread
+    desc.data->blocks.warmup(&compileContext);
+    publish(graph.release());
+  }
+
+  void removeChannel(ChannelData *data) {
+    std::scoped_lock lock(_registryMutex);
+    auto it = std::find_if(
+        _registry.begin(), _registry.end(),
+        [&](const ChannelDesc &desc) { return desc.data == data; });
+    if (it == _registry.end())
+      return;
+    _registry.erase(it);
+    publish(compile().release());
+  }
+
+  void releaseGraphs() {
+    delete _pendingGraph.exchange(nullptr);
+    delete _retiredGraph.exchange(nullptr);
+    delete _graph;
+    _graph = nullptr;
+  }
+
+  // audio thread
+  void swapGraph() {
+    // a single retire slot, wait until the control thread reclaims it
+    if (_retiredGraph.load(std::memory_order_acquire))
+      return;
+    auto graph = _pendingGraph.exchange(nullptr, std::memory_order_acq_rel);
+    if (!graph)
+      return;
+    auto old = _graph;
+    _graph = graph;
+    _retiredGraph.store(old, std::memory_order_release);
+  }
+
+  void fail(const char *message) {
+    errorMessage = message;
+    // this atomic will be read at the next iteration
+    hasErrors = true;
+    stopped = true;
+  }
+
+  // runs the graph for frameCount <= capacity frames
+  // output must be zeroed, returns false if processing stopped
+  bool process(AudioGraph &graph, const float *input, float *output,
+               ma_uint32 frameCount) {
+    actualBufferSize = frameCount;
+
+    // clear all bus buffers as from now we will += to them
+    for (auto &bus : graph.buses) {
+      memset(bus.samples.data(), 0x0,
+             sizeof(float) * bus.width * frameCount);
+    }
+
+    for (auto &group : graph.groups) {
+      // build the buffer with whatever we need as input
+      const auto nchannels = group.inChannels.size();
+      const float *samples = group.input.data();
+      if (group.source == AudioGraph::DeviceInput && input) {
+        if (group.identity) {
+          // this is the full device input, just copy it
+          memcpy(group.input.data(), input,
+                 sizeof(float) * nchannels * frameCount);
         } else {
-          const auto inputBuffer = device->outputBuffers[nbus][kind];
-          if (inputBuffer.size() != 0) {
-            std::copy(inputBuffer.begin(), inputBuffer.end(),
-                      device->inputScratch.begin());
-          } else {
-            memset(device->inputScratch.data(), 0x0,
-                   device->inputScratch.size() * sizeof(float));
+          // need to properly compose the input
+          for (ma_uint32 i = 0; i < frameCount; i++) {
+            for (size_t c = 0; c < nchannels; c++) {
+              group.input[(i * nchannels) + c] =
+                  input[(i * inChannels) + group.inChannels[c]];
+            }
           }
         }
+      } else if (group.source >= 0) {
+        // buses are complete at this point, read them in place
+        samples = graph.buses[group.source].samples.data();
+      } else {
+        memset(group.input.data(), 0x0,
+               sizeof(float) * nchannels * frameCount);
+      }
 
-        CBAudio inputPacket{uint32_t(device->sampleRate), //
-                            uint16_t(frameCount),         //
-                            uint16_t(nchannels),          //
-                            device->inputScratch.data()};
-        Var inputVar(inputPacket);
-
-        // run activations of all channels that need such input
-        for (auto channel : channels) {
-          CBVar output{};
-          device->dspChain->currentInput = inputVar;
-          if (channel->blocks.activate(&device->dspContext, inputVar, output,
-                                       false) == CBChainState::Stop) {
-            device->stopped = true;
-            // always cleanup or we risk to break someone's ears
-            memset(pOutput, 0x0, frameCount * sizeof(float));
-            return;
-          }
-          if (output.valueType == CBType::Audio) {
-            if (output.payload.audioValue.nsamples != frameCount) {
-              device->errorMessage = "Invalid output audio buffer size";
-              // this atomic will be read at the next iteration
-              device->hasErrors = true;
-              device->stopped = true;
-              // always cleanup or we risk to break someone's ears
-              memset(pOutput, 0x0, frameCount * sizeof(float));
-              return;
-            }
-            auto &a = output.payload.audioValue;
-            for (uint32_t i = 0; i < a.channels * a.nsamples; i++) {
-              channel->outputBuffer[i] +=
-                  a.samples[i] * channel->volume.get().payload.floatValue;
+      CBAudio inputPacket{uint32_t(sampleRate), //
+                          uint16_t(frameCount), //
+                          uint16_t(nchannels),  //
+                          const_cast<float *>(samples)};
+      Var inputVar(inputPacket);
+
+      // run activations of all channels that need such input
+      for (auto &node : group.nodes) {
+        CBVar res{};
+        dspChain->currentInput = inputVar;
+        if (node.data->blocks.activate(&dspContext, inputVar, res, false) ==
+            CBChainState::Stop) {
+          stopped = true;
+          return false;
+        }
+        if (res.valueType != CBType::Audio)
+          continue;
+
+        auto &a = res.payload.audioValue;
+        if (a.nsamples != frameCount) {
+          fail("Invalid output audio buffer size");
+          return false;
+        }
+        if (a.channels != node.width) {
+          fail("Invalid output audio channels");
+          return false;
+        }
+        const auto gain = float(node.data->volume.get().payload.floatValue);
+        if (node.target >= 0) {
+          mix(graph.buses[node.target].samples.data(), a.samples, gain,
+              size_t(a.channels) * frameCount);
+        } else if (node.identity) {
+          mix(output, a.samples, gain, size_t(outChannels) * frameCount);
+        } else {
+          auto &outs = node.data->outChannels;
+          for (ma_uint32 i = 0; i < frameCount; i++) {
+            for (size_t c = 0; c < outs.size(); c++) {
+              output[(i * outChannels) + outs[c]] +=
+                  a.samples[(i * a.channels) + c] * gain;
             }
           }
         }
       }
     }
 
-    // finally bake the device buffer
-    auto &output = device->outputBuffers[0][device->outputHash];
-    if (output.size() > 0) {
-      memcpy(pOutput, output.data(),
-             frameCount * sizeof(float) * device->outChannels);
-    } else {
-      // always cleanup or we risk to break someone's ears
-      memset(pOutput, 0x0, frameCount * sizeof(float) * device->outChannels);
+    return true;
+  }
+
+  // renders a whole device period, in chunks if bigger than the graph
+  void render(const float *input, float *output, ma_uint32 frameCount) {
+    // always cleanup or we risk to break someone's ears
+    memset(output, 0x0, sizeof(float) * outChannels * frameCount);
+
+    if (stopped)
+      return;
+
+    swapGraph();
+    if (!_graph)
+      return;
+
+    for (ma_uint32 offset = 0; offset < frameCount;) {
+      const auto chunk = std::min(frameCount - offset, _graph->capacity);
+      auto in = input ? input + size_t(offset) * inChannels : nullptr;
+      if (!process(*_graph, in, output + size_t(offset) * outChannels,
+                   chunk)) {
+        memset(output, 0x0, sizeof(float) * outChannels * frameCount);
+        return;
+      }
+      offset += chunk;
     }
   }
 
+  static void pcmCallback(ma_device *pDevice, void *pOutput, const void *pInput,
+                          ma_uint32 frameCount) {
+    assert(pDevice->capture.format == ma_format_f32);
+    assert(pDevice->playback.format == ma_format_f32);
+
+    auto device = reinterpret_cast<Device *>(pDevice->pUserData);
+    device->render(reinterpret_cast<const float *>(pInput),
+                   reinterpret_cast<float *>(pOutput), frameCount);
+  }
+
   void warmup(CBContext *context) {
     dspChain->node = dspNode;
 
@@ -247,6 +529,43 @@ struct Device {
     _deviceVarDsp->payload.objectTypeId = DeviceCC;
     _deviceVarDsp->payload.objectValue = this;
 
+    compileChain->node = dspNode;
+    _deviceVarCompile = referenceVariable(&compileContext, "Audio.Device");
+    _deviceVarCompile->valueType = CBType::Object;
+    _deviceVarCompile->payload.objectVendorId = CoreCC;
+    _deviceVarCompile->payload.objectTypeId = DeviceCC;
+    _deviceVarCompile->payload.objectValue = this;
+
+    if (_offline) {
+      // everything runs on our thread, no sound card involved
+      const auto frames = _frames > 0 ? _frames : bufferSize;
+      _offlineInput.assign(size_t(frames) * inChannels, 0.0f);
+      _offlineOutput.resize(size_t(frames) * outChannels);
+    } else {
+      open();
+    }
+
+    inputHash = layoutHash(inChannels);
+    outputHash = layoutHash(outChannels);
+
+    stopped = false;
+  }
+
+  // the hash of the full device layout of bus 0, same as Audio.Channel
+  static uint64_t layoutHash(ma_uint32 channels) {
+    uint32_t bus{0};
+    XXH3_state_s hashState;
+    XXH3_INITSTATE(&hashState);
+    XXH3_64bits_reset_withSecret(&hashState, CUSTOM_XXH3_kSecret,
+                                 XXH_SECRET_DEFAULT_SIZE);
+    XXH3_64bits_update(&hashState, &bus, sizeof(uint32_t));
+    for (CBInt i = 0; i < CBInt(channels); i++) {
+      XXH3_64bits_update(&hashState, &i, sizeof(CBInt));
+    }
+    return XXH3_64bits_digest(&hashState);
+  }
+
+  void open() {
     ma_device_config deviceConfig{};
     deviceConfig = ma_device_config_init(ma_device_type_duplex);
     deviceConfig.playback.pDeviceID = NULL;
@@ -271,40 +590,7 @@ struct Device {
       throw WarmupError("Failed to open default audio device");
     }
 
-    inputScratch.resize(bufferSize * deviceConfig.capture.channels);
-
-    {
-      uint64_t inChannels = uint64_t(deviceConfig.capture.channels);
-      uint32_t bus{0};
-      XXH3_state_s hashState;
-      XXH3_INITSTATE(&hashState);
-      XXH3_64bits_reset_withSecret(&hashState, CUSTOM_XXH3_kSecret,
-                                   XXH_SECRET_DEFAULT_SIZE);
-      XXH3_64bits_update(&hashState, &bus, sizeof(uint32_t));
-      for (CBInt i = 0; i < CBInt(inChannels); i++) {
-        XXH3_64bits_update(&hashState, &i, sizeof(CBInt));
-      }
-
-      inputHash = XXH3_64bits_digest(&hashState);
-    }
-
-    {
-      uint64_t outChannels = uint64_t(deviceConfig.playback.channels);
-      uint32_t bus{0};
-      XXH3_state_s hashState;
-      XXH3_INITSTATE(&hashState);
-      XXH3_64bits_reset_withSecret(&hashState, CUSTOM_XXH3_kSecret,
-                                   XXH_SECRET_DEFAULT_SIZE);
-      XXH3_64bits_update(&hashState, &bus, sizeof(uint32_t));
-      for (CBInt i = 0; i < CBInt(outChannels); i++) {
-        XXH3_64bits_update(&hashState, &i, sizeof(CBInt));
-      }
-
-      outputHash = XXH3_64bits_digest(&hashState);
-    }
-
     _open = true;
-    stopped = false;
   }
 
   void stop() const {
@@ -327,16 +613,60 @@ struct Device {
       _deviceVarDsp = nullptr;
     }
 
+    if (_deviceVarCompile) {
+      releaseVariable(_deviceVarCompile);
+      _deviceVarCompile = nullptr;
+    }
+
     _started = false;
     stopped = false;
     hasErrors = false;
-    channels.clear();
+
+    {
+      std::scoped_lock lock(_registryMutex);
+      _registry.clear();
+    }
+    releaseGraphs();
+  }
+
+  // renders as fast as we can on the calling thread, the sample clock is
+  // the only clock so results are the same on any machine
+  CBVar activateOffline(const CBVar &input) {
+    const auto frames = ma_uint32(_offlineOutput.size() / outChannels);
+    const float *samples = _offlineInput.data();
+    if (input.valueType == CBType::Audio) {
+      auto &a = input.payload.audioValue;
+      if (a.channels != inChannels || a.nsamples != frames) {
+        throw ActivationError("Audio.Device: input audio does not match the "
+                              "device channels and frames");
+      }
+      samples = a.samples;
+    }
+
+    render(samples, _offlineOutput.data(), frames);
+
+    if (hasErrors) {
+      throw ActivationError(errorMessage);
+    }
+
+    return Var(CBAudio{sampleRate, uint16_t(frames), uint16_t(outChannels),
+                       _offlineOutput.data()});
   }
 
   CBVar activate(CBContext *context, const CBVar &input) {
     // refresh this
     _deviceVar->payload.objectValue = this;
 
+    // graphs replaced by the audio thread are freed here
+    delete _retiredGraph.exchange(nullptr);
+
+    if (_offline) {
+      if (stopped) {
+        CB_STOP();
+      }
+      return activateOffline(input);
+    }
+
     if (!_started) {
       if (ma_device_start(&_device) != MA_SUCCESS) {
         throw ActivationError("Failed to start audio device");
@@ -366,7 +696,7 @@ struct Channel {
 
   ChannelData _data{};
   CBVar *_device{nullptr};
-  const Device *d{nullptr};
+  Device *d{nullptr};
   uint32_t _inBusNumber{0};
   OwnedVar _inChannels;
   uint32_t _outBusNumber{0};
@@ -453,7 +783,9 @@ struct Channel {
 
   void warmup(CBContext *context) {
     _device = referenceVariable(context, "Audio.Device");
-    d = reinterpret_cast<const Device *>(_device->payload.objectValue);
+    d = reinterpret_cast<Device *>(_device->payload.objectValue);
+    _data.inChannels.clear();
+    _data.outChannels.clear();
     uint64_t inHash = 0;
     uint64_t outHash = 0;
     uint32_t outChannels = 0;
@@ -489,12 +821,12 @@ struct Channel {
       outHash = XXH3_64bits_digest(&hashState);
     }
 
+    _data.volume.warmup(context);
+
     ChannelDesc cd{_inBusNumber, inHash,      _outBusNumber,
                    outHash,      outChannels, &_data};
-    d->newChannels.push(cd);
-
-    // blocks warmup done in audio thread!
-    _data.volume.warmup(context);
+    // also warms up our blocks
+    d->addChannel(cd);
   }
 
   void cleanup() {
@@ -502,6 +834,7 @@ struct Channel {
       // every device user needs to try and stop it!
       // else we risk to mess with the audio thread
       d->stop();
+      d->removeChannel(&_data);
       d = nullptr;
     }
 
@@ -581,7 +914,8 @@ struct Oscillator {
       _sampleRate = ma_uint32(value.payload.intValue);
       break;
     case 4:
-      _nsamples = ma_uint64(value.payload.intValue);
+      _nsamples = ma_uint64(
+          std::clamp(value.payload.intValue, int64_t(1), int64_t(UINT16_MAX)));
       break;
     default:
       throw InvalidParameterIndex();
@@ -737,7 +1071,8 @@ struct ReadFile {
       _sampleRate = ma_uint32(value.payload.intValue);
       break;
     case 3:
-      _nsamples = ma_uint64(value.payload.intValue);
+      _nsamples = ma_uint64(
+          std::clamp(value.payload.intValue, int64_t(1), int64_t(UINT16_MAX)));
       break;
     case 4:
       _looped = value.payload.boolValue;
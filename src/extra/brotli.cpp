@@ -8,6 +8,13 @@
 
 namespace chainblocks {
 namespace Brotli {
+// grow only, activations should not reallocate once the size settled
+inline uint8_t *reserve(std::vector<uint8_t> &buffer, size_t size) {
+  if (buffer.size() < size)
+    buffer.resize(size);
+  return buffer.data();
+}
+
 struct Compress {
   std::vector<uint8_t> _buffer;
   int _quality{BROTLI_DEFAULT_QUALITY};
@@ -32,18 +39,18 @@ struct Compress {
 
   CBVar activate(CBContext *context, const CBVar &input) {
     auto maxLen = BrotliEncoderMaxCompressedSize(input.payload.bytesSize);
-    _buffer.resize(maxLen + sizeof(uint32_t));
+    auto buffer = reserve(_buffer, maxLen + sizeof(uint32_t));
     size_t outputLen = maxLen;
     auto res = BrotliEncoderCompress(
         _quality, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE,
         input.payload.bytesSize, input.payload.bytesValue, &outputLen,
-        &_buffer[sizeof(uint32_t)]);
+        &buffer[sizeof(uint32_t)]);
     if (res != BROTLI_TRUE) {
       throw ActivationError("Failed to compress");
     }
-    auto len = reinterpret_cast<uint32_t *>(&_buffer.front());
+    auto len = reinterpret_cast<uint32_t *>(buffer);
     *len = input.payload.bytesSize;
-    return Var((uint8_t *)&_buffer[0], uint32_t(outputLen + sizeof(uint32_t)));
+    return Var(buffer, uint32_t(outputLen + sizeof(uint32_t)));
   }
 };
 
@@ -54,23 +61,124 @@ struct Decompress {
   static CBTypesInfo outputTypes() { return CoreInfo::BytesType; }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    auto len = reinterpret_cast<uint32_t *>(input.payload.bytesValue);
+    if (input.payload.bytesSize < sizeof(uint32_t)) {
+      throw ActivationError("Failed to decompress, input too small");
+    }
+    uint32_t len;
+    memcpy(&len, input.payload.bytesValue, sizeof(uint32_t));
     auto buffer = &input.payload.bytesValue[sizeof(uint32_t)];
     auto bufferSize = input.payload.bytesSize - sizeof(uint32_t);
-    _buffer.resize((*len) + 1);
-    size_t inLen = size_t(*len);
-    auto res = BrotliDecoderDecompress(bufferSize, buffer, &inLen, &_buffer[0]);
+    auto output = reserve(_buffer, size_t(len) + 1);
+    size_t inLen = size_t(len);
+    auto res = BrotliDecoderDecompress(bufferSize, buffer, &inLen, output);
     if (res != BROTLI_DECODER_RESULT_SUCCESS) {
       throw ActivationError("Failed to decompress");
     }
-    _buffer[*len] = 0;
-    return Var((uint8_t *)&_buffer[0], uint32_t(*len));
+    output[len] = 0;
+    return Var(output, len);
+  }
+};
+
+// Streaming variants keep the coder state alive across activations, every
+// activation flushes so its output can be decoded as soon as it arrives
+// while later chunks still reference the history of previous ones.
+// The stream restarts when the chain is restarted.
+struct CompressStream : public Compress {
+  BrotliEncoderState *_state{nullptr};
+
+  void cleanup() {
+    if (_state) {
+      BrotliEncoderDestroyInstance(_state);
+      _state = nullptr;
+    }
+  }
+
+  void warmup(CBContext *context) {
+    _state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+    if (!_state) {
+      throw WarmupError("Failed to create brotli encoder");
+    }
+    BrotliEncoderSetParameter(_state, BROTLI_PARAM_QUALITY, uint32_t(_quality));
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    size_t availIn = input.payload.bytesSize;
+    const uint8_t *nextIn = input.payload.bytesValue;
+    size_t used = 0;
+    // we usually need a bit less than the input, grow if not enough
+    reserve(_buffer, BrotliEncoderMaxCompressedSize(availIn) + 16);
+    while (true) {
+      size_t availOut = _buffer.size() - used;
+      uint8_t *nextOut = _buffer.data() + used;
+      if (!BrotliEncoderCompressStream(_state, BROTLI_OPERATION_FLUSH,
+                                       &availIn, &nextIn, &availOut, &nextOut,
+                                       nullptr)) {
+        throw ActivationError("Failed to compress");
+      }
+      used = size_t(nextOut - _buffer.data());
+      if (availIn == 0 && !BrotliEncoderHasMoreOutput(_state))
+        break;
+      if (availOut == 0)
+        _buffer.resize(_buffer.size() * 2);
+    }
+    return Var(_buffer.data(), uint32_t(used));
+  }
+};
+
+struct DecompressStream : public Decompress {
+  BrotliDecoderState *_state{nullptr};
+
+  void cleanup() {
+    if (_state) {
+      BrotliDecoderDestroyInstance(_state);
+      _state = nullptr;
+    }
+  }
+
+  void warmup(CBContext *context) {
+    _state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+    if (!_state) {
+      throw WarmupError("Failed to create brotli decoder");
+    }
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    size_t availIn = input.payload.bytesSize;
+    const uint8_t *nextIn = input.payload.bytesValue;
+    size_t used = 0;
+    reserve(_buffer, std::max(size_t(availIn) * 4, size_t(4096)));
+    while (true) {
+      // keep a byte for the null terminator
+      size_t availOut = _buffer.size() - used - 1;
+      uint8_t *nextOut = _buffer.data() + used;
+      auto res = BrotliDecoderDecompressStream(_state, &availIn, &nextIn,
+                                               &availOut, &nextOut, nullptr);
+      used = size_t(nextOut - _buffer.data());
+      if (res == BROTLI_DECODER_RESULT_ERROR) {
+        throw ActivationError(
+            std::string("Failed to decompress: ") +
+            BrotliDecoderErrorString(BrotliDecoderGetErrorCode(_state)));
+      } else if (res == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT ||
+                 (res == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT &&
+                  availOut == 0)) {
+        // a full output might still hide pending data, even when the decoder
+        // reports that it ran out of input
+        _buffer.resize(_buffer.size() * 2);
+      } else {
+        // needs more input (next activation) or the stream ended
+        break;
+      }
+    }
+    _buffer[used] = 0;
+    return Var(_buffer.data(), uint32_t(used));
   }
 };
 
 void registerBlocks() {
   REGISTER_CBLOCK("Brotli.Compress", Compress);
   REGISTER_CBLOCK("Brotli.Decompress", Decompress);
+  REGISTER_CBLOCK("Brotli.CompressStream", CompressStream);
+  REGISTER_CBLOCK("Brotli.DecompressStream", DecompressStream);
 }
 } // namespace Brotli
-} // namespace chainblocks
\ No newline at end of file
+} // namespace chainblocks
@@ -7,6 +7,11 @@
 #include "../../deps/kissfft/kiss_fft.h"
 #include "../../deps/kissfft/kiss_fftr.h"
 
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
 // TODO optimize.
 // Best would be to introduce our CBVar packing in kissfft fork
 // Just like linalg, so to use our types directly
@@ -15,9 +20,72 @@ namespace chainblocks {
 namespace DSP {
 static TableVar experimental{{"experimental", Var(true)}};
 
+// Complex kiss plans are immutable once allocated and can be used
+// concurrently, so one plan per (length, direction) is shared by every
+// block. Real plans are not, kiss_fftr goes through the plan's tmpbuf, so
+// those are shared only among the blocks running on the same thread.
+class Plans {
+public:
+  using Complex = std::shared_ptr<kiss_fft_state>;
+  using Real = std::shared_ptr<kiss_fftr_state>;
+
+  static Complex complex(int len, bool inverse) {
+    std::scoped_lock lock(_mutex);
+    return get(_complex, len, inverse, [](int len, bool inverse) {
+      return Complex(kiss_fft_alloc(len, inverse ? 1 : 0, 0, 0),
+                     [](kiss_fft_state *s) { kiss_fft_free(s); });
+    });
+  }
+
+  static Real real(int len, bool inverse) {
+    if (len % 2) {
+      throw ActivationError("Real FFT length must be even");
+    }
+    thread_local std::unordered_map<int64_t, Real> cache;
+    return get(cache, len, inverse, [](int len, bool inverse) {
+      return Real(kiss_fftr_alloc(len, inverse ? 1 : 0, 0, 0),
+                  [](kiss_fftr_state *s) { kiss_fftr_free(s); });
+    });
+  }
+
+private:
+  // plans nobody uses anymore are dropped once the cache grows past this
+  static constexpr size_t MaxIdle = 64;
+
+  template <typename P, typename F>
+  static P get(std::unordered_map<int64_t, P> &cache, int len, bool inverse,
+               F create) {
+    const auto key = int64_t(len) * 2 + (inverse ? 1 : 0);
+    auto it = cache.find(key);
+    if (it != cache.end())
+      return it->second;
+
+    if (cache.size() >= MaxIdle) {
+      for (auto jt = cache.begin(); jt != cache.end();) {
+        if (jt->second.use_count() == 1)
+          jt = cache.erase(jt);
+        else
+          ++jt;
+      }
+    }
+
+    auto plan = create(len, inverse);
+    if (!plan) {
+      throw ActivationError("Failed to allocate FFT plan");
+    }
+    cache.emplace(key, plan);
+    return plan;
+  }
+
+  static inline std::mutex _mutex;
+  static inline std::unordered_map<int64_t, Complex> _complex;
+};
+
 struct FFTBase {
-  kiss_fft_cfg _state{nullptr};
-  kiss_fftr_cfg _rstate{nullptr};
+  Plans::Complex _state;
+  Plans::Real _rstate;
+  // the thread _rstate was fetched on, see realPlan
+  std::thread::id _planThread;
   int _currentWindow{-1};
   std::vector<kiss_fft_cpx> _cscratch;
   std::vector<kiss_fft_cpx> _cscratch2;
@@ -28,15 +96,18 @@ struct FFTBase {
       {CoreInfo::FloatSeqType, CoreInfo::Float2SeqType, CoreInfo::AudioType}};
 
   void cleanup() {
-    if (_state) {
-      kiss_fft_free(_state);
-      _state = nullptr;
-    }
+    _state.reset();
+    _rstate.reset();
+    _currentWindow = -1;
+  }
 
-    if (_rstate) {
-      kiss_fftr_free(_rstate);
-      _rstate = nullptr;
-    }
+  // real plans belong to the thread that fetched them, a chain can be resumed
+  // on another thread so the plan is fetched again when that happens
+  void realPlan(int len, bool inverse) {
+    if (likely(_rstate && _planThread == std::this_thread::get_id()))
+      return;
+    _rstate = Plans::real(len, inverse);
+    _planThread = std::this_thread::get_id();
   }
 };
 
@@ -93,34 +164,36 @@ struct FFT : public FFTBase {
       cleanup();
 
       if constexpr (ITYPE == CBType::Float2) {
-        _state = kiss_fft_alloc(len, 0, 0, 0);
+        _state = Plans::complex(len, false);
         _cscratch2.resize(len);
       } else if constexpr (ITYPE == CBType::Float) {
-        _rstate = kiss_fftr_alloc(len, 0, 0, 0);
         _fscratch.resize(len);
-      } else {
-        _rstate = kiss_fftr_alloc(len, 0, 0, 0);
       }
       _currentWindow = len;
       _cscratch.resize(flen);
       _vscratch.resize(flen, CBVar{.valueType = CBType::Float2});
     }
 
+    if constexpr (ITYPE != CBType::Float2) {
+      realPlan(len, false);
+    }
+
     if constexpr (ITYPE == CBType::Float2) {
       int idx = 0;
       for (const auto &fvar : input) {
         _cscratch2[idx++] = {float(fvar.payload.float2Value[0]),
                              float(fvar.payload.float2Value[1])};
       }
-      kiss_fft(_state, _cscratch2.data(), _cscratch.data());
+      kiss_fft(_state.get(), _cscratch2.data(), _cscratch.data());
     } else if constexpr (ITYPE == CBType::Float) {
       int idx = 0;
       for (const auto &fvar : input) {
         _fscratch[idx++] = float(fvar.payload.floatValue);
       }
-      kiss_fftr(_rstate, _fscratch.data(), _cscratch.data());
+      kiss_fftr(_rstate.get(), _fscratch.data(), _cscratch.data());
     } else {
-      kiss_fftr(_rstate, input.payload.audioValue.samples, _cscratch.data());
+      kiss_fftr(_rstate.get(), input.payload.audioValue.samples,
+                _cscratch.data());
     }
 
     for (int i = 0; i < flen; i++) {
@@ -228,14 +301,17 @@ struct IFFT : public FFTBase {
       }
       if constexpr (OTYPE == CBType::Audio || OTYPE == CBType::Float) {
         _fscratch.resize(olen);
-        _rstate = kiss_fftr_alloc(olen, 1, 0, 0);
-        CBLOG_TRACE("IFFT alloc window {}", olen);
+        CBLOG_TRACE("IFFT window {}", olen);
       } else {
-        _state = kiss_fft_alloc(len, 1, 0, 0);
-        CBLOG_TRACE("IFFT alloc window {}", len);
+        _state = Plans::complex(len, true);
+        CBLOG_TRACE("IFFT window {}", len);
       }
     }
 
+    if constexpr (OTYPE == CBType::Audio || OTYPE == CBType::Float) {
+      realPlan(olen, true);
+    }
+
     int idx = 0;
     for (const auto &vf : input) {
       _cscratch[idx++] = {float(vf.payload.float2Value[0]),
@@ -243,11 +319,11 @@ struct IFFT : public FFTBase {
     }
 
     if constexpr (OTYPE == CBType::Audio) {
-      kiss_fftri(_rstate, _cscratch.data(), _fscratch.data());
+      kiss_fftri(_rstate.get(), _cscratch.data(), _fscratch.data());
 
       return Var(CBAudio{0, uint16_t(olen), uint16_t(1), _fscratch.data()});
     } else if constexpr (OTYPE == CBType::Float) {
-      kiss_fftri(_rstate, _cscratch.data(), _fscratch.data());
+      kiss_fftri(_rstate.get(), _cscratch.data(), _fscratch.data());
 
       for (int i = 0; i < olen; i++) {
         _vscratch[i].payload.floatValue = double(_fscratch[i]);
@@ -255,7 +331,7 @@ struct IFFT : public FFTBase {
 
       return Var(_vscratch);
     } else {
-      kiss_fft(_state, _cscratch.data(), _cscratch2.data());
+      kiss_fft(_state.get(), _cscratch.data(), _cscratch2.data());
 
       for (int i = 0; i < len; i++) {
         _vscratch[i].payload.float2Value[0] = _cscratch2[i].r;
@@ -279,6 +355,187 @@ struct IFFT : public FFTBase {
   }
 };
 
+// Transforms many frames of the same length in one go, frames are packed
+// float32 in and out (complex values are interleaved real, imaginary, the
+// same layout as kiss_fft_cpx) so nothing is converted from/to CBVars.
+// Multi channel audio is transformed per channel, one frame per channel.
+struct BatchFFT {
+  static inline Types InputTypes{{CoreInfo::BytesType, CoreInfo::AudioType}};
+
+  static CBTypesInfo inputTypes() { return InputTypes; }
+  static CBTypesInfo outputTypes() { return CoreInfo::BytesType; }
+
+  static const CBTable *properties() {
+    return &experimental.payload.tableValue;
+  }
+
+  static inline Parameters params{
+      {"Length",
+       CBCCSTR("The number of samples (or complex points) of every frame, 0 "
+               "uses the number of samples of the input audio."),
+       {CoreInfo::IntType}},
+      {"Complex",
+       CBCCSTR("Complex to complex transforms, otherwise real samples are "
+               "transformed into Length / 2 + 1 complex points and back."),
+       {CoreInfo::BoolType}},
+      {"Inverse",
+       CBCCSTR("Runs the inverse transform, the output is not normalized."),
+       {CoreInfo::BoolType}}};
+
+  CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _length = int(value.payload.intValue);
+      break;
+    case 1:
+      _complex = value.payload.boolValue;
+      break;
+    case 2:
+      _inverse = value.payload.boolValue;
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(_length);
+    case 1:
+      return Var(_complex);
+    case 2:
+      return Var(_inverse);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  int _length{0};
+  bool _complex{false};
+  bool _inverse{false};
+  int _currentWindow{-1};
+  Plans::Complex _state;
+  Plans::Real _rstate;
+  std::vector<float> _output;
+  std::vector<float> _deinterleaved;
+
+  CBTypeInfo compose(const CBInstanceData &data) {
+    if (data.inputType.basicType == Audio && (_complex || _inverse)) {
+      throw ComposeError("DSP.BatchFFT: audio input only supports forward "
+                         "real transforms");
+    }
+    if (_length < 0) {
+      throw ComposeError("DSP.BatchFFT: Length must be positive");
+    }
+    return CoreInfo::BytesType;
+  }
+
+  void cleanup() {
+    _state.reset();
+    _rstate.reset();
+    _currentWindow = -1;
+  }
+
+  void plan(int len) {
+    if (unlikely(_currentWindow != len)) {
+      if (_complex)
+        _state = Plans::complex(len, _inverse);
+      else
+        _rstate = Plans::real(len, _inverse);
+      _currentWindow = len;
+    }
+  }
+
+  // sizes in floats of a single frame
+  size_t inputFrame(int len) const {
+    if (_complex)
+      return size_t(len) * 2;
+    return _inverse ? size_t(len / 2 + 1) * 2 : size_t(len);
+  }
+
+  size_t outputFrame(int len) const {
+    if (_complex)
+      return size_t(len) * 2;
+    return _inverse ? size_t(len) : size_t(len / 2 + 1) * 2;
+  }
+
+  void transform(const float *in, float *out) {
+    if (_complex) {
+      kiss_fft(_state.get(), reinterpret_cast<const kiss_fft_cpx *>(in),
+               reinterpret_cast<kiss_fft_cpx *>(out));
+    } else if (_inverse) {
+      kiss_fftri(_rstate.get(), reinterpret_cast<const kiss_fft_cpx *>(in),
+                 out);
+    } else {
+      kiss_fftr(_rstate.get(), in, reinterpret_cast<kiss_fft_cpx *>(out));
+    }
+  }
+
+  CBVar activateAudio(const CBAudio &audio) {
+    const int len = _length > 0 ? _length : int(audio.nsamples);
+    if (len != int(audio.nsamples)) {
+      throw ActivationError("DSP.BatchFFT: audio samples don't match Length");
+    }
+    plan(len);
+    const size_t channels = audio.channels;
+    const size_t oframe = outputFrame(len);
+    _output.resize(oframe * channels);
+    if (channels == 1) {
+      transform(audio.samples, _output.data());
+    } else {
+      // audio is interleaved, make every channel a contiguous frame
+      _deinterleaved.resize(size_t(len) * channels);
+      for (size_t i = 0; i < size_t(len); i++) {
+        for (size_t c = 0; c < channels; c++) {
+          _deinterleaved[c * len + i] = audio.samples[i * channels + c];
+        }
+      }
+      for (size_t c = 0; c < channels; c++) {
+        transform(&_deinterleaved[c * len], &_output[c * oframe]);
+      }
+    }
+    return Var((uint8_t *)_output.data(),
+               uint32_t(_output.size() * sizeof(float)));
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (input.valueType == Audio) {
+      return activateAudio(input.payload.audioValue);
+    }
+
+    if (_length <= 0) {
+      throw ActivationError("DSP.BatchFFT: Length is required with bytes");
+    }
+    plan(_length);
+    const size_t iframe = inputFrame(_length);
+    const size_t oframe = outputFrame(_length);
+    const size_t size = input.payload.bytesSize;
+    if (size % (iframe * sizeof(float)) != 0) {
+      throw ActivationError(
+          "DSP.BatchFFT: input size is not a multiple of the frame size");
+    }
+    const size_t frames = size / (iframe * sizeof(float));
+    _output.resize(oframe * frames);
+    // bytes are not guaranteed to be float aligned
+    const float *in;
+    if (uintptr_t(input.payload.bytesValue) % alignof(float) != 0) {
+      _deinterleaved.resize(iframe * frames);
+      memcpy(_deinterleaved.data(), input.payload.bytesValue, size);
+      in = _deinterleaved.data();
+    } else {
+      in = reinterpret_cast<const float *>(input.payload.bytesValue);
+    }
+    for (size_t f = 0; f < frames; f++) {
+      transform(&in[f * iframe], &_output[f * oframe]);
+    }
+    return Var((uint8_t *)_output.data(),
+               uint32_t(_output.size() * sizeof(float)));
+  }
+};
+
 #if 0
 // TODO this works but we need to add more types, specifically orthogonal ones
 // TODO also add coverage of all cases
@@ -533,6 +790,7 @@ struct IWT : public WTBase {
 void registerBlocks() {
   REGISTER_CBLOCK("DSP.FFT", FFT);
   REGISTER_CBLOCK("DSP.IFFT", IFFT);
+  REGISTER_CBLOCK("DSP.BatchFFT", BatchFFT);
 #if 0
   REGISTER_CBLOCK("DSP.Wavelet", WT);
   REGISTER_CBLOCK("DSP.InverseWavelet", IWT);
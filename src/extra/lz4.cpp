@@ -0,0 +1,303 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/* Copyright © 2021 Fragcolor Pte. Ltd. */
+
+#include "blocks/shared.hpp"
+#include "runtime.hpp"
+#define LZ4_STATIC_LINKING_ONLY
+#include <lz4.h>
+
+namespace chainblocks {
+namespace LZ4 {
+static inline Types DictionaryTypes{
+    {CoreInfo::NoneType, CoreInfo::BytesType, CoreInfo::BytesVarType}};
+
+// lz4 never references data further back than this
+constexpr size_t HistorySize = 64 * 1024;
+
+inline char *reserve(std::vector<char> &buffer, size_t size) {
+  if (buffer.size() < size)
+    buffer.resize(size);
+  return buffer.data();
+}
+
+// Output layout is the same as Brotli: uint32 uncompressed size + lz4 block
+struct Compress {
+  static CBTypesInfo inputTypes() { return CoreInfo::BytesType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::BytesType; }
+
+  static inline Parameters params{
+      {"Acceleration",
+       CBCCSTR("Trades compression ratio for speed, 1 is the default and "
+               "every increment makes it roughly 3% faster."),
+       {CoreInfo::IntType}},
+      {"Dictionary",
+       CBCCSTR("An optional dictionary (e.g. trained with Zstd.Train) "
+               "improving small messages, it must be the same when "
+               "decompressing."),
+       {DictionaryTypes}}};
+
+  CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _acceleration = std::max(int(value.payload.intValue), 1);
+      break;
+    case 1:
+      _dictionary = value;
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(_acceleration);
+    case 1:
+      return _dictionary;
+    default:
+      return Var::Empty;
+    }
+  }
+
+  int _acceleration{1};
+  ParamVar _dictionary{};
+  std::vector<char> _buffer;
+  LZ4_stream_t *_stream{nullptr};
+  // the dictionary is digested once and attached to the stream every call,
+  // the hash catches a buffer refilled in place
+  LZ4_stream_t *_dictStream{nullptr};
+  const void *_dictData{nullptr};
+  uint32_t _dictSize{0};
+  uint64_t _dictHash{0};
+
+  void cleanup() {
+    if (_dictStream) {
+      LZ4_freeStream(_dictStream);
+      _dictStream = nullptr;
+    }
+    if (_stream) {
+      LZ4_freeStream(_stream);
+      _stream = nullptr;
+    }
+    _dictData = nullptr;
+    _dictSize = 0;
+    _dictHash = 0;
+    _dictionary.cleanup();
+  }
+
+  void warmup(CBContext *context) {
+    _dictionary.warmup(context);
+    _stream = LZ4_createStream();
+    if (!_stream)
+      throw WarmupError("Failed to create lz4 stream");
+  }
+
+  void updateDictionary() {
+    auto &dict = _dictionary.get();
+    if (dict.valueType != Bytes) {
+      _dictData = nullptr;
+      _dictSize = 0;
+      return;
+    }
+    const auto hash =
+        XXH3_64bits(dict.payload.bytesValue, dict.payload.bytesSize);
+    if (dict.payload.bytesValue == _dictData &&
+        dict.payload.bytesSize == _dictSize && hash == _dictHash)
+      return;
+    _dictData = dict.payload.bytesValue;
+    _dictSize = dict.payload.bytesSize;
+    _dictHash = hash;
+    if (!_dictStream) {
+      _dictStream = LZ4_createStream();
+      if (!_dictStream)
+        throw ActivationError("Failed to create lz4 stream");
+    }
+    LZ4_loadDict(_dictStream, (const char *)_dictData, int(_dictSize));
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (input.payload.bytesSize > LZ4_MAX_INPUT_SIZE) {
+      throw ActivationError("Failed to compress, input too large");
+    }
+    updateDictionary();
+    const auto inputSize = int(input.payload.bytesSize);
+    const auto bound = LZ4_compressBound(inputSize);
+    auto buffer = reserve(_buffer, size_t(bound) + sizeof(uint32_t));
+    LZ4_resetStream_fast(_stream);
+    LZ4_attach_dictionary(_stream, _dictData ? _dictStream : nullptr);
+    auto size = LZ4_compress_fast_continue(
+        _stream, (const char *)input.payload.bytesValue,
+        buffer + sizeof(uint32_t), inputSize, bound, _acceleration);
+    if (size <= 0) {
+      throw ActivationError("Failed to compress");
+    }
+    uint32_t len = input.payload.bytesSize;
+    memcpy(buffer, &len, sizeof(uint32_t));
+    return Var((uint8_t *)buffer, uint32_t(size + sizeof(uint32_t)));
+  }
+};
+
+struct Decompress {
+  static CBTypesInfo inputTypes() { return CoreInfo::BytesType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::BytesType; }
+
+  static inline Parameters params{
+      {"Dictionary",
+       CBCCSTR("The dictionary used when compressing, if any."),
+       {DictionaryTypes}}};
+
+  CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) { _dictionary = value; }
+
+  CBVar getParam(int index) { return _dictionary; }
+
+  ParamVar _dictionary{};
+  std::vector<char> _buffer;
+
+  void cleanup() { _dictionary.cleanup(); }
+
+  void warmup(CBContext *context) { _dictionary.warmup(context); }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (input.payload.bytesSize < sizeof(uint32_t)) {
+      throw ActivationError("Failed to decompress, input too small");
+    }
+    uint32_t len;
+    memcpy(&len, input.payload.bytesValue, sizeof(uint32_t));
+    if (len > LZ4_MAX_INPUT_SIZE) {
+      throw ActivationError("Failed to decompress, invalid size");
+    }
+    auto buffer = reserve(_buffer, size_t(len) + 1);
+    auto src = (const char *)input.payload.bytesValue + sizeof(uint32_t);
+    auto srcSize = int(input.payload.bytesSize - sizeof(uint32_t));
+    auto &dict = _dictionary.get();
+    int size;
+    if (dict.valueType == Bytes) {
+      size = LZ4_decompress_safe_usingDict(
+          src, buffer, srcSize, int(len), (const char *)dict.payload.bytesValue,
+          int(dict.payload.bytesSize));
+    } else {
+      size = LZ4_decompress_safe(src, buffer, srcSize, int(len));
+    }
+    if (size < 0 || uint32_t(size) != len) {
+      throw ActivationError("Failed to decompress");
+    }
+    buffer[len] = 0;
+    return Var((uint8_t *)buffer, len);
+  }
+};
+
+// Streaming variants let every chunk reference up to 64KB of previous
+// chunks, both sides keep that history across activations.
+// The stream restarts when the chain is restarted.
+struct CompressStream : public Compress {
+  // inputs are copied here so that consecutive chunks are contiguous
+  std::vector<char> _window;
+  size_t _pos{0};
+
+  static inline Parameters params{
+      {"Acceleration",
+       CBCCSTR("Trades compression ratio for speed, 1 is the default and "
+               "every increment makes it roughly 3% faster."),
+       {CoreInfo::IntType}}};
+
+  CBParametersInfo parameters() { return params; }
+
+  void warmup(CBContext *context) {
+    Compress::warmup(context);
+    _window.resize(HistorySize * 4);
+    _pos = 0;
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (input.payload.bytesSize > LZ4_MAX_INPUT_SIZE) {
+      throw ActivationError("Failed to compress, input too large");
+    }
+    const auto inputSize = int(input.payload.bytesSize);
+    if (_pos + inputSize > _window.size()) {
+      // move the history back to the front, to a bigger window if needed
+      if (HistorySize + inputSize > _window.size()) {
+        std::vector<char> window(HistorySize + size_t(inputSize) * 2);
+        _pos = LZ4_saveDict(_stream, window.data(), int(HistorySize));
+        _window.swap(window);
+      } else {
+        _pos = LZ4_saveDict(_stream, _window.data(), int(HistorySize));
+      }
+    }
+    auto source = _window.data() + _pos;
+    memcpy(source, input.payload.bytesValue, inputSize);
+    _pos += inputSize;
+
+    const auto bound = LZ4_compressBound(inputSize);
+    auto buffer = reserve(_buffer, size_t(bound) + sizeof(uint32_t));
+    auto size =
+        LZ4_compress_fast_continue(_stream, source, buffer + sizeof(uint32_t),
+                                   inputSize, bound, _acceleration);
+    if (size <= 0) {
+      throw ActivationError("Failed to compress");
+    }
+    uint32_t len = input.payload.bytesSize;
+    memcpy(buffer, &len, sizeof(uint32_t));
+    return Var((uint8_t *)buffer, uint32_t(size + sizeof(uint32_t)));
+  }
+};
+
+struct DecompressStream : public Decompress {
+  std::vector<char> _history;
+
+  static inline Parameters params{};
+
+  CBParametersInfo parameters() { return params; }
+
+  void warmup(CBContext *context) {
+    Decompress::warmup(context);
+    _history.clear();
+    _history.reserve(HistorySize * 2);
+  }
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    if (input.payload.bytesSize < sizeof(uint32_t)) {
+      throw ActivationError("Failed to decompress, input too small");
+    }
+    uint32_t len;
+    memcpy(&len, input.payload.bytesValue, sizeof(uint32_t));
+    if (len > LZ4_MAX_INPUT_SIZE) {
+      throw ActivationError("Failed to decompress, invalid size");
+    }
+    auto buffer = reserve(_buffer, size_t(len) + 1);
+    auto size = LZ4_decompress_safe_usingDict(
+        (const char *)input.payload.bytesValue + sizeof(uint32_t), buffer,
+        int(input.payload.bytesSize - sizeof(uint32_t)), int(len),
+        _history.data(), int(_history.size()));
+    if (size < 0 || uint32_t(size) != len) {
+      throw ActivationError("Failed to decompress");
+    }
+
+    // slide the history window
+    if (len >= HistorySize) {
+      _history.assign(buffer + len - HistorySize, buffer + len);
+    } else {
+      _history.insert(_history.end(), buffer, buffer + len);
+      if (_history.size() > HistorySize) {
+        _history.erase(_history.begin(),
+                       _history.begin() + (_history.size() - HistorySize));
+      }
+    }
+
+    buffer[len] = 0;
+    return Var((uint8_t *)buffer, len);
+  }
+};
+
+void registerBlocks() {
+  REGISTER_CBLOCK("LZ4.Compress", Compress);
+  REGISTER_CBLOCK("LZ4.Decompress", Decompress);
+  REGISTER_CBLOCK("LZ4.CompressStream", CompressStream);
+  REGISTER_CBLOCK("LZ4.DecompressStream", DecompressStream);
+}
+} // namespace LZ4
+} // namespace chainblocks
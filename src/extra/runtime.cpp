@@ -32,6 +32,14 @@ namespace Brotli {
 extern void registerBlocks();
 }
 
+namespace Zstd {
+extern void registerBlocks();
+}
+
+namespace LZ4 {
+extern void registerBlocks();
+}
+
 namespace XR {
 extern void registerBlocks();
 }
@@ -61,6 +69,8 @@ void cbInitExtras() {
 
   Snappy::registerBlocks();
   Brotli::registerBlocks();
+  Zstd::registerBlocks();
+  LZ4::registerBlocks();
 
 #ifdef __EMSCRIPTEN__
   registerEmscriptenShaderCompiler();
@@ -7,6 +7,13 @@
 
 namespace chainblocks {
 namespace Snappy {
+// grow only, activations should not reallocate once the size settled
+inline char *reserve(std::vector<char> &buffer, size_t size) {
+  if (buffer.size() < size)
+    buffer.resize(size);
+  return buffer.data();
+}
+
 struct Compress {
   std::vector<char> _buffer;
 
@@ -14,11 +21,12 @@ struct Compress {
   static CBTypesInfo outputTypes() { return CoreInfo::BytesType; }
 
   CBVar activate(CBContext *context, const CBVar &input) {
-    _buffer.resize(snappy::MaxCompressedLength(input.payload.bytesSize));
+    auto buffer = reserve(
+        _buffer, snappy::MaxCompressedLength(input.payload.bytesSize));
     size_t outputLen;
     snappy::RawCompress((char *)input.payload.bytesValue,
-                        input.payload.bytesSize, &_buffer[0], &outputLen);
-    return Var((uint8_t *)&_buffer[0], uint32_t(outputLen));
+                        input.payload.bytesSize, buffer, &outputLen);
+    return Var((uint8_t *)buffer, uint32_t(outputLen));
   }
 };
 
@@ -35,12 +43,14 @@ struct Decompress {
       throw CBException(
           "Snappy failed to find uncompressed length, probably invalid data!");
     }
-    _buffer.resize(len + 1);
-    snappy::RawUncompress((char *)input.payload.bytesValue,
-                          input.payload.bytesSize, &_buffer[0]);
+    auto buffer = reserve(_buffer, len + 1);
+    if (!snappy::RawUncompress((char *)input.payload.bytesValue,
+                               input.payload.bytesSize, buffer)) {
+      throw ActivationError("Snappy failed to decompress, invalid data!");
+    }
     // easy fix for null term strings
-    _buffer[len] = 0;
-    return Var((uint8_t *)&_buffer[0], uint32_t(len));
+    buffer[len] = 0;
+    return Var((uint8_t *)buffer, uint32_t(len));
   }
 };
 
@@ -0,0 +1,378 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/* Copyright © 2021 Fragcolor Pte. Ltd. */
+
+#include "blocks/shared.hpp"
+#include "runtime.hpp"
+#include <zdict.h>
+#include <zstd.h>
+
+namespace chainblocks {
+namespace Zstd {
+static inline Types DictionaryTypes{
+    {CoreInfo::NoneType, CoreInfo::BytesType, CoreInfo::BytesVarType}};
+
+inline uint8_t *reserve(std::vector<uint8_t> &buffer, size_t size) {
+  if (buffer.size() < size)
+    buffer.resize(size);
+  return buffer.data();
+}
+
+inline void check(size_t code, const char *what) {
+  if (ZSTD_isError(code)) {
+    throw ActivationError(std::string(what) + ": " + ZSTD_getErrorName(code));
+  }
+}
+
+struct Base {
+  static CBTypesInfo inputTypes() { return CoreInfo::BytesType; }
+  static CBTypesInfo outputTypes() { return CoreInfo::BytesType; }
+
+  std::vector<uint8_t> _buffer;
+  ParamVar _dictionary{};
+  // digested dictionaries are rebuilt only when the dictionary bytes change,
+  // the hash catches a buffer refilled in place
+  const void *_dictData{nullptr};
+  uint32_t _dictSize{0};
+  uint64_t _dictHash{0};
+
+  bool dictionaryChanged() {
+    auto &dict = _dictionary.get();
+    if (dict.valueType != Bytes) {
+      if (_dictData == nullptr)
+        return false;
+      _dictData = nullptr;
+      _dictSize = 0;
+      return true;
+    }
+    const auto hash =
+        XXH3_64bits(dict.payload.bytesValue, dict.payload.bytesSize);
+    if (dict.payload.bytesValue == _dictData &&
+        dict.payload.bytesSize == _dictSize && hash == _dictHash)
+      return false;
+    _dictData = dict.payload.bytesValue;
+    _dictSize = dict.payload.bytesSize;
+    _dictHash = hash;
+    return true;
+  }
+
+  void cleanup() {
+    _dictionary.cleanup();
+    _dictData = nullptr;
+    _dictSize = 0;
+    _dictHash = 0;
+  }
+
+  void warmup(CBContext *context) { _dictionary.warmup(context); }
+};
+
+struct CompressBase : public Base {
+  int _level{ZSTD_CLEVEL_DEFAULT};
+  int _workers{0};
+  ZSTD_CCtx *_ctx{nullptr};
+  ZSTD_CDict *_cdict{nullptr};
+
+  static inline Parameters params{
+      {"Level",
+       CBCCSTR("Compression level, higher is better but slower, valid values "
+               "from 1 to 19."),
+       {CoreInfo::IntType}},
+      {"Dictionary",
+       CBCCSTR("An optional dictionary trained with Zstd.Train, it must be "
+               "the same when decompressing."),
+       {DictionaryTypes}},
+      {"Workers",
+       CBCCSTR("The number of threads compressing large inputs in parallel, 0 "
+               "compresses on the calling thread."),
+       {CoreInfo::IntType}}};
+
+  CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    switch (index) {
+    case 0:
+      _level = std::clamp(int(value.payload.intValue), 1, 19);
+      break;
+    case 1:
+      _dictionary = value;
+      break;
+    case 2:
+      _workers = std::max(int(value.payload.intValue), 0);
+      break;
+    default:
+      break;
+    }
+  }
+
+  CBVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var(_level);
+    case 1:
+      return _dictionary;
+    case 2:
+      return Var(_workers);
+    default:
+      return Var::Empty;
+    }
+  }
+
+  void freeDict() {
+    if (_cdict) {
+      ZSTD_freeCDict(_cdict);
+      _cdict = nullptr;
+    }
+  }
+
+  void cleanup() {
+    freeDict();
+    if (_ctx) {
+      ZSTD_freeCCtx(_ctx);
+      _ctx = nullptr;
+    }
+    Base::cleanup();
+  }
+
+  void warmup(CBContext *context) {
+    Base::warmup(context);
+    _ctx = ZSTD_createCCtx();
+    if (!_ctx)
+      throw WarmupError("Failed to create zstd compression context");
+    ZSTD_CCtx_setParameter(_ctx, ZSTD_c_compressionLevel, _level);
+    if (_workers > 0 &&
+        ZSTD_isError(
+            ZSTD_CCtx_setParameter(_ctx, ZSTD_c_nbWorkers, _workers))) {
+      throw WarmupError("zstd was built without multi-threading support");
+    }
+  }
+
+  void updateDictionary() {
+    if (!dictionaryChanged())
+      return;
+    freeDict();
+    if (_dictData) {
+      _cdict = ZSTD_createCDict(_dictData, _dictSize, _level);
+      if (!_cdict)
+        throw ActivationError("Invalid zstd dictionary");
+    }
+    // a null dictionary reverts to plain compression
+    check(ZSTD_CCtx_refCDict(_ctx, _cdict), "Failed to set dictionary");
+  }
+};
+
+struct DecompressBase : public Base {
+  ZSTD_DCtx *_ctx{nullptr};
+  ZSTD_DDict *_ddict{nullptr};
+
+  static inline Parameters params{
+      {"Dictionary",
+       CBCCSTR("The dictionary used when compressing, if any."),
+       {DictionaryTypes}}};
+
+  CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) { _dictionary = value; }
+
+  CBVar getParam(int index) { return _dictionary; }
+
+  void freeDict() {
+    if (_ddict) {
+      ZSTD_freeDDict(_ddict);
+      _ddict = nullptr;
+    }
+  }
+
+  void cleanup() {
+    freeDict();
+    if (_ctx) {
+      ZSTD_freeDCtx(_ctx);
+      _ctx = nullptr;
+    }
+    Base::cleanup();
+  }
+
+  void warmup(CBContext *context) {
+    Base::warmup(context);
+    _ctx = ZSTD_createDCtx();
+    if (!_ctx)
+      throw WarmupError("Failed to create zstd decompression context");
+  }
+
+  void updateDictionary() {
+    if (!dictionaryChanged())
+      return;
+    freeDict();
+    if (_dictData) {
+      _ddict = ZSTD_createDDict(_dictData, _dictSize);
+      if (!_ddict)
+        throw ActivationError("Invalid zstd dictionary");
+    }
+    check(ZSTD_DCtx_refDDict(_ctx, _ddict), "Failed to set dictionary");
+  }
+
+  // decodes until the input is consumed, returns the decoded size
+  size_t decompressStream(const CBVar &input) {
+    ZSTD_inBuffer in{input.payload.bytesValue, input.payload.bytesSize, 0};
+    reserve(_buffer, std::max(size_t(in.size) * 4, ZSTD_DStreamOutSize()));
+    // keep a byte for the null terminator
+    ZSTD_outBuffer out{_buffer.data(), _buffer.size() - 1, 0};
+    while (true) {
+      check(ZSTD_decompressStream(_ctx, &out, &in), "Failed to decompress");
+      // a full output might still hide buffered data
+      if (in.pos == in.size && out.pos < out.size)
+        break;
+      if (out.pos == out.size) {
+        _buffer.resize(_buffer.size() * 2);
+        out.dst = _buffer.data();
+        out.size = _buffer.size() - 1;
+      }
+    }
+    _buffer[out.pos] = 0;
+    return out.pos;
+  }
+};
+
+struct Compress : public CompressBase {
+  CBVar activate(CBContext *context, const CBVar &input) {
+    updateDictionary();
+    auto bound = ZSTD_compressBound(input.payload.bytesSize);
+    auto buffer = reserve(_buffer, bound);
+    size_t size = 0;
+    if (_workers > 0) {
+      // workers block the calling thread until done, let the chain yield
+      await(
+          context,
+          [&]() {
+            size = ZSTD_compress2(_ctx, buffer, bound, input.payload.bytesValue,
+                                  input.payload.bytesSize);
+          },
+          [] {});
+    } else {
+      size = ZSTD_compress2(_ctx, buffer, bound, input.payload.bytesValue,
+                            input.payload.bytesSize);
+    }
+    check(size, "Failed to compress");
+    return Var(buffer, uint32_t(size));
+  }
+};
+
+struct Decompress : public DecompressBase {
+  CBVar activate(CBContext *context, const CBVar &input) {
+    updateDictionary();
+    auto len = ZSTD_getFrameContentSize(input.payload.bytesValue,
+                                        input.payload.bytesSize);
+    if (len == ZSTD_CONTENTSIZE_ERROR || len > UINT32_MAX) {
+      throw ActivationError("Failed to decompress, invalid frame");
+    }
+    if (len == ZSTD_CONTENTSIZE_UNKNOWN) {
+      // frames written by CompressStream don't record their size
+      check(ZSTD_DCtx_reset(_ctx, ZSTD_reset_session_only),
+            "Failed to decompress");
+      auto size = decompressStream(input);
+      if (size > UINT32_MAX)
+        throw ActivationError("Failed to decompress, output too large");
+      return Var(_buffer.data(), uint32_t(size));
+    }
+    auto buffer = reserve(_buffer, size_t(len) + 1);
+    auto size = ZSTD_decompressDCtx(_ctx, buffer, size_t(len),
+                                    input.payload.bytesValue,
+                                    input.payload.bytesSize);
+    check(size, "Failed to decompress");
+    buffer[size] = 0;
+    return Var(buffer, uint32_t(size));
+  }
+};
+
+// Streaming variants keep one frame open across activations, every
+// activation is flushed so the peer can decode it right away while later
+// chunks still match against the history of previous ones.
+// The stream restarts when the chain is restarted.
+struct CompressStream : public CompressBase {
+  CBVar activate(CBContext *context, const CBVar &input) {
+    updateDictionary();
+    ZSTD_inBuffer in{input.payload.bytesValue, input.payload.bytesSize, 0};
+    ZSTD_outBuffer out{
+        reserve(_buffer, ZSTD_compressBound(input.payload.bytesSize)),
+        _buffer.size(), 0};
+    while (true) {
+      auto remaining = ZSTD_compressStream2(_ctx, &out, &in, ZSTD_e_flush);
+      check(remaining, "Failed to compress");
+      if (remaining == 0)
+        break;
+      _buffer.resize(_buffer.size() * 2);
+      out.dst = _buffer.data();
+      out.size = _buffer.size();
+    }
+    return Var(_buffer.data(), uint32_t(out.pos));
+  }
+};
+
+struct DecompressStream : public DecompressBase {
+  CBVar activate(CBContext *context, const CBVar &input) {
+    updateDictionary();
+    auto size = decompressStream(input);
+    return Var(_buffer.data(), uint32_t(size));
+  }
+};
+
+struct Train {
+  static inline Types InputTypes{{CoreInfo::BytesSeqType}};
+
+  static CBTypesInfo inputTypes() { return InputTypes; }
+  static CBTypesInfo outputTypes() { return CoreInfo::BytesType; }
+
+  static inline Parameters params{
+      {"Size",
+       CBCCSTR("The maximum size of the dictionary in bytes, around 100 times "
+               "smaller than the total size of the samples works best."),
+       {CoreInfo::IntType}}};
+
+  CBParametersInfo parameters() { return params; }
+
+  void setParam(int index, const CBVar &value) {
+    // clamp while signed, a negative size would wrap around
+    _size = size_t(std::max(value.payload.intValue, int64_t(256)));
+  }
+
+  CBVar getParam(int index) { return Var(int64_t(_size)); }
+
+  size_t _size{110 * 1024};
+  std::vector<uint8_t> _samples;
+  std::vector<size_t> _sizes;
+  std::vector<uint8_t> _buffer;
+
+  CBVar activate(CBContext *context, const CBVar &input) {
+    _samples.clear();
+    _sizes.clear();
+    for (auto &sample : input) {
+      _samples.insert(_samples.end(), sample.payload.bytesValue,
+                      sample.payload.bytesValue + sample.payload.bytesSize);
+      _sizes.emplace_back(sample.payload.bytesSize);
+    }
+    _buffer.resize(_size);
+    size_t size = 0;
+    // training is slow, run it on the thread pool
+    await(
+        context,
+        [&]() {
+          size = ZDICT_trainFromBuffer(_buffer.data(), _buffer.size(),
+                                       _samples.data(), _sizes.data(),
+                                       unsigned(_sizes.size()));
+        },
+        [] {});
+    if (ZDICT_isError(size)) {
+      throw ActivationError(std::string("Failed to train dictionary: ") +
+                            ZDICT_getErrorName(size));
+    }
+    return Var(_buffer.data(), uint32_t(size));
+  }
+};
+
+void registerBlocks() {
+  REGISTER_CBLOCK("Zstd.Compress", Compress);
+  REGISTER_CBLOCK("Zstd.Decompress", Decompress);
+  REGISTER_CBLOCK("Zstd.CompressStream", CompressStream);
+  REGISTER_CBLOCK("Zstd.DecompressStream", DecompressStream);
+  REGISTER_CBLOCK("Zstd.Train", Train);
+}
+} // namespace Zstd
+} // namespace chainblocks
@@ -30,7 +30,23 @@
    (| (BigInt.ToHex) (Log))
    (BigInt.ToBytes :Bits 256) (Log)
    (ToHex) (Log)
-   (Assert.Is "0x00000000000000000000000000000000000000000000006c6b935b8bbd400000" true)))
+   (Assert.Is "0x00000000000000000000000000000000000000000000006c6b935b8bbd400000" true)
+
+   ; 256/512 bits words and results overflowing into arbitrary precision
+   "115792089237316195423570985008687907853269984665640564039457584007913129639935"
+   (BigInt) >= .max256
+   "1" (BigInt) >= .one
+   "-3" (BigInt) >= .minus3
+   .max256 (BigInt.Add .one) (BigInt.ToString)
+   (Assert.Is "115792089237316195423570985008687907853269984665640564039457584007913129639936" true)
+   .max256 (BigInt.Multiply .max256) (BigInt.Multiply .max256) (BigInt.Mod .max256)
+   (BigInt.ToString) (Assert.Is "0" true)
+   .one (BigInt.Subtract .max256) (BigInt.Add .max256) (BigInt.ToString)
+   (Assert.Is "1" true)
+   "-7" (BigInt) (BigInt.Mod .minus3) (BigInt.ToString) (Assert.Is "-1" true)
+   .minus3 (BigInt.Pow 3) (BigInt.ToString) (Assert.Is "-27" true)
+   "2" (BigInt) (BigInt.Pow 600) (BigInt.Mod .max256) (BigInt.ToString)
+   (Assert.Is "309485009821345068724781056" true)))
 
 (schedule Root test)
 (run Root 0.1 10)
\ No newline at end of file
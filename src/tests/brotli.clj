@@ -22,6 +22,18 @@
   (FromBytes)
   (ExpectString)
   (Assert.Is "Compressing this string is the test, Compressing this string is the test" true)
-  (Log)))
+  (Log)
+
+  ; chunks sharing the same stream
+  (Repeat
+   (->
+    (Get "string")
+    (ToBytes)
+    (Brotli.CompressStream :Quality 5)
+    (Brotli.DecompressStream)
+    (FromBytes)
+    (ExpectString)
+    (Assert.Is "Compressing this string is the test, Compressing this string is the test" true))
+   :Times 10)))
 
 (tick Root)
@@ -150,3 +150,49 @@
 (schedule Root evolveme)
 (run Root 0.1)
 (prn "Done 3")
+
+(def Root (Node))
+
+(def evolveme
+  (Chain
+   "test"
+   :Looped
+   (Once (-> 0 >= .era))
+   ; nothing changes the genomes, so only the first era runs anyone
+   (Evolve
+    (Chain
+     "frozen"
+     (Mutant (Const 10) [0])
+     (Mutant (Math.Multiply 2) [0]))
+    fitness
+    :Population 16
+    :Mutation 0.0
+    :Crossover 0.0
+    :Extinction 0.0
+    :Stats "frozen-stats")
+   ; every individual but the elites mutates
+   (Evolve
+    (Chain
+     "mutating"
+     (Mutant (Const 10) [0])
+     (Mutant (Math.Multiply 2) [0]))
+    fitness
+    :Population 16
+    :Mutation 1.0
+    :Crossover 0.0
+    :Extinction 0.0
+    :Elitism 0.25
+    :Stats "mutating-stats")
+   .era
+   (If (Is 0)
+       :Then (-> .frozen-stats (Assert.Is (Int2 16 0) true)
+                 .mutating-stats (Assert.Is (Int2 16 0) true))
+       :Else (-> .frozen-stats (Assert.Is (Int2 0 16) true)
+                 .mutating-stats (Assert.Is (Int2 12 4) true)))
+   (Math.Inc .era)
+   .era
+   (When (IsMore 3) (Stop))))
+
+(schedule Root evolveme)
+(run Root 0.1)
+(prn "Done 4")
@@ -66,23 +66,121 @@
            "avocado.glb" (FS.Write .avocado :Overwrite true)))
 (run Root 0.1)
 
-;; (def server-handler
-;;   (Chain
-;;    "server-handler"
-;;    :Looped
-;;    (Msg "handled")
-;;    (Http.Read)
-;;    (Log)
-;;    1 >> .r
-;;    2 >> .r
-;;    3 >> .r
-;;    .r (ToJson) (Http.Response)))
-
-;; (def test-server
-;;   (Chain
-;;    "test"
-;;    :Looped
-;;    (Http.Server :Handler server-handler)))
-
-;; (schedule Root test-server)
-;; (run Root 0.1)
\ No newline at end of file
+;; loopback server, every connection is served by one handler chain for as
+;; long as the client keeps it alive
+(def http-handler
+  (Chain
+   "http-handler"
+   0 >= .served
+   (Repeat
+    (->
+     (Http.Read :Timeout 5) (Take "target") >= .target
+     (Math.Inc .served)
+     .target
+     (Cond
+      [(-> (Is "/count")) (-> .served (ToString) (Http.Response))
+       (-> (Is "/stream")) (-> ["a" "b" ""] (ForEach (Http.Stream)))
+       (-> true) (-> .target (Http.SendFile))]))
+    :Forever true)))
+
+(def http-server
+  (Chain
+   "http-server"
+   :Looped
+   (Http.Server :Handler http-handler :Endpoint "127.0.0.1" :Port 7080)))
+
+(def http-client
+  (Chain
+   "http-client"
+   (Pause 0.2)
+   ; keep-alive, the handler counts the requests of its connection
+   0 >= .expected
+   (Repeat
+    (->
+     (Math.Inc .expected)
+     .expected (ToString) >= .expected-str
+     nil (Http.Get "http://127.0.0.1:7080/count" :MaxConnections 1)
+     (Is .expected-str) (Assert.Is true true))
+    :Times 3)
+   ; without keep-alive the pool opens a new connection for every request
+   (Repeat
+    (->
+     nil (Http.Get "http://127.0.0.1:7080/count" :KeepAlive 0)
+     (Assert.Is "1" true))
+    :Times 2)
+   ; a chunked response, one chunk per Http.Stream activation
+   nil (Http.Get "http://127.0.0.1:7080/stream") (Assert.Is "ab" true)
+   "http-test.txt" (FS.Write "Hello range test" :Overwrite true)
+   "http-test.txt.gz" (FS.Write "gzipped" :Overwrite true)
+   ; a single byte range
+   nil
+   (Http.Get "http://127.0.0.1:7080/http-test.txt"
+             :Headers {"Range" "bytes=6-10"} :FullResponse true) >= .ranged
+   (Take "status") (Assert.Is 206 true)
+   .ranged (Take "body") (Assert.Is "range" true)
+   ; the etag makes the next request conditional
+   .ranged (Take "headers") (Take "etag") (Set .conditional "If-None-Match")
+   nil
+   (Http.Get "http://127.0.0.1:7080/http-test.txt"
+             :Headers .conditional :FullResponse true)
+   (Take "status") (Assert.Is 304 true)
+   ; the pre-compressed sibling is sent as is
+   nil
+   (Http.Get "http://127.0.0.1:7080/http-test.txt"
+             :Headers {"Accept-Encoding" "gzip"} :FullResponse true) >= .encoded
+   (Take "headers") (Take "content-encoding") (Assert.Is "gzip" true)
+   .encoded (Take "body") (Assert.Is "gzipped" true)
+   "http-test.txt" (FS.Remove)
+   "http-test.txt.gz" (FS.Remove)))
+
+;; the same handler on two worker threads, each with its own node
+(def http-threaded-server
+  (Chain
+   "http-threaded-server"
+   :Looped
+   (Http.Server :Handler http-handler :Endpoint "127.0.0.1" :Port 7081
+                :Threads 2)))
+
+(def http-threaded-client
+  (Chain
+   "http-threaded-client"
+   (Pause 0.2)
+   nil (Http.Get "http://127.0.0.1:7081/count") (Assert.Is "1" true)
+   nil (Http.Get "http://127.0.0.1:7081/count") (Assert.Is "2" true)
+   nil (Http.Get "http://127.0.0.1:7081/stream") (Assert.Is "ab" true)))
+
+;; started together, the second request is pipelined on the connection of
+;; the first one (another host name, so another connection than http-client)
+(defn pipe-client [name]
+  (Chain
+   name
+   nil
+   (Http.Get "http://localhost:7080/count" :MaxConnections 1 :Pipelining true)))
+(def pipe-a (pipe-client "pipe-a"))
+(def pipe-b (pipe-client "pipe-b"))
+
+;; the servers are stopped whatever happens, so that a failure empties the
+;; node and makes run return false
+(def http-loopback
+  (Chain
+   "http-loopback"
+   (Detach http-server)
+   (Detach http-client)
+   (Detach http-threaded-server)
+   (Detach http-threaded-client)
+   (Maybe (->
+           (Wait http-client :Passthrough true)
+           (Wait http-threaded-client :Passthrough true)
+           (Detach pipe-a) (Detach pipe-b)
+           (Wait pipe-a) (ExpectString) (ParseInt) >= .pipelined
+           (Wait pipe-b) (ExpectString) (ParseInt) (Math.Add .pipelined)
+           ; 1 and 2, both served in order by the same handler
+           (Assert.Is 3 true))
+          :Else (-> (Stop http-server) (Stop http-threaded-server)
+                    (Fail "Http loopback test failed")))
+   (Stop http-server)
+   (Stop http-threaded-server)))
+
+(def Root (Node))
+(schedule Root http-loopback)
+(if (run Root 0.01) nil (throw "Http loopback test failed"))
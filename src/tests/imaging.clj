@@ -30,6 +30,45 @@
   (Log)
   .baseImg
   (ResizeImage 200 200)
-  (WritePNG "testResized.png")))
+  (WritePNG "testResized.png")
+  ; whole image filters
+  .baseImg (BlurImage 3 :Threads 4) (WritePNG "testBlur.png")
+  .baseImg (SharpenImage 0.5) (WritePNG "testSharpen.png")
+  .baseImg (StripAlpha) (SobelImage :Threads 2) (WritePNG "testSobel.png")
+  .baseImg (FilterImage [0.25 0.5 0.25] [0.25 0.5 0.25]) (WritePNG "testFilter.png")
+  .baseImg (ConvolveImage [0.0 0.0 0.0 0.0 1.0 0.0 0.0 0.0 0.0]) (WritePNG "testIdentity.png")
+  (Is .baseImg) (Assert.Is true true)
+  .baseImg (ConvolveImage [0.0 0.0 0.0 0.0 1.0 0.0 0.0 0.0 0.0] :Threads 4)
+  (Is .baseImg) (Assert.Is true true)
+  .baseImg (FilterImage [1.0] [1.0]) (Is .baseImg) (Assert.Is true true)
+  .baseImg (SharpenImage 0.0) (Is .baseImg) (Assert.Is true true)
+  ; a flat image stays flat when blurred and has no edges
+  .baseImg (ResizeImage 32 32) (ImageToFloats) (Math.Multiply 0.0) >= .zeros
+  (FloatsToImage 32 32 4) >= .blackImg
+  .zeros (Math.Add 0.5) (FloatsToImage 32 32 4) >= .flatImg
+  (BlurImage 3 :Threads 4) (Is .flatImg) (Assert.Is true true)
+  .flatImg (FilterImage [0.25 0.5 0.25] [0.25 0.5 0.25]) (Is .flatImg) (Assert.Is true true)
+  .flatImg (SobelImage) (Is .blackImg) (Assert.Is true true)
+  ; 402x239 pixels, a 5x5 patch every 4 pixels: 101x60 patches of 25 pixels
+  .baseImg (StripAlpha) >= .rgbImg
+  (ExtractPatches 3 :Step 4) (Log)
+  (ImageToFloats) >= .patchFloats
+  (Count .patchFloats) (Assert.Is 454500 true)
+  ; 1x1 patches at every pixel are the pixels themselves
+  .rgbImg (ResizeImage 64 64) >= .smallImg
+  (ImageToFloats) >= .smallFloats
+  .smallImg (ExtractPatches 1 :Threads 2) (ImageToFloats) (Is .smallFloats) (Assert.Is true true)
+  ; large images, views and streaming
+  (LargeImage.Load "../../assets/simple1.PNG") >= .large
+  ; the streamed PNG decoder gives the same pixels as stb_image
+  (LargeImage.ToImage) (Is .baseImg) (Assert.Is true true)
+  (LargeImage.Load "../../assets/simple1.PNG" :BPP BPP.u16) (LargeImage.ToImage) >= .large16
+  (LoadImage "../../assets/simple1.PNG" :BPP BPP.u16) (Is .large16) (Assert.Is true true)
+  (LargeImage.Size) (Log "large size")
+  .large (LargeImage.Crop 10 10 32 16) (LargeImage.ToImage) (WritePNG "testCrop.png")
+  .large (LargeImage.Tiles 16) (Count) (Log "tiles")
+  .large (LargeImage.Resize 70000 2) (LargeImage.Size) (Assert.Is (Int2 70000 2) true)
+  .large (LargeImage.Resize 100 100) (LargeImage.WritePNG "testLarge.png")
+  (LoadImage "testLarge.png") (Log)))
 
 (run Root 0.1)
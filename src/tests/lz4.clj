@@ -0,0 +1,76 @@
+; SPDX-License-Identifier: BSD-3-Clause
+; Copyright © 2021 Fragcolor Pte. Ltd.
+
+(def Root (Node))
+
+(schedule
+ Root
+ (Chain
+  "lz4-test"
+  "Compressing this string is the test, Compressing this string is the test"
+  (Set "string")
+  (Count "string")
+  (Log "length")
+  (Get "string")
+  (ToBytes)
+  (LZ4.Compress)
+  (Set "compressed")
+  (Count "compressed")
+  (Log "compressed")
+  (Get "compressed")
+  (LZ4.Decompress)
+  (FromBytes)
+  (ExpectString)
+  (Assert.Is "Compressing this string is the test, Compressing this string is the test" true)
+  (Log)
+
+  ; faster, bigger
+  (Get "string")
+  (ToBytes)
+  (LZ4.Compress :Acceleration 8)
+  (LZ4.Decompress)
+  (FromBytes)
+  (ExpectString)
+  (Assert.Is "Compressing this string is the test, Compressing this string is the test" true)
+
+  ; chunks sharing the same stream
+  (Repeat
+   (->
+    (Get "string")
+    (ToBytes)
+    (LZ4.CompressStream)
+    (LZ4.DecompressStream)
+    (FromBytes)
+    (ExpectString)
+    (Assert.Is "Compressing this string is the test, Compressing this string is the test" true))
+   :Times 10)
+
+  ; small messages with a trained dictionary
+  (Repeat
+   (->
+    (RandomInt 1000) (ToString) >= .id
+    "{\"name\": \"player\", \"id\": " >= .sample
+    .id (AppendTo .sample)
+    ", \"status\": \"online\"}" (AppendTo .sample)
+    .sample (ToBytes) (Push "samples"))
+   :Times 1000)
+  (Get "samples")
+  (Zstd.Train :Size 1024)
+  (Set "dictionary")
+  (Count "dictionary")
+  (Log "dictionary")
+  "{\"name\": \"player\", \"id\": 42, \"status\": \"online\"}"
+  (ToBytes)
+  (LZ4.Compress :Dictionary .dictionary)
+  (Count)
+  (Log "with dictionary")
+  "{\"name\": \"player\", \"id\": 42, \"status\": \"online\"}"
+  (ToBytes)
+  (LZ4.Compress :Dictionary .dictionary)
+  (LZ4.Decompress :Dictionary .dictionary)
+  (FromBytes)
+  (ExpectString)
+  (Assert.Is "{\"name\": \"player\", \"id\": 42, \"status\": \"online\"}" true)
+  (Log)))
+
+(tick Root)
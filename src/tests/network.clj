@@ -25,7 +25,22 @@
                                         ; will use automatically the context vars
            "Ok"
            (Network.Send)
-           ))))
+           ; packets/drops counters of this socket
+           (Network.Stats)
+           (Log)
+           ))
+         ; by the 4th tick the 5 packets of the client came in as one batch
+         ; and the 5 replies went out
+         (Once (-> 0 >= .server-ticks))
+         (Math.Inc .server-ticks)
+         .server-ticks
+         (When (Is 4)
+               (->
+                (Network.Stats) >= .server-stats
+                (Take "Received") (Assert.Is 5 true)
+                .server-stats (Take "Sent") (Assert.Is 5 true)
+                .server-stats (Take "Dropped") (Assert.Is 0 true)
+                (Msg "Server stats OK")))))
 
 (def client-init
   (Chain "init"
@@ -54,6 +69,16 @@
                                         ; Network.RemoteEndpoint
                                         ; are the injected variables
          (Once (Dispatch client-init))
+         (Once (-> 0 >= .client-ticks))
+         (Math.Inc .client-ticks)
+         .client-ticks
+         (When (Is 4)
+               (->
+                (Network.Stats) >= .client-stats
+                (Take "Sent") (Assert.Is 5 true)
+                .client-stats (Take "Received") (Assert.Is 5 true)
+                .client-stats (Take "Dropped") (Assert.Is 0 true)
+                (Msg "Client stats OK")))
          ))
 
 ; manually tick and such to properly close all (threads... windows issues)
@@ -67,6 +92,15 @@
 (tick network-test-server)
 (tick network-test-client)
 (sleep 3)
+; sends are flushed once per tick, let the replies go out
+(tick network-test-server)
+(tick network-test-client)
+(sleep 3)
+; both check their stats now, a failed check stops the chain
+(tick network-test-server)
+(tick network-test-client)
+(if (tick network-test-server) nil (throw "Network server stats check failed"))
+(if (tick network-test-client) nil (throw "Network client stats check failed"))
 (stop network-test-server)
 (stop network-test-client)
 ; destroy chains - issues with CI, to investigate better.. valgrind, gdb, drmingw said no problem tho...
@@ -75,3 +109,48 @@
 ;(def client-init nil)
 (sleep 3)
           
+
+; reliable ordered transport, the server echoes back what it gets and the
+; client checks it got everything back, in order
+(def kcp-node (Node))
+
+(schedule
+ kcp-node
+ (Chain "kcp-server" :Looped
+        (Network.KCPServer
+         "127.0.0.1" 9192
+         (->
+          (Network.Send)))))
+
+(schedule
+ kcp-node
+ (Chain "kcp-client" :Looped
+        (Sequence .kcp-echoes :Clear false)
+        (Network.KCPClient
+         "127.0.0.1" 9192
+         (->
+          (Push .kcp-echoes))
+         :Interval 5 :Window 256)
+        (Once (Dispatch client-init))
+        (Count .kcp-echoes)
+        (When (IsMore 4)
+              (->
+               .kcp-echoes
+               (Assert.Is ["Hey server" 2019 99.9 (Float4 3 2 1 0) [1 2 3 4 5]] true)
+               (Msg "KCP echoes OK")
+               (Stop)))
+        (Once (-> 0 >= .kcp-iterations))
+        (Math.Inc .kcp-iterations)
+        .kcp-iterations
+        (When (IsMore 150) (-> "KCP echoes not received" (Fail)))))
+
+(defn kcp-run [n]
+  (if (> n 0)
+    (do
+      (if (tick kcp-node) nil (throw "KCP test failed"))
+      (sleep 0.01)
+      (kcp-run (- n 1)))))
+
+(kcp-run 200)
+(def kcp-node nil)
+(sleep 1)
@@ -62,6 +62,23 @@
   (Take 2)
   (ExpectInt)
   (Assert.Is 3 true)
+
+  ; array of structs
+  (Const [[1 [1.0 2.0]] [2 [3.0 4.0]] [3 [5.0 6.0]]])
+  (Pack "i16 f64[2]" :Batch true) >= .aos
+  (Count .aos) (Assert.Is 54 true)
+  .aos (Unpack "i16 f64[2]" :Batch true) >= .records
+  (Count .records) (Assert.Is 3 true)
+  .records (Take 2) (ExpectSeq) (Take 1) (ExpectSeq)
+  (Take 1) (ExpectFloat) (Assert.Is 6.0 true)
+
+  ; short or misaligned input is rejected, not read past the end
+  .aos (Slice :To 4)
+  (Maybe (-> (Unpack "i16 f64[2]") "read") :Else (-> "rejected") :Silent true)
+  (Assert.Is "rejected" true)
+  .aos (Slice :To 20)
+  (Maybe (-> (Unpack "i16 f64[2]" :Batch true) "read") :Else (-> "rejected") :Silent true)
+  (Assert.Is "rejected" true)
   ))
 
 (tick Root)
@@ -1,11 +1,14 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 /* Copyright © 2020 Fragcolor Pte. Ltd. */
 
+#include <fstream>
 #include <random>
 
 #include "../../include/ops.hpp"
 #include "../../include/utility.hpp"
+#include "../core/blocks/http.hpp"
 #include "../core/runtime.hpp"
+#include "spdlog/sinks/base_sink.h"
 #include <linalg_shim.hpp>
 
 #undef CHECK
@@ -1174,6 +1177,100 @@ TEST_CASE("HashedActivations") {
   REQUIRE(output == input);
 }
 
+static int composeCalls = 0;
+static CBComposeProc innerCompose = nullptr;
+
+static int getParamCalls = 0;
+static CBGetParamProc innerGetParam = nullptr;
+
+static CBTypeInfo countingCompose(CBlock *self, CBInstanceData data) {
+  composeCalls++;
+  data.reportError(data.privateContext, "counted", true);
+  return innerCompose(self, data);
+}
+
+static CBVar countingGetParam(CBlock *self, int index) {
+  getParamCalls++;
+  return innerGetParam(self, index);
+}
+
+TEST_CASE("ComposeCache") {
+  auto chain = chainblocks::Chain("compose-cache-chain")
+                   .let(1)
+                   .block("Math.Add", 2)
+                   .block("Assert.Is", 3, true);
+  std::shared_ptr<CBChain> chainPtr = chain;
+
+  std::vector<std::string> warnings;
+  auto compose = [&]() {
+    CBInstanceData data{};
+    data.chain = chainPtr.get();
+    auto res = composeChain(
+        chainPtr.get(),
+        [](const CBlock *errorBlock, const char *errorTxt, bool nonfatalWarning,
+           void *userData) {
+          if (!nonfatalWarning)
+            throw ComposeError(errorTxt);
+          reinterpret_cast<std::vector<std::string> *>(userData)->emplace_back(
+              errorTxt);
+        },
+        &warnings, data);
+    arrayFree(res.exposedInfo);
+    arrayFree(res.requiredInfo);
+    return res.outputType;
+  };
+
+  // count how many times the blocks are actually composed
+  auto add = chainPtr->blocks[1];
+  REQUIRE(add->compose != nullptr);
+  innerCompose = add->compose;
+  add->compose = &countingCompose;
+  composeCalls = 0;
+
+  REQUIRE(compose().basicType == CBType::Int);
+  const auto key = chainPtr->composeCacheKey;
+  REQUIRE(key != 0);
+  REQUIRE(composeCalls == 1);
+  REQUIRE(warnings.size() == 1);
+
+  // same structure and input, reused without composing
+  REQUIRE(compose().basicType == CBType::Int);
+  REQUIRE(chainPtr->composeCacheKey == key);
+  REQUIRE(composeCalls == 1);
+  // and the warnings of the cached compose are reported again
+  REQUIRE(warnings.size() == 2);
+  REQUIRE(warnings[1] == warnings[0]);
+
+  // a parameter change invalidates the cached result
+  auto operand = Var(3);
+  add->setParam(add, 0, &operand);
+  REQUIRE(compose().basicType == CBType::Int);
+  REQUIRE(chainPtr->composeCacheKey != key);
+  REQUIRE(composeCalls == 2);
+
+  // blocks of a warmed up chain are hashed only once until cleanup
+  innerGetParam = add->getParam;
+  add->getParam = &countingGetParam;
+  chainPtr->warmedUp = true;
+  getParamCalls = 0;
+  REQUIRE(compose().basicType == CBType::Int);
+  REQUIRE(getParamCalls > 0);
+  REQUIRE(chainPtr->composeBlocksHash != 0);
+  const auto calls = getParamCalls;
+  REQUIRE(compose().basicType == CBType::Int);
+  REQUIRE(getParamCalls == calls);
+  REQUIRE(composeCalls == 2);
+
+  chainPtr->cleanup(true);
+  REQUIRE(chainPtr->composeBlocksHash == 0);
+  REQUIRE(compose().basicType == CBType::Int);
+  REQUIRE(getParamCalls > calls);
+  REQUIRE(composeCalls == 2);
+
+  add->getParam = innerGetParam;
+  add->compose = innerCompose;
+}
+
 #include "number_types.hpp"
 
 TEST_CASE("Number Types") {
@@ -1296,3 +1393,221 @@ TEST_CASE("Vector types") {
     CHECK(compatibleType->isInteger);
   }
 }
+
+TEST_CASE("HttpHeaders") {
+  using namespace chainblocks::Http;
+
+  SECTION("Range") {
+    uint64_t first = 0, last = 0;
+    bool partial = false;
+    CHECK(parseRange("bytes=0-99", 1000, first, last, partial));
+    CHECK(partial);
+    CHECK(first == 0);
+    CHECK(last == 99);
+    // open ended and clamped to the end
+    CHECK(parseRange("bytes=900-", 1000, first, last, partial));
+    CHECK((first == 900 && last == 999 && partial));
+    CHECK(parseRange("bytes=990-2000", 1000, first, last, partial));
+    CHECK((first == 990 && last == 999 && partial));
+    // suffix, the last 100 bytes, all of them if larger than the file
+    CHECK(parseRange("bytes=-100", 1000, first, last, partial));
+    CHECK((first == 900 && last == 999 && partial));
+    CHECK(parseRange("bytes=-5000", 1000, first, last, partial));
+    CHECK((first == 0 && last == 999 && partial));
+    // unsatisfiable
+    CHECK_FALSE(parseRange("bytes=1000-", 1000, first, last, partial));
+    CHECK_FALSE(parseRange("bytes=50-10", 1000, first, last, partial));
+    CHECK_FALSE(parseRange("bytes=-0", 1000, first, last, partial));
+    // ignored, the whole file is sent
+    CHECK(parseRange("bytes=0-1,5-6", 1000, first, last, partial));
+    CHECK_FALSE(partial);
+    CHECK(parseRange("items=0-1", 1000, first, last, partial));
+    CHECK_FALSE(partial);
+    CHECK(parseRange("bytes=a-b", 1000, first, last, partial));
+    CHECK_FALSE(partial);
+  }
+
+  SECTION("Accept-Encoding") {
+    CHECK(encodingQuality("gzip, br", "br") == 1.0);
+    CHECK(encodingQuality("gzip;q=0.5, br;q=0.8", "gzip") == 0.5);
+    CHECK(encodingQuality("GZIP ; q=0.3", "gzip") == 0.3);
+    CHECK(encodingQuality("gzip", "br") == 0.0);
+    CHECK(encodingQuality("br;q=0", "br") == 0.0);
+    CHECK(encodingQuality("*;q=0.2", "br") == 0.2);
+    // an explicit entry wins over the wildcard, wherever it is
+    CHECK(encodingQuality("*, br;q=0", "br") == 0.0);
+    CHECK(encodingQuality("", "gzip") == 0.0);
+  }
+
+  SECTION("Dates") {
+    std::time_t time = 0;
+    // the three formats of RFC 7231 for the same instant
+    CHECK(parseHttpDate("Sun, 06 Nov 1994 08:49:37 GMT", time));
+    CHECK(time == 784111777);
+    CHECK(parseHttpDate("Sunday, 06-Nov-94 08:49:37 GMT", time));
+    CHECK(time == 784111777);
+    CHECK(parseHttpDate("Sun Nov  6 08:49:37 1994", time));
+    CHECK(time == 784111777);
+    CHECK_FALSE(parseHttpDate("yesterday", time));
+    CHECK(httpDate(784111777) == "Sun, 06 Nov 1994 08:49:37 GMT");
+  }
+}
+
+namespace chainblocks {
+extern void startLogPipeline(size_t capacity,
+                             std::shared_ptr<spdlog::logger> logger,
+                             const char *binaryPath);
+extern void stopLogPipeline(bool wait);
+} // namespace chainblocks
+
+struct CaptureSink : public spdlog::sinks::base_sink<std::mutex> {
+  std::vector<std::string> lines;
+
+protected:
+  void sink_it_(const spdlog::details::log_msg &msg) override {
+    lines.emplace_back(msg.payload.data(), msg.payload.size());
+  }
+  void flush_() override {}
+};
+
+TEST_CASE("LogSampling") {
+  auto chain = chainblocks::Chain("log-sampling");
+  std::shared_ptr<CBChain> chainPtr = chain;
+  CBCoro foo{};
+  CBFlow flow{};
+#ifndef __EMSCRIPTEN__
+  CBContext ctx(std::move(foo), chainPtr.get(), &flow);
+#else
+  CBContext ctx(&foo, chainPtr.get(), &flow);
+#endif
+
+  // activates a fresh Log or Msg block times times
+  auto run = [&](const char *name, const char *message, int64_t every,
+                 double perSecond, const CBVar &input, int times) {
+    auto blk = createBlock(name);
+    DEFER(blk->destroy(blk));
+    auto msgVar = Var(message);
+    auto everyVar = Var(every);
+    auto perSecondVar = Var(perSecond);
+    blk->setParam(blk, 0, &msgVar);
+    blk->setParam(blk, 1, &everyVar);
+    blk->setParam(blk, 2, &perSecondVar);
+    blk->warmup(blk, &ctx);
+    for (int i = 0; i < times; i++) {
+      blk->activate(blk, &ctx, &input);
+    }
+  };
+
+  auto sink = std::make_shared<CaptureSink>();
+  auto count = [&](const std::string &text) {
+    return std::count_if(
+        sink->lines.begin(), sink->lines.end(),
+        [&](auto &line) { return line.find(text) != std::string::npos; });
+  };
+
+  SECTION("Sync") {
+    auto &sinks = spdlog::default_logger()->sinks();
+    sinks.push_back(sink);
+    DEFER(sinks.pop_back());
+
+    run("Log", "every 10", 10, 0.0, Var(1), 100);
+    CHECK(count("every 10") == 10);
+    // the first one has nothing to report
+    CHECK(count("(9 suppressed)") == 9);
+
+    // a burst gets one second worth of tokens
+    run("Log", "at most 5 per second", 1, 5.0, Var(1), 100);
+    auto limited = count("at most 5 per second");
+    CHECK(limited >= 5);
+    CHECK(limited < 10);
+
+    run("Msg", "sampled message", 50, 0.0, Var::Empty, 100);
+    CHECK(count("sampled message") == 2);
+  }
+
+  SECTION("Async") {
+    auto logger = std::make_shared<spdlog::logger>("log-sampling-async", sink);
+    logger->set_level(spdlog::level::trace);
+    startLogPipeline(1024, logger, nullptr);
+    run("Log", "every 10", 10, 0.0, Var(1), 100);
+    run("Msg", "sampled message", 50, 0.0, Var::Empty, 100);
+    stopLogPipeline(true);
+
+    CHECK(count("every 10: 1") == 10);
+    CHECK(count("(9 suppressed)") == 9);
+    CHECK(count("sampled message") == 2);
+  }
+
+  SECTION("Binary") {
+    const auto path = "log-sampling.bin";
+    std::remove(path);
+    auto logger = std::make_shared<spdlog::logger>("log-sampling-binary", sink);
+    startLogPipeline(1024, logger, path);
+    run("Log", "every 10", 10, 0.0, Var(7), 100);
+    // objects are formatted on the calling thread, also when nested
+    ObjectVar<int> objects{"LogSamplingObject", 100, 2};
+    auto obj = objects.New();
+    std::vector<Var> nested{Var(1), Var(objects.Get(obj))};
+    run("Log", "nested", 1, 0.0, Var(nested), 1);
+    objects.Release(obj);
+    stopLogPipeline(true);
+    CHECK(sink->lines.empty());
+
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+    size_t offset = 0;
+    auto read = [&](uint8_t *buf, size_t size) {
+      if (data.size() < offset + size)
+        throw ActivationError("Binary log underrun");
+      memcpy(buf, data.data() + offset, size);
+      offset += size;
+    };
+    auto readString = [&]() {
+      uint32_t len;
+      read((uint8_t *)&len, sizeof(uint32_t));
+      std::string str(len, '\0');
+      read((uint8_t *)str.data(), len);
+      return str;
+    };
+
+    char magic[4];
+    uint32_t version;
+    read((uint8_t *)magic, 4);
+    read((uint8_t *)&version, sizeof(uint32_t));
+    CHECK(memcmp(magic, "CBLG", 4) == 0);
+    CHECK(version == 1);
+
+    int records = 0;
+    uint64_t suppressed = 0;
+    Serialization serialization;
+    while (offset < data.size()) {
+      int64_t ns;
+      uint8_t level, hasValue;
+      read((uint8_t *)&ns, sizeof(int64_t));
+      read(&level, 1);
+      CHECK(readString() == "log-sampling");
+      auto message = readString();
+      read(&hasValue, 1);
+      if (message == "every 10") {
+        REQUIRE(hasValue == 1);
+        CBVar value{};
+        serialization.deserialize(read, value);
+        CHECK(value == Var(7));
+        Serialization::varFree(value);
+        serialization.reset();
+      } else {
+        CHECK(message.find("nested: ") == 0);
+        CHECK(hasValue == 0);
+      }
+      uint64_t recordSuppressed;
+      read((uint8_t *)&recordSuppressed, sizeof(uint64_t));
+      suppressed += recordSuppressed;
+      records++;
+    }
+    CHECK(records == 11);
+    CHECK(suppressed == 90);
+    file.close();
+    std::remove(path);
+  }
+}
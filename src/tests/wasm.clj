@@ -11,7 +11,66 @@
    "" (Wasm.Run "../../deps/wasm3/test/wasi/simple/test.wasm" ["cat" "wasm.clj"]) (Log "r2")
    "" (Wasm.Run "../../deps/wasm3/test/lang/fib32.wasm" ["10"] :EntryPoint "fib") (Log "r3")
    "" (Wasm.Run "../../deps/wasm3/test/lang/fib32.wasm" ["20"] :EntryPoint "fib") (Log "r4")
+   ; pooled instances, restored to their initial memory every run
+   "" (Wasm.Run "../../deps/wasm3/test/lang/fib32.wasm" ["20"] :EntryPoint "fib" :ResetRuntime true) (Log "r5")
+   "" (Wasm.Run "../../deps/wasm3/test/lang/fib32.wasm" ["20"] :EntryPoint "fib" :ResetRuntime true) (Log "r6")
+   ; typed call into a persistent instance
+   10 (Wasm.Call "../../deps/wasm3/test/lang/fib32.wasm" "fib") (Log "r7") (Assert.Is 55 true)
+   20 (Wasm.Call "../../deps/wasm3/test/lang/fib32.wasm" "fib") (Assert.Is 6765 true)
    ))
 
 (schedule Root test)
-(run Root 0.1 10)
\ No newline at end of file
+(run Root 0.1 10)
+
+; buffer inputs are copied into the module memory and, when the function
+; returns nothing, read back from it as the output
+(def buffers
+  (Chain
+   "buffers"
+   ; Bytes as (pointer, size)
+   "abc" (StringToBytes) (Wasm.Call "wasm/buffers.wasm" "invert") >= .inverted
+   (BytesToInts) (Assert.Is [158 157 156] true)
+   .inverted (Wasm.Call "wasm/buffers.wasm" "sum") (Assert.Is 471 true)
+   .inverted (Wasm.Call "wasm/buffers.wasm" "invert")
+   (BytesToString) (Assert.Is "abc" true)
+   ; larger than the first buffer, reallocated and the memory grown
+   (RandomBytes 200000) >= .big
+   (Wasm.Call "wasm/buffers.wasm" "invert") (Wasm.Call "wasm/buffers.wasm" "invert")
+   (Is .big) (Assert.Is true true)
+   ; Floats as (pointer, count) of 32 bits floats
+   [1.0 2.5 -3.0] (Wasm.Call "wasm/buffers.wasm" "scale")
+   (Assert.Is [2.0 5.0 -6.0] true)
+   ; Images as (pointer, width, height, channels)
+   [0.0 1.0 0.0 1.0] (FloatsToImage 2 2 1)
+   (Wasm.Call "wasm/buffers.wasm" "invert_image")
+   (ImageToFloats) (Assert.Is [1.0 0.0 1.0 0.0] true)))
+
+(def buffersNode (Node))
+(schedule buffersNode buffers)
+(if (run buffersNode 0.1) nil (throw "Wasm buffers test failed"))
+
+; counter.wasm prints a counter kept in its memory, 1 on a fresh instance
+(def pooled
+  (Chain
+   "pooled"
+   ; the block's own instance keeps its memory between runs
+   (Repeat (-> "" (Wasm.Run "wasm/counter.wasm") >> .kept) 3)
+   .kept (Assert.Is ["1" "2" "3"] true)
+   (Wasm.Stats) >= .before
+   ; pooled instances are restored after every run, the output never changes
+   (Repeat (-> "" (Wasm.Run "wasm/counter.wasm" :ResetRuntime true) >> .reset) 3)
+   .reset (Assert.Is ["1" "1" "1"] true)
+   (Wasm.Stats) >= .after
+   ; every run found the module in the cache and its instance in the pool
+   .before (Take "ModuleHits") (Math.Add 3) >= .expectedHits
+   .after (Take "ModuleHits") (Is .expectedHits) (Assert.Is true true)
+   .before (Take "ModuleLoads") >= .loads
+   .after (Take "ModuleLoads") (Is .loads) (Assert.Is true true)
+   .before (Take "Instantiated") >= .instantiated
+   .after (Take "Instantiated") (Is .instantiated) (Assert.Is true true)
+   .before (Take "Reused") (Math.Add 3) >= .expectedReused
+   .after (Take "Reused") (Is .expectedReused) (Assert.Is true true)))
+
+(def pooledNode (Node))
+(schedule pooledNode pooled)
+(if (run pooledNode 0.1) nil (throw "Wasm pooled test failed"))
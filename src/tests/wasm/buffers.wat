@@ -0,0 +1,76 @@
+;; SPDX-License-Identifier: BSD-3-Clause
+;; Copyright © 2021 Fragcolor Pte. Ltd.
+
+;; Buffer functions for the Wasm.Call tests in wasm.clj, buffers.wasm is the
+;; compiled form of this module
+(module
+  (memory (export "memory") 1)
+  (global $heap (mut i32) (i32.const 1024))
+
+  ;; bump allocator, grows the memory when needed and never frees
+  (func (export "malloc") (param $size i32) (result i32)
+    (local $ptr i32) (local $end i32)
+    (local.set $ptr (global.get $heap))
+    (local.set $end
+      (i32.and (i32.add (i32.add (local.get $ptr) (local.get $size))
+                        (i32.const 15))
+               (i32.const -16)))
+    (block
+      (br_if 0 (i32.le_u (local.get $end)
+                         (i32.shl (memory.size) (i32.const 16))))
+      (br_if 0 (i32.ne
+                 (memory.grow
+                   (i32.shr_u
+                     (i32.add (i32.sub (local.get $end)
+                                       (i32.shl (memory.size) (i32.const 16)))
+                              (i32.const 65535))
+                     (i32.const 16)))
+                 (i32.const -1)))
+      (return (i32.const 0)))
+    (global.set $heap (local.get $end))
+    (local.get $ptr))
+
+  (func (export "free") (param i32))
+
+  ;; every byte becomes 255 - byte, in place
+  (func $invert (export "invert") (param $ptr i32) (param $len i32)
+    (local $end i32)
+    (local.set $end (i32.add (local.get $ptr) (local.get $len)))
+    (block
+      (loop
+        (br_if 1 (i32.ge_u (local.get $ptr) (local.get $end)))
+        (i32.store8 (local.get $ptr)
+                    (i32.sub (i32.const 255) (i32.load8_u (local.get $ptr))))
+        (local.set $ptr (i32.add (local.get $ptr) (i32.const 1)))
+        (br 0))))
+
+  (func (export "invert_image")
+    (param $ptr i32) (param $w i32) (param $h i32) (param $c i32)
+    (call $invert (local.get $ptr)
+                  (i32.mul (i32.mul (local.get $w) (local.get $h))
+                           (local.get $c))))
+
+  (func (export "sum") (param $ptr i32) (param $len i32) (result i32)
+    (local $acc i32) (local $end i32)
+    (local.set $end (i32.add (local.get $ptr) (local.get $len)))
+    (block
+      (loop
+        (br_if 1 (i32.ge_u (local.get $ptr) (local.get $end)))
+        (local.set $acc (i32.add (local.get $acc)
+                                 (i32.load8_u (local.get $ptr))))
+        (local.set $ptr (i32.add (local.get $ptr) (i32.const 1)))
+        (br 0)))
+    (local.get $acc))
+
+  ;; doubles count 32 bits floats, in place
+  (func (export "scale") (param $ptr i32) (param $count i32)
+    (local $end i32)
+    (local.set $end (i32.add (local.get $ptr)
+                             (i32.shl (local.get $count) (i32.const 2))))
+    (block
+      (loop
+        (br_if 1 (i32.ge_u (local.get $ptr) (local.get $end)))
+        (f32.store (local.get $ptr)
+                   (f32.mul (f32.load (local.get $ptr)) (f32.const 2)))
+        (local.set $ptr (i32.add (local.get $ptr) (i32.const 4)))
+        (br 0)))))
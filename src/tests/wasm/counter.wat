@@ -0,0 +1,19 @@
+;; SPDX-License-Identifier: BSD-3-Clause
+;; Copyright © 2021 Fragcolor Pte. Ltd.
+
+;; Prints a digit kept in memory and bumps it every run, a fresh instance
+;; prints 1, counter.wasm is the compiled form of this module
+(module
+  (import "wasi_snapshot_preview1" "fd_write"
+    (func $fd_write (param i32 i32 i32 i32) (result i32)))
+  (memory (export "memory") 1)
+  (data (i32.const 100) "0")
+
+  (func (export "_start")
+    (i32.store8 (i32.const 100)
+                (i32.add (i32.load8_u (i32.const 100)) (i32.const 1)))
+    ;; one iovec at 0 pointing to the digit, written count at 8
+    (i32.store (i32.const 0) (i32.const 100))
+    (i32.store (i32.const 4) (i32.const 1))
+    (drop (call $fd_write (i32.const 1) (i32.const 0) (i32.const 1)
+                          (i32.const 8)))))
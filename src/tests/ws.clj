@@ -3,6 +3,43 @@
 
 (def Root (Node))
 
+; local echo server, handler chains read and write their peer by default
+(def ws-echo
+  (Chain
+   "ws-echo"
+   :Looped
+   (WebSocket.Read)
+   (WebSocket.Write)))
+
+(def ws-server
+  (Chain
+   "ws-server"
+   :Looped
+   (WebSocket.Server ws-echo "127.0.0.1" 7071 true)))
+
+(def ws-local
+  (Chain
+   "ws-local"
+   :Looped
+   (WebSocket.Client "ws2" "127.0.0.1" :Port 7071 :Secure false :Compression true)
+   (Const [1 2 3 "four" 5.0])
+   (WebSocket.Write .ws2)
+   (WebSocket.Write .ws2)
+   (WebSocket.Read .ws2)
+   (Assert.Is [1 2 3 "four" 5.0] true)
+   (WebSocket.Read .ws2)
+   (Log "echo")
+   (Assert.Is [1 2 3 "four" 5.0] true)))
+
+(schedule Root ws-server)
+(schedule Root ws-local)
+(run Root 0.1 20)
+
+(def ws-local nil)
+(def ws-server nil)
+(def ws-echo nil)
+(def Root (Node))
+
 (def test
   (Chain
    "ws-test"
@@ -0,0 +1,85 @@
+; SPDX-License-Identifier: BSD-3-Clause
+; Copyright © 2021 Fragcolor Pte. Ltd.
+
+(def Root (Node))
+
+(schedule
+ Root
+ (Chain
+  "zstd-test"
+  "Compressing this string is the test, Compressing this string is the test"
+  (Set "string")
+  (Count "string")
+  (Log "length")
+  (Get "string")
+  (ToBytes)
+  (Zstd.Compress :Level 7)
+  (Set "compressed")
+  (Count "compressed")
+  (Log "compressed")
+  (Get "compressed")
+  (Zstd.Decompress)
+  (FromBytes)
+  (ExpectString)
+  (Assert.Is "Compressing this string is the test, Compressing this string is the test" true)
+  (Log)
+
+  ; multi-threaded
+  (Get "string")
+  (ToBytes)
+  (Zstd.Compress :Workers 2)
+  (Zstd.Decompress)
+  (FromBytes)
+  (ExpectString)
+  (Assert.Is "Compressing this string is the test, Compressing this string is the test" true)
+
+  ; chunks sharing the same stream
+  (Repeat
+   (->
+    (Get "string")
+    (ToBytes)
+    (Zstd.CompressStream)
+    (Zstd.DecompressStream)
+    (FromBytes)
+    (ExpectString)
+    (Assert.Is "Compressing this string is the test, Compressing this string is the test" true))
+   :Times 10)
+
+  ; a streamed frame has no content size, Decompress must still read it
+  (Get "string")
+  (ToBytes)
+  (Zstd.CompressStream)
+  (Zstd.Decompress)
+  (FromBytes)
+  (ExpectString)
+  (Assert.Is "Compressing this string is the test, Compressing this string is the test" true)
+
+  ; small messages with a trained dictionary
+  (Repeat
+   (->
+    (RandomInt 1000) (ToString) >= .id
+    "{\"name\": \"player\", \"id\": " >= .sample
+    .id (AppendTo .sample)
+    ", \"status\": \"online\"}" (AppendTo .sample)
+    .sample (ToBytes) (Push "samples"))
+   :Times 1000)
+  (Get "samples")
+  (Zstd.Train :Size 1024)
+  (Set "dictionary")
+  (Count "dictionary")
+  (Log "dictionary")
+  "{\"name\": \"player\", \"id\": 42, \"status\": \"online\"}"
+  (ToBytes)
+  (Zstd.Compress :Dictionary .dictionary)
+  (Count)
+  (Log "with dictionary")
+  "{\"name\": \"player\", \"id\": 42, \"status\": \"online\"}"
+  (ToBytes)
+  (Zstd.Compress :Dictionary .dictionary)
+  (Zstd.Decompress :Dictionary .dictionary)
+  (FromBytes)
+  (ExpectString)
+  (Assert.Is "{\"name\": \"player\", \"id\": 42, \"status\": \"online\"}" true)
+  (Log)))
+
+(tick Root)